@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "../pipeline/pipeline.h"
+
+/**
+ * BENCHMARK :
+ * pushes a capture file (or a synthetic one made on the fly) through the
+ * real pipeline, replay sniffer -> batch ring -> workers -> decoder,
+ * as fast as the workers take it and prints one JSON report on stdout.
+ * the sniffer and the workers log where they always do, so stdout only
+ * holds the report
+ *
+ *   pipeline_bench [-f capture.pcap] [-n frames] [-F flows] [-s size]
+ *                  [-l loops] [-w workers] [-d depth] [-r rules]
+ *                  [-b list] [-t]
+ *
+ * without -f the input is `frames` synthetic ethernet/ipv4 frames spread
+ * over `flows` flows (tcp, udp and icmp), all of `size` bytes or an imix
+ * (7x64, 4x576, 1x1500) when size is 0, -t turns the text sink of the
+ * workers on. -r has the workers match the packets against a rule file
+ * (compiled into an anonymous memfd and mapped like the engine maps its
+ * rule db), the synthetic payloads are then text instead of zeros. -b
+ * has them look the endpoints up in a prefix list, compiled the same way
+ */
+
+#define PCAP_MAGIC_USEC 0xA1B2C3D4
+
+typedef struct {
+    char *file;
+    int frames;
+    int flows;
+    int size;
+    int loops;
+    int workers;
+    int depth;
+    char *rules;
+    char *reputation;
+    bool text_output;
+} bench_args;
+
+static uint64_t monotonic_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint16_t ip_checksum(const uint8_t *header, int len){
+    uint32_t sum = 0;
+    for (int i = 0; i < len; i += 2)
+        sum += (header[i] << 8) | header[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+/**
+ * build synthetic frame number `index` in `frame`, flow `index % flows`
+ * ### return:
+ *  `int`: length of the frame
+ */
+static int synthetic_frame(uint8_t *frame, int index, const bench_args *args){
+    static const int imix[12] = {64, 64, 64, 64, 64, 64, 64, 576, 576, 576, 576, 1500};
+    int len = args->size ? args->size : imix[index % 12];
+    int flow = index % args->flows;
+    uint8_t proto = flow % 8 == 7 ? IPPROTO_ICMP : (flow % 2 ? IPPROTO_UDP : IPPROTO_TCP);
+    memset(frame, 0, len);
+
+    // ethernet
+    uint8_t dst_mac[6] = {0x02, 0, 0, 0, 0, 0x01};
+    uint8_t src_mac[6] = {0x02, 0, 0, 0, 0, 0x02};
+    memcpy(frame, dst_mac, 6);
+    memcpy(frame + 6, src_mac, 6);
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+
+    // ipv4, every other packet of a flow goes the other way
+    uint8_t *ip = frame + 14;
+    uint32_t client = htonl(0x0A000000 | (uint32_t)(flow & 0xFFFFFF));
+    uint32_t server = htonl(0xC0A80001);
+    bool reply = (index / args->flows) % 2;
+    ip[0] = 0x45;
+    uint16_t total = htons((uint16_t)(len - 14));
+    memcpy(ip + 2, &total, 2);
+    ip[8] = 64;
+    ip[9] = proto;
+    memcpy(ip + 12, reply ? &server : &client, 4);
+    memcpy(ip + 16, reply ? &client : &server, 4);
+    uint16_t checksum = htons(ip_checksum(ip, 20));
+    memcpy(ip + 10, &checksum, 2);
+
+    // l4, just the ports (or the icmp echo type)
+    uint8_t *l4 = ip + 20;
+    if (proto == IPPROTO_ICMP){
+        l4[0] = reply ? 0 : 8;
+        return len;
+    }
+    uint16_t client_port = htons((uint16_t)(1024 + flow % 60000));
+    uint16_t server_port = htons(proto == IPPROTO_TCP ? 443 : 53);
+    memcpy(l4, reply ? &server_port : &client_port, 2);
+    memcpy(l4 + 2, reply ? &client_port : &server_port, 2);
+    if (proto == IPPROTO_TCP){
+        l4[12] = 0x50;
+        l4[13] = 0x10;  // ack
+    }
+    if (args->rules){
+        static const char text[] = "GET /index.html HTTP/1.1 Host: example.com User-Agent: curl/8.0 Accept: */* ";
+        int payload = 14 + 20 + (proto == IPPROTO_TCP ? 20 : 8);
+        for (int i = payload; i < len; i++)
+            frame[i] = (uint8_t)text[(i - payload + index) % (sizeof(text) - 1)];
+    }
+    return len;
+}
+
+/**
+ * write the synthetic capture in an anonymous memfd, so it goes through
+ * the exact same replay path as a real file
+ * ### return:
+ *  `int`: the fd, the file is /proc/self/fd/<fd>
+ *  `-1`: on error
+ */
+static int synthetic_capture(const bench_args *args){
+    int fd = memfd_create("pipeline_bench.pcap", 0);
+    if (fd < 0){
+        perror("[x] can't create the synthetic capture");
+        return -1;
+    }
+    FILE *out = fdopen(dup(fd), "w");
+    if (!out){
+        close(fd);
+        return -1;
+    }
+    uint32_t global[6] = {PCAP_MAGIC_USEC, 2 | (4 << 16), 0, 0, 65535, 1};
+    fwrite(global, sizeof(global), 1, out);
+    uint8_t frame[1514];
+    for (int i = 0; i < args->frames; i++){
+        int len = synthetic_frame(frame, i, args);
+        // 1us apart, only matters for pacings we don't use here
+        uint32_t record[4] = {(uint32_t)(i / 1000000), (uint32_t)(i % 1000000), (uint32_t)len, (uint32_t)len};
+        fwrite(record, sizeof(record), 1, out);
+        fwrite(frame, len, 1, out);
+    }
+    if (fclose(out) != 0){
+        perror("[x] can't write the synthetic capture");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * copy a compiled image in an anonymous memfd
+ * ### return:
+ *  `int`: the fd, the file is /proc/self/fd/<fd>
+ *  `-1`: on error
+ */
+static int memfd_image(const char *name, const void *image, size_t size){
+    int fd = memfd_create(name, 0);
+    size_t written = 0;
+    while (fd >= 0 && written < size){
+        ssize_t n = write(fd, (const u_char *)image + written, size - written);
+        if (n <= 0)
+            break;
+        written += (size_t)n;
+    }
+    if (fd < 0 || written < size){
+        perror("[x] can't write the compiled image");
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * compile the rule file in an anonymous memfd, mapped back the way the
+ * engine maps its rule db file
+ * ### return:
+ *  `int`: the fd, the file is /proc/self/fd/<fd>
+ *  `-1`: on error
+ */
+static int compiled_rules(const char *path){
+    rule_db *compiled = rule_compile(path);
+    if (!compiled)
+        return -1;
+    int fd = memfd_image("pipeline_bench.rules", compiled, compiled->size);
+    free(compiled);
+    return fd;
+}
+
+/**
+ * same for a prefix list
+ */
+static int compiled_list(const char *path){
+    lpm_db *compiled = lpm_compile(path);
+    if (!compiled)
+        return -1;
+    int fd = memfd_image("pipeline_bench.reputation", compiled, compiled->size);
+    free(compiled);
+    return fd;
+}
+
+static void print_stage(const char *name, const latency_hist *hist, bool last){
+    printf("    \"%s\": {\"count\": %lu, \"mean_ns\": %lu, \"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}%s\n",
+        name,
+        (unsigned long)hist->count,
+        (unsigned long)(hist->count ? hist->sum / hist->count : 0),
+        (unsigned long)latency_percentile(hist, 0.50),
+        (unsigned long)latency_percentile(hist, 0.99),
+        (unsigned long)latency_percentile(hist, 0.999),
+        (unsigned long)(hist->count ? hist->max : 0),
+        last ? "" : ",");
+}
+
+static int parse_args(int argc, char **argv, bench_args *args){
+    args->file = NULL;
+    args->frames = 1000000;
+    args->flows = 1024;
+    args->size = 0;
+    args->loops = 1;
+    args->workers = 2;
+    args->depth = 4;
+    args->rules = NULL;
+    args->reputation = NULL;
+    args->text_output = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:n:F:s:l:w:d:r:b:t")) != -1){
+        switch (opt){
+            case 'f': args->file = optarg; break;
+            case 'n': args->frames = atoi(optarg); break;
+            case 'F': args->flows = atoi(optarg); break;
+            case 's': args->size = atoi(optarg); break;
+            case 'l': args->loops = atoi(optarg); break;
+            case 'w': args->workers = atoi(optarg); break;
+            case 'd': args->depth = atoi(optarg); break;
+            case 'r': args->rules = optarg; break;
+            case 'b': args->reputation = optarg; break;
+            case 't': args->text_output = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-f capture.pcap] [-n frames] [-F flows] [-s size] [-l loops] [-w workers] [-d depth] [-r rules] [-b list] [-t]\n", argv[0]);
+                return -1;
+        }
+    }
+    if (args->frames < 1 || args->flows < 1 || args->loops < 1 || args->depth < 2 ||
+        (args->depth & (args->depth - 1)) || args->workers < 1 || args->workers > MAX_WORKERS ||
+        (args->size != 0 && (args->size < 60 || args->size > 1514))){
+        fprintf(stderr, "[x] bad arguments, workers must be in [1, %d], depth a power of two, size in [60, 1514] or 0\n", MAX_WORKERS);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv){
+    bench_args args;
+    if (parse_args(argc, argv, &args) < 0)
+        return -1;
+
+    char path[64];
+    char *input = args.file;
+    if (!input){
+        int fd = synthetic_capture(&args);
+        if (fd < 0)
+            return -1;
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        input = path;
+    }
+
+    batch_ring = INIT_BATCH_RING(args.depth, args.workers, 0);
+    if (!batch_ring)
+        return -1;
+    batch_ring->text_output = args.text_output;
+    // the defaults of core.json
+    batch_ring->defrag = (defrag_config){
+        .enabled = true,
+        .max_datagrams = 1024,
+        .memory_kb = 4096,
+        .timeout_ms = 30000,
+        .policy = DEFRAG_FIRST
+    };
+    batch_ring->flows = (flow_config){
+        .enabled = true,
+        .max_flows = 65536,
+        .timeout_new_ms = 30000,
+        .timeout_established_ms = 300000,
+        .timeout_closed_ms = 10000
+    };
+    batch_ring->streams = (stream_config){
+        .enabled = true,
+        .depth_kb = 1024,
+        .flow_buffer_kb = 256,
+        .memory_kb = 16384
+    };
+    if (args.rules){
+        int fd = compiled_rules(args.rules);
+        if (fd < 0)
+            return -1;
+        char db[64];
+        snprintf(db, sizeof(db), "/proc/self/fd/%d", fd);
+        batch_ring->rules = INIT_RULE_DB(db);
+        if (!batch_ring->rules)
+            return -1;
+    }
+    if (args.reputation){
+        int fd = compiled_list(args.reputation);
+        if (fd < 0)
+            return -1;
+        char db[64];
+        snprintf(db, sizeof(db), "/proc/self/fd/%d", fd);
+        batch_ring->reputation = INIT_LPM(db);
+        if (!batch_ring->reputation)
+            return -1;
+    }
+    batch_ring->stats = INIT_PIPELINE_STATS();
+    if (!batch_ring->stats)
+        return -1;
+    replay_file *replay = INIT_REPLAY(input, REPLAY_FAST, 0, args.loops);
+    if (!replay)
+        return -1;
+    batch_ring->ring = replay->map;
+    batch_ring->zero_copy = true;
+    batch_ring->snaplen = 65535;
+
+    pid_t *pids = calloc(args.workers + 1, sizeof(pid_t));
+    for (int i = 0; i < args.workers; i++){
+        pids[i] = fork();
+        if (pids[i] == 0){
+            worker(i);
+            exit(0);
+        }
+        if (pids[i] < 0){
+            perror("[x] can't fork a worker");
+            return -1;
+        }
+    }
+    uint64_t start_ns = monotonic_ns();
+    pids[args.workers] = fork();
+    if (pids[args.workers] == 0){
+        // the per batch log would land in the middle of the report
+        freopen("/dev/null", "w", stdout);
+        sniffer_replay(replay);
+        exit(0);
+    }
+    for (int i = 0; i <= args.workers; i++){
+        int status = 0;
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            fprintf(stderr, "[x] %s %d did not exit cleanly\n", i < args.workers ? "worker" : "sniffer", i);
+            return -1;
+        }
+    }
+
+    // merge what every worker measured
+    pipeline_stats *stats = batch_ring->stats;
+    latency_hist *queue = malloc(sizeof(latency_hist));
+    latency_hist *work = malloc(sizeof(latency_hist));
+    latency_hist *total = malloc(sizeof(latency_hist));
+    latency_reset(queue);
+    latency_reset(work);
+    latency_reset(total);
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t end_ns = start_ns;
+    for (int i = 0; i < args.workers; i++){
+        packets += stats->packets[i];
+        bytes += stats->bytes[i];
+        if (stats->end_ns[i] > end_ns)
+            end_ns = stats->end_ns[i];
+        latency_merge(queue, &stats->queue[i]);
+        latency_merge(work, &stats->work[i]);
+        latency_merge(total, &stats->total[i]);
+    }
+    double seconds = (double)(end_ns - start_ns) / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+
+    printf("{\n");
+    printf("  \"input\": \"%s\",\n", args.file ? args.file : "synthetic");
+    printf("  \"workers\": %d,\n", args.workers);
+    printf("  \"batch_ring_depth\": %d,\n", args.depth);
+    printf("  \"max_batch\": %d,\n", MAX_BATCH);
+    printf("  \"loops\": %d,\n", args.loops);
+    printf("  \"text_output\": %s,\n", args.text_output ? "true" : "false");
+    if (args.rules)
+        printf("  \"rules\": \"%s\",\n", args.rules);
+    else
+        printf("  \"rules\": null,\n");
+    if (args.reputation)
+        printf("  \"reputation\": \"%s\",\n", args.reputation);
+    else
+        printf("  \"reputation\": null,\n");
+    printf("  \"packets\": %lu,\n", (unsigned long)packets);
+    printf("  \"bytes\": %lu,\n", (unsigned long)bytes);
+    printf("  \"seconds\": %.6f,\n", seconds);
+    printf("  \"packets_per_sec\": %.1f,\n", (double)packets / seconds);
+    printf("  \"bytes_per_sec\": %.1f,\n", (double)bytes / seconds);
+    printf("  \"gbps\": %.4f,\n", (double)bytes * 8 / seconds / 1e9);
+    printf("  \"batches\": %lu,\n", (unsigned long)stats->batches);
+    printf("  \"batch_fill_ratio\": %.4f,\n",
+        stats->batches ? (double)stats->batch_packets / ((double)stats->batches * MAX_BATCH) : 0.0);
+    printf("  \"stages\": {\n");
+    print_stage("batch_fill", &stats->fill, false);
+    print_stage("queue_wait", queue, false);
+    print_stage("worker", work, false);
+    print_stage("end_to_end", total, true);
+    printf("  }\n");
+    printf("}\n");
+
+    free(queue);
+    free(work);
+    free(total);
+    free(pids);
+    FREE_REPLAY(replay);
+    return 0;
+}
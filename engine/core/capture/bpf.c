@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include "./bpf.h"
+
+/**
+ * REFERENCES I WILL NEED :
+ * BPF SYSCALL      : /usr/include/linux/bpf.h , man 2 bpf
+ *
+ * tiny wrappers around the bpf() syscall so the capture backends can
+ * load their own small programs without pulling libbpf in.
+ * the programs are raw instructions and live in here, this file can't
+ * include pcap.h since both define their own `struct bpf_insn`
+ */
+
+// instruction builders, same as the kernel's samples/bpf/bpf_insn.h
+#define INSN_LDX_MEM(SIZE, DST, SRC, OFF) \
+    ((struct bpf_insn){ .code = BPF_LDX | BPF_SIZE(SIZE) | BPF_MEM, .dst_reg = DST, .src_reg = SRC, .off = OFF, .imm = 0 })
+#define INSN_MOV64_IMM(DST, IMM) \
+    ((struct bpf_insn){ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = DST, .src_reg = 0, .off = 0, .imm = IMM })
+#define INSN_LD_MAP_FD(DST, MAP_FD) \
+    ((struct bpf_insn){ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = DST, .src_reg = BPF_PSEUDO_MAP_FD, .off = 0, .imm = MAP_FD }), \
+    ((struct bpf_insn){ .code = 0, .dst_reg = 0, .src_reg = 0, .off = 0, .imm = 0 })
+#define INSN_CALL(FUNC) \
+    ((struct bpf_insn){ .code = BPF_JMP | BPF_CALL, .dst_reg = 0, .src_reg = 0, .off = 0, .imm = FUNC })
+#define INSN_MOV64_REG(DST, SRC) \
+    ((struct bpf_insn){ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = DST, .src_reg = SRC, .off = 0, .imm = 0 })
+#define INSN_ALU64_REG(OP, DST, SRC) \
+    ((struct bpf_insn){ .code = BPF_ALU64 | BPF_OP(OP) | BPF_X, .dst_reg = DST, .src_reg = SRC, .off = 0, .imm = 0 })
+#define INSN_ALU32_IMM(OP, DST, IMM) \
+    ((struct bpf_insn){ .code = BPF_ALU | BPF_OP(OP) | BPF_K, .dst_reg = DST, .src_reg = 0, .off = 0, .imm = IMM })
+#define INSN_ALU32_REG(OP, DST, SRC) \
+    ((struct bpf_insn){ .code = BPF_ALU | BPF_OP(OP) | BPF_X, .dst_reg = DST, .src_reg = SRC, .off = 0, .imm = 0 })
+#define INSN_LD_ABS(SIZE, IMM) \
+    ((struct bpf_insn){ .code = BPF_LD | BPF_SIZE(SIZE) | BPF_ABS, .dst_reg = 0, .src_reg = 0, .off = 0, .imm = IMM })
+#define INSN_JMP_IMM(OP, DST, IMM, OFF) \
+    ((struct bpf_insn){ .code = BPF_JMP | BPF_OP(OP) | BPF_K, .dst_reg = DST, .src_reg = 0, .off = OFF, .imm = IMM })
+#define INSN_JA(OFF) \
+    ((struct bpf_insn){ .code = BPF_JMP | BPF_JA, .dst_reg = 0, .src_reg = 0, .off = OFF, .imm = 0 })
+#define INSN_EXIT() \
+    ((struct bpf_insn){ .code = BPF_JMP | BPF_EXIT, .dst_reg = 0, .src_reg = 0, .off = 0, .imm = 0 })
+
+static long sys_bpf(int cmd, union bpf_attr *attr){
+    return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * create a bpf map
+ * ### return:
+ *  `int`: the map fd if successful
+ *  `-1`: on error
+ */
+int bpf_create_map(uint32_t map_type, uint32_t key_size, uint32_t value_size, uint32_t max_entries){
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = map_type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    int fd = (int)sys_bpf(BPF_MAP_CREATE, &attr);
+    if (fd < 0)
+        perror("[x] can't create the bpf map");
+    return fd;
+}
+
+/**
+ * set `key` to `value` in a bpf map
+ * ### return:
+ *  `0`: if successful
+ *  `-1`: on error
+ */
+int bpf_update_map(int map_fd, const void *key, const void *value){
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(unsigned long)key;
+    attr.value = (uint64_t)(unsigned long)value;
+    attr.flags = BPF_ANY;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0){
+        perror("[x] can't update the bpf map");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * load a program made of `insn_count` raw instructions,
+ * the verifier log gets printed if the kernel refuses it
+ * ### return:
+ *  `int`: the program fd if successful
+ *  `-1`: on error
+ */
+static int bpf_load_program(uint32_t prog_type, const struct bpf_insn *insns, uint32_t insn_count){
+    static char log[4096];
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = prog_type;
+    attr.insns = (uint64_t)(unsigned long)insns;
+    attr.insn_cnt = insn_count;
+    attr.license = (uint64_t)(unsigned long)"GPL";
+    int fd = (int)sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd >= 0)
+        return fd;
+    // try again with the verifier log on so we know why
+    int error = errno;
+    log[0] = '\0';
+    attr.log_buf = (uint64_t)(unsigned long)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    fd = (int)sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd >= 0)
+        return fd;
+    printf("[x] can't load the bpf program: %s\n%s\n", strerror(error), log);
+    return -1;
+}
+
+/**
+ * attach an XDP program to an interface through a bpf link,
+ * the program is detached when the link fd is closed (or we die)
+ * ### return:
+ *  `int`: the link fd if successful
+ *  `-1`: on error
+ */
+int bpf_attach_xdp(int prog_fd, int ifindex, uint32_t xdp_flags){
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = xdp_flags;
+    int fd = (int)sys_bpf(BPF_LINK_CREATE, &attr);
+    if (fd < 0)
+        perror("[x] can't attach the xdp program");
+    return fd;
+}
+
+/**
+ * load the XDP program of the AF_XDP backend, it sends every frame of
+ * rx queue N to the socket at index N of `xsks_map_fd` and lets the
+ * frame go on to the stack when no socket is there:
+ *
+ *   return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+ *
+ * ### return:
+ *  `int`: the program fd if successful
+ *  `-1`: on error
+ */
+int bpf_load_xsk_redirect(int xsks_map_fd){
+    struct bpf_insn insns[] = {
+        INSN_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index)),
+        INSN_LD_MAP_FD(BPF_REG_1, xsks_map_fd),
+        INSN_MOV64_IMM(BPF_REG_3, XDP_PASS),
+        INSN_CALL(BPF_FUNC_redirect_map),
+        INSN_EXIT(),
+    };
+    return bpf_load_program(BPF_PROG_TYPE_XDP, insns, sizeof(insns) / sizeof(insns[0]));
+}
+
+/**
+ * create the XSKMAP the AF_XDP sockets get registered in,
+ * one entry per rx queue
+ */
+int bpf_create_xsks_map(uint32_t max_entries){
+    return bpf_create_map(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t), sizeof(int), max_entries);
+}
+
+/**
+ * load the PACKET_FANOUT_EBPF program, it picks the socket of a packet
+ * from a symmetric hash of its address pair (xor of both addresses,
+ * then mixed) so both directions of a flow land on the same sniffer.
+ * offsets are relative to the network header (SKF_NET_OFF) so vlan
+ * tags don't matter, anything that isn't IPv6 is read as IPv4:
+ *
+ *   h = is_v6 ? xor(saddr6, daddr6 words) : saddr ^ daddr;
+ *   h ^= h >> 16; h *= 0x45d9f3b; h ^= h >> 16;
+ *   return h;        // the kernel takes it modulo the group size
+ *
+ * ### return:
+ *  `int`: the program fd if successful
+ *  `-1`: on error
+ */
+int bpf_load_fanout_hash(){
+    struct bpf_insn insns[] = {
+        // LD_ABS wants the context in r6
+        INSN_MOV64_REG(BPF_REG_6, BPF_REG_1),
+        INSN_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct __sk_buff, protocol)),
+        INSN_MOV64_IMM(BPF_REG_7, 0),
+        INSN_JMP_IMM(BPF_JEQ, BPF_REG_2, htons(ETH_P_IPV6), 5),
+        // IPv4, saddr ^ daddr
+        INSN_LD_ABS(BPF_W, SKF_NET_OFF + 12),
+        INSN_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_0),
+        INSN_LD_ABS(BPF_W, SKF_NET_OFF + 16),
+        INSN_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_0),
+        INSN_JA(16),
+        // IPv6, the 8 words of both addresses
+        INSN_LD_ABS(BPF_W, SKF_NET_OFF + 8),
+        INSN_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_0),
+        INSN_LD_ABS(BPF_W, SKF_NET_OFF + 12),
+        INSN_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_0),
+        INSN_LD_ABS(BPF_W, SKF_NET_OFF + 16),
+        INSN_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_0),
+        INSN_LD_ABS(BPF_W, SKF_NET_OFF + 20),
+        INSN_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_0),
+        INSN_LD_ABS(BPF_W, SKF_NET_OFF + 24),
+        INSN_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_0),
+        INSN_LD_ABS(BPF_W, SKF_NET_OFF + 28),
+        INSN_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_0),
+        INSN_LD_ABS(BPF_W, SKF_NET_OFF + 32),
+        INSN_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_0),
+        INSN_LD_ABS(BPF_W, SKF_NET_OFF + 36),
+        INSN_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_0),
+        // mix it so close addresses don't all land on one socket
+        INSN_MOV64_REG(BPF_REG_0, BPF_REG_7),
+        INSN_MOV64_REG(BPF_REG_1, BPF_REG_0),
+        INSN_ALU32_IMM(BPF_RSH, BPF_REG_1, 16),
+        INSN_ALU32_REG(BPF_XOR, BPF_REG_0, BPF_REG_1),
+        INSN_ALU32_IMM(BPF_MUL, BPF_REG_0, 0x45d9f3b),
+        INSN_MOV64_REG(BPF_REG_1, BPF_REG_0),
+        INSN_ALU32_IMM(BPF_RSH, BPF_REG_1, 16),
+        INSN_ALU32_REG(BPF_XOR, BPF_REG_0, BPF_REG_1),
+        INSN_EXIT(),
+    };
+    return bpf_load_program(BPF_PROG_TYPE_SOCKET_FILTER, insns, sizeof(insns) / sizeof(insns[0]));
+}
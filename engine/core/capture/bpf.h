@@ -0,0 +1,15 @@
+#ifndef BPF_HEADERS
+#define BPF_HEADERS
+#include <stdint.h>
+
+/**
+ * eBPF helpers for the capture backends, kept apart from capture.h
+ * because <linux/bpf.h> and <pcap.h> can't be included together
+ */
+int bpf_create_map(uint32_t map_type, uint32_t key_size, uint32_t value_size, uint32_t max_entries);
+int bpf_update_map(int map_fd, const void *key, const void *value);
+int bpf_attach_xdp(int prog_fd, int ifindex, uint32_t xdp_flags);
+int bpf_create_xsks_map(uint32_t max_entries);
+int bpf_load_xsk_redirect(int xsks_map_fd);
+int bpf_load_fanout_hash();
+#endif
@@ -2,7 +2,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <string.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
 #include "./capture.h"
 #include <unistd.h>
 
@@ -26,9 +29,13 @@ void handle_sigint(int sig) {
  * with a ring buffer of size 64 * 1024 * 1024 
  * and it allows buffering by setting the `pcap_set_immediate_mode` 
  * second param to 0 and sets a timeout of 10 seconds
- * so we don't wast CPU cycles doing shallow work
+ * so we don't wast CPU cycles doing shallow work.
+ * only the first `snaplen` bytes of a frame are copied to us and when
+ * `filter` is not NULL the kernel drops everything that doesn't match it.
+ * `nano_ts` asks for nanosecond timestamps, microseconds when the device
+ * can't
  */
-pcap_t *INIT_PCAP(char *interface_name){
+pcap_t *INIT_PCAP(char *interface_name, int snaplen, const char *filter, bool nano_ts){
     char errbuf[PCAP_ERRBUF_SIZE];
     pcap_t *pcap;
     
@@ -54,11 +61,85 @@ pcap_t *INIT_PCAP(char *interface_name){
     // set timeout 10s
     pcap_set_timeout(pcap, 10000);
 
+    // don't copy bytes we never look at
+    pcap_set_snaplen(pcap, snaplen);
+
+    // ts.tv_usec holds ns once this is set, the sniffer asks pcap which one it got
+    if (nano_ts && pcap_set_tstamp_precision(pcap, PCAP_TSTAMP_PRECISION_NANO) != 0)
+        printf("[!] no nanosecond timestamps on %s, using microseconds\n", interface_name);
+
     // activate the capture
     if (pcap_activate(pcap) != 0) {
         fprintf(stderr, "pcap_activate failed: %s\n", pcap_geterr(pcap));
         pcap_close(pcap);
         return NULL;
     }
+
+    if (filter){
+        struct bpf_program program;
+        if (pcap_compile(pcap, &program, filter, 1, PCAP_NETMASK_UNKNOWN) != 0) {
+            fprintf(stderr, "[x] can't compile filter <%s>: %s\n", filter, pcap_geterr(pcap));
+            pcap_close(pcap);
+            return NULL;
+        }
+        // on linux this ends up as a socket filter, so it runs in the kernel
+        int res = pcap_setfilter(pcap, &program);
+        pcap_freecode(&program);
+        if (res != 0) {
+            fprintf(stderr, "[x] can't set filter <%s>: %s\n", filter, pcap_geterr(pcap));
+            pcap_close(pcap);
+            return NULL;
+        }
+    }
     return pcap;
 }
+
+/**
+ * compile a pcap filter expression for ethernet frames into a classic
+ * BPF program, the accept instructions return `snaplen` so the program
+ * also truncates what it accepts. a NULL `filter` accepts everything
+ * ### return:
+ *  `0`: if successful, free `program` with pcap_freecode
+ *  `-1`: on error
+ */
+int capture_compile_filter(const char *filter, int snaplen, struct bpf_program *program){
+    // no live handle needed to compile, just the link type and the snaplen
+    pcap_t *dead = pcap_open_dead(DLT_EN10MB, snaplen);
+    if (!dead){
+        printf("[x] can't open a pcap handle to compile the filter\n");
+        return -1;
+    }
+    if (pcap_compile(dead, program, filter ? filter : "", 1, PCAP_NETMASK_UNKNOWN) != 0){
+        printf("[x] can't compile filter <%s>: %s\n", filter ? filter : "", pcap_geterr(dead));
+        pcap_close(dead);
+        return -1;
+    }
+    pcap_close(dead);
+    return 0;
+}
+
+/**
+ * attach `filter` (and `snaplen`) to a raw AF_PACKET socket as a classic
+ * BPF socket filter, frames it rejects never reach the ring and the
+ * accepted ones are cut to `snaplen` by the kernel
+ * ### return:
+ *  `0`: if successful
+ *  `-1`: on error
+ */
+int capture_attach_filter(int fd, const char *filter, int snaplen){
+    struct bpf_program program;
+    if (capture_compile_filter(filter, snaplen, &program) < 0)
+        return -1;
+    // pcap's bpf_insn and the kernel's sock_filter are the same 8 bytes
+    struct sock_fprog fprog;
+    memset(&fprog, 0, sizeof(fprog));
+    fprog.len = (unsigned short)program.bf_len;
+    fprog.filter = (struct sock_filter *)program.bf_insns;
+    int res = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+    pcap_freecode(&program);
+    if (res < 0){
+        perror("[x] can't attach the socket filter");
+        return -1;
+    }
+    return 0;
+}
@@ -1,12 +1,179 @@
 #ifndef CAPTURE_HEADERS
 #define CAPTURE_HEADERS
 #include <pcap.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <linux/if_packet.h>
+#include <linux/if_xdp.h>
 typedef unsigned char u_char;
 
-pcap_t *INIT_PCAP(char *interface_name);
+/** capture backends that can be selected in core.json */
+typedef enum {
+    CAPTURE_PCAP = 31,
+    CAPTURE_TPACKET = 32,
+    CAPTURE_XDP = 33,
+    CAPTURE_REPLAY = 34
+} capture_backend;
+
+/** how fast a replayed capture file is played */
+typedef enum {
+    REPLAY_FAST = 41,           // as fast as the pipeline takes it
+    REPLAY_ORIGINAL = 42,       // the gaps recorded in the file
+    REPLAY_PPS = 43             // a fixed packet rate
+} replay_pacing;
+
+/**
+ * capture record of a frame, whatever the backend. a frame that stays
+ * where the capture backend put it is at `offset` from the start of the
+ * shared capture ring
+ */
+typedef struct {
+    uint64_t offset;
+    uint32_t caplen;            // bytes we have
+    uint32_t wire_len;          // bytes the frame had on the wire, more than caplen past snaplen
+    uint64_t ts_ns;             // since the epoch, 0 when the source has no time
+    uint32_t ingress;           // ifindex it came in on, the interface id of a replayed pcapng
+    uint32_t pad;
+} packet_desc;
+
+/** TPACKET_V3 mmap'd rx ring */
+typedef struct {
+    int fd;
+    int ifindex;
+    uint8_t *map;               // the whole ring, block_count * block_size
+    size_t map_size;
+    unsigned int block_size;
+    unsigned int block_count;
+    unsigned int frame_size;
+    unsigned int current;       // next block we expect the kernel to hand us
+} tpacket_ring;
+
+typedef void (*tpacket_handler)(
+    u_char *user,
+    const struct tpacket3_hdr *hdr,
+    const u_char *frame
+);
+
+/** one of the 4 rings of an AF_XDP socket, mapped from the kernel */
+typedef struct {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+    uint32_t size;              // power of two
+    uint32_t cached_producer;
+    uint32_t cached_consumer;
+    void *map;
+    size_t map_size;
+} xdp_ring;
+
+/** AF_XDP socket with its own UMEM */
+typedef struct {
+    int fd;
+    int ifindex;
+    uint32_t queue_id;
+    u_char *umem;               // MAP_SHARED, same address in every process
+    size_t umem_size;
+    uint32_t frame_size;
+    uint32_t frame_count;
+    xdp_ring fill;
+    xdp_ring completion;
+    xdp_ring rx;
+    int map_fd;                 // XSKMAP
+    int prog_fd;                // redirect program
+    int link_fd;                // program attached to the interface
+} xdp_socket;
+
+typedef void (*xdp_handler)(
+    u_char *user,
+    const struct xdp_desc *desc,
+    const u_char *frame
+);
+
+#define REPLAY_MAX_INTERFACES 16
+
+/** a .pcap or .pcapng file mmap'd for replay */
+typedef struct {
+    int fd;
+    u_char *map;                // the whole file, read only, same address in every process
+    size_t map_size;
+    bool pcapng;
+    bool swapped;               // written on a host of the other endianness
+    size_t start;               // offset of the first record
+    size_t cursor;              // offset of the next record
+    // timestamp units per second, per pcapng interface (pcap only uses [0])
+    uint64_t ts_units[REPLAY_MAX_INTERFACES];
+    int interface_count;
+
+    replay_pacing pacing;
+    uint64_t pps;
+    int loops;                  // 0 loops forever
+    int loops_done;
+    bool finished;
+
+    // pacing state, reset on every loop
+    uint64_t start_ns;          // CLOCK_MONOTONIC when the loop started
+    uint64_t first_ts_ns;       // timestamp of the first packet of the loop
+    uint64_t last_ts_ns;        // of the previous packet, a simple packet block has none
+    bool first_seen;
+    uint64_t sent;
+} replay_file;
+
+/** `desc->offset` is relative to the start of the file map */
+typedef void (*replay_handler)(
+    u_char *user,
+    const packet_desc *desc,
+    const u_char *frame
+);
+
+extern volatile sig_atomic_t running;
+void handle_sigint(int sig);
+
+pcap_t *INIT_PCAP(char *interface_name, int snaplen, const char *filter, bool nano_ts);
 void packet_handler(
     u_char *user,
     const struct pcap_pkthdr *h,
     const u_char *bytes
 );
-#endif
\ No newline at end of file
+
+/** filter API */
+int capture_compile_filter(const char *filter, int snaplen, struct bpf_program *program);
+int capture_attach_filter(int fd, const char *filter, int snaplen);
+
+/** TPACKET_V3 API */
+tpacket_ring *INIT_TPACKET(
+    char *interface_name,
+    unsigned int block_size,
+    unsigned int block_count,
+    unsigned int frame_size,
+    unsigned int block_timeout_ms
+);
+void FREE_TPACKET(tpacket_ring *ring);
+struct tpacket_block_desc *tpacket_next_block(tpacket_ring *ring, int timeout_ms);
+void tpacket_release_block(struct tpacket_block_desc *block);
+int tpacket_walk_block(struct tpacket_block_desc *block, tpacket_handler handler, u_char *user);
+int tpacket_join_fanout(tpacket_ring *ring, int group_id, int mode);
+
+/** AF_XDP API */
+xdp_socket *INIT_XDP(
+    char *interface_name,
+    uint32_t queue_id,
+    uint32_t frame_count,
+    uint32_t frame_size,
+    uint32_t ring_size
+);
+void FREE_XDP(xdp_socket *xsk);
+void xdp_fill_frame(xdp_socket *xsk, uint64_t addr);
+void xdp_fill_flush(xdp_socket *xsk);
+int xdp_walk_rx(xdp_socket *xsk, int max, int timeout_ms, xdp_handler handler, u_char *user);
+
+/** replay API */
+replay_file *INIT_REPLAY(const char *path, replay_pacing pacing, uint64_t pps, int loops);
+void FREE_REPLAY(replay_file *file);
+int replay_walk(replay_file *file, int max, int timeout_ms, replay_handler handler, u_char *user);
+
+/** flow hashing */
+uint64_t flow_hash(const u_char *frame, size_t caplen);
+#endif
@@ -0,0 +1,68 @@
+#include <string.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include "xxhash.h"
+#include "./capture.h"
+#include "./protocols/protoheaders.h"
+
+/**
+ * the sniffer uses this hash to pick the worker of a packet,
+ * it's symmetric: (a -> b) and (b -> a) hash the same so both
+ * directions of a flow land on the same worker. it's the address pair
+ * (and the ipv4 protocol), never the ports: the fragments of a datagram have
+ * none past the first one, and the datagram reassembled from them must
+ * be on the worker that has the rest of its flow. the packet is walked
+ * by the decoder itself, a tunnel it opens hashes on the innermost
+ * headers like the flow table keys it
+ */
+
+// the key gets canonicalized in here before hashing,
+// the smaller address always goes first
+typedef struct {
+    uint8_t addr_lo[16];
+    uint8_t addr_hi[16];
+    uint16_t ether_type;
+    uint8_t proto;
+    uint8_t pad[5];
+} flow_tuple;
+
+#define FLOW_HASH_SEED 0xA7
+
+/**
+ * fill the tuple so that the lowest address is first
+ */
+static void canonical_tuple(flow_tuple *tuple, const uint8_t *src, const uint8_t *dst, size_t addr_len){
+    bool ordered = memcmp(src, dst, addr_len) <= 0;
+    memcpy(tuple->addr_lo, ordered ? src : dst, addr_len);
+    memcpy(tuple->addr_hi, ordered ? dst : src, addr_len);
+}
+
+/**
+ * flow_hash: symmetric hash of an ethernet frame, walked like the
+ * workers decode it (vlan tags, mpls and the tunnels up to
+ * decoder.max_tunnel_depth): the innermost IPv4 header hashes on its
+ * address pair and protocol, IPv6 on its address pair (fragments and
+ * whole packets alike), anything else on the mac address pair and its
+ * ethertype
+ * ### return:
+ *  `uint64_t`: the hash, 0 for frames shorter than an ethernet header
+ */
+uint64_t flow_hash(const u_char *frame, size_t caplen){
+    packet_meta meta;
+    if (!decode_layers(frame, (uint32_t)caplen, 0, &meta))
+        return 0;
+    flow_tuple tuple;
+    memset(&tuple, 0, sizeof(tuple));
+    if (meta.flags & META_HAS_L3){
+        // the transport of a later v6 fragment can be behind extension
+        // headers only the first one has, the address pair alone there
+        tuple.proto = meta.ip_version == 4 ? meta.ip_proto : 0;
+        canonical_tuple(&tuple, meta.src_addr, meta.dst_addr, meta.ip_version == 6 ? 16 : 4);
+    }else{
+        // not ip, or nothing the decoder could get to: the stations
+        tuple.ether_type = meta.ethertype;
+        canonical_tuple(&tuple, frame, frame + 6, 6);
+    }
+    return XXH64(&tuple, sizeof(tuple), FLOW_HASH_SEED);
+}
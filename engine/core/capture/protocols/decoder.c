@@ -0,0 +1,490 @@
+#include <string.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include "./protoheaders.h"
+#include "./read.h"
+
+/**
+ * REFERENCES I WILL NEED :
+ * ETHERNER HEADERS : /usr/include/net/ethernet.h
+ * IP HEADERS       : /usr/include/netinet/ip.h
+ * IPV6 HEADERS     : /usr/include/netinet/ip6.h
+ *
+ * the decoder only reads the frame and writes the meta record, no
+ * allocation, no strings, no stdio. every read is checked against the
+ * captured length, a header that doesn't fit sets META_TRUNCATED and
+ * stops the decoding there, what was decoded before it stays valid
+ */
+
+#define IPV4_MIN_HEADER 20
+#define IPV6_HEADER 40
+#define TCP_MIN_HEADER 20
+#define IPV6_FRAGMENT_HEADER 8
+
+// ipv6 next header values of the extension headers we walk
+#define IPV6_EXT_HOP_BY_HOP 0
+#define IPV6_EXT_ROUTING 43
+#define IPV6_EXT_FRAGMENT 44
+#define IPV6_EXT_ESP 50
+#define IPV6_EXT_AH 51
+#define IPV6_EXT_NO_NEXT 59
+#define IPV6_EXT_DEST_OPTS 60
+
+/**
+ * transport header at `offset`, the payload is whatever follows it
+ * up to `end` (end of the ip payload, clamped to the capture)
+ */
+static void decode_l4(const u_char *frame, uint32_t offset, uint32_t end, packet_meta *meta){
+    const u_char *l4 = frame + offset;
+    uint32_t available = end > offset ? end - offset : 0;
+    meta->l4_offset = (uint16_t)offset;
+    const dissector *transport = ip_dissector(meta->ip_proto);
+    if (!transport->fn){
+        // unknown transport, everything after ip is payload
+        meta->payload_offset = (uint16_t)offset;
+        meta->payload_len = (uint16_t)available;
+        return;
+    }
+    int header = transport->fn(l4, available, meta);
+    if (header == 0){
+        meta->flags |= META_TRUNCATED;
+        return;
+    }
+    if (header < 0){
+        meta->flags |= META_MALFORMED;
+        return;
+    }
+    meta->flags |= META_HAS_L4;
+    meta->payload_offset = (uint16_t)(offset + header);
+    meta->payload_len = (uint16_t)(available - header);
+}
+
+/**
+ * fast path for the frame we see most, untagged ethernet / ipv4 without
+ * options / tcp, not fragmented. all the checks are folded in one
+ * condition so the common case costs a single predictable branch, then
+ * the record is filled with straight loads. anything else (options,
+ * vlan, a header cut by the snaplen...) goes the general way
+ * ### return:
+ *  `true`: `meta` is complete
+ *  `false`: nothing written, use the general path
+ */
+static inline bool decode_ipv4_tcp_fast(const u_char *frame, uint32_t caplen, uint64_t ts_ns, packet_meta *meta){
+    if (caplen < ETH_HLEN + IPV4_MIN_HEADER + TCP_MIN_HEADER)
+        return false;
+    const u_char *ip = frame + ETH_HLEN;
+    const u_char *tcp = ip + IPV4_MIN_HEADER;
+    uint32_t total = read_be16(ip + 2);
+    uint32_t tcp_header = (uint32_t)(tcp[12] >> 4) * 4;
+    uint32_t l4_end = ETH_HLEN + IPV4_MIN_HEADER + tcp_header;
+    // & instead of && on purpose, every operand is already safe to read
+    bool common = (read_be16(frame + 12) == ETHERTYPE_IP)
+        & (ip[0] == 0x45)
+        & (ip[9] == IPPROTO_TCP)
+        & ((read_be16(ip + 6) & 0x3FFF) == 0)
+        & (tcp_header >= TCP_MIN_HEADER)
+        & (l4_end <= caplen)
+        & (IPV4_MIN_HEADER + tcp_header <= total);
+    if (__builtin_expect(!common, 0))
+        return false;
+
+    // ethernet padding is not payload
+    uint32_t end = ETH_HLEN + total < caplen ? ETH_HLEN + total : caplen;
+    memset(meta, 0, sizeof(packet_meta));
+    meta->ts_ns = ts_ns;
+    meta->caplen = caplen;
+    meta->flags = META_HAS_L3 | META_HAS_L4;
+    meta->ethertype = ETHERTYPE_IP;
+    meta->l3_offset = ETH_HLEN;
+    meta->l4_offset = ETH_HLEN + IPV4_MIN_HEADER;
+    meta->payload_offset = (uint16_t)l4_end;
+    meta->payload_len = (uint16_t)(end - l4_end);
+    meta->ip_version = 4;
+    meta->ip_proto = IPPROTO_TCP;
+    meta->ttl = ip[8];
+    meta->ip_id = read_be16(ip + 4);
+    memcpy(meta->src_addr, ip + 12, 4);
+    memcpy(meta->dst_addr, ip + 16, 4);
+    meta->src_port = read_be16(tcp);
+    meta->dst_port = read_be16(tcp + 2);
+    meta->tcp_seq = read_be32(tcp + 4);
+    meta->tcp_ack = read_be32(tcp + 8);
+    meta->tcp_flags = tcp[13];
+    meta->tcp_window = read_be16(tcp + 14);
+    meta->l4_checksum = read_be16(tcp + 16);
+    return true;
+}
+
+/**
+ * ipv4 header at `offset`
+ * ### return:
+ *  `uint32_t`: offset of the transport header, 0 when there's none to decode
+ */
+static uint32_t decode_ipv4(const u_char *frame, uint32_t caplen, uint32_t offset, packet_meta *meta, uint32_t *end){
+    const u_char *ip = frame + offset;
+    if (caplen - offset < IPV4_MIN_HEADER){
+        meta->flags |= META_TRUNCATED;
+        return 0;
+    }
+    uint32_t header = (uint32_t)(ip[0] & 0x0F) * 4;
+    uint32_t total = read_be16(ip + 2);
+    if ((ip[0] >> 4) != 4 || header < IPV4_MIN_HEADER || total < header){
+        meta->flags |= META_MALFORMED;
+        return 0;
+    }
+    meta->ip_version = 4;
+    meta->flags |= META_HAS_L3;
+    meta->ttl = ip[8];
+    meta->ip_proto = ip[9];
+    meta->ip_id = read_be16(ip + 4);
+    uint16_t frag = read_be16(ip + 6);
+    meta->frag_offset = (uint16_t)((frag & 0x1FFF) * 8);
+    if (frag & 0x2000)
+        meta->flags |= META_MORE_FRAGMENTS;
+    if (frag & 0x3FFF){
+        meta->flags |= META_FRAGMENT;
+        meta->frag_data = (uint16_t)(offset + header);
+    }
+    memcpy(meta->src_addr, ip + 12, 4);
+    memcpy(meta->dst_addr, ip + 16, 4);
+    if (caplen - offset < header){
+        meta->flags |= META_TRUNCATED;
+        return 0;
+    }
+    // ethernet padding is not payload
+    *end = offset + total < caplen ? offset + total : caplen;
+    // only the first fragment carries the transport header
+    if (meta->frag_offset != 0){
+        meta->payload_offset = (uint16_t)(offset + header);
+        meta->payload_len = (uint16_t)(*end > offset + header ? *end - (offset + header) : 0);
+        return 0;
+    }
+    return offset + header;
+}
+
+/**
+ * ipv6_walk: follow the next header chain of the ipv6 header at `ip6`
+ * through hop-by-hop, routing, fragment, destination options and AH
+ * headers, at most IPV6_MAX_EXTENSIONS of them, reading in place.
+ * `available` is how many bytes of the packet we have from `ip6` on.
+ * a non first fragment, ESP or a chain that doesn't fit leaves
+ * `chain->has_l4` false
+ */
+void ipv6_walk(const u_char *ip6, uint32_t available, ipv6_chain *chain){
+    memset(chain, 0, sizeof(ipv6_chain));
+    if (available < IPV6_HEADER){
+        chain->flags |= META_TRUNCATED;
+        return;
+    }
+    uint8_t next = ip6[6];
+    uint32_t offset = IPV6_HEADER;
+    for (;;){
+        uint32_t len = 0;
+        switch (next){
+            case IPV6_EXT_HOP_BY_HOP:
+            case IPV6_EXT_ROUTING:
+            case IPV6_EXT_DEST_OPTS:
+                if (available - offset < 2)
+                    goto truncated;
+                len = ((uint32_t)ip6[offset + 1] + 1) * 8;
+                break;
+            case IPV6_EXT_AH:
+                if (available - offset < 2)
+                    goto truncated;
+                // AH counts in 4 byte words, minus 2
+                len = ((uint32_t)ip6[offset + 1] + 2) * 4;
+                break;
+            case IPV6_EXT_FRAGMENT:
+                if (available - offset < IPV6_FRAGMENT_HEADER)
+                    goto truncated;
+                len = IPV6_FRAGMENT_HEADER;
+                uint16_t frag = read_be16(ip6 + offset + 2);
+                // offset 0 without M is an atomic fragment (RFC 6946),
+                // the whole packet, that's also what reassembly leaves
+                if (frag & 0xFFF9){
+                    chain->flags |= META_FRAGMENT;
+                    chain->frag_data = (uint16_t)(offset + IPV6_FRAGMENT_HEADER);
+                }
+                if (frag & 0x0001)
+                    chain->flags |= META_MORE_FRAGMENTS;
+                chain->frag_offset = frag & 0xFFF8;
+                chain->frag_id = read_be32(ip6 + offset + 4);
+                break;
+            case IPV6_EXT_ESP:
+                chain->flags |= META_ENCRYPTED;
+                goto done;
+            default:
+                // the transport, or IPV6_EXT_NO_NEXT
+                chain->has_l4 = next != IPV6_EXT_NO_NEXT;
+                goto done;
+        }
+        if (chain->ext_count == IPV6_MAX_EXTENSIONS){
+            chain->flags |= META_EXT_LIMIT;
+            goto done;
+        }
+        if (available - offset < len)
+            goto truncated;
+        chain->ext_count++;
+        next = ip6[offset];
+        offset += len;
+        // only the first fragment has the rest of the chain
+        if (chain->frag_offset != 0)
+            goto done;
+    }
+
+truncated:
+    chain->flags |= META_TRUNCATED;
+done:
+    chain->proto = next;
+    chain->offset = (uint16_t)offset;
+}
+
+/**
+ * ipv6 header at `offset` and its extension headers
+ * ### return:
+ *  `uint32_t`: offset of the transport header, 0 when there's none to decode
+ */
+static uint32_t decode_ipv6(const u_char *frame, uint32_t caplen, uint32_t offset, packet_meta *meta, uint32_t *end){
+    const u_char *ip = frame + offset;
+    if (caplen - offset < IPV6_HEADER){
+        meta->flags |= META_TRUNCATED;
+        return 0;
+    }
+    if ((ip[0] >> 4) != 6){
+        meta->flags |= META_MALFORMED;
+        return 0;
+    }
+    meta->ip_version = 6;
+    meta->flags |= META_HAS_L3;
+    meta->ttl = ip[7];
+    memcpy(meta->src_addr, ip + 8, 16);
+    memcpy(meta->dst_addr, ip + 24, 16);
+    uint32_t total = IPV6_HEADER + read_be16(ip + 4);
+    *end = offset + total < caplen ? offset + total : caplen;
+
+    ipv6_chain chain;
+    ipv6_walk(ip, *end - offset, &chain);
+    meta->ip_proto = chain.proto;
+    meta->ext_count = chain.ext_count;
+    meta->frag_offset = chain.frag_offset;
+    meta->ip_id = chain.frag_id;
+    meta->flags |= chain.flags;
+    if (chain.flags & META_FRAGMENT)
+        meta->frag_data = (uint16_t)(offset + chain.frag_data);
+    if (!chain.has_l4){
+        // whatever we couldn't go through is payload (fragment data, ESP)
+        if (!(chain.flags & (META_TRUNCATED | META_EXT_LIMIT))){
+            meta->payload_offset = (uint16_t)(offset + chain.offset);
+            meta->payload_len = (uint16_t)(*end - (offset + chain.offset));
+        }
+        return 0;
+    }
+    return offset + chain.offset;
+}
+
+// decoder.max_tunnel_depth, set once before the workers are forked
+static int tunnel_depth = 2;
+
+void decoder_set_tunnel_depth(int depth){
+    tunnel_depth = depth < 0 ? 0 : (depth > META_MAX_TUNNELS ? META_MAX_TUNNELS : depth);
+}
+
+/**
+ * push a tunnel layer whose outer header is the current l3 header and
+ * forget that layer, what's decoded next is the packet it carries
+ * ### return:
+ *  `false`: too deep, the current layer stays and the rest is its payload
+ */
+static bool enter_tunnel(packet_meta *meta, uint8_t type, uint32_t id){
+    if (meta->tunnel_count >= tunnel_depth){
+        meta->flags |= META_TUNNEL_LIMIT;
+        return false;
+    }
+    meta->tunnel_type[meta->tunnel_count] = type;
+    meta->tunnel_offset[meta->tunnel_count] = meta->l3_offset;
+    meta->tunnel_count++;
+    meta->tunnel_id = id;
+    meta->flags &= ~(META_HAS_L3 | META_HAS_L4);
+    memset(&meta->l3_offset, 0, sizeof(packet_meta) - offsetof(packet_meta, l3_offset));
+    return true;
+}
+
+static int decode_l3(const u_char *frame, uint32_t end, uint32_t offset, uint16_t ether_type, packet_meta *meta);
+
+/**
+ * ethernet header at `offset`, the outer one or one carried by a
+ * tunnel, vlan tags (802.1Q, 802.1ad and the older 0x9100) are walked,
+ * nothing past `end` is read
+ */
+static int decode_ethernet(const u_char *frame, uint32_t end, uint32_t offset, packet_meta *meta){
+    if (end - offset < ETH_HLEN){
+        meta->flags |= META_TRUNCATED;
+        return offset ? 2 : 0;
+    }
+    uint16_t ether_type = read_be16(frame + offset + 12);
+    offset += ETH_HLEN;
+    while (ether_type == ETHERTYPE_VLAN || ether_type == ETHERTYPE_QINQ || ether_type == ETHERTYPE_QINQ_OLD){
+        if (end - offset < 4){
+            meta->ethertype = ether_type;
+            meta->flags |= META_TRUNCATED;
+            return 2;
+        }
+        if (meta->vlan_count < META_MAX_VLANS)
+            meta->vlan_id[meta->vlan_count++] = read_be16(frame + offset) & 0x0FFF;
+        else
+            meta->flags |= META_VLAN_OVERFLOW;
+        ether_type = read_be16(frame + offset + 2);
+        offset += 4;
+    }
+    return decode_l3(frame, end, offset, ether_type, meta);
+}
+
+/**
+ * what a tunnel carries, starting at `offset`, `next` being its ethertype
+ */
+static int decode_inner(const u_char *frame, uint32_t end, uint32_t offset, uint16_t next, packet_meta *meta){
+    if (next == ETHERTYPE_TEB)
+        return decode_ethernet(frame, end, offset, meta);
+    return decode_l3(frame, end, offset, next, meta);
+}
+
+/**
+ * an ethertype the decoder doesn't know itself, given to the registered
+ * dissector if there's one, what follows its header is payload
+ */
+static int decode_other_l3(const u_char *frame, uint32_t end, uint32_t offset, uint16_t ether_type, packet_meta *meta){
+    const dissector *other = ether_dissector(ether_type);
+    if (!other || !other->fn)
+        return 2;
+    int len = other->fn(frame + offset, end - offset, meta);
+    if (len == 0)
+        meta->flags |= META_TRUNCATED;
+    else if (len < 0)
+        meta->flags |= META_MALFORMED;
+    else {
+        meta->payload_offset = (uint16_t)(offset + len);
+        meta->payload_len = (uint16_t)(end - offset - len);
+    }
+    return 2;
+}
+
+/**
+ * hand the payload to the dissector registered on the destination port,
+ * or on the source port, the first that doesn't say "not mine" keeps it
+ */
+static void dissect_payload(const u_char *frame, packet_meta *meta){
+    uint8_t ids[2] = {
+        port_dissector_id(meta->ip_proto, meta->dst_port),
+        port_dissector_id(meta->ip_proto, meta->src_port)
+    };
+    for (int i = 0; i < 2; i++){
+        if (!ids[i])
+            continue;
+        const dissector *payload = port_dissector(ids[i]);
+        if (payload->fn && payload->fn(frame + meta->payload_offset, meta->payload_len, meta) >= 0){
+            meta->dissector = ids[i];
+            return;
+        }
+    }
+}
+
+/**
+ * l3 header of type `ether_type` at `offset` and everything on top of
+ * it, recursing into the tunnels we know (at most tunnel_depth of them)
+ */
+static int decode_l3(const u_char *frame, uint32_t end, uint32_t offset, uint16_t ether_type, packet_meta *meta){
+    meta->ethertype = ether_type;
+    meta->l3_offset = (uint16_t)offset;
+    uint16_t next = 0;
+    uint32_t id = 0;
+    int len = 0;
+
+    if (ether_type == ETHERTYPE_MPLS || ether_type == ETHERTYPE_MPLS_MC){
+        len = decode_mpls(frame + offset, end - offset, &next, &id);
+        if (len == 0)
+            meta->flags |= META_TRUNCATED;
+        if (len <= 0 || !enter_tunnel(meta, TUNNEL_MPLS, id))
+            return 2;
+        return decode_inner(frame, end, offset + len, next, meta);
+    }
+
+    uint32_t l4 = 0;
+    if (ether_type == ETHERTYPE_IP)
+        l4 = decode_ipv4(frame, end, offset, meta, &end);
+    else if (ether_type == ETHERTYPE_IPV6)
+        l4 = decode_ipv6(frame, end, offset, meta, &end);
+    else
+        return decode_other_l3(frame, end, offset, ether_type, meta);
+    if (!l4)
+        return meta->flags & META_HAS_L3 ? 3 : 2;
+
+    // a fragment only carries a piece of the inner packet, it's payload
+    // until the fragments are put back together
+    bool whole = !(meta->flags & META_FRAGMENT);
+    switch (meta->ip_proto){
+        case IPPROTO_IPIP:
+        case IPPROTO_IPV6:
+            next = meta->ip_proto == IPPROTO_IPIP ? ETHERTYPE_IP : ETHERTYPE_IPV6;
+            if (whole && enter_tunnel(meta, TUNNEL_IPIP, 0))
+                return decode_l3(frame, end, l4, next, meta);
+            break;
+        case IPPROTO_GRE:
+            len = whole ? decode_gre(frame + l4, end - l4, &next, &id) : -1;
+            if (len > 0 && enter_tunnel(meta, TUNNEL_GRE, id))
+                return decode_inner(frame, end, l4 + len, next, meta);
+            break;
+    }
+    decode_l4(frame, l4, end, meta);
+    if (!(meta->flags & META_HAS_L4))
+        return 3;
+
+    if (meta->ip_proto == IPPROTO_UDP && whole){
+        uint32_t udp_payload = meta->payload_offset;
+        uint8_t type = 0;
+        if (meta->dst_port == VXLAN_PORT){
+            type = TUNNEL_VXLAN;
+            len = decode_vxlan(frame + udp_payload, end - udp_payload, &next, &id);
+        }else if (meta->dst_port == GENEVE_PORT){
+            type = TUNNEL_GENEVE;
+            len = decode_geneve(frame + udp_payload, end - udp_payload, &next, &id);
+        }
+        if (type && len > 0 && enter_tunnel(meta, type, id))
+            return decode_inner(frame, end, udp_payload + len, next, meta);
+    }
+    return 4;
+}
+
+/**
+ * decode_layers: decode_packet without the port dissectors, the layout
+ * of the frame alone (the sniffer shards on it)
+ * ### return:
+ *  `int`: the deepest layer that was decoded (2, 3 or 4) in the innermost packet
+ *  `0`: not even an ethernet header
+ */
+int decode_layers(const u_char *frame, uint32_t caplen, uint64_t ts_ns, packet_meta *meta){
+    if (decode_ipv4_tcp_fast(frame, caplen, ts_ns, meta))
+        return 4;
+    memset(meta, 0, sizeof(packet_meta));
+    meta->ts_ns = ts_ns;
+    meta->caplen = caplen;
+    return decode_ethernet(frame, caplen, 0, meta);
+}
+
+/**
+ * decode_packet: fill `meta` with the l2-l4 layout of an ethernet frame,
+ * vlan tags are walked, IPv4 and IPv6 understood, the transport and
+ * other ethertypes go to their dissector (protocols/dissector.c), the
+ * payload to the one registered on its port if any. GRE, VXLAN, GENEVE, IP in IP
+ * and MPLS are decapsulated up to decoder.max_tunnel_depth deep, the
+ * record then describes the innermost packet (see packet_meta)
+ * ### return:
+ *  `int`: the deepest layer that was decoded (2, 3 or 4) in the innermost packet
+ *  `0`: not even an ethernet header
+ */
+int decode_packet(const u_char *frame, uint32_t caplen, uint64_t ts_ns, packet_meta *meta){
+    int layer = decode_layers(frame, caplen, ts_ns, meta);
+    if (layer == 4)
+        dissect_payload(frame, meta);
+    return layer;
+}
@@ -0,0 +1,158 @@
+#include <string.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include "./protoheaders.h"
+
+/**
+ * dissector registry, filled at startup (before the workers are forked,
+ * so every worker gets a read only copy) and looked up per packet:
+ *  - ip protocols: a dense 256 entry array indexed by the protocol
+ *  - ethertypes and (ip protocol, port): small open addressing tables,
+ *    power of two sized, linear probing, never deleted from
+ * a lookup is an index or a couple of probes, then one indirect call
+ */
+
+#define ETHER_BITS 6
+#define PORT_BITS 10
+#define ETHER_SLOTS (1 << ETHER_BITS)
+#define PORT_SLOTS (1 << PORT_BITS)
+
+typedef struct {
+    uint16_t ether_type;        // 0 is a free slot, real ones are >= 0x0600
+    uint8_t id;
+} ether_slot;
+
+typedef struct {
+    uint32_t key;               // ip_proto << 16 | port, 0 is a free slot
+    uint8_t id;
+} port_slot;
+
+// the transports the decoder ships with, they don't need registering
+dissector ip_dissectors[256] = {
+    [IPPROTO_ICMP] = {"icmp", decode_icmp},
+    [IPPROTO_TCP] = {"tcp", decode_tcp},
+    [IPPROTO_UDP] = {"udp", decode_udp},
+    [IPPROTO_ICMPV6] = {"icmpv6", decode_icmp},
+};
+
+// id 0 is "none", so at most 255 of each
+static dissector ether_dissectors[256];
+static dissector port_dissectors[256];
+static int ether_count = 0;
+static int port_count = 0;
+static ether_slot ether_table[ETHER_SLOTS];
+static port_slot port_table[PORT_SLOTS];
+
+// fibonacci hashing, the top bits of the product are the well mixed ones
+static inline uint32_t slot_hash(uint32_t key, int bits){
+    return (key * 0x9E3779B1u) >> (32 - bits);
+}
+
+/**
+ * register_ip_dissector: decode ip protocol `proto` with `fn`, replaces
+ * whatever was there (the built in ones included)
+ */
+void register_ip_dissector(uint8_t proto, const char *name, dissector_fn fn){
+    ip_dissectors[proto].name = name;
+    ip_dissectors[proto].fn = fn;
+}
+
+/**
+ * register_ether_dissector: `fn` gets the frame from the header that
+ * follows the ethernet/vlan headers when it's `ether_type`. ip, ipv6 and
+ * mpls stay in the decoder, the tunnels go through them
+ * ### return:
+ *  `0`: registered (or replaced)
+ *  `-1`: not an ethertype, or the table is full
+ */
+int register_ether_dissector(uint16_t ether_type, const char *name, dissector_fn fn){
+    if (ether_type < 0x0600){
+        printf("[x] 0x%04x is a length, not an ethertype\n", ether_type);
+        return -1;
+    }
+    uint32_t slot = slot_hash(ether_type, ETHER_BITS);
+    for (int probe = 0; probe < ETHER_SLOTS; probe++, slot = (slot + 1) & (ETHER_SLOTS - 1)){
+        if (ether_table[slot].ether_type == ether_type){
+            ether_dissectors[ether_table[slot].id] = (dissector){name, fn};
+            return 0;
+        }
+        if (ether_table[slot].ether_type != 0)
+            continue;
+        // keep the table at most half full so misses stay short
+        if (ether_count == 255 || ether_count >= ETHER_SLOTS / 2)
+            break;
+        ether_dissectors[++ether_count] = (dissector){name, fn};
+        ether_table[slot].ether_type = ether_type;
+        ether_table[slot].id = (uint8_t)ether_count;
+        return 0;
+    }
+    printf("[x] can't register %s, the ethertype dissector table is full\n", name);
+    return -1;
+}
+
+/**
+ * register_port_dissector: `fn` gets the payload of `ip_proto` (tcp or
+ * udp) packets to or from `port`, the destination port is tried first
+ * ### return:
+ *  `0`: registered (or replaced)
+ *  `-1`: port 0, or the table is full
+ */
+int register_port_dissector(uint8_t ip_proto, uint16_t port, const char *name, dissector_fn fn){
+    if (port == 0){
+        printf("[x] can't register %s on port 0\n", name);
+        return -1;
+    }
+    uint32_t key = (uint32_t)ip_proto << 16 | port;
+    uint32_t slot = slot_hash(key, PORT_BITS);
+    for (int probe = 0; probe < PORT_SLOTS; probe++, slot = (slot + 1) & (PORT_SLOTS - 1)){
+        if (port_table[slot].key == key){
+            port_dissectors[port_table[slot].id] = (dissector){name, fn};
+            return 0;
+        }
+        if (port_table[slot].key != 0)
+            continue;
+        if (port_count == 255)
+            break;
+        port_dissectors[++port_count] = (dissector){name, fn};
+        port_table[slot].key = key;
+        port_table[slot].id = (uint8_t)port_count;
+        return 0;
+    }
+    printf("[x] can't register %s, the port dissector table is full\n", name);
+    return -1;
+}
+
+const dissector *ether_dissector(uint16_t ether_type){
+    if (!ether_count)
+        return NULL;
+    uint32_t slot = slot_hash(ether_type, ETHER_BITS);
+    while (ether_table[slot].ether_type != 0){
+        if (ether_table[slot].ether_type == ether_type)
+            return &ether_dissectors[ether_table[slot].id];
+        slot = (slot + 1) & (ETHER_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/**
+ * port_dissector_id: id of the dissector registered for `port` of `ip_proto`
+ * ### return:
+ *  `uint8_t`: the id, 0 when there's none
+ */
+uint8_t port_dissector_id(uint8_t ip_proto, uint16_t port){
+    if (!port_count)
+        return 0;
+    uint32_t key = (uint32_t)ip_proto << 16 | port;
+    uint32_t slot = slot_hash(key, PORT_BITS);
+    // the table never fills (255 of 1024 slots), there's always a free one
+    while (port_table[slot].key != 0){
+        if (port_table[slot].key == key)
+            return port_table[slot].id;
+        slot = (slot + 1) & (PORT_SLOTS - 1);
+    }
+    return 0;
+}
+
+const dissector *port_dissector(uint8_t id){
+    return id ? &port_dissectors[id] : NULL;
+}
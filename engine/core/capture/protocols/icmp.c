@@ -0,0 +1,34 @@
+#include "./protoheaders.h"
+#include "./read.h"
+
+/**
+ * REFERENCES I WILL NEED :
+ * ICMP HEADERS     : /usr/include/netinet/ip_icmp.h
+ * ICMPV6 HEADERS   : /usr/include/netinet/icmp6.h
+ */
+
+#define ICMP_MIN_HEADER 4
+#define ICMP_ECHO_HEADER 8
+
+/**
+ * decode_icmp: type, code and checksum of an icmp or icmpv6 header at
+ * `l4` (`meta->ip_proto` tells which), plus id/seq for echo messages
+ * ### return:
+ *  `int`: length of the header (4, or 8 for echo)
+ *  `0`: truncated
+ */
+int decode_icmp(const u_char *l4, uint32_t available, packet_meta *meta){
+    if (available < ICMP_MIN_HEADER)
+        return 0;
+    meta->icmp_type = l4[0];
+    meta->icmp_code = l4[1];
+    meta->l4_checksum = read_be16(l4 + 2);
+    bool echo = meta->ip_proto == IPPROTO_ICMPV6
+        ? (l4[0] == 128 || l4[0] == 129)
+        : (l4[0] == 8 || l4[0] == 0);
+    if (!echo || available < ICMP_ECHO_HEADER)
+        return ICMP_MIN_HEADER;
+    meta->icmp_id = read_be16(l4 + 4);
+    meta->icmp_seq = read_be16(l4 + 6);
+    return ICMP_ECHO_HEADER;
+}
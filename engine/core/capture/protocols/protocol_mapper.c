@@ -1,98 +1,106 @@
 #define _GNU_SOURCE
-#include <netinet/if_ether.h>   // struct ether_header
-#include <netinet/ip.h>         // struct ip, struct iphdr
-#include <netinet/tcp.h>        // struct tcphdr
-#include <netinet/udp.h>        // struct udphdr
-#include <netinet/ip_icmp.h>    // struct icmphdr
-#include <netinet/ip6.h>        // struct ip6_hdr (IPv6)
-#include <arpa/inet.h>          // ntohs(), ntohl(), inet_ntoa()
-#include <net/ethernet.h>  
+#include <arpa/inet.h>          // inet_ntop()
+#include <netinet/in.h>
 #include <string.h>
 #include <stdio.h>
-void protocol_mapper(struct ip *iph){
-    if (!iph)
-        return;
-    char src_ip[INET_ADDRSTRLEN];
-    char dst_ip[INET_ADDRSTRLEN];
-    strcpy(src_ip, inet_ntoa(iph->ip_src));
-    strcpy(dst_ip, inet_ntoa(iph->ip_dst));
-    char protocol_str[200]; 
-    switch (iph->ip_p)
-    {
-        case 0:// IP
-            /* code */
-            break;
-        case 1:// ICMP
-            strcpy(protocol_str, "ICMP");
-            break;
-        case 2:// IGMP
-            strcpy(protocol_str, "IGMP");
-            break;
-        case 4:// IPIP
-            strcpy(protocol_str, "IPIP");
-            break;
-        case 6:// TCP
-            strcpy(protocol_str, "TCP");
-            break;
-        case 8:// EGP
-            strcpy(protocol_str, "EGP");
-            break;
-        case 12:// PUP
-            strcpy(protocol_str, "PUP");
-            break;
-        case 17:// UDP
-            strcpy(protocol_str, "UDP");
-            break;
-        case 22:// IDP
-            strcpy(protocol_str, "IDP");
-            break;
-        case 29:// TP
-            strcpy(protocol_str, "TP");
-            break;
-        case 33:// DCCP
-            strcpy(protocol_str, "DCCP");
-            break;
-        case 41:// IPV6
-            strcpy(protocol_str, "IPV6");
-            break;
-        case 46:
-            break;
-        case 47:
-            break;
-        case 50:
-            break;
-        case 51:
-            break;
-        case 92:
-            break;
-        case 94:
-            break;
-        case 98:
-            break;
-        case 103:
-            break;
-        case 108:
-            break;
-        case 115:
-            break;
-        case 132:
-            break;
-        case 136:
-            break;
-        case 137:
-            break;
-        case 143:
-            break;
-        case 255:
-            break;
-    default:
-        break;
+#include "./protoheaders.h"
+
+/**
+ * text sink of the decoder, only used when someone wants to read the
+ * packets, the decoder itself never formats anything
+ */
+
+static const char *protocol_names[256] = {
+    [0] = "HOPOPT",
+    [1] = "ICMP",
+    [2] = "IGMP",
+    [4] = "IPIP",
+    [6] = "TCP",
+    [8] = "EGP",
+    [12] = "PUP",
+    [17] = "UDP",
+    [22] = "IDP",
+    [29] = "TP",
+    [33] = "DCCP",
+    [41] = "IPV6",
+    [43] = "IPV6-ROUTE",
+    [44] = "IPV6-FRAG",
+    [46] = "RSVP",
+    [47] = "GRE",
+    [50] = "ESP",
+    [51] = "AH",
+    [58] = "ICMPV6",
+    [59] = "IPV6-NONXT",
+    [60] = "IPV6-OPTS",
+    [92] = "MTP",
+    [94] = "BEETPH",
+    [98] = "ENCAP",
+    [103] = "PIM",
+    [108] = "COMP",
+    [115] = "L2TP",
+    [132] = "SCTP",
+    [136] = "UDPLITE",
+    [137] = "MPLS",
+    [143] = "ETHERNET",
+    [255] = "RAW",
+};
+
+/**
+ * name of an ip protocol number, "?" when we don't know it
+ */
+const char *protocol_name(uint8_t proto){
+    return protocol_names[proto] ? protocol_names[proto] : "?";
+}
+
+/**
+ * render one meta record as a single line, same shape the old
+ * protocol_mapper printed: [PROTO]src -> dst
+ * ### return:
+ *  `int`: length of the line (snprintf semantics)
+ */
+int meta_format(const packet_meta *meta, char *buffer, size_t size){
+    char src[INET6_ADDRSTRLEN];
+    char dst[INET6_ADDRSTRLEN];
+    char vlan[96] = "";
+    int used = 0;
+    for (int i = 0; i < meta->vlan_count; i++)
+        used += snprintf(vlan + used, sizeof(vlan) - used, "vlan[%u] ", meta->vlan_id[i]);
+    // outermost tunnel first, only the innermost one has its id
+    for (int i = 0; i < meta->tunnel_count; i++){
+        if (i == meta->tunnel_count - 1)
+            used += snprintf(vlan + used, sizeof(vlan) - used, "%s[%u] ", tunnel_name(meta->tunnel_type[i]), meta->tunnel_id);
+        else
+            used += snprintf(vlan + used, sizeof(vlan) - used, "%s ", tunnel_name(meta->tunnel_type[i]));
+    }
+
+    if (!(meta->flags & META_HAS_L3))
+        return snprintf(buffer, size, "%s[ether 0x%04x] %u bytes\n", vlan, meta->ethertype, meta->caplen);
+
+    // TCP/http when a port dissector took the payload
+    char proto[48];
+    const dissector *payload = port_dissector(meta->dissector);
+    snprintf(proto, sizeof(proto), "%s%s%s", protocol_name(meta->ip_proto),
+        payload ? "/" : "", payload ? payload->name : "");
+
+    int family = meta->ip_version == 6 ? AF_INET6 : AF_INET;
+    inet_ntop(family, meta->src_addr, src, sizeof(src));
+    inet_ntop(family, meta->dst_addr, dst, sizeof(dst));
+    if (meta->flags & META_HAS_L4 && (meta->src_port || meta->dst_port)){
+        // [addr]:port so the port can't be mistaken for a piece of an ipv6
+        const char *format = meta->ip_version == 6 ? "%s[%s][%s]:%u -> [%s]:%u\n" : "%s[%s]%s:%u -> %s:%u\n";
+        return snprintf(buffer, size, format,
+            vlan, proto, src, meta->src_port, dst, meta->dst_port);
     }
-    printf(
-    "[%s]%s -> %s\n", 
-    protocol_str,
-    src_ip,
-    dst_ip
-    );
+    return snprintf(buffer, size, "%s[%s]%s -> %s\n",
+        vlan, proto, src, dst);
+}
 
-}
\ No newline at end of file
+/**
+ * write one meta record to `out`, buffered, flushing is up to the caller
+ */
+void meta_print(const packet_meta *meta, FILE *out){
+    char line[256];
+    int len = meta_format(meta, line, sizeof(line));
+    if (len > 0)
+        fwrite(line, 1, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1, out);
+}
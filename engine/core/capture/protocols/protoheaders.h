@@ -1,6 +1,10 @@
 #ifndef PROTO_HEADERS
 #define PROTO_HEADERS
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
 
 
 #define ETH_HEADER_SIZE_PLAIN 14
@@ -18,7 +22,182 @@ typedef struct{
 }IPV6;
 
 
-void protocol_mapper(struct ip *iph);
+#define META_MAX_VLANS 2
+// tunnel layers a packet_meta can record, decoder.max_tunnel_depth is capped to it
+#define META_MAX_TUNNELS 4
+
+// packet_meta.flags
+#define META_TRUNCATED          0x0001  // a header was cut by the capture length
+#define META_MALFORMED          0x0002  // a header doesn't make sense
+#define META_FRAGMENT           0x0004  // ip fragment, l4 only on the first one
+#define META_MORE_FRAGMENTS     0x0008
+#define META_VLAN_OVERFLOW      0x0010  // more tags than META_MAX_VLANS
+#define META_HAS_L3             0x0020
+#define META_HAS_L4             0x0040
+#define META_EXT_LIMIT          0x0080  // ipv6 extension chain longer than IPV6_MAX_EXTENSIONS
+#define META_ENCRYPTED          0x0100  // transport is behind ESP
+#define META_TUNNEL_LIMIT       0x0200  // more tunnels than the max depth, the rest is payload
+
+// ipv6 extension headers walked before giving up on reaching l4
+#define IPV6_MAX_EXTENSIONS 8
+
+// ethertypes net/ethernet.h doesn't have
+#define ETHERTYPE_QINQ          0x88A8  // 802.1ad service tag
+#define ETHERTYPE_QINQ_OLD      0x9100  // pre 802.1ad double tagging
+#define ETHERTYPE_MPLS          0x8847
+#define ETHERTYPE_MPLS_MC       0x8848
+#define ETHERTYPE_TEB           0x6558  // transparent ethernet bridging, ethernet in GRE/GENEVE
+
+// well known udp ports of the udp tunnels
+#define VXLAN_PORT 4789
+#define GENEVE_PORT 6081
+
+/** what carries the next layer, packet_meta.tunnel_type */
+typedef enum {
+    TUNNEL_GRE = 51,
+    TUNNEL_VXLAN = 52,
+    TUNNEL_GENEVE = 53,
+    TUNNEL_IPIP = 54,           // ipv4 or ipv6 straight in ipv4/ipv6
+    TUNNEL_MPLS = 55
+} tunnel_type;
+
+/**
+ * everything the analysis stages need to know about a packet, filled
+ * by decode_packet without allocating or formatting anything.
+ * fixed size and no pointers, offsets are from the start of the frame
+ * and ports/ids are in host order, addresses stay in network order
+ * (ipv4 in the first 4 bytes).
+ * on a tunneled packet the l3/l4 fields describe the innermost packet,
+ * the tunnel_* fields tell how we got there, outermost first: layer i
+ * was carried by `tunnel_type[i]` whose outer header (the ip header,
+ * or the label stack for mpls) starts at `tunnel_offset[i]`
+ */
+typedef struct {
+    uint64_t ts_ns;
+    uint32_t caplen;
+    uint16_t flags;             // META_*
+    uint16_t ethertype;         // of the innermost l3 header, after the vlan tags
+    uint16_t vlan_id[META_MAX_VLANS];
+    uint8_t vlan_count;
+    uint8_t tunnel_count;
+    uint8_t tunnel_type[META_MAX_TUNNELS];
+    uint16_t tunnel_offset[META_MAX_TUNNELS];
+    uint32_t tunnel_id;         // of the innermost tunnel: vni, gre key or bottom mpls label
+    // from here on it's about one layer, cleared when entering a tunnel
+    uint16_t l3_offset;
+    uint16_t l4_offset;
+    uint16_t payload_offset;
+    uint16_t payload_len;       // captured payload bytes
+    uint8_t ip_version;         // 4, 6 or 0
+    uint8_t ip_proto;           // transport protocol
+    uint8_t ttl;                // hop limit for ipv6
+    uint8_t ext_count;          // ipv6 extension headers walked
+    uint32_t ip_id;             // 16 bits for ipv4, fragment header id for ipv6
+    uint16_t frag_offset;       // in bytes
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t tcp_window;
+    uint8_t tcp_flags;
+    uint8_t icmp_type;
+    uint8_t icmp_code;
+    uint8_t dissector;          // port dissector that took the payload, 0 for none
+    uint32_t tcp_seq;
+    uint32_t tcp_ack;
+    uint16_t l4_len;            // udp length field
+    uint16_t icmp_id;           // echo request/reply only
+    uint16_t icmp_seq;
+    uint16_t l4_checksum;
+    uint16_t frag_data;         // fragments only, where the fragmentable part starts
+    uint8_t src_addr[16];
+    uint8_t dst_addr[16];
+    // from the capture record, not the frame
+    uint32_t wire_len;          // caplen is less past the snaplen
+    uint32_t ingress;           // see packet_desc
+} packet_meta;
+
+_Static_assert(sizeof(packet_meta) <= 128, "packet_meta must fit in two cache lines");
+
+/** where the extension headers of an ipv6 packet lead */
+typedef struct {
+    uint16_t offset;            // from the ipv6 header, where the walk stopped
+    uint8_t proto;              // next header value of what sits at `offset`
+    bool has_l4;                // `proto` is a transport header we can read
+    uint8_t ext_count;
+    uint16_t flags;             // META_* (fragment, truncated, malformed, limit, encrypted)
+    uint16_t frag_offset;       // in bytes
+    uint16_t frag_data;         // from the ipv6 header, right after the fragment header
+    uint32_t frag_id;
+} ipv6_chain;
+
+// tcp flags
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_URG 0x20
+#define TCP_ECE 0x40
+#define TCP_CWR 0x80
+
+/** transport decoders, `available` bytes from `l4` on
+ * ### return:
+ *  `int`: length of the header
+ *  `0`: truncated
+ *  `-1`: malformed
+ */
+int decode_tcp(const u_char *l4, uint32_t available, packet_meta *meta);
+int decode_udp(const u_char *l4, uint32_t available, packet_meta *meta);
+int decode_icmp(const u_char *l4, uint32_t available, packet_meta *meta);
+
+/** tunnel headers, `available` bytes from the tunnel header on,
+ * `next` gets the ethertype of what it carries and `id` the vni, gre
+ * key or bottom mpls label
+ * ### return:
+ *  `int`: length of the tunnel header(s)
+ *  `0`: truncated
+ *  `-1`: not something we can look into
+ */
+int decode_gre(const u_char *gre, uint32_t available, uint16_t *next, uint32_t *id);
+int decode_vxlan(const u_char *vxlan, uint32_t available, uint16_t *next, uint32_t *id);
+int decode_geneve(const u_char *geneve, uint32_t available, uint16_t *next, uint32_t *id);
+int decode_mpls(const u_char *mpls, uint32_t available, uint16_t *next, uint32_t *id);
+const char *tunnel_name(uint8_t type);
+
+/**
+ * a dissector reads `available` bytes from `data` and fills what it
+ * knows in `meta`, same contract as the transport decoders above
+ * (header length, 0 truncated, -1 not mine/malformed)
+ */
+typedef int (*dissector_fn)(const u_char *data, uint32_t available, packet_meta *meta);
+
+typedef struct {
+    const char *name;
+    dissector_fn fn;
+} dissector;
+
+/** dissector registry, register before the workers are forked */
+extern dissector ip_dissectors[256];
+void register_ip_dissector(uint8_t proto, const char *name, dissector_fn fn);
+int register_ether_dissector(uint16_t ether_type, const char *name, dissector_fn fn);
+int register_port_dissector(uint8_t ip_proto, uint16_t port, const char *name, dissector_fn fn);
+const dissector *ether_dissector(uint16_t ether_type);
+uint8_t port_dissector_id(uint8_t ip_proto, uint16_t port);
+const dissector *port_dissector(uint8_t id);
+
+static inline const dissector *ip_dissector(uint8_t proto){
+    return &ip_dissectors[proto];
+}
+
+/** decoder */
+int decode_packet(const u_char *frame, uint32_t caplen, uint64_t ts_ns, packet_meta *meta);
+int decode_layers(const u_char *frame, uint32_t caplen, uint64_t ts_ns, packet_meta *meta);
+void decoder_set_tunnel_depth(int depth);
+void ipv6_walk(const u_char *ip6, uint32_t available, ipv6_chain *chain);
+
+/** optional text sink */
+const char *protocol_name(uint8_t proto);
+int meta_format(const packet_meta *meta, char *buffer, size_t size);
+void meta_print(const packet_meta *meta, FILE *out);
 
 
 
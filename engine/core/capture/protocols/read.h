@@ -0,0 +1,18 @@
+#ifndef PROTO_READ_HEADERS
+#define PROTO_READ_HEADERS
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/**
+ * big endian reads that don't care about alignment, the headers
+ * sit wherever the capture put them
+ */
+static inline uint16_t read_be16(const u_char *p){
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t read_be32(const u_char *p){
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+#endif
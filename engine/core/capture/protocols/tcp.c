@@ -0,0 +1,36 @@
+#include "./protoheaders.h"
+#include "./read.h"
+
+/**
+ * REFERENCES I WILL NEED :
+ * TCP HEADERS      : /usr/include/netinet/tcp.h
+ * RFC 9293
+ */
+
+#define TCP_MIN_HEADER 20
+
+/**
+ * decode_tcp: ports, seq/ack, flags and window of the tcp header at `l4`,
+ * options are left alone, the payload starts after the data offset
+ * ### return:
+ *  `int`: length of the header (options included)
+ *  `0`: truncated
+ *  `-1`: malformed (data offset < 5)
+ */
+int decode_tcp(const u_char *l4, uint32_t available, packet_meta *meta){
+    if (available < TCP_MIN_HEADER)
+        return 0;
+    int header = (l4[12] >> 4) * 4;
+    if (header < TCP_MIN_HEADER)
+        return -1;
+    if (available < (uint32_t)header)
+        return 0;
+    meta->src_port = read_be16(l4);
+    meta->dst_port = read_be16(l4 + 2);
+    meta->tcp_seq = read_be32(l4 + 4);
+    meta->tcp_ack = read_be32(l4 + 8);
+    meta->tcp_flags = l4[13];
+    meta->tcp_window = read_be16(l4 + 14);
+    meta->l4_checksum = read_be16(l4 + 16);
+    return header;
+}
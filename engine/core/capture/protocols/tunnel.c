@@ -0,0 +1,148 @@
+#include <net/ethernet.h>
+#include "./protoheaders.h"
+#include "./read.h"
+
+/**
+ * REFERENCES I WILL NEED :
+ * GRE              : RFC 2784, RFC 2890 (key and sequence number)
+ * VXLAN            : RFC 7348
+ * GENEVE           : RFC 8926
+ * MPLS             : RFC 3032, RFC 4385 (pseudowire control word)
+ *
+ * only the tunnel header itself is read here, the decoder goes on with
+ * whatever `next` says it carries
+ */
+
+#define GRE_MIN_HEADER 4
+#define GRE_CHECKSUM 0x8000
+#define GRE_ROUTING 0x4000
+#define GRE_KEY 0x2000
+#define GRE_SEQUENCE 0x1000
+#define GRE_VERSION 0x0007
+
+#define VXLAN_HEADER 8
+#define VXLAN_VNI_VALID 0x08
+
+#define GENEVE_MIN_HEADER 8
+
+#define MPLS_LABEL 4
+#define MPLS_MAX_LABELS 8
+#define MPLS_CONTROL_WORD 4
+
+static const char *tunnel_names[] = {
+    [TUNNEL_GRE - TUNNEL_GRE] = "gre",
+    [TUNNEL_VXLAN - TUNNEL_GRE] = "vxlan",
+    [TUNNEL_GENEVE - TUNNEL_GRE] = "geneve",
+    [TUNNEL_IPIP - TUNNEL_GRE] = "ipip",
+    [TUNNEL_MPLS - TUNNEL_GRE] = "mpls",
+};
+
+const char *tunnel_name(uint8_t type){
+    if (type < TUNNEL_GRE || type > TUNNEL_MPLS)
+        return "tunnel";
+    return tunnel_names[type - TUNNEL_GRE];
+}
+
+/** the payloads the decoder knows how to go on with */
+static bool known_inner(uint16_t ether_type){
+    return ether_type == ETHERTYPE_IP || ether_type == ETHERTYPE_IPV6 ||
+        ether_type == ETHERTYPE_TEB || ether_type == ETHERTYPE_MPLS;
+}
+
+/**
+ * decode_gre: plain GRE (version 0) with the optional checksum, key and
+ * sequence number, the key is the tunnel id. version 1 (PPTP) and the
+ * old source routing are left alone
+ */
+int decode_gre(const u_char *gre, uint32_t available, uint16_t *next, uint32_t *id){
+    if (available < GRE_MIN_HEADER)
+        return 0;
+    uint16_t flags = read_be16(gre);
+    if (flags & (GRE_VERSION | GRE_ROUTING))
+        return -1;
+    uint32_t len = GRE_MIN_HEADER;
+    if (flags & GRE_CHECKSUM)
+        len += 4;
+    *id = 0;
+    if (flags & GRE_KEY){
+        if (available < len + 4)
+            return 0;
+        *id = read_be32(gre + len);
+        len += 4;
+    }
+    if (flags & GRE_SEQUENCE)
+        len += 4;
+    if (available < len)
+        return 0;
+    *next = read_be16(gre + 2);
+    return known_inner(*next) ? (int)len : -1;
+}
+
+/**
+ * decode_vxlan: the 8 byte header, always followed by ethernet,
+ * a header without the I flag has no vni and isn't vxlan
+ */
+int decode_vxlan(const u_char *vxlan, uint32_t available, uint16_t *next, uint32_t *id){
+    if (available < VXLAN_HEADER)
+        return 0;
+    if (!(vxlan[0] & VXLAN_VNI_VALID))
+        return -1;
+    *id = read_be32(vxlan + 4) >> 8;
+    *next = ETHERTYPE_TEB;
+    return VXLAN_HEADER;
+}
+
+/**
+ * decode_geneve: version 0 header, the options are skipped
+ * (their total length is in the header)
+ */
+int decode_geneve(const u_char *geneve, uint32_t available, uint16_t *next, uint32_t *id){
+    if (available < GENEVE_MIN_HEADER)
+        return 0;
+    if (geneve[0] >> 6)
+        return -1;
+    uint32_t len = GENEVE_MIN_HEADER + (uint32_t)(geneve[0] & 0x3F) * 4;
+    if (available < len)
+        return 0;
+    *id = read_be32(geneve + 4) >> 8;
+    *next = read_be16(geneve + 2);
+    return known_inner(*next) ? (int)len : -1;
+}
+
+/**
+ * decode_mpls: the whole label stack, at most MPLS_MAX_LABELS, up to the
+ * bottom of stack bit. mpls doesn't say what it carries, so like every
+ * router does we look at the first nibble: 4 and 6 are ip, 0 is the
+ * pseudowire control word followed by ethernet
+ */
+int decode_mpls(const u_char *mpls, uint32_t available, uint16_t *next, uint32_t *id){
+    uint32_t len = 0;
+    for (int i = 0; i < MPLS_MAX_LABELS; i++){
+        if (available < len + MPLS_LABEL)
+            return 0;
+        const u_char *label = mpls + len;
+        len += MPLS_LABEL;
+        if (!(label[2] & 0x01))
+            continue;
+        // bottom of the stack
+        *id = read_be32(label) >> 12;
+        if (available < len + 1)
+            return 0;
+        switch (mpls[len] >> 4){
+            case 4:
+                *next = ETHERTYPE_IP;
+                return (int)len;
+            case 6:
+                *next = ETHERTYPE_IPV6;
+                return (int)len;
+            case 0:
+                if (available < len + MPLS_CONTROL_WORD)
+                    return 0;
+                *next = ETHERTYPE_TEB;
+                return (int)(len + MPLS_CONTROL_WORD);
+            default:
+                return -1;
+        }
+    }
+    return -1;
+}
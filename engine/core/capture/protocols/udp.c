@@ -0,0 +1,30 @@
+#include "./protoheaders.h"
+#include "./read.h"
+
+/**
+ * REFERENCES I WILL NEED :
+ * UDP HEADERS      : /usr/include/netinet/udp.h
+ * RFC 768
+ */
+
+#define UDP_HEADER 8
+
+/**
+ * decode_udp: ports, length and checksum of the udp header at `l4`
+ * ### return:
+ *  `int`: length of the header (always 8)
+ *  `0`: truncated
+ *  `-1`: malformed (length field shorter than the header)
+ */
+int decode_udp(const u_char *l4, uint32_t available, packet_meta *meta){
+    if (available < UDP_HEADER)
+        return 0;
+    meta->src_port = read_be16(l4);
+    meta->dst_port = read_be16(l4 + 2);
+    meta->l4_len = read_be16(l4 + 4);
+    meta->l4_checksum = read_be16(l4 + 6);
+    // 0 is a jumbogram on ipv6, anything else under 8 is junk
+    if (meta->l4_len != 0 && meta->l4_len < UDP_HEADER)
+        return -1;
+    return UDP_HEADER;
+}
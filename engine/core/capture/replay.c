@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "./capture.h"
+
+/**
+ * REFERENCES I WILL NEED :
+ * PCAP             : https://www.tcpdump.org/manpages/pcap-savefile.5.html
+ * PCAPNG           : https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-03.html
+ *
+ * the file is mmap'd once before the fork, so just like the tpacket and
+ * xdp rings the workers read the frames where they are, a descriptor
+ * offset is an offset in the file. nothing is ever written or released
+ */
+
+#define PCAP_MAGIC_USEC         0xA1B2C3D4
+#define PCAP_MAGIC_NSEC         0xA1B23C4D
+#define PCAP_GLOBAL_HEADER_SIZE 24
+#define PCAP_RECORD_HEADER_SIZE 16
+
+#define PCAPNG_SHB              0x0A0D0D0A
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_OPB              0x00000002
+#define PCAPNG_SPB              0x00000003
+#define PCAPNG_EPB              0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPT_TSRESOL      9
+
+#define LINKTYPE_ETHERNET       1
+
+static inline uint32_t read32(replay_file *file, size_t offset){
+    uint32_t value;
+    memcpy(&value, file->map + offset, sizeof(value));
+    return file->swapped ? __builtin_bswap32(value) : value;
+}
+
+static inline uint16_t read16(replay_file *file, size_t offset){
+    uint16_t value;
+    memcpy(&value, file->map + offset, sizeof(value));
+    return file->swapped ? __builtin_bswap16(value) : value;
+}
+
+/** `ts` in 1/`units` of a second to ns, whole seconds and the rest apart */
+static inline uint64_t to_ns(uint64_t ts, uint64_t units){
+    uint64_t whole = ts / units, rest = ts % units;
+    // finer than a ns the rest could overflow, what's dropped is under a ns
+    while (rest > UINT64_MAX / 1000000000ULL){
+        rest >>= 1;
+        units >>= 1;
+    }
+    return whole * 1000000000ULL + rest * 1000000000ULL / units;
+}
+
+static inline uint64_t monotonic_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * read the pcap global header
+ * ### return:
+ *  `0`: if successful
+ *  `-1`: not a pcap file
+ */
+static int open_pcap(replay_file *file){
+    if (file->map_size < PCAP_GLOBAL_HEADER_SIZE)
+        return -1;
+    uint32_t magic;
+    memcpy(&magic, file->map, sizeof(magic));
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC){
+        file->swapped = false;
+    }else if (__builtin_bswap32(magic) == PCAP_MAGIC_USEC || __builtin_bswap32(magic) == PCAP_MAGIC_NSEC){
+        file->swapped = true;
+        magic = __builtin_bswap32(magic);
+    }else{
+        return -1;
+    }
+    file->ts_units[0] = magic == PCAP_MAGIC_NSEC ? 1000000000ULL : 1000000ULL;
+    file->interface_count = 1;
+    // the link type is the low 16 bits, the rest are FCS flags
+    if ((read32(file, 20) & 0xFFFF) != LINKTYPE_ETHERNET)
+        printf("[!] replay file is not ethernet, workers will misparse it\n");
+    file->start = PCAP_GLOBAL_HEADER_SIZE;
+    return 0;
+}
+
+/**
+ * pick up the byte order of a section header block, it also
+ * forgets the interfaces of the previous section
+ * ### return:
+ *  `0`: if successful
+ *  `-1`: not a section header
+ */
+static int read_section_header(replay_file *file, size_t offset){
+    if (offset + 12 > file->map_size)
+        return -1;
+    uint32_t magic;
+    memcpy(&magic, file->map + offset + 8, sizeof(magic));
+    if (magic == PCAPNG_BYTE_ORDER_MAGIC)
+        file->swapped = false;
+    else if (__builtin_bswap32(magic) == PCAPNG_BYTE_ORDER_MAGIC)
+        file->swapped = true;
+    else
+        return -1;
+    file->interface_count = 0;
+    return 0;
+}
+
+/**
+ * record an interface description block, only the timestamp resolution
+ * is kept (default microseconds)
+ */
+static void read_interface(replay_file *file, size_t offset, uint32_t block_len){
+    if (file->interface_count >= REPLAY_MAX_INTERFACES){
+        printf("[!] replay file has more than %d interfaces\n", REPLAY_MAX_INTERFACES);
+        return;
+    }
+    uint64_t units = 1000000ULL;
+    if ((read16(file, offset + 8)) != LINKTYPE_ETHERNET)
+        printf("[!] replay interface %d is not ethernet, workers will misparse it\n", file->interface_count);
+    // options sit between the fixed 16 bytes and the trailing length
+    size_t option = offset + 16;
+    size_t end = offset + block_len - 4;
+    while (option + 4 <= end){
+        uint16_t code = read16(file, option);
+        uint16_t len = read16(file, option + 2);
+        if (code == 0 || option + 4 + len > end)
+            break;
+        if (code == PCAPNG_OPT_TSRESOL && len >= 1){
+            uint8_t resol = file->map[option + 4];
+            uint8_t power = resol & 0x7F;
+            // msb set: negative power of 2, otherwise of 10
+            if (resol & 0x80){
+                units = power < 64 ? 1ULL << power : 0;
+            }else{
+                units = 1;
+                for (int i = 0; i < power && units; i++)
+                    units = units > UINT64_MAX / 10 ? 0 : units * 10;
+            }
+            if (units == 0){
+                printf("[!] unsupported pcapng timestamp resolution, using microseconds\n");
+                units = 1000000ULL;
+            }
+        }
+        option += 4 + ((len + 3) & ~3u);
+    }
+    file->ts_units[file->interface_count++] = units;
+}
+
+/**
+ * INIT_REPLAY: mmap a .pcap or .pcapng capture file for replay, the
+ * format is picked from the magic. `pacing` is one of REPLAY_FAST,
+ * REPLAY_ORIGINAL or REPLAY_PPS (at `pps` packets per second) and the
+ * file is played `loops` times, 0 for forever
+ * ### return:
+ *  `replay_file *`: if successful
+ *  `NULL`: on error
+ */
+replay_file *INIT_REPLAY(const char *path, replay_pacing pacing, uint64_t pps, int loops){
+    if (!path){
+        printf("[x] no replay file was passed!\n");
+        return NULL;
+    }
+    if (pacing == REPLAY_PPS && pps == 0){
+        printf("[x] replay pps must be >= 1\n");
+        return NULL;
+    }
+
+    signal(SIGINT, handle_sigint);
+
+    replay_file *file = calloc(1, sizeof(replay_file));
+    if (!file){
+        printf("[x] can't allocate the replay file\n");
+        return NULL;
+    }
+    file->map = MAP_FAILED;
+    file->pacing = pacing;
+    file->pps = pps;
+    file->loops = loops;
+
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0){
+        perror("[x] can't open the replay file");
+        goto fail;
+    }
+    struct stat st;
+    if (fstat(file->fd, &st) < 0 || st.st_size == 0){
+        printf("[x] replay file %s is empty\n", path);
+        goto fail;
+    }
+    file->map_size = (size_t)st.st_size;
+    // MAP_POPULATE so the first loop doesn't measure the page cache
+    file->map = mmap(NULL, file->map_size, PROT_READ, MAP_SHARED | MAP_POPULATE, file->fd, 0);
+    if (file->map == MAP_FAILED){
+        perror("[x] can't mmap the replay file");
+        goto fail;
+    }
+    madvise(file->map, file->map_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+    if (open_pcap(file) == 0){
+        file->pcapng = false;
+    }else if (read_section_header(file, 0) == 0 && read32(file, 0) == PCAPNG_SHB){
+        file->pcapng = true;
+        file->start = 0;
+    }else{
+        printf("[x] %s is neither a pcap nor a pcapng file\n", path);
+        goto fail;
+    }
+    file->cursor = file->start;
+    return file;
+
+fail:
+    FREE_REPLAY(file);
+    return NULL;
+}
+
+/**
+ * unmap the file and close it
+ */
+void FREE_REPLAY(replay_file *file){
+    if (!file)
+        return;
+    if (file->map != MAP_FAILED && file->map)
+        munmap(file->map, file->map_size);
+    if (file->fd >= 0)
+        close(file->fd);
+    free(file);
+}
+
+/**
+ * parse the record at the cursor into `desc`, pcapng blocks that are
+ * not packets are consumed on the way
+ * ### return:
+ *  `1`: `desc` was filled, `*next` is the offset of the record after it
+ *  `0`: end of file
+ *  `-1`: malformed file
+ */
+static int replay_parse(replay_file *file, packet_desc *desc, size_t *next){
+    size_t offset = file->cursor;
+    if (!file->pcapng){
+        if (offset + PCAP_RECORD_HEADER_SIZE > file->map_size)
+            return 0;
+        uint64_t sec = read32(file, offset);
+        uint64_t frac = read32(file, offset + 4);
+        uint32_t caplen = read32(file, offset + 8);
+        if (offset + PCAP_RECORD_HEADER_SIZE + caplen > file->map_size)
+            return -1;
+        desc->offset = offset + PCAP_RECORD_HEADER_SIZE;
+        desc->caplen = caplen;
+        desc->wire_len = read32(file, offset + 12);
+        desc->ts_ns = sec * 1000000000ULL + to_ns(frac, file->ts_units[0]);
+        desc->ingress = 0;
+        *next = desc->offset + caplen;
+        return 1;
+    }
+    while (offset + 12 <= file->map_size){
+        uint32_t type = read32(file, offset);
+        if (type == PCAPNG_SHB && read_section_header(file, offset) < 0)
+            return -1;
+        uint32_t block_len = read32(file, offset + 4);
+        if (block_len < 12 || block_len % 4 != 0 || offset + block_len > file->map_size)
+            return -1;
+        size_t body = offset + 8;
+        size_t end = offset + block_len - 4;
+        if (type == PCAPNG_IDB && block_len >= 20){
+            read_interface(file, offset, block_len);
+        }else if ((type == PCAPNG_EPB && block_len >= 32) || (type == PCAPNG_OPB && block_len >= 32)){
+            // same layout once past the interface id (OPB has 16 bits of it + drops)
+            uint32_t interface = type == PCAPNG_EPB ? read32(file, body) : read16(file, body);
+            uint64_t ts = ((uint64_t)read32(file, body + 4) << 32) | read32(file, body + 8);
+            uint32_t caplen = read32(file, body + 12);
+            if (interface >= (uint32_t)file->interface_count || body + 20 + caplen > end)
+                return -1;
+            desc->offset = body + 20;
+            desc->caplen = caplen;
+            desc->wire_len = read32(file, body + 16);
+            desc->ts_ns = to_ns(ts, file->ts_units[interface]);
+            desc->ingress = interface;
+            *next = offset + block_len;
+            return 1;
+        }else if (type == PCAPNG_SPB && block_len >= 16){
+            // no timestamp, it goes out right after the previous packet
+            uint32_t len = read32(file, body);
+            uint32_t caplen = (uint32_t)(end - (body + 4));
+            desc->offset = body + 4;
+            desc->caplen = len < caplen ? len : caplen;
+            desc->wire_len = len;
+            desc->ts_ns = file->first_seen ? file->last_ts_ns : 0;
+            // simple packets always come from the first interface
+            desc->ingress = 0;
+            *next = offset + block_len;
+            return 1;
+        }
+        offset += block_len;
+        file->cursor = offset;
+    }
+    return 0;
+}
+
+/**
+ * when the packet with timestamp `ts_ns` is due (CLOCK_MONOTONIC)
+ */
+static uint64_t replay_due(replay_file *file, uint64_t ts_ns){
+    if (!file->first_seen){
+        file->first_seen = true;
+        file->first_ts_ns = ts_ns;
+        file->start_ns = monotonic_ns();
+    }
+    switch (file->pacing){
+        case REPLAY_ORIGINAL:
+            // a timestamp going back in time goes out right away
+            return ts_ns > file->first_ts_ns ? file->start_ns + (ts_ns - file->first_ts_ns) : file->start_ns;
+        case REPLAY_PPS:
+            return file->start_ns + to_ns(file->sent, file->pps);
+        default:
+            return 0;
+    }
+}
+
+/**
+ * walk up to `max` packets of the file that are due and call `handler`
+ * on each one, waits at most `timeout_ms` when the next packet isn't due
+ * yet. stops early rather than sleeping once it walked something, so
+ * the caller can publish what it has. at the end of the file it starts
+ * over until `loops` is reached, then sets `file->finished`
+ * ### return:
+ *  `int`: number of packets walked
+ *  `-1`: on error
+ */
+int replay_walk(replay_file *file, int max, int timeout_ms, replay_handler handler, u_char *user){
+    if (!file || !handler)
+        return -1;
+    int walked = 0;
+    while (walked < max && !file->finished){
+        packet_desc desc;
+        size_t next = 0;
+        int res = replay_parse(file, &desc, &next);
+        if (res < 0){
+            printf("[x] malformed replay file at offset %zu\n", file->cursor);
+            file->finished = true;
+            return -1;
+        }
+        if (res == 0){
+            file->loops_done++;
+            // a file without a single packet would loop forever
+            if (!file->sent && file->loops == 0)
+                printf("[!] no packets in the replay file, not looping\n");
+            if (!file->sent || (file->loops != 0 && file->loops_done >= file->loops)){
+                file->finished = true;
+                break;
+            }
+            // start over, the pacing starts over with it
+            file->cursor = file->start;
+            file->first_seen = false;
+            file->sent = 0;
+            continue;
+        }
+        uint64_t due = replay_due(file, desc.ts_ns);
+        if (due){
+            uint64_t now = monotonic_ns();
+            if (due > now){
+                if (walked > 0)
+                    break;
+                uint64_t wait = due - now;
+                uint64_t max_wait = (uint64_t)timeout_ms * 1000000ULL;
+                struct timespec ts;
+                ts.tv_sec = (wait < max_wait ? wait : max_wait) / 1000000000ULL;
+                ts.tv_nsec = (wait < max_wait ? wait : max_wait) % 1000000000ULL;
+                nanosleep(&ts, NULL);
+                if (wait > max_wait)
+                    break;
+            }
+        }
+        handler(user, &desc, file->map + desc.offset);
+        file->last_ts_ns = desc.ts_ns;
+        file->cursor = next;
+        file->sent++;
+        walked++;
+    }
+    return walked;
+}
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include "./capture.h"
+#include "./bpf.h"
+
+/**
+ * REFERENCES I WILL NEED :
+ * TPACKET_V3       : /usr/include/linux/if_packet.h
+ * KERNEL DOCS      : Documentation/networking/packet_mmap.rst
+ *
+ * the kernel fills whole blocks of frames in a ring that we mmap,
+ * a block is ours when TP_STATUS_USER is set and goes back to the
+ * kernel when we write TP_STATUS_KERNEL, so no per packet syscall
+ * and no per packet callback like libpcap
+ */
+
+/**
+ * INIT_TPACKET: opens an AF_PACKET socket bound to `interface_name`
+ * with a TPACKET_V3 rx ring of `block_count` blocks of `block_size` bytes
+ * mapped in our address space.
+ * `block_size` must be a multiple of the page size and of `frame_size`,
+ * a block is retired to us after `block_timeout_ms` even if not full
+ * so a slow link doesn't keep packets hostage
+ * ### return:
+ *  `tpacket_ring *`: if successful
+ *  `NULL`: on error
+ */
+tpacket_ring *INIT_TPACKET(
+    char *interface_name,
+    unsigned int block_size,
+    unsigned int block_count,
+    unsigned int frame_size,
+    unsigned int block_timeout_ms
+){
+    if (!interface_name){
+        printf("[x] no interface name was passed!\n");
+        return NULL;
+    }
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (block_size == 0 || block_size % page_size != 0){
+        printf("[x] block size %u must be a multiple of the page size %ld\n",
+            block_size, page_size);
+        return NULL;
+    }
+    if (frame_size < TPACKET_ALIGNMENT || block_size % frame_size != 0){
+        printf("[x] block size %u must be a multiple of the frame size %u\n",
+            block_size, frame_size);
+        return NULL;
+    }
+    if (block_count == 0){
+        printf("[x] block count must be >= 1\n");
+        return NULL;
+    }
+
+    signal(SIGINT, handle_sigint);
+
+    tpacket_ring *ring = calloc(1, sizeof(tpacket_ring));
+    if (!ring){
+        printf("[x] can't allocate the tpacket ring\n");
+        return NULL;
+    }
+    ring->fd = -1;
+    ring->map = MAP_FAILED;
+
+    ring->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (ring->fd < 0){
+        perror("[x] can't open the AF_PACKET socket");
+        goto fail;
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0){
+        perror("[x] can't switch the socket to TPACKET_V3");
+        goto fail;
+    }
+
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = block_size;
+    req.tp_block_nr = block_count;
+    req.tp_frame_size = frame_size;
+    req.tp_frame_nr = (block_size / frame_size) * block_count;
+    req.tp_retire_blk_tov = block_timeout_ms;
+    // ask the kernel to fill the rx hash, free flow hash for later
+    req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0){
+        perror("[x] can't set up the rx ring");
+        goto fail;
+    }
+
+    ring->block_size = block_size;
+    ring->block_count = block_count;
+    ring->frame_size = frame_size;
+    ring->map_size = (size_t)block_size * block_count;
+    ring->map = mmap(NULL, ring->map_size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_LOCKED,
+                     ring->fd, 0);
+    if (ring->map == MAP_FAILED){
+        // MAP_LOCKED can fail on a low RLIMIT_MEMLOCK , try without it
+        ring->map = mmap(NULL, ring->map_size,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED,
+                         ring->fd, 0);
+    }
+    if (ring->map == MAP_FAILED){
+        perror("[x] can't mmap the rx ring");
+        goto fail;
+    }
+
+    ring->ifindex = if_nametoindex(interface_name);
+    if (ring->ifindex == 0){
+        printf("[x] no such interface %s\n", interface_name);
+        goto fail;
+    }
+    struct sockaddr_ll ll;
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_ALL);
+    ll.sll_ifindex = ring->ifindex;
+    if (bind(ring->fd, (struct sockaddr *)&ll, sizeof(ll)) < 0){
+        perror("[x] can't bind the AF_PACKET socket");
+        goto fail;
+    }
+
+    // my trafic is my trafic your trafic is my trafic :) (same as pcap)
+    struct packet_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ring->ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0){
+        perror("[!] can't set promiscuous mode, continuing without it");
+    }
+    ring->current = 0;
+    return ring;
+
+fail:
+    FREE_TPACKET(ring);
+    return NULL;
+}
+
+/**
+ * unmap the ring and close the socket
+ */
+void FREE_TPACKET(tpacket_ring *ring){
+    if (!ring)
+        return;
+    if (ring->map != MAP_FAILED && ring->map)
+        munmap(ring->map, ring->map_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring);
+}
+
+/**
+ * get the next block the kernel handed over to us,
+ * blocks are consumed strictly in ring order , so if the current
+ * one is still owned by the kernel we poll for at most `timeout_ms`
+ * ### return:
+ *  `struct tpacket_block_desc *`: a block that holds at least one frame
+ *  `NULL`: timeout or error
+ */
+struct tpacket_block_desc *tpacket_next_block(tpacket_ring *ring, int timeout_ms){
+    if (!ring)
+        return NULL;
+    struct tpacket_block_desc *block = (struct tpacket_block_desc *)
+        (ring->map + (size_t)ring->current * ring->block_size);
+
+    if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)){
+        struct pollfd pfd;
+        pfd.fd = ring->fd;
+        pfd.events = POLLIN | POLLERR;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, timeout_ms) <= 0)
+            return NULL;
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+            return NULL;
+    }
+    ring->current = (ring->current + 1) % ring->block_count;
+    return block;
+}
+
+/**
+ * hand a block back to the kernel , the frames in it must not
+ * be touched after this
+ */
+void tpacket_release_block(struct tpacket_block_desc *block){
+    if (!block)
+        return;
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+}
+
+/**
+ * walk every frame of a block and call `handler` on it,
+ * the frame pointer points straight into the ring (no copy)
+ * ### return:
+ *  `int`: number of frames walked
+ */
+int tpacket_walk_block(struct tpacket_block_desc *block, tpacket_handler handler, u_char *user){
+    if (!block || !handler)
+        return 0;
+    uint32_t num_pkts = block->hdr.bh1.num_pkts;
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)
+        ((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+
+    for (uint32_t index = 0; index < num_pkts; index++){
+        handler(user, hdr, (const u_char *)hdr + hdr->tp_mac);
+        hdr = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+    }
+    return (int)num_pkts;
+}
+
+/**
+ * join the socket to the PACKET_FANOUT group `group_id`, the kernel then
+ * splits the traffic of the interface between every socket of the group.
+ * `mode` is one of PACKET_FANOUT_HASH, PACKET_FANOUT_CPU or
+ * PACKET_FANOUT_EBPF (our own symmetric hash program)
+ * ### return:
+ *  `0`: if successful
+ *  `-1`: on error
+ */
+int tpacket_join_fanout(tpacket_ring *ring, int group_id, int mode){
+    if (!ring)
+        return -1;
+    int fanout = (group_id & 0xFFFF) | (mode << 16);
+    // the kernel hash needs the whole datagram to keep fragments together
+    if (mode == PACKET_FANOUT_HASH)
+        fanout |= PACKET_FANOUT_FLAG_DEFRAG << 16;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0){
+        perror("[x] can't join the fanout group");
+        return -1;
+    }
+    if (mode != PACKET_FANOUT_EBPF)
+        return 0;
+    int prog_fd = bpf_load_fanout_hash();
+    if (prog_fd < 0)
+        return -1;
+    int res = setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT_DATA, &prog_fd, sizeof(prog_fd));
+    // the group keeps its own reference on the program
+    close(prog_fd);
+    if (res < 0){
+        perror("[x] can't attach the fanout program");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include "./capture.h"
+#include "./bpf.h"
+
+/**
+ * REFERENCES I WILL NEED :
+ * AF_XDP           : /usr/include/linux/if_xdp.h
+ * KERNEL DOCS      : Documentation/networking/af_xdp.rst
+ *
+ * the UMEM is an anonymous MAP_SHARED area we allocate ourselves, so
+ * once it's registered and the processes are forked the workers can read
+ * the frames the kernel wrote in there directly.
+ * we run in generic (SKB) copy mode, it works on any driver including
+ * veth, the only copy is the kernel's skb -> UMEM one.
+ *
+ * frame life cycle: fill ring (ours -> kernel) , rx ring (kernel -> ours),
+ * then the frame is ours until we put it back in the fill ring
+ */
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XSKS_MAP_ENTRIES 64
+
+static bool is_power_of_two(uint32_t value){
+    return value && !(value & (value - 1));
+}
+
+/**
+ * mmap one of the 4 rings of the socket and point our helper
+ * struct at the producer/consumer/descriptors of it
+ */
+static int map_ring(int fd, xdp_ring *ring, struct xdp_ring_offset *offset,
+                    uint32_t size, size_t desc_size, off_t pgoff){
+    ring->map_size = offset->desc + (size_t)size * desc_size;
+    ring->map = mmap(NULL, ring->map_size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE,
+                     fd, pgoff);
+    if (ring->map == MAP_FAILED){
+        ring->map = NULL;
+        perror("[x] can't mmap an xdp ring");
+        return -1;
+    }
+    ring->producer = (uint32_t *)((uint8_t *)ring->map + offset->producer);
+    ring->consumer = (uint32_t *)((uint8_t *)ring->map + offset->consumer);
+    ring->flags = (uint32_t *)((uint8_t *)ring->map + offset->flags);
+    ring->descs = (uint8_t *)ring->map + offset->desc;
+    ring->size = size;
+    ring->cached_producer = *ring->producer;
+    ring->cached_consumer = *ring->consumer;
+    return 0;
+}
+
+static void unmap_ring(xdp_ring *ring){
+    if (ring->map)
+        munmap(ring->map, ring->map_size);
+    ring->map = NULL;
+}
+
+/**
+ * INIT_XDP: opens an AF_XDP socket on `queue_id` of `interface_name`
+ * in generic/SKB mode and attaches the small redirect program.
+ * the UMEM holds `frame_count` frames of `frame_size` bytes, both must be
+ * powers of two, `ring_size` is the size of the rx ring (power of two too).
+ * every frame starts in the fill ring
+ * ### return:
+ *  `xdp_socket *`: if successful
+ *  `NULL`: on error
+ */
+xdp_socket *INIT_XDP(
+    char *interface_name,
+    uint32_t queue_id,
+    uint32_t frame_count,
+    uint32_t frame_size,
+    uint32_t ring_size
+){
+    if (!interface_name){
+        printf("[x] no interface name was passed!\n");
+        return NULL;
+    }
+    if (!is_power_of_two(frame_count) || !is_power_of_two(frame_size) || !is_power_of_two(ring_size)){
+        printf("[x] xdp frame count, frame size and ring size must be powers of two\n");
+        return NULL;
+    }
+    if (frame_size < 2048 || frame_size > 4096){
+        printf("[x] xdp frame size must be 2048 or 4096\n");
+        return NULL;
+    }
+
+    signal(SIGINT, handle_sigint);
+
+    xdp_socket *xsk = calloc(1, sizeof(xdp_socket));
+    if (!xsk){
+        printf("[x] can't allocate the xdp socket\n");
+        return NULL;
+    }
+    xsk->fd = -1;
+    xsk->map_fd = -1;
+    xsk->prog_fd = -1;
+    xsk->link_fd = -1;
+    xsk->queue_id = queue_id;
+    xsk->frame_size = frame_size;
+    xsk->frame_count = frame_count;
+
+    xsk->ifindex = if_nametoindex(interface_name);
+    if (xsk->ifindex == 0){
+        printf("[x] no such interface %s\n", interface_name);
+        goto fail;
+    }
+
+    // the UMEM, shared so the forked workers see the frames
+    xsk->umem_size = (size_t)frame_count * frame_size;
+    xsk->umem = mmap(NULL, xsk->umem_size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS,
+                     -1, 0);
+    if (xsk->umem == MAP_FAILED){
+        xsk->umem = NULL;
+        printf("[x] can't allocate the UMEM\n");
+        goto fail;
+    }
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xsk->fd < 0){
+        perror("[x] can't open the AF_XDP socket");
+        goto fail;
+    }
+
+    struct xdp_umem_reg umem_reg;
+    memset(&umem_reg, 0, sizeof(umem_reg));
+    umem_reg.addr = (uint64_t)(unsigned long)xsk->umem;
+    umem_reg.len = xsk->umem_size;
+    umem_reg.chunk_size = frame_size;
+    umem_reg.headroom = 0;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) < 0){
+        perror("[x] can't register the UMEM");
+        goto fail;
+    }
+
+    // the fill ring can hold every frame so giving frames back never blocks,
+    // the completion ring is only there because the kernel wants one
+    uint32_t fill_size = frame_count;
+    uint32_t completion_size = ring_size;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(fill_size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &completion_size, sizeof(completion_size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) < 0){
+        perror("[x] can't size the xdp rings");
+        goto fail;
+    }
+
+    struct xdp_mmap_offsets offsets;
+    socklen_t optlen = sizeof(offsets);
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &optlen) < 0){
+        perror("[x] can't get the xdp ring offsets");
+        goto fail;
+    }
+    if (map_ring(xsk->fd, &xsk->fill, &offsets.fr, fill_size, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+        map_ring(xsk->fd, &xsk->completion, &offsets.cr, completion_size, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+        map_ring(xsk->fd, &xsk->rx, &offsets.rx, ring_size, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0){
+        goto fail;
+    }
+
+    // hand every frame to the kernel
+    for (uint32_t frame = 0; frame < frame_count; frame++){
+        xdp_fill_frame(xsk, (uint64_t)frame * frame_size);
+    }
+    xdp_fill_flush(xsk);
+
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = xsk->ifindex;
+    sxdp.sxdp_queue_id = queue_id;
+    sxdp.sxdp_flags = XDP_COPY;
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0){
+        perror("[x] can't bind the AF_XDP socket");
+        goto fail;
+    }
+
+    // steer the queue to us
+    xsk->map_fd = bpf_create_xsks_map(XSKS_MAP_ENTRIES);
+    if (xsk->map_fd < 0)
+        goto fail;
+    if (bpf_update_map(xsk->map_fd, &queue_id, &xsk->fd) < 0)
+        goto fail;
+    xsk->prog_fd = bpf_load_xsk_redirect(xsk->map_fd);
+    if (xsk->prog_fd < 0)
+        goto fail;
+    xsk->link_fd = bpf_attach_xdp(xsk->prog_fd, xsk->ifindex, XDP_FLAGS_SKB_MODE);
+    if (xsk->link_fd < 0)
+        goto fail;
+    return xsk;
+
+fail:
+    FREE_XDP(xsk);
+    return NULL;
+}
+
+/**
+ * detach the program, unmap the rings and the UMEM and close everything
+ */
+void FREE_XDP(xdp_socket *xsk){
+    if (!xsk)
+        return;
+    if (xsk->link_fd >= 0)
+        close(xsk->link_fd);
+    if (xsk->prog_fd >= 0)
+        close(xsk->prog_fd);
+    if (xsk->map_fd >= 0)
+        close(xsk->map_fd);
+    unmap_ring(&xsk->rx);
+    unmap_ring(&xsk->completion);
+    unmap_ring(&xsk->fill);
+    if (xsk->fd >= 0)
+        close(xsk->fd);
+    if (xsk->umem)
+        munmap(xsk->umem, xsk->umem_size);
+    free(xsk);
+}
+
+/**
+ * queue a frame (its UMEM offset) for the kernel to fill again,
+ * nothing is visible to the kernel until xdp_fill_flush
+ */
+void xdp_fill_frame(xdp_socket *xsk, uint64_t addr){
+    xdp_ring *fill = &xsk->fill;
+    // back to the start of the chunk, the rx addr can point past it
+    addr -= addr % xsk->frame_size;
+    ((uint64_t *)fill->descs)[fill->cached_producer & (fill->size - 1)] = addr;
+    fill->cached_producer++;
+}
+
+/**
+ * publish every frame queued with xdp_fill_frame
+ */
+void xdp_fill_flush(xdp_socket *xsk){
+    __atomic_store_n(xsk->fill.producer, xsk->fill.cached_producer, __ATOMIC_RELEASE);
+}
+
+/**
+ * walk up to `max` received frames and call `handler` on each one,
+ * waits at most `timeout_ms` when nothing is there yet.
+ * the frames stay ours after this, give them back with xdp_fill_frame
+ * ### return:
+ *  `int`: number of frames walked
+ *  `-1`: on error
+ */
+int xdp_walk_rx(xdp_socket *xsk, int max, int timeout_ms, xdp_handler handler, u_char *user){
+    if (!xsk || !handler)
+        return -1;
+    xdp_ring *rx = &xsk->rx;
+    uint32_t producer = __atomic_load_n(rx->producer, __ATOMIC_ACQUIRE);
+    uint32_t available = producer - rx->cached_consumer;
+    if (available == 0){
+        struct pollfd pfd;
+        pfd.fd = xsk->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int res = poll(&pfd, 1, timeout_ms);
+        if (res < 0)
+            return -1;
+        producer = __atomic_load_n(rx->producer, __ATOMIC_ACQUIRE);
+        available = producer - rx->cached_consumer;
+        if (available == 0)
+            return 0;
+    }
+    if (available > (uint32_t)max)
+        available = (uint32_t)max;
+
+    struct xdp_desc *descs = (struct xdp_desc *)rx->descs;
+    for (uint32_t index = 0; index < available; index++){
+        struct xdp_desc *desc = &descs[(rx->cached_consumer + index) & (rx->size - 1)];
+        handler(user, desc, xsk->umem + desc->addr);
+    }
+    rx->cached_consumer += available;
+    __atomic_store_n(rx->consumer, rx->cached_consumer, __ATOMIC_RELEASE);
+    return (int)available;
+}
@@ -1,4 +1,6 @@
 #include "config.h"
+#include "../capture/protocols/protoheaders.h"
+#include "../flow/flow.h"
 
 // this file will contain getter functions , that just act
 // as an easy way to get config values, feel free to add more
@@ -103,4 +105,361 @@ double GET_MAX_THRESHOLD(cJSON *json){
     }
     double value = *max_threshold;
     return value;
-}
\ No newline at end of file
+}
+
+/**
+ * get an optional integer from the "capture" section,
+ * falls back to `default_value` when it's not configured
+ */
+static int get_capture_int(cJSON *json, char *key, int default_value, int min_value){
+    int *value = get_nested_values(json, INT, 2, "capture", key);
+    if (!value){
+        printf("[!] capture.%s is not configured in the %s, using %d\n",
+            key, CORE_CONFIG_PATH, default_value);
+        return default_value;
+    }
+    if (*value < min_value){
+        printf("[x] capture.%s must be >= %d\n", key, min_value);
+        exit(-11);
+    }
+    return *value;
+}
+
+capture_backend GET_CAPTURE_BACKEND(cJSON *json){
+    char **backend = get_nested_values(json, STRING, 2, "capture", "backend");
+    if (!backend){
+        printf("[!] capture.backend is not configured in the %s, using pcap\n", CORE_CONFIG_PATH);
+        return CAPTURE_PCAP;
+    }
+    if (strcmp(*backend, "pcap") == 0)
+        return CAPTURE_PCAP;
+    if (strcmp(*backend, "tpacket") == 0)
+        return CAPTURE_TPACKET;
+    if (strcmp(*backend, "xdp") == 0)
+        return CAPTURE_XDP;
+    if (strcmp(*backend, "replay") == 0)
+        return CAPTURE_REPLAY;
+    printf("[x] unknown capture backend <%s>, expected pcap, tpacket, xdp or replay\n", *backend);
+    exit(-11);
+}
+
+char *GET_CAPTURE_INTERFACE(cJSON *json){
+    char **interface_name = get_nested_values(json, STRING, 2, "capture", "interface");
+    if (!interface_name){
+        printf("[!] capture.interface is not configured in the %s, using wlan0\n", CORE_CONFIG_PATH);
+        return "wlan0";
+    }
+    return *interface_name;
+}
+
+/**
+ * pcap filter expression of the traffic we capture, NULL (everything)
+ * when it's not configured or empty
+ */
+char *GET_CAPTURE_FILTER(cJSON *json){
+    char **filter = get_nested_values(json, STRING, 2, "capture", "filter");
+    if (!filter || (*filter)[0] == '\0')
+        return NULL;
+    return *filter;
+}
+
+int GET_CAPTURE_SNAPLEN(cJSON *json){
+    return get_capture_int(json, "snaplen", 65535, 64);
+}
+
+int GET_CAPTURE_BLOCK_SIZE(cJSON *json){
+    return get_capture_int(json, "block_size", 1 << 20, 4096);
+}
+
+int GET_CAPTURE_BLOCK_COUNT(cJSON *json){
+    return get_capture_int(json, "block_count", 64, 1);
+}
+
+int GET_CAPTURE_FRAME_SIZE(cJSON *json){
+    return get_capture_int(json, "frame_size", 2048, 64);
+}
+
+int GET_CAPTURE_BLOCK_TIMEOUT(cJSON *json){
+    return get_capture_int(json, "block_timeout_ms", 100, 1);
+}
+
+int GET_CAPTURE_XDP_QUEUE(cJSON *json){
+    return get_capture_int(json, "xdp_queue", 0, 0);
+}
+
+int GET_CAPTURE_XDP_FRAME_COUNT(cJSON *json){
+    return get_capture_int(json, "xdp_frame_count", 16384, 64);
+}
+
+int GET_CAPTURE_XDP_RING_SIZE(cJSON *json){
+    return get_capture_int(json, "xdp_ring_size", 4096, 64);
+}
+
+bool GET_CAPTURE_ZERO_COPY(cJSON *json){
+    int *zero_copy = get_nested_values(json, BOOLEAN, 2, "capture", "zero_copy");
+    if (!zero_copy)
+        return false;
+    if (*zero_copy && GET_CAPTURE_BACKEND(json) != CAPTURE_TPACKET){
+        printf("[x] capture.zero_copy needs the tpacket backend (xdp is always zero copy)\n");
+        exit(-11);
+    }
+    return *zero_copy;
+}
+
+/**
+ * ask pcap for nanosecond timestamps, the other backends always have them
+ */
+bool GET_CAPTURE_NANO_TIMESTAMPS(cJSON *json){
+    int *nano = get_nested_values(json, BOOLEAN, 2, "capture", "nano_timestamps");
+    return nano ? *nano : false;
+}
+
+int GET_BATCH_RING_DEPTH(cJSON *json){
+    int *depth = get_nested_values(json, INT, 1, "batch_ring_depth");
+    if (!depth){
+        printf("[!] batch_ring_depth is not configured in the %s, using 4\n", CORE_CONFIG_PATH);
+        return 4;
+    }
+    // it sizes the queues of the workers too, spsc rings are powers of two
+    if (*depth < 2 || (*depth & (*depth - 1))){
+        printf("[x] batch ring depth must be a power of two >= 2\n");
+        exit(-11);
+    }
+    return *depth;
+}
+
+/**
+ * how many capture sockets join the fanout group, 1 (no fanout)
+ * when capture.fanout is not configured
+ */
+int GET_CAPTURE_FANOUT_SOCKETS(cJSON *json){
+    int *sockets = get_nested_values(json, INT, 3, "capture", "fanout", "sockets");
+    if (!sockets)
+        return 1;
+    if (*sockets < 1){
+        printf("[x] capture.fanout.sockets must be >= 1\n");
+        exit(-11);
+    }
+    return *sockets;
+}
+
+int GET_CAPTURE_FANOUT_MODE(cJSON *json){
+    char **mode = get_nested_values(json, STRING, 3, "capture", "fanout", "mode");
+    if (!mode){
+        printf("[!] capture.fanout.mode is not configured in the %s, using hash\n", CORE_CONFIG_PATH);
+        return PACKET_FANOUT_HASH;
+    }
+    if (strcmp(*mode, "hash") == 0)
+        return PACKET_FANOUT_HASH;
+    if (strcmp(*mode, "cpu") == 0)
+        return PACKET_FANOUT_CPU;
+    if (strcmp(*mode, "ebpf") == 0)
+        return PACKET_FANOUT_EBPF;
+    printf("[x] unknown fanout mode <%s>, expected hash, cpu or ebpf\n", *mode);
+    exit(-11);
+}
+
+int GET_CAPTURE_FANOUT_GROUP(cJSON *json){
+    int *group = get_nested_values(json, INT, 3, "capture", "fanout", "group_id");
+    if (!group){
+        // unique enough per instance
+        return getpid() & 0xFFFF;
+    }
+    if (*group < 0 || *group > 0xFFFF){
+        printf("[x] capture.fanout.group_id must be in [0, 65535]\n");
+        exit(-11);
+    }
+    return *group;
+}
+
+bool GET_CAPTURE_FANOUT_PIN(cJSON *json){
+    int *pin = get_nested_values(json, BOOLEAN, 3, "capture", "fanout", "pin");
+    if (!pin)
+        return true;
+    return *pin;
+}
+
+/**
+ * the .pcap/.pcapng file the replay backend plays
+ */
+char *GET_CAPTURE_REPLAY_FILE(cJSON *json){
+    char **file = get_nested_values(json, STRING, 3, "capture", "replay", "file");
+    if (!file){
+        printf("[x] capture.replay.file is required by the replay backend\n");
+        exit(-11);
+    }
+    return *file;
+}
+
+replay_pacing GET_CAPTURE_REPLAY_PACING(cJSON *json){
+    char **pacing = get_nested_values(json, STRING, 3, "capture", "replay", "pacing");
+    if (!pacing){
+        printf("[!] capture.replay.pacing is not configured in the %s, using fast\n", CORE_CONFIG_PATH);
+        return REPLAY_FAST;
+    }
+    if (strcmp(*pacing, "fast") == 0)
+        return REPLAY_FAST;
+    if (strcmp(*pacing, "original") == 0)
+        return REPLAY_ORIGINAL;
+    if (strcmp(*pacing, "pps") == 0)
+        return REPLAY_PPS;
+    printf("[x] unknown replay pacing <%s>, expected fast, original or pps\n", *pacing);
+    exit(-11);
+}
+
+int GET_CAPTURE_REPLAY_PPS(cJSON *json){
+    int *pps = get_nested_values(json, INT, 3, "capture", "replay", "pps");
+    if (!pps)
+        return 100000;
+    if (*pps < 1){
+        printf("[x] capture.replay.pps must be >= 1\n");
+        exit(-11);
+    }
+    return *pps;
+}
+
+/**
+ * how many times the file is played, 0 is forever
+ */
+int GET_CAPTURE_REPLAY_LOOPS(cJSON *json){
+    int *loops = get_nested_values(json, INT, 3, "capture", "replay", "loops");
+    if (!loops)
+        return 1;
+    if (*loops < 0){
+        printf("[x] capture.replay.loops must be >= 0\n");
+        exit(-11);
+    }
+    return *loops;
+}
+
+/**
+ * should the workers print every decoded packet in their log,
+ * off by default, it costs more than decoding
+ */
+bool GET_DECODER_TEXT_OUTPUT(cJSON *json){
+    int *text_output = get_nested_values(json, BOOLEAN, 2, "decoder", "text_output");
+    if (!text_output)
+        return false;
+    return *text_output;
+}
+
+/**
+ * how many tunnels (gre, vxlan, geneve, ip in ip, mpls) the decoder
+ * goes through to reach the inner packet, 0 leaves them opaque
+ */
+int GET_DECODER_MAX_TUNNEL_DEPTH(cJSON *json){
+    int *depth = get_nested_values(json, INT, 2, "decoder", "max_tunnel_depth");
+    if (!depth)
+        return 2;
+    if (*depth < 0 || *depth > META_MAX_TUNNELS){
+        printf("[x] decoder.max_tunnel_depth must be in [0, %d]\n", META_MAX_TUNNELS);
+        exit(-11);
+    }
+    return *depth;
+}
+
+/**
+ * get an optional integer from a top level `section`,
+ * falls back to `default_value` when it's not configured
+ */
+static int get_section_int(cJSON *json, char *section, char *key, int default_value, int min_value){
+    int *value = get_nested_values(json, INT, 2, section, key);
+    if (!value)
+        return default_value;
+    if (*value < min_value){
+        printf("[x] %s.%s must be >= %d\n", section, key, min_value);
+        exit(-11);
+    }
+    return *value;
+}
+
+/**
+ * fragment reassembly settings of every worker, on by default:
+ * 1024 datagrams in flight, 4 MB of fragments, 30s, first copy wins
+ */
+void GET_DEFRAG_CONFIG(cJSON *json, defrag_config *config){
+    int *enabled = get_nested_values(json, BOOLEAN, 2, "defrag", "enabled");
+    config->enabled = enabled ? *enabled : true;
+    config->max_datagrams = get_section_int(json, "defrag", "max_datagrams", 1024, 1);
+    config->memory_kb = get_section_int(json, "defrag", "memory_kb", 4096, 2 * DEFRAG_CHUNK_SIZE / 1024);
+    config->timeout_ms = get_section_int(json, "defrag", "timeout_ms", 30000, 1);
+    config->policy = DEFRAG_FIRST;
+    char **overlap = get_nested_values(json, STRING, 2, "defrag", "overlap");
+    if (!overlap || strcmp(*overlap, "first") == 0)
+        return;
+    if (strcmp(*overlap, "last") == 0){
+        config->policy = DEFRAG_LAST;
+        return;
+    }
+    printf("[x] unknown defrag.overlap <%s>, expected first or last\n", *overlap);
+    exit(-11);
+}
+
+/**
+ * flow table of every worker, on by default: 65536 flows,
+ * 30s for handshakes, 5 min once established, 10s after FIN/RST
+ */
+void GET_FLOW_CONFIG(cJSON *json, flow_config *config){
+    int *enabled = get_nested_values(json, BOOLEAN, 2, "flows", "enabled");
+    config->enabled = enabled ? *enabled : true;
+    config->max_flows = get_section_int(json, "flows", "max_flows", 65536, 1);
+    config->timeout_new_ms = get_section_int(json, "flows", "timeout_new_ms", 30000, 1);
+    config->timeout_established_ms = get_section_int(json, "flows", "timeout_established_ms", 300000, 1);
+    config->timeout_closed_ms = get_section_int(json, "flows", "timeout_closed_ms", 10000, 1);
+}
+
+/**
+ * tcp stream reassembly of every worker, on by default (and only with
+ * flows): 1 MB of each direction, 256 KB of out of order data per
+ * direction, 16 MB of copies per worker
+ */
+void GET_STREAM_CONFIG(cJSON *json, stream_config *config){
+    int *enabled = get_nested_values(json, BOOLEAN, 2, "streams", "enabled");
+    config->enabled = enabled ? *enabled : true;
+    config->depth_kb = get_section_int(json, "streams", "depth_kb", 1024, 0);
+    config->flow_buffer_kb = get_section_int(json, "streams", "flow_buffer_kb", 256, 1);
+    config->memory_kb = get_section_int(json, "streams", "memory_kb", 16384, STREAM_CHUNK_SIZE / 1024);
+}
+
+/**
+ * rule file compiled at startup, NULL when it's not configured or empty
+ */
+char *GET_DETECT_RULES(cJSON *json){
+    char **rules = get_nested_values(json, STRING, 2, "detect", "rules");
+    if (!rules || (*rules)[0] == '\0')
+        return NULL;
+    return *rules;
+}
+
+/**
+ * compiled rule db, written there from detect.rules or mapped as is when
+ * there's no rule file. NULL (no payload inspection) when it's empty
+ */
+char *GET_DETECT_RULE_DB(cJSON *json){
+    char **db = get_nested_values(json, STRING, 2, "detect", "rule_db");
+    if (!db || (*db)[0] == '\0')
+        return NULL;
+    return *db;
+}
+
+/**
+ * prefix list (ip reputation, blocklist) compiled at startup, NULL when
+ * it's not configured or empty
+ */
+char *GET_REPUTATION_LIST(cJSON *json){
+    char **list = get_nested_values(json, STRING, 2, "reputation", "list");
+    if (!list || (*list)[0] == '\0')
+        return NULL;
+    return *list;
+}
+
+/**
+ * compiled prefix list, written there from reputation.list or mapped as
+ * is when there's no list. NULL (no lookups) when it's empty
+ */
+char *GET_REPUTATION_DB(cJSON *json){
+    char **db = get_nested_values(json, STRING, 2, "reputation", "db");
+    if (!db || (*db)[0] == '\0')
+        return NULL;
+    return *db;
+}
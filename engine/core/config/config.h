@@ -3,6 +3,7 @@
 
 #include <cjson/cJSON.h>
 #include "../../helpers/helpers.h"
+#include "../flow/flow.h"
 
 cJSON *INIT_CORE_CONFIG();
 int GET_CORE_COUNT(cJSON *json);
@@ -11,6 +12,37 @@ double GET_MAX_THRESHOLD(cJSON *json);
 double GET_MIN_THRESHOLD(cJSON *json);
 double GET_THRESHOLD(cJSON *json);
 int GET_SHARED_MEMORY_UNITES(cJSON *json);
+capture_backend GET_CAPTURE_BACKEND(cJSON *json);
+char *GET_CAPTURE_INTERFACE(cJSON *json);
+char *GET_CAPTURE_FILTER(cJSON *json);
+int GET_CAPTURE_SNAPLEN(cJSON *json);
+int GET_CAPTURE_BLOCK_SIZE(cJSON *json);
+int GET_CAPTURE_BLOCK_COUNT(cJSON *json);
+int GET_CAPTURE_FRAME_SIZE(cJSON *json);
+int GET_CAPTURE_BLOCK_TIMEOUT(cJSON *json);
+int GET_CAPTURE_XDP_QUEUE(cJSON *json);
+int GET_CAPTURE_XDP_FRAME_COUNT(cJSON *json);
+int GET_CAPTURE_XDP_RING_SIZE(cJSON *json);
+bool GET_CAPTURE_ZERO_COPY(cJSON *json);
+bool GET_CAPTURE_NANO_TIMESTAMPS(cJSON *json);
+int GET_BATCH_RING_DEPTH(cJSON *json);
+int GET_CAPTURE_FANOUT_SOCKETS(cJSON *json);
+int GET_CAPTURE_FANOUT_MODE(cJSON *json);
+int GET_CAPTURE_FANOUT_GROUP(cJSON *json);
+bool GET_CAPTURE_FANOUT_PIN(cJSON *json);
+char *GET_CAPTURE_REPLAY_FILE(cJSON *json);
+replay_pacing GET_CAPTURE_REPLAY_PACING(cJSON *json);
+int GET_CAPTURE_REPLAY_PPS(cJSON *json);
+int GET_CAPTURE_REPLAY_LOOPS(cJSON *json);
+bool GET_DECODER_TEXT_OUTPUT(cJSON *json);
+int GET_DECODER_MAX_TUNNEL_DEPTH(cJSON *json);
+void GET_DEFRAG_CONFIG(cJSON *json, defrag_config *config);
+void GET_FLOW_CONFIG(cJSON *json, flow_config *config);
+void GET_STREAM_CONFIG(cJSON *json, stream_config *config);
+char *GET_DETECT_RULES(cJSON *json);
+char *GET_DETECT_RULE_DB(cJSON *json);
+char *GET_REPUTATION_LIST(cJSON *json);
+char *GET_REPUTATION_DB(cJSON *json);
 
 
 
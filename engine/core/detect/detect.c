@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>          // inet_ntop()
+#include "./detect.h"
+
+/**
+ * payload inspection of a worker: a packet only ever looks at the rules
+ * of its group (protocol and destination port, one table lookup). the
+ * payloads of a batch are gathered and scanned for the fast patterns of
+ * their group at the end of it, one call per group, a match there names
+ * the one rule worth matching in full. tcp payload of tracked flows comes
+ * from the stream reassembly instead (when it's on) so a pattern cut
+ * across two segments is still found, the dfa state of each direction is
+ * kept between its chunks. the rules of the group without content don't
+ * go through the prefilter, every packet is matched against them. a pcre
+ * only ever runs on a rule the prefilter named, on the lazy dfa of the
+ * worker
+ */
+
+static void alert(detector *detector, const rule *rule, const rule_packet *packet){
+    char src[INET6_ADDRSTRLEN] = "?", dst[INET6_ADDRSTRLEN] = "?";
+    int family = packet->version == 6 ? AF_INET6 : AF_INET;
+    inet_ntop(family, packet->src, src, sizeof(src));
+    inet_ntop(family, packet->dst, dst, sizeof(dst));
+    // [addr]:port so the port can't be mistaken for a piece of an ipv6
+    const char *format = packet->version == 6 ? "[ALERT] [%u:%u] %s [%s][%s]:%u -> [%s]:%u"
+        : "[ALERT] [%u:%u] %s [%s]%s:%u -> %s:%u";
+    printf(format, rule->sid, rule->rev, rule_msg(detector->rules, rule), protocol_name(packet->proto),
+        src, packet->src_port, dst, packet->dst_port);
+    // where the last pcre of the rule matched, in the payload (a stream
+    // chunk: negative in the tail of the previous one)
+    if (detector->regex && detector->regex->matched)
+        printf(" (pcre %lld-%lld)", (long long)detector->regex->match.start - packet->start,
+            (long long)detector->regex->match.end - packet->start);
+    printf("\n");
+    detector->stats.alerts++;
+}
+
+/** a rule the prefilter named, once per input however many times it matched */
+static void evaluate(detector *detector, uint32_t index, const rule_packet *packet, uint32_t stamp){
+    if (detector->seen[index] == stamp)
+        return;
+    detector->seen[index] = stamp;
+    detector->stats.evaluated++;
+    const rule *rule = &rule_db_rules(detector->rules)[index];
+    if (rule_match(detector->rules, rule, packet, detector->regex))
+        alert(detector, rule, packet);
+}
+
+/** the first of `count` new stamps, the rules are all unseen again when it wraps */
+static uint32_t take_stamps(detector *detector, uint32_t count){
+    if (detector->stamp > UINT32_MAX - count){
+        memset(detector->seen, 0, sizeof(uint32_t) * detector->rules->rule_count);
+        detector->stamp = 0;
+    }
+    uint32_t first = detector->stamp + 1;
+    detector->stamp += count;
+    return first;
+}
+
+static void count_hits(detector *detector, uint32_t found){
+    uint32_t kept = found < DETECT_MAX_HITS ? found : DETECT_MAX_HITS;
+    detector->stats.hits += found;
+    detector->stats.dropped_hits += found - kept;
+}
+
+static int compare_order(const void *a, const void *b){
+    uint32_t left = *(const uint32_t *)a, right = *(const uint32_t *)b;
+    return (left > right) - (left < right);
+}
+
+/**
+ * what the rules of a stream need of the previous chunk: a content chain
+ * that ends in this chunk can start that far before it. the longest
+ * content (the fast patterns among them) and the windows of the relative
+ * ones after it, at most DETECT_STREAM_TAIL
+ */
+static uint32_t stream_tail_size(const rule_db *rules){
+    const rule_check *checks = (const rule_check *)((const u_char *)rules + rules->checks_offset);
+    uint32_t size = 0;
+    for (uint32_t r = 0; r < rules->rule_count; r++){
+        const rule *rule = &rule_db_rules(rules)[r];
+        uint64_t span = 0;
+        for (int i = 0; i < rule->check_count; i++){
+            const rule_check *check = &checks[rule->first_check + i];
+            if (check->type != CHECK_CONTENT || check->flags & CHECK_NEGATED)
+                continue;
+            if (!(check->flags & CHECK_RELATIVE))
+                span = check->len;
+            else if (check->depth)
+                span += check->depth;
+            else
+                span += (uint64_t)(check->offset > 0 ? check->offset : 0) + check->len;
+            if (span > size)
+                size = span < DETECT_STREAM_TAIL ? (uint32_t)span : DETECT_STREAM_TAIL;
+        }
+    }
+    return size;
+}
+
+/** the tail of a direction followed by the chunk, NULL when it can't grow */
+static const u_char *join_tail(detector *detector, const u_char *tail, uint32_t tail_len, const stream_chunk *chunk){
+    uint32_t len = tail_len + chunk->len;
+    if (len > detector->joined_size){
+        u_char *grown = realloc(detector->joined, len);
+        if (!grown)
+            return NULL;
+        detector->joined = grown;
+        detector->joined_size = len;
+    }
+    memcpy(detector->joined, tail, tail_len);
+    memcpy(detector->joined + tail_len, chunk->data, chunk->len);
+    return detector->joined;
+}
+
+/** the last tail_size bytes of the direction, the chunk after the tail */
+static void keep_tail(detector *detector, u_char *tail, uint16_t *tail_len, const stream_chunk *chunk){
+    uint32_t size = detector->tail_size;
+    if (chunk->len >= size){
+        memcpy(tail, chunk->data + chunk->len - size, size);
+        *tail_len = (uint16_t)size;
+        return;
+    }
+    uint32_t kept = *tail_len + chunk->len > size ? size - chunk->len : *tail_len;
+    memmove(tail, tail + *tail_len - kept, kept);
+    memcpy(tail + kept, chunk->data, chunk->len);
+    *tail_len = (uint16_t)(kept + chunk->len);
+}
+
+/**
+ * stream callback, one chunk of one direction. the fast patterns carry
+ * their dfa state over from the previous chunk, the rules they name are
+ * matched on its tail and the chunk together so their contents can be
+ * cut across the two as well
+ */
+static void detect_stream(void *ctx, const flow_entry *flow, int direction, const stream_chunk *chunk){
+    detector *detector = ctx;
+    size_t index = (size_t)flow_index(detector->flows, flow) * 2 + direction;
+    uint32_t *state = &detector->stream_states[index];
+    u_char *tail = detector->stream_tails + index * detector->tail_size;
+    uint16_t *tail_len = &detector->stream_tail_lens[index];
+    // nothing carries over a hole, or to the next flow of the entry
+    if (chunk->flags & (STREAM_GAP | STREAM_END)){
+        *state = 0;
+        *tail_len = 0;
+    }
+    if (!chunk->len)
+        return;
+    // the endpoints of the chunk are in the flow key, the lower one first.
+    // a direction keeps its group, the dfa state stays the one of its matcher
+    const flow_key *key = &flow->key;
+    bool from_lo = (direction == FLOW_TO_SERVER) == flow->client_is_lo;
+    const rule_group *group = rule_db_group(detector->rules,
+        rule_group_index(detector->rules, key->proto, from_lo ? key->port_hi : key->port_lo));
+    const matcher *patterns = rule_group_matcher(detector->rules, group);
+    if (!patterns)
+        return;
+    detector->stats.chunks++;
+    detector->stats.bytes += chunk->len;
+    uint32_t found = matcher_scan(patterns, chunk->data, chunk->len, state,
+        detector->hits, DETECT_MAX_HITS, 0);
+    const u_char *data = found ? join_tail(detector, tail, *tail_len, chunk) : NULL;
+    if (found && !data){
+        // no room to join them, the chunk alone still gets its rules
+        data = chunk->data;
+        *tail_len = 0;
+    }
+    if (found){
+        count_hits(detector, found);
+        rule_packet packet = {
+            .data = data,
+            .len = *tail_len + chunk->len,
+            .start = *tail_len,
+            .version = key->version,
+            .proto = key->proto,
+            .flow_state = flow->state,
+            .direction = (uint8_t)direction,
+            .src = from_lo ? key->addr_lo : key->addr_hi,
+            .dst = from_lo ? key->addr_hi : key->addr_lo,
+            .src_port = from_lo ? key->port_lo : key->port_hi,
+            .dst_port = from_lo ? key->port_hi : key->port_lo
+        };
+        uint32_t stamp = take_stamps(detector, 1);
+        for (uint32_t i = 0; i < found && i < DETECT_MAX_HITS; i++)
+            evaluate(detector, detector->hits[i].id, &packet, stamp);
+    }
+    keep_tail(detector, tail, tail_len, chunk);
+}
+
+/**
+ * INIT_DETECTOR: scratch and stats of a worker, with `streams` (can be
+ * NULL) it gets the tcp payload from them
+ * ### return:
+ *  `detector *`: if successful
+ *  `NULL`: on error
+ */
+detector *INIT_DETECTOR(const rule_db *rules, stream_table *streams){
+    detector *built = calloc(1, sizeof(detector));
+    if (!built)
+        return NULL;
+    built->rules = rules;
+    built->seen = calloc(rules->rule_count, sizeof(uint32_t));
+    if (rules->regex_count)
+        built->regex = INIT_REGEX_SCRATCH(rules->regex_count);
+    if (!built->seen || (rules->regex_count && !built->regex)){
+        FREE_DETECTOR(built);
+        return NULL;
+    }
+    if (streams && rules->pattern_count){
+        built->flows = streams->flows;
+        size_t directions = ((size_t)streams->flows->config.max_flows + 1) * 2;
+        built->tail_size = stream_tail_size(rules);
+        built->stream_states = calloc(directions, sizeof(uint32_t));
+        built->stream_tails = malloc(directions * built->tail_size);
+        built->stream_tail_lens = calloc(directions, sizeof(uint16_t));
+        if (!built->stream_states || !built->stream_tails || !built->stream_tail_lens
+            || register_stream_callback(detect_stream, built) < 0){
+            FREE_DETECTOR(built);
+            return NULL;
+        }
+    }
+    printf("[@] detect: %u rules in %u port groups, %u fast patterns, %u pcres\n",
+        rules->rule_count, rules->group_count, rules->pattern_count, rules->regex_count);
+    return built;
+}
+
+void FREE_DETECTOR(detector *detector){
+    if (!detector)
+        return;
+    free(detector->stream_states);
+    free(detector->stream_tails);
+    free(detector->stream_tail_lens);
+    free(detector->joined);
+    FREE_REGEX_SCRATCH(detector->regex);
+    free(detector->seen);
+    free(detector);
+}
+
+/**
+ * detect_batch_end: scan what the batch gathered, before the frames go
+ */
+void detect_batch_end(detector *detector){
+    uint32_t count = detector->input_count;
+    if (!count)
+        return;
+    uint32_t stamp = take_stamps(detector, count);
+    detector->input_count = 0;
+    // the inputs of a group side by side, most batches only have a few
+    qsort(detector->order, count, sizeof(uint32_t), compare_order);
+    for (uint32_t i = 0; i < count; i++)
+        detector->sorted[i] = detector->inputs[detector->order[i] & 0xffff];
+    for (uint32_t first = 0, end; first < count; first = end){
+        uint32_t group = detector->order[first] >> 16;
+        end = first + 1;
+        while (end < count && detector->order[end] >> 16 == group)
+            end++;
+        const matcher *patterns = rule_group_matcher(detector->rules, rule_db_group(detector->rules, (uint16_t)group));
+        uint32_t found = matcher_scan_batch(patterns, &detector->sorted[first], end - first,
+            detector->hits, DETECT_MAX_HITS);
+        if (!found)
+            continue;
+        count_hits(detector, found);
+        for (uint32_t i = 0; i < found && i < DETECT_MAX_HITS; i++){
+            uint32_t input = detector->order[first + detector->hits[i].input] & 0xffff;
+            evaluate(detector, detector->hits[i].id, &detector->packets[input], stamp + input);
+        }
+    }
+}
+
+/**
+ * detect_packet: match a decoded packet against the rules without
+ * content now, and queue its payload for the prefilter at the end of the
+ * batch unless `scan_payload` is off (the tcp payload that went to the
+ * streams). a `transient` frame (reassembled datagram) is scanned now
+ */
+void detect_packet(detector *detector, const packet_meta *meta, const u_char *frame,
+    const flow_entry *flow, int direction, bool scan_payload, bool transient){
+    rule_packet packet = {
+        .data = frame + meta->payload_offset,
+        .len = meta->payload_len,
+        .version = meta->ip_version,
+        .proto = meta->ip_proto,
+        .flow_state = flow ? flow->state : 0,
+        .direction = (uint8_t)direction,
+        .src = meta->src_addr,
+        .dst = meta->dst_addr,
+        .src_port = meta->src_port,
+        .dst_port = meta->dst_port
+    };
+    uint16_t index = rule_group_index(detector->rules, meta->ip_proto, meta->dst_port);
+    const rule_group *group = rule_db_group(detector->rules, index);
+    const uint32_t *always = (const uint32_t *)((const u_char *)detector->rules + group->always_offset);
+    for (uint32_t i = 0; i < group->always_count; i++){
+        const rule *rule = &rule_db_rules(detector->rules)[always[i]];
+        detector->stats.evaluated++;
+        if (rule_match(detector->rules, rule, &packet, detector->regex))
+            alert(detector, rule, &packet);
+    }
+    if (!scan_payload || !meta->payload_len || !group->matcher_offset)
+        return;
+    if (detector->input_count == DETECT_BATCH)
+        detect_batch_end(detector);
+    detector->order[detector->input_count] = (uint32_t)index << 16 | detector->input_count;
+    detector->packets[detector->input_count] = packet;
+    detector->inputs[detector->input_count++] = (matcher_input){packet.data, packet.len, NULL};
+    detector->stats.packets++;
+    detector->stats.bytes += meta->payload_len;
+    if (transient)
+        detect_batch_end(detector);
+}
@@ -0,0 +1,399 @@
+#ifndef DETECT_HEADERS
+#define DETECT_HEADERS
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "../capture/protocols/protoheaders.h"
+#include "../flow/flow.h"
+
+/**
+ * payload inspection. what's compiled (the rules and their patterns) is built once by
+ * the main process before the fork and only ever read after it, so every
+ * worker reads the same pages. what's per worker (scratch, stream states,
+ * stats) is created by the worker like its flow table
+ */
+
+/** multi pattern matcher */
+
+#define MATCHER_MAX_PATTERN 1024        // bytes of one pattern
+// matcher_pattern.flags
+#define MATCHER_NOCASE 0x01
+
+typedef struct {
+    const u_char *bytes;
+    uint32_t len;
+    uint32_t id;                // what a match reports
+    uint8_t flags;              // MATCHER_*
+} matcher_pattern;
+
+/** a pattern as the compiled matcher keeps it */
+typedef struct {
+    uint32_t id;
+    uint32_t offset;            // of its bytes, from the start of the matcher
+    uint32_t len;
+    uint32_t flags;
+} matcher_entry;
+
+/** how the scan skips ahead while nothing is partially matched */
+typedef enum {
+    PREFILTER_NONE = 81,        // too many bytes start a pattern to bother
+    PREFILTER_BYTE = 82,        // one byte starts them all, memchr
+    PREFILTER_SET = 83          // nibble tables, avx2/sse4.2 when the cpu has them
+} matcher_prefilter;
+
+/**
+ * aho-corasick dfa over byte classes (the bytes no pattern uses share
+ * one), states numbered breadth first so the hot ones sit together,
+ * 16 bit transitions when there are few enough states. the top bit of a
+ * transition says the state it leads to has matches.
+ * one block with offsets instead of pointers, it can be written to a
+ * file and mapped back as is
+ */
+typedef struct {
+    uint32_t size;              // of the whole block, header included
+    uint32_t pattern_count;
+    uint32_t state_count;
+    uint16_t class_count;
+    uint8_t wide;               // 32 bit transitions
+    uint8_t folded;             // built on lower case, at least one pattern is nocase
+    uint32_t next_offset;       // transitions, state_count * class_count
+    uint32_t out_offset;        // where the matches of each state start, state_count + 1
+    uint32_t outputs_offset;    // indexes of matcher_entry
+    uint32_t entries_offset;
+    uint32_t prefilter;         // matcher_prefilter
+    uint32_t first_count;       // bytes that leave the root
+    uint8_t first_byte;         // PREFILTER_BYTE
+    uint8_t classes[256];
+    uint8_t first[256];         // bytes that leave the root
+    uint8_t lo_nibbles[16];     // PREFILTER_SET, a byte may start a pattern when
+    uint8_t hi_nibbles[16];     // lo_nibbles[b & 15] & hi_nibbles[b >> 4]
+} matcher;
+
+/** something to scan, a packet payload or a chunk of a stream */
+typedef struct {
+    const u_char *data;
+    uint32_t len;
+    uint32_t *state;            // carried from the previous chunk of a stream (starts at 0), NULL for a packet
+} matcher_input;
+
+typedef struct {
+    uint32_t id;                // of the pattern
+    uint32_t input;             // index of the input in the batch
+    uint32_t end;               // offset right after the match, a match started in an earlier chunk ends before its length
+} matcher_hit;
+
+int matcher_parse_content(const char **text, u_char *out, uint32_t size);
+matcher *INIT_MATCHER(const matcher_pattern *patterns, uint32_t count);
+void FREE_MATCHER(matcher *matcher);
+uint32_t matcher_scan(const matcher *matcher, const u_char *data, uint32_t len, uint32_t *state,
+    matcher_hit *hits, uint32_t max_hits, uint32_t input);
+uint32_t matcher_scan_batch(const matcher *matcher, const matcher_input *inputs, uint32_t count,
+    matcher_hit *hits, uint32_t max_hits);
+const char *matcher_prefilter_name(const matcher *matcher);
+
+/** regex, only ever run on a payload the literal prefilter already named */
+
+#define REGEX_MAX_NODES 4096            // of the nfa, counted repetitions are unrolled
+#define REGEX_MAX_REPEAT 1000           // {n,m}
+#define REGEX_CACHE_KB 64               // lazy dfa of one regex in one worker
+#define REGEX_NONE 0xffff
+// regex.flags
+#define REGEX_NOCASE    0x01            // i
+#define REGEX_DOTALL    0x02            // s, . takes \n too
+#define REGEX_MULTILINE 0x04            // m, ^ and $ at line starts and ends too
+
+typedef enum {
+    REGEX_SET = 101,                    // one byte of a set
+    REGEX_SPLIT = 102,                  // both ways, no byte
+    REGEX_MATCH = 103,
+    REGEX_MATCH_EOL = 104               // a match only at the end of the payload ($)
+} regex_node_type;
+
+typedef struct {
+    uint8_t type;                       // regex_node_type
+    uint8_t pad;
+    uint16_t set;                       // REGEX_SET, index of its 256 bit set
+    uint16_t out;
+    uint16_t out2;                      // REGEX_SPLIT
+} regex_node;
+
+/**
+ * thompson nfa of a regex: no backtracking ever, a search is one pass
+ * over the payload whatever the regex is. one position independent block
+ * like the matcher, it goes in the rule db as is. the bytes no set tells
+ * apart share a class, the lazy dfa of a worker has one transition per
+ * state and class
+ */
+typedef struct {
+    uint32_t size;                      // of the whole block
+    uint16_t node_count;
+    uint16_t set_count;
+    uint16_t start;                     // the alternatives that can start anywhere, REGEX_NONE if they all have ^
+    uint16_t start_anchored;            // the ones that start with ^, REGEX_NONE when there's none
+    uint16_t class_count;
+    uint8_t flags;                      // REGEX_*
+    uint8_t pad;
+    uint32_t nodes_offset;
+    uint32_t sets_offset;               // 32 bytes each
+    uint8_t classes[256];
+} regex;
+
+/** [start, end) of the leftmost longest match, from the start of the payload */
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} regex_match;
+
+/**
+ * lazy dfa of one regex in one worker: a state is a set of nfa states,
+ * made the first time a transition leads to it. past REGEX_CACHE_KB the
+ * search goes on on the nfa and the cache starts over on the next one
+ */
+typedef struct {
+    uint32_t class_count;
+    uint32_t state_count;
+    uint32_t max_states;
+    uint32_t set_used;                  // of `sets`
+    uint32_t set_size;
+    uint16_t *next;                     // state_count * class_count, REGEX_NONE until it's needed
+    uint8_t *flags;
+    uint32_t *set_offset;               // nfa states of each dfa state, in `sets`
+    uint16_t *set_len;
+    uint16_t *sets;
+    uint32_t *slots;                    // hash of the sets, state + 1
+    uint32_t slot_mask;
+    bool full;
+} regex_dfa;
+
+typedef struct {
+    uint64_t searches;
+    uint64_t dfa_states;                // made
+    uint64_t flushes;                   // caches started over once full
+    uint64_t nfa_searches;              // finished on the nfa
+} regex_stats;
+
+/** what a worker needs to run the regexes of a rule db */
+typedef struct {
+    regex_dfa *dfas;                    // one per regex, allocated on first use
+    uint32_t count;
+    uint16_t *current;                  // nfa state sets while stepping
+    uint16_t *following;
+    uint32_t *current_starts;           // where the thread in each nfa state started, for the offsets
+    uint32_t *following_starts;
+    uint16_t *stack;
+    uint32_t *marks;
+    uint32_t mark;
+    uint32_t match_start;               // of the first thread to reach a match in the last step
+    uint32_t eol_start;                 // same for $
+    bool matched;                       // the last rule matched had a regex
+    regex_match match;                  // where its last regex matched
+    regex_stats stats;
+} regex_scratch;
+
+regex *INIT_REGEX(const char *pattern, uint32_t len, uint8_t flags);
+void FREE_REGEX(regex *regex);
+regex_scratch *INIT_REGEX_SCRATCH(uint32_t count);
+void FREE_REGEX_SCRATCH(regex_scratch *scratch);
+bool regex_search(regex_scratch *scratch, uint32_t index, const regex *regex, const u_char *data,
+    uint32_t from, uint32_t len, regex_match *match);
+
+/** rules */
+
+#define RULE_DB_MAGIC 0x42445241        // "ARDB"
+#define RULE_DB_VERSION 3
+#define RULE_MAX_CHECKS 32              // contents, byte tests and regexes of one rule
+#define RULE_MATCH_BUDGET 256           // content positions tried per rule and packet
+
+typedef enum {
+    CHECK_CONTENT = 91,
+    CHECK_BYTE_TEST = 92,
+    CHECK_REGEX = 93
+} rule_check_type;
+
+// rule_check.flags
+#define CHECK_NOCASE   0x01
+#define CHECK_RELATIVE 0x02             // from the end of the previous content or regex match
+#define CHECK_NEGATED  0x04             // content or regex must not be there
+#define CHECK_LITTLE   0x08             // byte_test reads little endian
+
+/** one content, byte_test or pcre of a rule, in the order the rule has them */
+typedef struct {
+    uint8_t type;                       // rule_check_type
+    uint8_t flags;                      // CHECK_*
+    uint8_t op;                         // byte_test: < > = ! &
+    uint8_t size;                       // byte_test: 1, 2, 4 or 8 bytes
+    int32_t offset;                     // content: offset (distance when relative), byte_test: where to read
+    uint32_t depth;                     // content: depth (within when relative), 0 for the rest of the payload
+    uint32_t bytes;                     // content and regex: from the start of the db
+    uint32_t len;
+    uint64_t value;                     // byte_test, the index of a regex
+} rule_check;
+
+typedef struct {
+    uint8_t version;                    // 0 for any, 4 or 6
+    uint8_t prefix;
+    uint8_t negated;
+    uint8_t pad;
+    uint8_t addr[16];
+} rule_addr;
+
+typedef struct {
+    uint16_t lo;                        // any is 0-65535
+    uint16_t hi;
+    uint8_t negated;
+    uint8_t pad[3];
+} rule_ports;
+
+// rule.flow
+#define RULE_ESTABLISHED     0x01
+#define RULE_NOT_ESTABLISHED 0x02
+#define RULE_TO_SERVER       0x04
+#define RULE_TO_CLIENT       0x08
+
+/** `alert <proto> <src> <port> -> <dst> <port> (<options>)` once compiled */
+typedef struct {
+    uint32_t sid;
+    uint32_t rev;
+    uint32_t msg;                       // nul terminated, from the start of the db
+    uint32_t first_check;
+    uint8_t check_count;
+    uint8_t proto;                      // 0 for ip, icmp also takes icmpv6
+    uint8_t flow;                       // RULE_*
+    uint8_t bidirectional;              // <>
+    int32_t fast_pattern;               // check the prefilter looks for, -1 when the rule has no content
+    rule_addr src;
+    rule_addr dst;
+    rule_ports src_ports;
+    rule_ports dst_ports;
+} rule;
+
+/**
+ * the rules a packet can match, by protocol and destination port: ports
+ * that the same rules can match share a group. the fast pattern of each
+ * rule with content (its longest one) is in the matcher of the group, a
+ * match there is the index of the rule to look at
+ */
+typedef struct {
+    uint32_t always_count;              // rules without content, looked at on every packet
+    uint32_t always_offset;             // their indexes, from the start of the db
+    uint32_t pattern_count;
+    uint32_t matcher_offset;            // 0 when no rule of the group has content
+} rule_group;
+
+#define RULE_PORT_GROUPS 65536          // by destination port, tcp then udp
+
+/**
+ * the compiled rules, one immutable block with offsets instead of
+ * pointers: written to a file once and mapped read only by the main
+ * process before the fork, the workers share its pages through the page
+ * cache. group 0 has no rules
+ */
+typedef struct {
+    uint32_t magic;                     // RULE_DB_MAGIC
+    uint32_t version;                   // RULE_DB_VERSION
+    uint64_t size;                      // of the whole image
+    uint32_t rule_count;
+    uint32_t rules_offset;
+    uint32_t check_count;
+    uint32_t checks_offset;
+    uint32_t group_count;
+    uint32_t groups_offset;
+    uint32_t port_groups_offset;        // uint16_t group of every tcp and udp destination port
+    uint32_t pattern_count;             // over all groups
+    uint16_t icmp_group;                // icmp and icmpv6
+    uint16_t other_group;               // the other protocols, only ip rules
+    uint32_t regex_count;               // each has its own lazy dfa in a worker
+} rule_db;
+
+/** what a rule is matched against, a packet or a chunk of a stream */
+typedef struct {
+    const u_char *data;                 // payload
+    uint32_t len;
+    uint32_t start;                     // offset and depth count from here, a stream chunk has the previous tail before it
+    uint8_t version;
+    uint8_t proto;
+    uint8_t flow_state;                 // flow_state when it was seen, 0 untracked
+    uint8_t direction;                  // FLOW_TO_*
+    const uint8_t *src;
+    const uint8_t *dst;
+    uint16_t src_port;
+    uint16_t dst_port;
+} rule_packet;
+
+static inline const rule *rule_db_rules(const rule_db *db){
+    return (const rule *)((const u_char *)db + db->rules_offset);
+}
+
+/** the group of a packet, one table lookup */
+static inline uint16_t rule_group_index(const rule_db *db, uint8_t proto, uint16_t dst_port){
+    if (proto == IPPROTO_TCP || proto == IPPROTO_UDP){
+        const uint16_t *ports = (const uint16_t *)((const u_char *)db + db->port_groups_offset);
+        return ports[(proto == IPPROTO_UDP ? RULE_PORT_GROUPS : 0) + dst_port];
+    }
+    return proto == IPPROTO_ICMP || proto == IPPROTO_ICMPV6 ? db->icmp_group : db->other_group;
+}
+
+static inline const rule_group *rule_db_group(const rule_db *db, uint16_t index){
+    return (const rule_group *)((const u_char *)db + db->groups_offset) + index;
+}
+
+static inline const matcher *rule_group_matcher(const rule_db *db, const rule_group *group){
+    return group->matcher_offset ? (const matcher *)((const u_char *)db + group->matcher_offset) : NULL;
+}
+
+static inline const char *rule_msg(const rule_db *db, const rule *rule){
+    return (const char *)db + rule->msg;
+}
+
+rule_db *rule_compile(const char *path);
+int rule_db_write(const rule_db *db, const char *path);
+const rule_db *INIT_RULE_DB(const char *path);
+void FREE_RULE_DB(const rule_db *db);
+bool rule_match(const rule_db *db, const rule *rule, const rule_packet *packet, regex_scratch *scratch);
+
+/** worker side */
+
+// inputs scanned together, and the matches kept from one scan
+#define DETECT_BATCH 1024
+#define DETECT_MAX_HITS 16384
+#define DETECT_STREAM_TAIL 128          // bytes of a stream direction kept for the next chunk, at most
+
+typedef struct {
+    uint64_t packets;               // payloads scanned
+    uint64_t chunks;                // stream chunks scanned
+    uint64_t bytes;
+    uint64_t hits;                  // of fast patterns
+    uint64_t dropped_hits;          // past DETECT_MAX_HITS in one scan
+    uint64_t evaluated;             // rules looked at past the prefilter
+    uint64_t alerts;
+} detect_stats;
+
+typedef struct {
+    const rule_db *rules;
+    flow_table *flows;              // set when the tcp payload comes from the streams
+    uint32_t *stream_states;        // dfa state of each stream direction, 2 per flow entry
+    u_char *stream_tails;           // last bytes of each stream direction, tail_size each
+    uint16_t *stream_tail_lens;
+    uint32_t tail_size;
+    u_char *joined;                 // tail and chunk side by side, for the rules
+    uint32_t joined_size;
+    uint32_t *seen;                 // stamp of the input each rule was last looked at on
+    regex_scratch *regex;           // NULL when the rules have no pcre
+    uint32_t stamp;
+    uint32_t input_count;
+    matcher_input inputs[DETECT_BATCH];
+    rule_packet packets[DETECT_BATCH];
+    uint32_t order[DETECT_BATCH];   // group << 16 | input, sorted to scan each group in one call
+    matcher_input sorted[DETECT_BATCH];
+    matcher_hit hits[DETECT_MAX_HITS];
+    detect_stats stats;
+} detector;
+
+detector *INIT_DETECTOR(const rule_db *rules, stream_table *streams);
+void FREE_DETECTOR(detector *detector);
+void detect_packet(detector *detector, const packet_meta *meta, const u_char *frame,
+    const flow_entry *flow, int direction, bool inspect_payload, bool transient);
+void detect_batch_end(detector *detector);
+
+#endif
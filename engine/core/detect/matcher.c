@@ -0,0 +1,525 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "./detect.h"
+
+/**
+ * multi pattern matcher: the patterns go in a trie, the failure links
+ * of aho-corasick turn it into a dfa (every state has a transition for
+ * every byte class) so the scan is one table read per byte, never a walk
+ * back. while the scan sits on the root nothing is matched yet, it skips
+ * straight to the next byte that can start a pattern with a vectorized
+ * nibble lookup (the `shufti` trick: a byte is a candidate when the masks
+ * of its two nibbles share a bit), false candidates just step the dfa
+ * back to the root
+ */
+
+#define MATCHER_NARROW_MATCH 0x8000u
+#define MATCHER_WIDE_MATCH 0x80000000u
+// more states than that need 32 bit transitions
+#define MATCHER_NARROW_STATES 0x8000u
+// past that many bytes leaving the root, skipping doesn't pay
+#define MATCHER_SKIP_LIMIT 128
+#define MATCHER_NONE UINT32_MAX
+
+static inline uint8_t fold(uint8_t byte){
+    return (uint8_t)tolower(byte);
+}
+
+static inline const void *matcher_at(const matcher *matcher, uint32_t offset){
+    return (const u_char *)matcher + offset;
+}
+
+static inline int hex_value(char c){
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = (char)tolower((unsigned char)c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/**
+ * matcher_parse_content: read a quoted content, `*text` is right after the
+ * opening quote. `|de ad be ef|` is hex, `\"` `\\` `\|` are the quote, the
+ * backslash and the pipe
+ * ### return:
+ *  `int`: bytes written in `out`, `*text` is right after the closing quote
+ *  `-1`: malformed, or longer than `size`
+ */
+int matcher_parse_content(const char **text, u_char *out, uint32_t size){
+    const char *c = *text;
+    uint32_t len = 0;
+    bool hex = false;
+    while (*c && *c != '"'){
+        if (*c == '|'){
+            hex = !hex;
+            c++;
+            continue;
+        }
+        int byte;
+        if (hex){
+            if (*c == ' '){
+                c++;
+                continue;
+            }
+            int high = hex_value(c[0]);
+            int low = high < 0 ? -1 : hex_value(c[1]);
+            if (low < 0)
+                return -1;
+            byte = high << 4 | low;
+            c += 2;
+        }else if (*c == '\\'){
+            if (c[1] != '"' && c[1] != '\\' && c[1] != '|')
+                return -1;
+            byte = (unsigned char)c[1];
+            c += 2;
+        }else{
+            byte = (unsigned char)*c++;
+        }
+        if (len == size)
+            return -1;
+        out[len++] = (u_char)byte;
+    }
+    if (*c != '"' || hex)
+        return -1;
+    *text = c + 1;
+    return (int)len;
+}
+
+typedef struct {
+    uint32_t pattern;
+    uint32_t next;
+} output_node;
+
+/**
+ * spread the bytes that leave the root over 8 buckets of the nibble
+ * tables, high nibbles that go with the same low nibbles share a bucket
+ * and past 8 of those the closest ones merge (more false candidates)
+ */
+static void build_nibbles(matcher *matcher){
+    uint16_t lows[16] = {0};
+    for (int b = 0; b < 256; b++){
+        if (matcher->first[b])
+            lows[b >> 4] |= (uint16_t)(1u << (b & 15));
+    }
+    uint16_t bucket_lows[8] = {0};
+    int buckets = 0;
+    for (int high = 0; high < 16; high++){
+        if (!lows[high])
+            continue;
+        int bucket = -1;
+        for (int k = 0; k < buckets && bucket < 0; k++){
+            if (bucket_lows[k] == lows[high])
+                bucket = k;
+        }
+        if (bucket < 0 && buckets < 8)
+            bucket = buckets++;
+        if (bucket < 0){
+            int growth = 17;
+            for (int k = 0; k < 8; k++){
+                int grows = __builtin_popcount(bucket_lows[k] | lows[high]) - __builtin_popcount(bucket_lows[k]);
+                if (grows < growth){
+                    growth = grows;
+                    bucket = k;
+                }
+            }
+        }
+        bucket_lows[bucket] |= lows[high];
+        matcher->hi_nibbles[high] |= (uint8_t)(1u << bucket);
+    }
+    for (int low = 0; low < 16; low++){
+        for (int k = 0; k < buckets; k++){
+            if (bucket_lows[k] & (1u << low))
+                matcher->lo_nibbles[low] |= (uint8_t)(1u << k);
+        }
+    }
+}
+
+/**
+ * INIT_MATCHER: compile the patterns, they can be freed afterwards
+ * ### return:
+ *  `matcher *`: one block, free it with FREE_MATCHER
+ *  `NULL`: on error
+ */
+matcher *INIT_MATCHER(const matcher_pattern *patterns, uint32_t count){
+    if (!count){
+        printf("[x] a matcher needs at least one pattern\n");
+        return NULL;
+    }
+    bool folded = false;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < count; i++){
+        if (!patterns[i].len || patterns[i].len > MATCHER_MAX_PATTERN){
+            printf("[x] pattern %u must be 1 to %d bytes\n", patterns[i].id, MATCHER_MAX_PATTERN);
+            return NULL;
+        }
+        if (patterns[i].flags & MATCHER_NOCASE)
+            folded = true;
+        total += patterns[i].len;
+    }
+    if (total >= MATCHER_WIDE_MATCH){
+        printf("[x] too many pattern bytes\n");
+        return NULL;
+    }
+
+    // one class per byte some pattern uses, the others share class 0.
+    // with nocase patterns around everything is matched on lower case
+    bool used[256] = {false};
+    int used_count = 0;
+    for (uint32_t i = 0; i < count; i++){
+        for (uint32_t j = 0; j < patterns[i].len; j++){
+            uint8_t byte = folded ? fold(patterns[i].bytes[j]) : patterns[i].bytes[j];
+            used_count += !used[byte];
+            used[byte] = true;
+        }
+    }
+    uint8_t classes[256] = {0};
+    uint32_t class_count = used_count == 256 ? 256 : 1;
+    for (int b = 0; b < 256; b++){
+        if (used_count == 256)
+            classes[b] = (uint8_t)b;
+        else if (used[b])
+            classes[b] = (uint8_t)class_count++;
+    }
+    if (folded){
+        for (int b = 'A'; b <= 'Z'; b++)
+            classes[b] = classes[b + 'a' - 'A'];
+    }
+
+    // the trie, transitions of missing children are 0 (the root is nobody's child)
+    uint32_t max_states = (uint32_t)total + 1;
+    uint32_t *next = calloc((size_t)max_states * class_count, sizeof(uint32_t));
+    uint32_t *own = malloc(sizeof(uint32_t) * max_states);          // first output node of a state
+    uint32_t *fail = calloc(max_states, sizeof(uint32_t));
+    uint32_t *suffix = malloc(sizeof(uint32_t) * max_states);       // closest failure state with outputs
+    uint32_t *order = malloc(sizeof(uint32_t) * max_states);        // breadth first
+    uint32_t *renumber = malloc(sizeof(uint32_t) * max_states);
+    output_node *nodes = malloc(sizeof(output_node) * count);
+    if (!next || !own || !fail || !suffix || !order || !renumber || !nodes){
+        printf("[x] can't allocate the matcher of %u patterns\n", count);
+        free(next); free(own); free(fail); free(suffix); free(order); free(renumber); free(nodes);
+        return NULL;
+    }
+    memset(own, 0xFF, sizeof(uint32_t) * max_states);
+    uint32_t state_count = 1;
+    for (uint32_t i = 0; i < count; i++){
+        uint32_t state = 0;
+        for (uint32_t j = 0; j < patterns[i].len; j++){
+            uint32_t *to = &next[(size_t)state * class_count + classes[patterns[i].bytes[j]]];
+            if (!*to)
+                *to = state_count++;
+            state = *to;
+        }
+        nodes[i] = (output_node){i, own[state]};
+        own[state] = i;
+    }
+
+    // failure links breadth first, a missing transition takes the one
+    // of the failure state, which is shallower so already complete
+    uint32_t head = 0;
+    uint32_t tail = 0;
+    order[tail++] = 0;
+    suffix[0] = MATCHER_NONE;
+    while (head < tail){
+        uint32_t state = order[head++];
+        for (uint32_t c = 0; c < class_count; c++){
+            uint32_t *to = &next[(size_t)state * class_count + c];
+            // the trie's children were numbered after their parent
+            if (*to && *to > state){
+                uint32_t child = *to;
+                fail[child] = state ? next[(size_t)fail[state] * class_count + c] : 0;
+                suffix[child] = own[fail[child]] != MATCHER_NONE ? fail[child] : suffix[fail[child]];
+                order[tail++] = child;
+            }else if (state){
+                *to = next[(size_t)fail[state] * class_count + c];
+            }
+        }
+    }
+    for (uint32_t i = 0; i < state_count; i++)
+        renumber[order[i]] = i;
+
+    uint32_t output_count = 0;
+    for (uint32_t state = 0; state < state_count; state++){
+        for (uint32_t s = own[state] != MATCHER_NONE ? state : suffix[state]; s != MATCHER_NONE; s = suffix[s]){
+            for (uint32_t n = own[s]; n != MATCHER_NONE; n = nodes[n].next)
+                output_count++;
+        }
+    }
+
+    // lay the block out, the transitions on their own cache lines
+    bool wide = state_count > MATCHER_NARROW_STATES;
+    size_t transition = wide ? sizeof(uint32_t) : sizeof(uint16_t);
+    size_t next_offset = (sizeof(matcher) + 63) & ~(size_t)63;
+    size_t out_offset = (next_offset + (size_t)state_count * class_count * transition + 3) & ~(size_t)3;
+    size_t outputs_offset = out_offset + sizeof(uint32_t) * ((size_t)state_count + 1);
+    size_t entries_offset = outputs_offset + sizeof(uint32_t) * (size_t)output_count;
+    size_t bytes_offset = entries_offset + sizeof(matcher_entry) * (size_t)count;
+    size_t size = bytes_offset + (size_t)total;
+    matcher *built = size < UINT32_MAX ? aligned_alloc(64, (size + 63) & ~(size_t)63) : NULL;
+    if (!built){
+        printf("[x] can't allocate the matcher of %u patterns\n", count);
+        free(next); free(own); free(fail); free(suffix); free(order); free(renumber); free(nodes);
+        return NULL;
+    }
+    memset(built, 0, sizeof(matcher));
+    built->size = (uint32_t)size;
+    built->pattern_count = count;
+    built->state_count = state_count;
+    built->class_count = (uint16_t)class_count;
+    built->wide = wide;
+    built->folded = folded;
+    built->next_offset = (uint32_t)next_offset;
+    built->out_offset = (uint32_t)out_offset;
+    built->outputs_offset = (uint32_t)outputs_offset;
+    built->entries_offset = (uint32_t)entries_offset;
+    memcpy(built->classes, classes, sizeof(classes));
+
+    uint32_t *out = (uint32_t *)((u_char *)built + out_offset);
+    uint32_t *outputs = (uint32_t *)((u_char *)built + outputs_offset);
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < state_count; i++){
+        uint32_t state = order[i];
+        out[i] = written;
+        for (uint32_t s = own[state] != MATCHER_NONE ? state : suffix[state]; s != MATCHER_NONE; s = suffix[s]){
+            for (uint32_t n = own[s]; n != MATCHER_NONE; n = nodes[n].next)
+                outputs[written++] = nodes[n].pattern;
+        }
+    }
+    out[state_count] = written;
+    for (uint32_t i = 0; i < state_count; i++){
+        uint32_t state = order[i];
+        for (uint32_t c = 0; c < class_count; c++){
+            uint32_t to = renumber[next[(size_t)state * class_count + c]];
+            bool matches = out[to + 1] > out[to];
+            size_t at = (size_t)i * class_count + c;
+            if (wide)
+                ((uint32_t *)((u_char *)built + next_offset))[at] = to | (matches ? MATCHER_WIDE_MATCH : 0);
+            else
+                ((uint16_t *)((u_char *)built + next_offset))[at] = (uint16_t)(to | (matches ? MATCHER_NARROW_MATCH : 0));
+        }
+    }
+    matcher_entry *entries = (matcher_entry *)((u_char *)built + entries_offset);
+    size_t at = bytes_offset;
+    for (uint32_t i = 0; i < count; i++){
+        entries[i] = (matcher_entry){patterns[i].id, (uint32_t)at, patterns[i].len, patterns[i].flags};
+        memcpy((u_char *)built + at, patterns[i].bytes, patterns[i].len);
+        at += patterns[i].len;
+    }
+
+    // the root row says which bytes can start a match
+    for (int b = 0; b < 256; b++){
+        if (next[classes[b]]){
+            built->first[b] = 1;
+            built->first_count++;
+            built->first_byte = (uint8_t)b;
+        }
+    }
+    if (built->first_count == 1)
+        built->prefilter = PREFILTER_BYTE;
+    else if (built->first_count < MATCHER_SKIP_LIMIT)
+        built->prefilter = PREFILTER_SET;
+    else
+        built->prefilter = PREFILTER_NONE;
+    build_nibbles(built);
+
+    free(next); free(own); free(fail); free(suffix); free(order); free(renumber); free(nodes);
+    return built;
+}
+
+void FREE_MATCHER(matcher *matcher){
+    free(matcher);
+}
+
+/** skipping on the nibble tables, where the cpu can't do better */
+static uint32_t skip_scalar(const matcher *matcher, const u_char *data, uint32_t i, uint32_t len){
+    while (i < len && !matcher->first[data[i]])
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static uint32_t skip_avx2(const matcher *matcher, const u_char *data, uint32_t i, uint32_t len){
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)matcher->lo_nibbles));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)matcher->hi_nibbles));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 32 <= len; i += 32){
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i low = _mm256_shuffle_epi8(lo, _mm256_and_si256(bytes, nibble));
+        __m256i high = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+        uint32_t candidates = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(low, high), zero));
+        if (candidates)
+            return i + (uint32_t)__builtin_ctz(candidates);
+    }
+    return skip_scalar(matcher, data, i, len);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t skip_sse42(const matcher *matcher, const u_char *data, uint32_t i, uint32_t len){
+    const __m128i lo = _mm_loadu_si128((const __m128i *)matcher->lo_nibbles);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)matcher->hi_nibbles);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16){
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i low = _mm_shuffle_epi8(lo, _mm_and_si128(bytes, nibble));
+        __m128i high = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+        uint32_t candidates = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(low, high), zero)) & 0xFFFF;
+        if (candidates)
+            return i + (uint32_t)__builtin_ctz(candidates);
+    }
+    return skip_scalar(matcher, data, i, len);
+}
+#endif
+
+typedef uint32_t (*skip_fn)(const matcher *matcher, const u_char *data, uint32_t i, uint32_t len);
+
+// picked on the first scan, every process asks its cpu once
+static skip_fn skip_set = NULL;
+static const char *skip_set_name = "scalar";
+
+static void pick_skip(){
+    skip_set = skip_scalar;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        skip_set = skip_avx2;
+        skip_set_name = "avx2";
+    }else if (__builtin_cpu_supports("sse4.2")){
+        skip_set = skip_sse42;
+        skip_set_name = "sse4.2";
+    }
+#endif
+}
+
+/** matcher_prefilter_name: how scans skip ahead with this matcher, for the logs */
+const char *matcher_prefilter_name(const matcher *matcher){
+    if (matcher->prefilter == PREFILTER_BYTE)
+        return "memchr";
+    if (matcher->prefilter == PREFILTER_NONE)
+        return "none";
+    if (!skip_set)
+        pick_skip();
+    return skip_set_name;
+}
+
+/** next position from `i` where a pattern may start */
+static inline uint32_t skip(const matcher *matcher, const u_char *data, uint32_t i, uint32_t len){
+    if (matcher->prefilter == PREFILTER_BYTE){
+        const u_char *found = memchr(data + i, matcher->first_byte, len - i);
+        return found ? (uint32_t)(found - data) : len;
+    }
+    if (matcher->prefilter == PREFILTER_SET)
+        return skip_set(matcher, data, i, len);
+    return i;
+}
+
+/**
+ * the matches of `state`, a match ending at `end`. the dfa of a folded
+ * matcher doesn't see case, a case sensitive pattern is checked against
+ * the data when it's all in this buffer
+ */
+static inline uint32_t report(const matcher *matcher, uint32_t state, const u_char *data, uint32_t end,
+    matcher_hit *hits, uint32_t found, uint32_t max_hits, uint32_t input){
+    const uint32_t *out = matcher_at(matcher, matcher->out_offset);
+    const uint32_t *outputs = matcher_at(matcher, matcher->outputs_offset);
+    const matcher_entry *entries = matcher_at(matcher, matcher->entries_offset);
+    for (uint32_t k = out[state]; k < out[state + 1]; k++){
+        const matcher_entry *entry = &entries[outputs[k]];
+        if (matcher->folded && !(entry->flags & MATCHER_NOCASE) && end >= entry->len &&
+            memcmp(data + end - entry->len, matcher_at(matcher, entry->offset), entry->len) != 0)
+            continue;
+        if (found < max_hits)
+            hits[found] = (matcher_hit){entry->id, input, end};
+        found++;
+    }
+    return found;
+}
+
+/** one specialized loop per transition width */
+static inline __attribute__((always_inline)) uint32_t scan(const matcher *matcher, const u_char *data, uint32_t len,
+    uint32_t *state, matcher_hit *hits, uint32_t found, uint32_t max_hits, uint32_t input, bool wide){
+    const uint8_t *classes = matcher->classes;
+    const uint16_t *narrow = matcher_at(matcher, matcher->next_offset);
+    const uint32_t *broad = matcher_at(matcher, matcher->next_offset);
+    uint32_t class_count = matcher->class_count;
+    uint32_t current = *state;
+    uint32_t i = 0;
+    while (i < len){
+        if (!current){
+            i = skip(matcher, data, i, len);
+            if (i == len)
+                break;
+        }
+        uint32_t to = wide ? broad[(size_t)current * class_count + classes[data[i]]]
+                           : narrow[(size_t)current * class_count + classes[data[i]]];
+        i++;
+        uint32_t match = wide ? MATCHER_WIDE_MATCH : MATCHER_NARROW_MATCH;
+        current = to & ~match;
+        if (__builtin_expect(to & match, 0))
+            found = report(matcher, current, data, i, hits, found, max_hits, input);
+    }
+    *state = current;
+    return found;
+}
+
+static uint32_t scan_narrow(const matcher *matcher, const u_char *data, uint32_t len, uint32_t *state,
+    matcher_hit *hits, uint32_t found, uint32_t max_hits, uint32_t input){
+    return scan(matcher, data, len, state, hits, found, max_hits, input, false);
+}
+
+static uint32_t scan_wide(const matcher *matcher, const u_char *data, uint32_t len, uint32_t *state,
+    matcher_hit *hits, uint32_t found, uint32_t max_hits, uint32_t input){
+    return scan(matcher, data, len, state, hits, found, max_hits, input, true);
+}
+
+/**
+ * matcher_scan: every match of every pattern in `data`, `state` carries
+ * a partial match over to the next chunk of a stream (0 to start)
+ * ### return:
+ *  `uint32_t`: how many matches there were, only the first `max_hits`
+ *  are written in `hits`
+ */
+uint32_t matcher_scan(const matcher *matcher, const u_char *data, uint32_t len, uint32_t *state,
+    matcher_hit *hits, uint32_t max_hits, uint32_t input){
+    if (!skip_set)
+        pick_skip();
+    uint32_t start = 0;
+    if (!state)
+        state = &start;
+    if (matcher->wide)
+        return scan_wide(matcher, data, len, state, hits, 0, max_hits, input);
+    return scan_narrow(matcher, data, len, state, hits, 0, max_hits, input);
+}
+
+/**
+ * matcher_scan_batch: matcher_scan over `count` inputs in a row, the
+ * hits say which input they're in
+ * ### return:
+ *  `uint32_t`: how many matches there were in all, only the first
+ *  `max_hits` are written in `hits`
+ */
+uint32_t matcher_scan_batch(const matcher *matcher, const matcher_input *inputs, uint32_t count,
+    matcher_hit *hits, uint32_t max_hits){
+    if (!skip_set)
+        pick_skip();
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < count; i++){
+        if (i + 1 < count)
+            __builtin_prefetch(inputs[i + 1].data);
+        uint32_t start = 0;
+        uint32_t *state = inputs[i].state ? inputs[i].state : &start;
+        if (matcher->wide)
+            found = scan_wide(matcher, inputs[i].data, inputs[i].len, state, hits, found, max_hits, i);
+        else
+            found = scan_narrow(matcher, inputs[i].data, inputs[i].len, state, hits, found, max_hits, i);
+    }
+    return found;
+}
@@ -0,0 +1,922 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./detect.h"
+
+/**
+ * regex without backtracking: the pattern is parsed into a tree, the tree
+ * into a thompson nfa (counted repetitions unrolled), and a search walks
+ * the payload once with the set of nfa states it can be in. a worker
+ * caches those sets as the states of a lazy dfa, so a search is one table
+ * read per byte once the states it needs exist, the cache has a size and
+ * the nfa takes over when it's full. most searches find nothing, the
+ * dfa says so and stops at the first match when there's one. only then
+ * the nfa runs again, its threads keep where they started, for the
+ * offsets of the leftmost longest match.
+ * supported: literals, . [..] [^..] \d \w \s \D \W \S \xHH \n \r \t,
+ * ( ) (?: ) |, * + ? {n} {n,} {n,m} (lazy ones are taken as greedy), ^ at
+ * the start and $ at the end of an alternative
+ */
+
+#define REGEX_MAX_DEPTH 64              // of nested groups
+#define REGEX_INFINITE 0xffff
+// dfa state flags
+#define DFA_MATCH 0x01
+#define DFA_MATCH_EOL 0x02
+
+typedef enum {
+    AST_SET = 1,
+    AST_CAT = 2,
+    AST_ALT = 3,
+    AST_REPEAT = 4,
+    AST_EMPTY = 5,
+    AST_EOL = 6
+} ast_type;
+
+typedef struct {
+    uint8_t type;                       // ast_type
+    int left;
+    int right;
+    uint16_t min;                       // AST_REPEAT
+    uint16_t max;
+    uint8_t set[32];
+} regex_ast;
+
+typedef struct {
+    const char *at;
+    const char *end;
+    uint8_t flags;
+    regex_ast *nodes;
+    uint32_t count;
+    uint32_t size;
+    int depth;
+    const char *error;
+} regex_parser;
+
+// while the nfa is emitted
+typedef struct {
+    regex_node *nodes;
+    uint32_t count;
+    uint8_t (*sets)[32];
+    uint32_t set_count;
+    uint16_t match;
+    uint16_t match_eol;
+    const regex_parser *parser;
+    const char *error;
+} regex_builder;
+
+static inline bool set_has(const uint8_t *set, uint8_t byte){
+    return set[byte >> 3] & (1 << (byte & 7));
+}
+
+static inline void set_add(uint8_t *set, uint8_t byte){
+    set[byte >> 3] |= (uint8_t)(1 << (byte & 7));
+}
+
+static void set_range(uint8_t *set, int lo, int hi){
+    for (int b = lo; b <= hi; b++)
+        set_add(set, (uint8_t)b);
+}
+
+static void set_fold(uint8_t *set){
+    for (int b = 'a'; b <= 'z'; b++){
+        if (set_has(set, (uint8_t)b) || set_has(set, (uint8_t)(b - 32))){
+            set_add(set, (uint8_t)b);
+            set_add(set, (uint8_t)(b - 32));
+        }
+    }
+}
+
+static int ast_add(regex_parser *parser, uint8_t type, int left, int right){
+    if (parser->count == parser->size){
+        uint32_t wanted = parser->size ? parser->size * 2 : 64;
+        regex_ast *grown = realloc(parser->nodes, sizeof(regex_ast) * wanted);
+        if (!grown){
+            parser->error = "out of memory";
+            return -1;
+        }
+        parser->nodes = grown;
+        parser->size = wanted;
+    }
+    regex_ast *node = &parser->nodes[parser->count];
+    memset(node, 0, sizeof(regex_ast));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return (int)parser->count++;
+}
+
+static int hex_digit(char c){
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * an escape, `at` is past the backslash. the classes (\d ...) fill `set`,
+ * a single byte is returned
+ * ### return:
+ *  `int`: the byte, 256 for a class
+ *  `-1`: not something we know
+ */
+static int parse_escape(regex_parser *parser, uint8_t *set){
+    if (parser->at == parser->end){
+        parser->error = "trailing backslash";
+        return -1;
+    }
+    char c = *parser->at++;
+    uint8_t class[32] = {0};
+    bool negated = c == 'D' || c == 'W' || c == 'S';
+    switch (c){
+        case 'd': case 'D':
+            set_range(class, '0', '9');
+            break;
+        case 'w': case 'W':
+            set_range(class, '0', '9');
+            set_range(class, 'a', 'z');
+            set_range(class, 'A', 'Z');
+            set_add(class, '_');
+            break;
+        case 's': case 'S':
+            set_range(class, '\t', '\r');
+            set_add(class, ' ');
+            break;
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 't': return '\t';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case 'e': return 0x1b;
+        case '0': return 0;
+        case 'x':{
+            int high = parser->end - parser->at >= 2 ? hex_digit(parser->at[0]) : -1;
+            int low = high < 0 ? -1 : hex_digit(parser->at[1]);
+            if (low < 0){
+                parser->error = "\\x needs two hex digits";
+                return -1;
+            }
+            parser->at += 2;
+            return high << 4 | low;
+        }
+        default:
+            // escaped punctuation is itself, letters and digits are
+            // assertions or back references we don't do
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')){
+                parser->error = "unsupported escape (no \\b, back references, ...)";
+                return -1;
+            }
+            return (uint8_t)c;
+    }
+    for (int i = 0; i < 32; i++)
+        set[i] |= negated ? (uint8_t)~class[i] : class[i];
+    return 256;
+}
+
+/** [..] or [^..], `at` is past the [ */
+static int parse_class(regex_parser *parser){
+    int node = ast_add(parser, AST_SET, -1, -1);
+    if (node < 0)
+        return -1;
+    uint8_t set[32] = {0};
+    bool negated = parser->at < parser->end && *parser->at == '^';
+    if (negated)
+        parser->at++;
+    bool first = true;
+    while (parser->at < parser->end && (*parser->at != ']' || first)){
+        first = false;
+        int lo = (uint8_t)*parser->at++;
+        if (lo == '\\'){
+            lo = parse_escape(parser, set);
+            if (lo < 0)
+                return -1;
+            if (lo == 256)
+                continue;
+        }
+        int hi = lo;
+        if (parser->end - parser->at >= 2 && parser->at[0] == '-' && parser->at[1] != ']'){
+            parser->at++;
+            hi = (uint8_t)*parser->at++;
+            if (hi == '\\'){
+                hi = parse_escape(parser, set);
+                if (hi < 0)
+                    return -1;
+                if (hi == 256){
+                    parser->error = "a class can't end a range";
+                    return -1;
+                }
+            }
+            if (hi < lo){
+                parser->error = "range out of order";
+                return -1;
+            }
+        }
+        set_range(set, lo, hi);
+    }
+    if (parser->at == parser->end){
+        parser->error = "missing ]";
+        return -1;
+    }
+    parser->at++;
+    if (parser->flags & REGEX_NOCASE)
+        set_fold(set);
+    for (int i = 0; i < 32; i++)
+        parser->nodes[node].set[i] = negated ? (uint8_t)~set[i] : set[i];
+    return node;
+}
+
+static int parse_alternation(regex_parser *parser, bool top);
+
+static int parse_atom(regex_parser *parser){
+    char c = *parser->at++;
+    if (c == '('){
+        if (++parser->depth > REGEX_MAX_DEPTH){
+            parser->error = "groups nested too deep";
+            return -1;
+        }
+        if (parser->end - parser->at >= 2 && parser->at[0] == '?'){
+            if (parser->at[1] != ':'){
+                parser->error = "only (?: ) groups, no lookarounds or named groups";
+                return -1;
+            }
+            parser->at += 2;
+        }
+        int inside = parse_alternation(parser, false);
+        if (inside < 0)
+            return -1;
+        if (parser->at == parser->end || *parser->at != ')'){
+            parser->error = "missing )";
+            return -1;
+        }
+        parser->at++;
+        parser->depth--;
+        return inside;
+    }
+    if (c == '[')
+        return parse_class(parser);
+    if (c == '$')
+        return ast_add(parser, AST_EOL, -1, -1);
+    if (c == '^'){
+        parser->error = "^ only at the start of an alternative";
+        return -1;
+    }
+    if (c == '*' || c == '+' || c == '?' || c == '{'){
+        parser->error = "nothing to repeat";
+        return -1;
+    }
+    int node = ast_add(parser, AST_SET, -1, -1);
+    if (node < 0)
+        return -1;
+    uint8_t *set = parser->nodes[node].set;
+    if (c == '.'){
+        memset(set, 0xff, 32);
+        if (!(parser->flags & REGEX_DOTALL))
+            set['\n' >> 3] &= (uint8_t)~(1 << ('\n' & 7));
+        return node;
+    }
+    int byte = (uint8_t)c;
+    if (c == '\\'){
+        uint8_t class[32] = {0};
+        byte = parse_escape(parser, class);
+        if (byte < 0)
+            return -1;
+        set = parser->nodes[node].set;
+        if (byte == 256)
+            memcpy(set, class, 32);
+    }
+    if (byte != 256)
+        set_add(set, (uint8_t)byte);
+    if (parser->flags & REGEX_NOCASE)
+        set_fold(set);
+    return node;
+}
+
+/** {n}, {n,} or {n,m}, `at` is past the { */
+static bool parse_count(regex_parser *parser, uint16_t *min, uint16_t *max){
+    uint32_t values[2] = {0, 0};
+    int count = 0;
+    bool open = false;
+    for (int i = 0; i < 2; i++){
+        bool digits = false;
+        while (parser->at < parser->end && *parser->at >= '0' && *parser->at <= '9'){
+            values[i] = values[i] * 10 + (uint32_t)(*parser->at++ - '0');
+            digits = true;
+            if (values[i] > REGEX_MAX_REPEAT){
+                parser->error = "counted repetition over 1000";
+                return false;
+            }
+        }
+        if (!digits && i == 0)
+            break;
+        count++;
+        if (i == 0 && parser->at < parser->end && *parser->at == ','){
+            parser->at++;
+            open = parser->at < parser->end && *parser->at == '}';
+            if (open)
+                break;
+        }else{
+            break;
+        }
+    }
+    if (!count || parser->at == parser->end || *parser->at != '}'){
+        parser->error = "malformed {n,m}";
+        return false;
+    }
+    parser->at++;
+    *min = (uint16_t)values[0];
+    *max = open ? REGEX_INFINITE : (uint16_t)(count == 2 ? values[1] : values[0]);
+    if (*max < *min){
+        parser->error = "{n,m} with m < n";
+        return false;
+    }
+    return true;
+}
+
+static int parse_repeat(regex_parser *parser){
+    int node = parse_atom(parser);
+    while (node >= 0 && parser->at < parser->end){
+        char c = *parser->at;
+        uint16_t min, max;
+        if (c == '*' || c == '+' || c == '?'){
+            parser->at++;
+            min = c == '+' ? 1 : 0;
+            max = c == '?' ? 1 : REGEX_INFINITE;
+        }else if (c == '{'){
+            parser->at++;
+            if (!parse_count(parser, &min, &max))
+                return -1;
+        }else{
+            break;
+        }
+        // lazy is taken as greedy, the match is the leftmost longest either way
+        if (parser->at < parser->end && *parser->at == '?')
+            parser->at++;
+        else if (parser->at < parser->end && *parser->at == '+'){
+            parser->error = "no possessive quantifiers";
+            return -1;
+        }
+        if (parser->nodes[node].type == AST_EOL){
+            parser->error = "$ can't be repeated";
+            return -1;
+        }
+        int repeat = ast_add(parser, AST_REPEAT, node, -1);
+        if (repeat < 0)
+            return -1;
+        parser->nodes[repeat].min = min;
+        parser->nodes[repeat].max = max;
+        node = repeat;
+    }
+    return node;
+}
+
+/** a sequence up to | or ), `anchored` is set when a top level one starts with ^ */
+static int parse_sequence(regex_parser *parser, bool top, bool *anchored){
+    *anchored = false;
+    if (top && parser->at < parser->end && *parser->at == '^'){
+        parser->at++;
+        *anchored = true;
+    }
+    int sequence = -1;
+    while (parser->at < parser->end && *parser->at != '|' && *parser->at != ')'){
+        int item = parse_repeat(parser);
+        if (item < 0)
+            return -1;
+        sequence = sequence < 0 ? item : ast_add(parser, AST_CAT, sequence, item);
+        if (sequence < 0)
+            return -1;
+    }
+    return sequence < 0 ? ast_add(parser, AST_EMPTY, -1, -1) : sequence;
+}
+
+/**
+ * alternatives, at the top level the ones with ^ are kept apart in
+ * `right` of an AST_ALT whose `left` has the others (either can be -1)
+ */
+static int parse_alternation(regex_parser *parser, bool top){
+    int free_alts = -1, anchored_alts = -1;
+    while (true){
+        bool anchored;
+        int sequence = parse_sequence(parser, top, &anchored);
+        if (sequence < 0)
+            return -1;
+        int *into = anchored ? &anchored_alts : &free_alts;
+        *into = *into < 0 ? sequence : ast_add(parser, AST_ALT, *into, sequence);
+        if (*into < 0)
+            return -1;
+        if (parser->at == parser->end || *parser->at != '|')
+            break;
+        parser->at++;
+    }
+    if (top)
+        return ast_add(parser, AST_ALT, free_alts, anchored_alts);
+    return free_alts;
+}
+
+static int node_add(regex_builder *builder, uint8_t type, uint16_t set, uint16_t out, uint16_t out2){
+    if (builder->count == REGEX_MAX_NODES){
+        builder->error = "too big once repetitions are unrolled";
+        return -1;
+    }
+    builder->nodes[builder->count] = (regex_node){.type = type, .set = set, .out = out, .out2 = out2};
+    return (int)builder->count++;
+}
+
+static int set_index(regex_builder *builder, const uint8_t *set){
+    for (uint32_t i = 0; i < builder->set_count; i++)
+        if (!memcmp(builder->sets[i], set, 32))
+            return (int)i;
+    memcpy(builder->sets[builder->set_count], set, 32);
+    return (int)builder->set_count++;
+}
+
+/**
+ * emit: the nfa of a tree node that goes on to `next`, built from the
+ * end backwards
+ * ### return:
+ *  `int`: its first nfa node
+ *  `-1`: too big, or $ somewhere it can't be
+ */
+static int emit(regex_builder *builder, int ast, int next){
+    const regex_ast *node = &builder->parser->nodes[ast];
+    switch (node->type){
+        case AST_EMPTY:
+            return next;
+        case AST_EOL:
+            if (next != builder->match){
+                builder->error = "$ only at the end of an alternative";
+                return -1;
+            }
+            return builder->match_eol;
+        case AST_SET:{
+            int set = set_index(builder, node->set);
+            return node_add(builder, REGEX_SET, (uint16_t)set, (uint16_t)next, REGEX_NONE);
+        }
+        case AST_CAT:{
+            int right = emit(builder, node->right, next);
+            return right < 0 ? -1 : emit(builder, node->left, right);
+        }
+        case AST_ALT:{
+            int left = emit(builder, node->left, next);
+            int right = left < 0 ? -1 : emit(builder, node->right, next);
+            if (right < 0)
+                return -1;
+            return node_add(builder, REGEX_SPLIT, 0, (uint16_t)left, (uint16_t)right);
+        }
+        default:{
+            int at = next;
+            if (node->max == REGEX_INFINITE){
+                // the loop: once more, or go on
+                int loop = node_add(builder, REGEX_SPLIT, 0, REGEX_NONE, (uint16_t)next);
+                int body = loop < 0 ? -1 : emit(builder, node->left, loop);
+                if (body < 0)
+                    return -1;
+                builder->nodes[loop].out = (uint16_t)body;
+                at = loop;
+            }else{
+                for (int i = node->min; i < node->max && at >= 0; i++){
+                    int body = emit(builder, node->left, at);
+                    at = body < 0 ? -1 : node_add(builder, REGEX_SPLIT, 0, (uint16_t)body, (uint16_t)next);
+                }
+            }
+            for (int i = 0; i < node->min && at >= 0; i++)
+                at = emit(builder, node->left, at);
+            return at;
+        }
+    }
+}
+
+/**
+ * INIT_REGEX: compile a regex, `flags` are REGEX_*
+ * ### return:
+ *  `regex *`: if successful
+ *  `NULL`: malformed, something we don't do, or too big
+ */
+regex *INIT_REGEX(const char *pattern, uint32_t len, uint8_t flags){
+    regex_parser parser = {.at = pattern, .end = pattern + len, .flags = flags};
+    regex_builder builder = {.parser = &parser};
+    regex *built = NULL;
+    int root = parse_alternation(&parser, true);
+    if (root >= 0 && parser.at != parser.end)
+        parser.error = "unbalanced )";
+    builder.nodes = malloc(sizeof(regex_node) * REGEX_MAX_NODES);
+    builder.sets = malloc(32 * REGEX_MAX_NODES);
+    if (!parser.error && (!builder.nodes || !builder.sets))
+        parser.error = "out of memory";
+    const char *error = parser.error;
+    int start = REGEX_NONE, anchored = REGEX_NONE;
+    if (!error){
+        builder.match = (uint16_t)node_add(&builder, REGEX_MATCH, 0, REGEX_NONE, REGEX_NONE);
+        builder.match_eol = (uint16_t)node_add(&builder, REGEX_MATCH_EOL, 0, REGEX_NONE, REGEX_NONE);
+        const regex_ast *top = &parser.nodes[root];
+        if (top->left >= 0)
+            start = emit(&builder, top->left, builder.match);
+        if (start >= 0 && top->right >= 0)
+            anchored = emit(&builder, top->right, builder.match);
+        error = start < 0 || anchored < 0 ? builder.error : NULL;
+    }
+    if (error){
+        printf("[x] regex /%.*s/: %s\n", (int)len, pattern, error);
+    }else{
+        // bytes in the same sets behave the same, they share a class. a
+        // line feed has its own with m, ^ starts over after it
+        uint8_t classes[256] = {0};
+        int class_count = 1;
+        for (uint32_t s = 0; s <= builder.set_count; s++){
+            int split[256][2];
+            memset(split, -1, sizeof(split));
+            int count = 0;
+            for (int b = 0; b < 256; b++){
+                bool in = s < builder.set_count ? set_has(builder.sets[s], (uint8_t)b)
+                    : (flags & REGEX_MULTILINE) && b == '\n';
+                int *to = &split[classes[b]][in];
+                if (*to < 0)
+                    *to = count++;
+                classes[b] = (uint8_t)*to;
+            }
+            class_count = count;
+        }
+        size_t nodes_offset = (sizeof(regex) + 7) & ~(size_t)7;
+        size_t sets_offset = nodes_offset + sizeof(regex_node) * builder.count;
+        size_t size = sets_offset + 32 * builder.set_count;
+        built = calloc(1, size);
+        if (built){
+            *built = (regex){
+                .size = (uint32_t)size,
+                .node_count = (uint16_t)builder.count,
+                .set_count = (uint16_t)builder.set_count,
+                .start = (uint16_t)start,
+                .start_anchored = (uint16_t)anchored,
+                .class_count = (uint16_t)class_count,
+                .flags = flags,
+                .nodes_offset = (uint32_t)nodes_offset,
+                .sets_offset = (uint32_t)sets_offset
+            };
+            memcpy(built->classes, classes, 256);
+            memcpy((u_char *)built + nodes_offset, builder.nodes, sizeof(regex_node) * builder.count);
+            memcpy((u_char *)built + sets_offset, builder.sets, 32 * builder.set_count);
+        }
+    }
+    free(parser.nodes);
+    free(builder.nodes);
+    free(builder.sets);
+    return built;
+}
+
+void FREE_REGEX(regex *regex){
+    free(regex);
+}
+
+/**
+ * INIT_REGEX_SCRATCH: what a worker needs to run `count` regexes, their
+ * dfas are only allocated when they're first used
+ * ### return:
+ *  `regex_scratch *`: if successful
+ *  `NULL`: on error
+ */
+regex_scratch *INIT_REGEX_SCRATCH(uint32_t count){
+    regex_scratch *built = calloc(1, sizeof(regex_scratch));
+    if (!built)
+        return NULL;
+    built->count = count;
+    built->dfas = calloc(count ? count : 1, sizeof(regex_dfa));
+    built->current = malloc(sizeof(uint16_t) * REGEX_MAX_NODES);
+    built->following = malloc(sizeof(uint16_t) * REGEX_MAX_NODES);
+    built->current_starts = malloc(sizeof(uint32_t) * REGEX_MAX_NODES);
+    built->following_starts = malloc(sizeof(uint32_t) * REGEX_MAX_NODES);
+    // a split pushes both its ways, each split is only followed once
+    built->stack = malloc(sizeof(uint16_t) * (REGEX_MAX_NODES * 2 + 1));
+    built->marks = calloc(REGEX_MAX_NODES, sizeof(uint32_t));
+    if (!built->dfas || !built->current || !built->following || !built->current_starts
+        || !built->following_starts || !built->stack || !built->marks){
+        FREE_REGEX_SCRATCH(built);
+        return NULL;
+    }
+    return built;
+}
+
+static void free_dfa(regex_dfa *dfa){
+    free(dfa->next);
+    free(dfa->flags);
+    free(dfa->set_offset);
+    free(dfa->set_len);
+    free(dfa->sets);
+    free(dfa->slots);
+}
+
+void FREE_REGEX_SCRATCH(regex_scratch *scratch){
+    if (!scratch)
+        return;
+    for (uint32_t i = 0; scratch->dfas && i < scratch->count; i++)
+        free_dfa(&scratch->dfas[i]);
+    free(scratch->dfas);
+    free(scratch->current);
+    free(scratch->following);
+    free(scratch->current_starts);
+    free(scratch->following_starts);
+    free(scratch->stack);
+    free(scratch->marks);
+    free(scratch);
+}
+
+static inline const regex_node *regex_nodes(const regex *regex){
+    return (const regex_node *)((const u_char *)regex + regex->nodes_offset);
+}
+
+static inline const uint8_t *regex_set(const regex *regex, uint16_t set){
+    return (const uint8_t *)regex + regex->sets_offset + (size_t)set * 32;
+}
+
+/** a new generation of marks, every nfa state is unvisited again */
+static void next_mark(regex_scratch *scratch){
+    if (++scratch->mark == 0){
+        memset(scratch->marks, 0, sizeof(uint32_t) * REGEX_MAX_NODES);
+        scratch->mark = 1;
+    }
+}
+
+/**
+ * follow the splits from `node`, the states that take a byte go in `out`
+ * (with `start` in `out_starts` when there's one) and the matches reached
+ * in `flags`. the threads come in by start, the first one to reach a state
+ * is the leftmost, the later ones are dropped
+ */
+static uint32_t closure(const regex *regex, regex_scratch *scratch, uint16_t node, uint16_t *out,
+    uint32_t *out_starts, uint32_t count, uint8_t *flags, uint32_t start){
+    const regex_node *nodes = regex_nodes(regex);
+    uint32_t depth = 0;
+    scratch->stack[depth++] = node;
+    while (depth){
+        uint16_t at = scratch->stack[--depth];
+        if (at == REGEX_NONE || scratch->marks[at] == scratch->mark)
+            continue;
+        scratch->marks[at] = scratch->mark;
+        switch (nodes[at].type){
+            case REGEX_SET:
+                if (out_starts)
+                    out_starts[count] = start;
+                out[count++] = at;
+                break;
+            case REGEX_SPLIT:
+                scratch->stack[depth++] = nodes[at].out2;
+                scratch->stack[depth++] = nodes[at].out;
+                break;
+            case REGEX_MATCH:
+                scratch->match_start = start;
+                *flags |= DFA_MATCH;
+                break;
+            default:
+                scratch->eol_start = start;
+                *flags |= DFA_MATCH_EOL;
+                break;
+        }
+    }
+    return count;
+}
+
+/** where new matches can start, after `byte` (-1 at the start of the search) */
+static uint32_t restart(const regex *regex, regex_scratch *scratch, int byte, uint16_t *out,
+    uint32_t *out_starts, uint32_t count, uint8_t *flags, uint32_t start){
+    if (regex->start != REGEX_NONE)
+        count = closure(regex, scratch, regex->start, out, out_starts, count, flags, start);
+    if (regex->start_anchored != REGEX_NONE && (byte < 0 || (regex->flags & REGEX_MULTILINE && byte == '\n')))
+        count = closure(regex, scratch, regex->start_anchored, out, out_starts, count, flags, start);
+    return count;
+}
+
+/**
+ * the states after `byte` from the `count` of `set`, new matches start at
+ * `position`. the starts are only carried when `set_starts` is there
+ */
+static uint32_t step(const regex *regex, regex_scratch *scratch, const uint16_t *set, const uint32_t *set_starts,
+    uint32_t count, uint8_t byte, uint16_t *out, uint32_t *out_starts, uint8_t *flags, uint32_t position){
+    const regex_node *nodes = regex_nodes(regex);
+    next_mark(scratch);
+    *flags = 0;
+    scratch->match_start = scratch->eol_start = UINT32_MAX;
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < count; i++){
+        const regex_node *node = &nodes[set[i]];
+        if (set_has(regex_set(regex, node->set), byte))
+            found = closure(regex, scratch, node->out, out, out_starts, found, flags, set_starts ? set_starts[i] : 0);
+    }
+    return restart(regex, scratch, byte, out, out_starts, found, flags, position);
+}
+
+/** the first step of a search, from `from` */
+static uint32_t begin(const regex *regex, regex_scratch *scratch, uint16_t *out, uint32_t *out_starts,
+    uint8_t *flags, uint32_t from){
+    next_mark(scratch);
+    *flags = 0;
+    scratch->match_start = scratch->eol_start = UINT32_MAX;
+    return restart(regex, scratch, -1, out, out_starts, 0, flags, from);
+}
+
+/** nothing can match anymore, no state left and none to start over from */
+static inline bool dead(const regex *regex, uint32_t count, uint8_t flags){
+    return !count && !flags && regex->start == REGEX_NONE && !(regex->flags & REGEX_MULTILINE);
+}
+
+static inline bool accepts(const regex *regex, uint8_t flags, const u_char *data, uint32_t at, uint32_t len){
+    if (flags & DFA_MATCH)
+        return true;
+    return flags & DFA_MATCH_EOL && (at == len || (regex->flags & REGEX_MULTILINE && data[at] == '\n'));
+}
+
+static int compare_state(const void *a, const void *b){
+    return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+/** the cache of a regex, as many states as REGEX_CACHE_KB holds */
+static bool dfa_init(regex_dfa *dfa, const regex *regex){
+    // a transition per class, the state itself, ~8 nfa states and 2 hash slots
+    uint32_t per_state = regex->class_count * sizeof(uint16_t) + 1 + sizeof(uint32_t) + sizeof(uint16_t)
+        + 8 * sizeof(uint16_t) + 2 * sizeof(uint32_t);
+    uint32_t max_states = REGEX_CACHE_KB * 1024 / per_state;
+    if (max_states < 16)
+        max_states = 16;
+    uint32_t slots = 1;
+    while (slots < max_states * 2)
+        slots <<= 1;
+    dfa->class_count = regex->class_count;
+    dfa->max_states = max_states;
+    dfa->set_size = max_states * 8 > regex->node_count ? max_states * 8 : regex->node_count;
+    dfa->slot_mask = slots - 1;
+    dfa->next = malloc(sizeof(uint16_t) * max_states * regex->class_count);
+    dfa->flags = malloc(max_states);
+    dfa->set_offset = malloc(sizeof(uint32_t) * max_states);
+    dfa->set_len = malloc(sizeof(uint16_t) * max_states);
+    dfa->sets = malloc(sizeof(uint16_t) * dfa->set_size);
+    dfa->slots = calloc(slots, sizeof(uint32_t));
+    if (!dfa->next || !dfa->flags || !dfa->set_offset || !dfa->set_len || !dfa->sets || !dfa->slots){
+        free_dfa(dfa);
+        memset(dfa, 0, sizeof(regex_dfa));
+        return false;
+    }
+    return true;
+}
+
+static void dfa_flush(regex_dfa *dfa){
+    dfa->state_count = 0;
+    dfa->set_used = 0;
+    dfa->full = false;
+    memset(dfa->slots, 0, sizeof(uint32_t) * (dfa->slot_mask + 1));
+}
+
+/**
+ * dfa_state: the dfa state of a set of nfa states, made if it's new
+ * (`set` gets sorted)
+ * ### return:
+ *  `uint32_t`: the state
+ *  `REGEX_NONE`: the cache is full
+ */
+static uint32_t dfa_state(regex_dfa *dfa, regex_scratch *scratch, uint16_t *set, uint32_t count, uint8_t flags){
+    qsort(set, count, sizeof(uint16_t), compare_state);
+    uint32_t hash = 2166136261u ^ flags;
+    for (uint32_t i = 0; i < count; i++)
+        hash = (hash ^ set[i]) * 16777619u;
+    uint32_t slot = hash & dfa->slot_mask;
+    for (; dfa->slots[slot]; slot = (slot + 1) & dfa->slot_mask){
+        uint32_t state = dfa->slots[slot] - 1;
+        if (dfa->flags[state] == flags && dfa->set_len[state] == count
+            && !memcmp(dfa->sets + dfa->set_offset[state], set, sizeof(uint16_t) * count))
+            return state;
+    }
+    if (dfa->state_count == dfa->max_states || dfa->set_used + count > dfa->set_size){
+        dfa->full = true;
+        return REGEX_NONE;
+    }
+    uint32_t state = dfa->state_count++;
+    memset(dfa->next + (size_t)state * dfa->class_count, 0xff, sizeof(uint16_t) * dfa->class_count);
+    dfa->flags[state] = flags;
+    dfa->set_offset[state] = dfa->set_used;
+    dfa->set_len[state] = (uint16_t)count;
+    memcpy(dfa->sets + dfa->set_used, set, sizeof(uint16_t) * count);
+    dfa->set_used += count;
+    dfa->slots[slot] = state + 1;
+    scratch->stats.dfa_states++;
+    return state;
+}
+
+/** go on with the `count` states in scratch->current on the nfa, from `at` */
+static bool nfa_search(const regex *regex, regex_scratch *scratch, const u_char *data, uint32_t at,
+    uint32_t len, uint32_t count, uint32_t *end){
+    scratch->stats.nfa_searches++;
+    for (; at < len; at++){
+        uint8_t flags;
+        count = step(regex, scratch, scratch->current, NULL, count, data[at], scratch->following, NULL, &flags, at + 1);
+        uint16_t *swap = scratch->current;
+        scratch->current = scratch->following;
+        scratch->following = swap;
+        if (accepts(regex, flags, data, at + 1, len)){
+            *end = at + 1;
+            return true;
+        }
+        if (dead(regex, count, flags))
+            return false;
+    }
+    return false;
+}
+
+/** the earliest end of a match from `from`, on the dfa as long as its cache has room */
+static bool earliest_end(const regex *regex, regex_scratch *scratch, regex_dfa *dfa, const u_char *data,
+    uint32_t from, uint32_t len, uint32_t *end){
+    uint8_t flags;
+    uint32_t count = begin(regex, scratch, scratch->current, NULL, &flags, from);
+    if (accepts(regex, flags, data, from, len)){
+        *end = from;
+        return true;
+    }
+    uint32_t state = dfa ? dfa_state(dfa, scratch, scratch->current, count, flags) : REGEX_NONE;
+    if (state == REGEX_NONE)
+        return nfa_search(regex, scratch, data, from, len, count, end);
+    for (uint32_t at = from; at < len; at++){
+        uint16_t *next = &dfa->next[(size_t)state * dfa->class_count + regex->classes[data[at]]];
+        uint32_t following = *next;
+        if (following == REGEX_NONE){
+            // first time this way, the nfa says where it leads
+            count = step(regex, scratch, dfa->sets + dfa->set_offset[state], NULL, dfa->set_len[state],
+                data[at], scratch->current, NULL, &flags, at + 1);
+            following = dfa_state(dfa, scratch, scratch->current, count, flags);
+            if (following == REGEX_NONE){
+                if (accepts(regex, flags, data, at + 1, len)){
+                    *end = at + 1;
+                    return true;
+                }
+                return !dead(regex, count, flags) && nfa_search(regex, scratch, data, at + 1, len, count, end);
+            }
+            *next = (uint16_t)following;
+        }
+        state = following;
+        flags = dfa->flags[state];
+        if (flags && accepts(regex, flags, data, at + 1, len)){
+            *end = at + 1;
+            return true;
+        }
+        if (!dfa->set_len[state] && dead(regex, 0, flags))
+            return false;
+    }
+    return false;
+}
+
+/**
+ * the leftmost longest match, once the dfa said there's one: the nfa
+ * again with the start of every thread. past the first match no thread
+ * starts anymore and the ones that started after the best die, it's over
+ * when none is left
+ */
+static void leftmost_longest(const regex *regex, regex_scratch *scratch, const u_char *data,
+    uint32_t from, uint32_t len, regex_match *match){
+    uint8_t flags;
+    uint32_t count = begin(regex, scratch, scratch->current, scratch->current_starts, &flags, from);
+    match->start = UINT32_MAX;
+    for (uint32_t at = from; ; at++){
+        // the threads are in the order they started, the first one to match is the leftmost
+        uint32_t start = flags & DFA_MATCH ? scratch->match_start : UINT32_MAX;
+        if (accepts(regex, flags & DFA_MATCH_EOL, data, at, len) && scratch->eol_start < start)
+            start = scratch->eol_start;
+        if (start != UINT32_MAX && start <= match->start){
+            match->start = start;
+            match->end = at;
+        }
+        while (match->start != UINT32_MAX && count && scratch->current_starts[count - 1] > match->start)
+            count--;
+        if (at == len || (!count && match->start != UINT32_MAX))
+            return;
+        count = step(regex, scratch, scratch->current, scratch->current_starts, count, data[at],
+            scratch->following, scratch->following_starts, &flags, at + 1);
+        uint16_t *swap = scratch->current;
+        scratch->current = scratch->following;
+        scratch->following = swap;
+        uint32_t *swap_starts = scratch->current_starts;
+        scratch->current_starts = scratch->following_starts;
+        scratch->following_starts = swap_starts;
+    }
+}
+
+/**
+ * regex_search: the match of regex `index` in [from, len) that starts
+ * first, the longest from there (posix, what a greedy perl regex finds
+ * most of the time). the dfa of the worker finds out if there's one
+ * ### return:
+ *  `true`: matched, `match` says where
+ *  `false`: no match
+ */
+bool regex_search(regex_scratch *scratch, uint32_t index, const regex *regex, const u_char *data,
+    uint32_t from, uint32_t len, regex_match *match){
+    scratch->stats.searches++;
+    regex_dfa *dfa = index < scratch->count ? &scratch->dfas[index] : NULL;
+    if (dfa && !dfa->next && !dfa_init(dfa, regex))
+        dfa = NULL;
+    if (dfa && dfa->full){
+        scratch->stats.flushes++;
+        dfa_flush(dfa);
+    }
+    uint32_t end;
+    if (!earliest_end(regex, scratch, dfa, data, from, len, &end))
+        return false;
+    leftmost_longest(regex, scratch, data, from, len, match);
+    return true;
+}
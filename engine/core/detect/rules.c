@@ -0,0 +1,1207 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>          // inet_pton()
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "./detect.h"
+
+/**
+ * rule language, snort like, one rule per line (`#` starts a comment):
+ *   alert tcp any any -> 10.0.0.0/8 80 (msg:"admin page"; content:"GET "; depth:4;
+ *       content:"/admin"; distance:0; within:64; flow:established,to_server; sid:1001;)
+ *   alert tcp any any -> any 80 (msg:"user in the query"; content:"user="; pcre:"/[?&]user=\w{32,}/R"; sid:1002;)
+ * the compiler reads a rule file into one rule_db image, the main process
+ * writes it to a file and maps it back read only before the fork. the
+ * workers only look rules up in it and match them against a packet
+ */
+
+#define RULE_MSG_MAX 256
+#define RULE_WORD_MAX 64
+
+// what the compiler gathers before laying the image out, offsets of the
+// contents and messages are in the pool until then
+typedef struct {
+    rule *rules;
+    uint32_t rule_count;
+    uint32_t rule_size;
+    rule_check *checks;
+    uint32_t check_count;
+    uint32_t check_size;
+    u_char *pool;
+    uint32_t pool_len;
+    uint32_t pool_size;
+    regex **regexes;            // compiled pcres, their checks have the index
+    uint32_t regex_count;
+    uint32_t regex_size;
+} rule_builder;
+
+// where the options of the rule being read are at
+typedef struct {
+    const char *path;
+    int line;
+    rule *rule;
+    int64_t last_content;       // check nocase, offset, depth, ... apply to, -1 before the first
+    bool absolute;              // the last content has an offset or a depth
+    bool has_sid;
+} rule_parser;
+
+static inline uint8_t lower(uint8_t byte){
+    return byte >= 'A' && byte <= 'Z' ? byte + ('a' - 'A') : byte;
+}
+
+static const char *skip_space(const char *c){
+    while (isspace((unsigned char)*c))
+        c++;
+    return c;
+}
+
+/** make room for one more item of an array that doubles */
+static void *grow(void *array, uint32_t count, uint32_t *size, size_t item){
+    if (count < *size)
+        return array;
+    uint32_t wanted = *size ? *size * 2 : 256;
+    void *grown = realloc(array, item * wanted);
+    if (grown)
+        *size = wanted;
+    return grown;
+}
+
+/**
+ * pool_add: copy bytes in the pool
+ * ### return:
+ *  `int64_t`: their offset in the pool
+ *  `-1`: out of memory
+ */
+static int64_t pool_add(rule_builder *builder, const void *bytes, uint32_t len){
+    while (builder->pool_len + len > builder->pool_size){
+        uint32_t wanted = builder->pool_size ? builder->pool_size * 2 : 4096;
+        u_char *grown = realloc(builder->pool, wanted);
+        if (!grown)
+            return -1;
+        builder->pool = grown;
+        builder->pool_size = wanted;
+    }
+    memcpy(builder->pool + builder->pool_len, bytes, len);
+    builder->pool_len += len;
+    return builder->pool_len - len;
+}
+
+static int parse_error(const rule_parser *parser, const char *what){
+    printf("[x] %s:%d: %s\n", parser->path, parser->line, what);
+    return -1;
+}
+
+/** one word of the header, up to a space or the option list */
+static bool next_word(const char **c, char *out, size_t size){
+    *c = skip_space(*c);
+    size_t len = 0;
+    while (**c && !isspace((unsigned char)**c) && **c != '('){
+        if (len + 1 == size)
+            return false;
+        out[len++] = *(*c)++;
+    }
+    out[len] = '\0';
+    return len > 0;
+}
+
+/** an unsigned decimal (or 0x hex when `hex`) number up to `max` */
+static bool read_number(const char **c, uint64_t max, bool hex, uint64_t *value){
+    if (!isdigit((unsigned char)**c))
+        return false;
+    char *end;
+    unsigned long long read = strtoull(*c, &end, hex ? 0 : 10);
+    if (read > max)
+        return false;
+    *c = end;
+    *value = read;
+    return true;
+}
+
+static bool read_signed(const char **c, int32_t *value){
+    bool negative = **c == '-';
+    const char *at = *c + (negative ? 1 : 0);
+    uint64_t read;
+    if (!read_number(&at, (uint64_t)INT32_MAX, false, &read))
+        return false;
+    *c = at;
+    *value = negative ? -(int32_t)read : (int32_t)read;
+    return true;
+}
+
+/** `any`, `[!]<ipv4|ipv6>[/<prefix>]` */
+static bool parse_addr(const char *word, rule_addr *addr){
+    memset(addr, 0, sizeof(rule_addr));
+    if (*word == '!'){
+        addr->negated = 1;
+        word++;
+    }
+    if (strcmp(word, "any") == 0)
+        return !addr->negated;
+    char text[INET6_ADDRSTRLEN];
+    const char *slash = strchr(word, '/');
+    size_t len = slash ? (size_t)(slash - word) : strlen(word);
+    if (len >= sizeof(text))
+        return false;
+    memcpy(text, word, len);
+    text[len] = '\0';
+    if (inet_pton(AF_INET, text, addr->addr) == 1)
+        addr->version = 4;
+    else if (inet_pton(AF_INET6, text, addr->addr) == 1)
+        addr->version = 6;
+    else
+        return false;
+    uint64_t max = addr->version == 4 ? 32 : 128;
+    uint64_t prefix = max;
+    if (slash){
+        const char *c = slash + 1;
+        if (!read_number(&c, max, false, &prefix) || *c)
+            return false;
+    }
+    addr->prefix = (uint8_t)prefix;
+    return true;
+}
+
+/** `any`, `[!]<port>`, `[!]<lo>:<hi>`, `<lo>:` or `:<hi>` */
+static bool parse_ports(const char *word, rule_ports *ports){
+    *ports = (rule_ports){.lo = 0, .hi = 65535};
+    if (*word == '!'){
+        ports->negated = 1;
+        word++;
+    }
+    if (strcmp(word, "any") == 0)
+        return !ports->negated;
+    uint64_t port;
+    if (*word != ':'){
+        if (!read_number(&word, 65535, false, &port))
+            return false;
+        ports->lo = (uint16_t)port;
+        if (!*word){
+            ports->hi = ports->lo;
+            return true;
+        }
+    }
+    if (*word++ != ':')
+        return false;
+    if (*word){
+        if (!read_number(&word, 65535, false, &port) || *word)
+            return false;
+        ports->hi = (uint16_t)port;
+    }
+    return ports->lo <= ports->hi;
+}
+
+/** past the value of an option we don't use, quotes can hide a ; */
+static const char *skip_value(const char *c){
+    bool quoted = false;
+    while (*c && (quoted || *c != ';')){
+        if (*c == '\\' && c[1])
+            c++;
+        else if (*c == '"')
+            quoted = !quoted;
+        c++;
+    }
+    return c;
+}
+
+static int parse_content(rule_parser *parser, rule_builder *builder, const char **c){
+    bool negated = **c == '!';
+    if (negated)
+        *c = skip_space(*c + 1);
+    if (**c != '"')
+        return parse_error(parser, "content must be quoted");
+    (*c)++;
+    u_char bytes[MATCHER_MAX_PATTERN];
+    int len = matcher_parse_content(c, bytes, sizeof(bytes));
+    if (len <= 0)
+        return parse_error(parser, "malformed or empty content");
+    if (parser->rule->check_count == RULE_MAX_CHECKS)
+        return parse_error(parser, "too many contents, byte tests and pcres in one rule");
+    rule_check *check = grow(builder->checks, builder->check_count, &builder->check_size, sizeof(rule_check));
+    int64_t at = pool_add(builder, bytes, (uint32_t)len);
+    if (!check || at < 0)
+        return parse_error(parser, "out of memory");
+    builder->checks = check;
+    check = &builder->checks[builder->check_count++];
+    *check = (rule_check){
+        .type = CHECK_CONTENT,
+        .flags = negated ? CHECK_NEGATED : 0,
+        .bytes = (uint32_t)at,
+        .len = (uint32_t)len
+    };
+    parser->rule->check_count++;
+    parser->last_content = builder->check_count - 1;
+    parser->absolute = false;
+    return 0;
+}
+
+/** offset, depth, distance and within, of the last content */
+static int parse_modifier(rule_parser *parser, rule_builder *builder, const char *key, const char **c){
+    if (parser->last_content < 0)
+        return parse_error(parser, "offset, depth, distance and within need a content before them");
+    rule_check *check = &builder->checks[parser->last_content];
+    bool relative = strcmp(key, "distance") == 0 || strcmp(key, "within") == 0;
+    // what was seen, not the values: offset:0 then distance:4 is a mix too
+    if (relative ? parser->absolute : !!(check->flags & CHECK_RELATIVE))
+        return parse_error(parser, "a content is either offset/depth or distance/within");
+    if (relative)
+        check->flags |= CHECK_RELATIVE;
+    else
+        parser->absolute = true;
+    if (strcmp(key, "offset") == 0 || strcmp(key, "distance") == 0){
+        if (!read_signed(c, &check->offset) || (!relative && check->offset < 0))
+            return parse_error(parser, "offset must be >= 0, distance a number");
+        return 0;
+    }
+    uint64_t depth;
+    if (!read_number(c, UINT32_MAX, false, &depth) || depth < check->len)
+        return parse_error(parser, "depth and within can't be shorter than their content");
+    check->depth = (uint32_t)depth;
+    return 0;
+}
+
+/** `byte_test:<bytes>,<op>,<value>,<offset>[,relative][,little|big]` */
+static int parse_byte_test(rule_parser *parser, rule_builder *builder, const char **c){
+    const char *usage = "byte_test:<1|2|4|8>,<op>,<value>,<offset>[,relative][,little|big]";
+    uint64_t size;
+    if (!read_number(c, 8, false, &size) || (size != 1 && size != 2 && size != 4 && size != 8))
+        return parse_error(parser, usage);
+    *c = skip_space(*c);
+    if (*(*c)++ != ',')
+        return parse_error(parser, usage);
+    *c = skip_space(*c);
+    char op = *(*c)++;
+    if (op == '!' && **c == '=')
+        (*c)++;
+    if (!op || !strchr("<>=!&", op))
+        return parse_error(parser, "byte_test operators are < > = ! &");
+    *c = skip_space(*c);
+    uint64_t value;
+    if (*(*c)++ != ',' || (*c = skip_space(*c), !read_number(c, UINT64_MAX, true, &value)))
+        return parse_error(parser, usage);
+    *c = skip_space(*c);
+    int32_t offset;
+    if (*(*c)++ != ',' || (*c = skip_space(*c), !read_signed(c, &offset)))
+        return parse_error(parser, usage);
+    uint8_t flags = 0;
+    while (*(*c = skip_space(*c)) == ','){
+        char word[RULE_WORD_MAX];
+        size_t len = 0;
+        *c = skip_space(*c + 1);
+        while (isalpha((unsigned char)**c) && len + 1 < sizeof(word))
+            word[len++] = *(*c)++;
+        word[len] = '\0';
+        if (strcmp(word, "relative") == 0)
+            flags |= CHECK_RELATIVE;
+        else if (strcmp(word, "little") == 0)
+            flags |= CHECK_LITTLE;
+        else if (strcmp(word, "big") != 0)
+            return parse_error(parser, usage);
+    }
+    if (!(flags & CHECK_RELATIVE) && offset < 0)
+        return parse_error(parser, "a byte_test offset must be >= 0 unless it's relative");
+    if (parser->rule->check_count == RULE_MAX_CHECKS)
+        return parse_error(parser, "too many contents, byte tests and pcres in one rule");
+    rule_check *check = grow(builder->checks, builder->check_count, &builder->check_size, sizeof(rule_check));
+    if (!check)
+        return parse_error(parser, "out of memory");
+    builder->checks = check;
+    builder->checks[builder->check_count++] = (rule_check){
+        .type = CHECK_BYTE_TEST,
+        .flags = flags,
+        .op = (uint8_t)op,
+        .size = (uint8_t)size,
+        .offset = offset,
+        .value = value
+    };
+    parser->rule->check_count++;
+    return 0;
+}
+
+/**
+ * `pcre:[!]"/<regex>/[ismR]"`, i s and m as in perl, R from the end of
+ * the last match. what regex.c can't do (back references, lookarounds,
+ * \b, ...) is an error, the rule isn't silently weaker
+ */
+static int parse_pcre(rule_parser *parser, rule_builder *builder, const char **c){
+    bool negated = **c == '!';
+    if (negated)
+        *c = skip_space(*c + 1);
+    if (**c != '"' || (*c)[1] != '/')
+        return parse_error(parser, "pcre must be quoted, \"/<regex>/<flags>\"");
+    const char *pattern = *c + 2, *end = pattern;
+    while (*end && *end != '"')
+        end += *end == '\\' && end[1] ? 2 : 1;
+    const char *slash = end;
+    while (slash > pattern && *slash != '/')
+        slash--;
+    if (!*end || *slash != '/')
+        return parse_error(parser, "pcre must be quoted, \"/<regex>/<flags>\"");
+    uint8_t flags = 0, check_flags = negated ? CHECK_NEGATED : 0;
+    for (const char *flag = slash + 1; flag < end; flag++){
+        if (*flag == 'i')
+            flags |= REGEX_NOCASE;
+        else if (*flag == 's')
+            flags |= REGEX_DOTALL;
+        else if (*flag == 'm')
+            flags |= REGEX_MULTILINE;
+        else if (*flag == 'R')
+            check_flags |= CHECK_RELATIVE;
+        else
+            return parse_error(parser, "the pcre flags are i, s, m and R");
+    }
+    *c = end + 1;
+    if (parser->rule->check_count == RULE_MAX_CHECKS)
+        return parse_error(parser, "too many contents, byte tests and pcres in one rule");
+    regex *compiled = INIT_REGEX(pattern, (uint32_t)(slash - pattern), flags);
+    if (!compiled)
+        return parse_error(parser, "malformed or unsupported pcre (see above)");
+    rule_check *check = grow(builder->checks, builder->check_count, &builder->check_size, sizeof(rule_check));
+    regex **regexes = grow(builder->regexes, builder->regex_count, &builder->regex_size, sizeof(regex *));
+    if (check)
+        builder->checks = check;
+    if (regexes)
+        builder->regexes = regexes;
+    if (!check || !regexes){
+        FREE_REGEX(compiled);
+        return parse_error(parser, "out of memory");
+    }
+    builder->checks[builder->check_count++] = (rule_check){
+        .type = CHECK_REGEX,
+        .flags = check_flags,
+        .len = compiled->size,
+        .value = builder->regex_count
+    };
+    builder->regexes[builder->regex_count++] = compiled;
+    parser->rule->check_count++;
+    return 0;
+}
+
+/** `flow:[established|not_established|stateless][,to_server|to_client|from_server|from_client]` */
+static int parse_flow(rule_parser *parser, const char **c){
+    while (true){
+        char word[RULE_WORD_MAX];
+        size_t len = 0;
+        *c = skip_space(*c);
+        while ((isalpha((unsigned char)**c) || **c == '_') && len + 1 < sizeof(word))
+            word[len++] = *(*c)++;
+        word[len] = '\0';
+        if (strcmp(word, "established") == 0)
+            parser->rule->flow |= RULE_ESTABLISHED;
+        else if (strcmp(word, "not_established") == 0)
+            parser->rule->flow |= RULE_NOT_ESTABLISHED;
+        else if (strcmp(word, "to_server") == 0 || strcmp(word, "from_client") == 0)
+            parser->rule->flow |= RULE_TO_SERVER;
+        else if (strcmp(word, "to_client") == 0 || strcmp(word, "from_server") == 0)
+            parser->rule->flow |= RULE_TO_CLIENT;
+        else if (strcmp(word, "stateless") != 0)
+            return parse_error(parser, "unknown flow keyword");
+        *c = skip_space(*c);
+        if (**c != ',')
+            break;
+        (*c)++;
+    }
+    uint8_t flow = parser->rule->flow;
+    if ((flow & RULE_ESTABLISHED && flow & RULE_NOT_ESTABLISHED) || (flow & RULE_TO_SERVER && flow & RULE_TO_CLIENT))
+        return parse_error(parser, "flow keywords contradict each other");
+    return 0;
+}
+
+/** the `(key:value; key; ...)` part, `c` is right after the ( */
+static int parse_options(rule_parser *parser, rule_builder *builder, const char *c){
+    while (true){
+        c = skip_space(c);
+        if (*c == ')'){
+            c = skip_space(c + 1);
+            if (*c)
+                return parse_error(parser, "text after the options");
+            break;
+        }
+        char key[RULE_WORD_MAX];
+        size_t len = 0;
+        while ((isalnum((unsigned char)*c) || *c == '_') && len + 1 < sizeof(key))
+            key[len++] = *c++;
+        key[len] = '\0';
+        if (!len)
+            return parse_error(parser, "expected an option or the closing )");
+        c = skip_space(c);
+        bool has_value = *c == ':';
+        if (has_value)
+            c = skip_space(c + 1);
+        int failed = 0;
+        uint64_t number;
+        if (strcmp(key, "nocase") == 0){
+            if (parser->last_content < 0)
+                return parse_error(parser, "nocase needs a content before it");
+            builder->checks[parser->last_content].flags |= CHECK_NOCASE;
+        }else if (!has_value){
+            return parse_error(parser, "option without a value");
+        }else if (strcmp(key, "msg") == 0){
+            char msg[RULE_MSG_MAX];
+            int msg_len = -1;
+            if (*c == '"'){
+                c++;
+                msg_len = matcher_parse_content(&c, (u_char *)msg, sizeof(msg) - 1);
+            }
+            if (msg_len < 0)
+                return parse_error(parser, "msg must be quoted and shorter than 256 bytes");
+            msg[msg_len] = '\0';
+            int64_t at = pool_add(builder, msg, (uint32_t)msg_len + 1);
+            if (at < 0)
+                return parse_error(parser, "out of memory");
+            parser->rule->msg = (uint32_t)at;
+        }else if (strcmp(key, "sid") == 0 || strcmp(key, "rev") == 0){
+            if (!read_number(&c, UINT32_MAX, false, &number))
+                return parse_error(parser, "sid and rev are numbers");
+            if (key[0] == 's'){
+                parser->rule->sid = (uint32_t)number;
+                parser->has_sid = true;
+            }else{
+                parser->rule->rev = (uint32_t)number;
+            }
+        }else if (strcmp(key, "content") == 0){
+            failed = parse_content(parser, builder, &c);
+        }else if (strcmp(key, "offset") == 0 || strcmp(key, "depth") == 0
+            || strcmp(key, "distance") == 0 || strcmp(key, "within") == 0){
+            failed = parse_modifier(parser, builder, key, &c);
+        }else if (strcmp(key, "byte_test") == 0){
+            failed = parse_byte_test(parser, builder, &c);
+        }else if (strcmp(key, "pcre") == 0){
+            failed = parse_pcre(parser, builder, &c);
+        }else if (strcmp(key, "flow") == 0){
+            failed = parse_flow(parser, &c);
+        }else if (strcmp(key, "classtype") == 0 || strcmp(key, "reference") == 0
+            || strcmp(key, "metadata") == 0 || strcmp(key, "priority") == 0 || strcmp(key, "gid") == 0){
+            c = skip_value(c);
+        }else{
+            char what[RULE_WORD_MAX + 32];
+            snprintf(what, sizeof(what), "unknown option <%s>", key);
+            return parse_error(parser, what);
+        }
+        if (failed)
+            return -1;
+        c = skip_space(c);
+        if (*c++ != ';')
+            return parse_error(parser, "expected ; after an option");
+    }
+    if (!parser->has_sid)
+        return parse_error(parser, "a rule needs a sid");
+    return 0;
+}
+
+/** `alert <proto> <src> <port> <-> or <>> <dst> <port> (<options>)` */
+static int parse_rule(rule_parser *parser, rule_builder *builder, const char *c){
+    rule *rule = parser->rule;
+    char word[RULE_WORD_MAX];
+    if (!next_word(&c, word, sizeof(word)) || strcmp(word, "alert") != 0)
+        return parse_error(parser, "a rule starts with alert");
+    if (!next_word(&c, word, sizeof(word)))
+        return parse_error(parser, "expected a protocol");
+    if (strcmp(word, "ip") == 0)
+        rule->proto = 0;
+    else if (strcmp(word, "tcp") == 0)
+        rule->proto = IPPROTO_TCP;
+    else if (strcmp(word, "udp") == 0)
+        rule->proto = IPPROTO_UDP;
+    else if (strcmp(word, "icmp") == 0)
+        rule->proto = IPPROTO_ICMP;
+    else
+        return parse_error(parser, "the protocol is ip, tcp, udp or icmp");
+    if (!next_word(&c, word, sizeof(word)) || !parse_addr(word, &rule->src))
+        return parse_error(parser, "bad source address, any or [!]<addr>[/<prefix>]");
+    if (!next_word(&c, word, sizeof(word)) || !parse_ports(word, &rule->src_ports))
+        return parse_error(parser, "bad source port, any, [!]<port> or [!]<lo>:<hi>");
+    if (!next_word(&c, word, sizeof(word)) || (strcmp(word, "->") != 0 && strcmp(word, "<>") != 0))
+        return parse_error(parser, "the direction is -> or <>");
+    rule->bidirectional = word[0] == '<';
+    if (!next_word(&c, word, sizeof(word)) || !parse_addr(word, &rule->dst))
+        return parse_error(parser, "bad destination address, any or [!]<addr>[/<prefix>]");
+    if (!next_word(&c, word, sizeof(word)) || !parse_ports(word, &rule->dst_ports))
+        return parse_error(parser, "bad destination port, any, [!]<port> or [!]<lo>:<hi>");
+    c = skip_space(c);
+    if (*c != '(')
+        return parse_error(parser, "expected the options in ( )");
+    return parse_options(parser, builder, c + 1);
+}
+
+// a group while compiling, the rules it has in ascending order
+typedef struct {
+    uint32_t *rules;
+    uint32_t count;
+    uint32_t hash;
+    matcher *fast;
+    uint32_t always_count;
+} group_build;
+
+typedef struct {
+    group_build *groups;
+    uint32_t count;
+    uint32_t size;
+    uint32_t *slots;            // open addressing on the hash, group index + 1
+} group_set;
+
+#define GROUP_SLOTS (1u << 18)  // twice the most groups there can be
+#define GROUP_MAX 65535         // indexes are 16 bit
+
+// ports a rule can see as the destination port of a packet
+typedef struct {
+    uint16_t lo;
+    uint16_t hi;
+} port_range;
+
+static int add_ports(const rule_ports *ports, port_range *ranges, int count){
+    if (!ports->negated){
+        ranges[count++] = (port_range){ports->lo, ports->hi};
+        return count;
+    }
+    if (ports->lo > 0)
+        ranges[count++] = (port_range){0, ports->lo - 1};
+    if (ports->hi < 65535)
+        ranges[count++] = (port_range){ports->hi + 1, 65535};
+    return count;
+}
+
+/** the destination ports of a rule, its source ports too when it's <> */
+static int rule_ranges(const rule *rule, port_range ranges[4]){
+    int count = add_ports(&rule->dst_ports, ranges, 0);
+    if (rule->bidirectional)
+        count = add_ports(&rule->src_ports, ranges, count);
+    return count;
+}
+
+static bool covers(const port_range *ranges, int count, uint32_t port){
+    for (int i = 0; i < count; i++)
+        if (port >= ranges[i].lo && port <= ranges[i].hi)
+            return true;
+    return false;
+}
+
+/**
+ * group_add: the group of exactly these rules, made when it's new
+ * ### return:
+ *  `int64_t`: its index
+ *  `-1`: out of memory, or more than GROUP_MAX groups
+ */
+static int64_t group_add(group_set *set, const uint32_t *rules, uint32_t count){
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < count; i++)
+        hash = (hash ^ rules[i]) * 16777619u;
+    uint32_t slot = hash & (GROUP_SLOTS - 1);
+    for (; set->slots[slot]; slot = (slot + 1) & (GROUP_SLOTS - 1)){
+        const group_build *group = &set->groups[set->slots[slot] - 1];
+        if (group->hash == hash && group->count == count && !memcmp(group->rules, rules, sizeof(uint32_t) * count))
+            return set->slots[slot] - 1;
+    }
+    if (set->count == GROUP_MAX){
+        printf("[x] the rules need more than %d port groups\n", GROUP_MAX);
+        return -1;
+    }
+    group_build *grown = grow(set->groups, set->count, &set->size, sizeof(group_build));
+    uint32_t *copy = malloc(sizeof(uint32_t) * (count ? count : 1));
+    if (!grown || !copy){
+        if (grown)
+            set->groups = grown;
+        free(copy);
+        printf("[x] can't allocate the port groups\n");
+        return -1;
+    }
+    set->groups = grown;
+    memcpy(copy, rules, sizeof(uint32_t) * count);
+    set->groups[set->count] = (group_build){.rules = copy, .count = count, .hash = hash};
+    set->slots[slot] = ++set->count;
+    return set->count - 1;
+}
+
+static bool proto_applies(const rule *rule, uint8_t proto){
+    return !rule->proto || rule->proto == proto;
+}
+
+/**
+ * split the rules in groups: every tcp and udp destination port gets the
+ * group of the rules that can match it (elementary intervals between the
+ * port boundaries of the rules have the same ones), icmp and the other
+ * protocols have no ports, theirs is port 0
+ */
+static int build_groups(const rule_builder *builder, group_set *set, uint16_t *port_groups,
+    uint16_t *icmp_group, uint16_t *other_group){
+    uint32_t count = builder->rule_count;
+    port_range *ranges = malloc(sizeof(port_range) * 4 * count);
+    int *range_counts = malloc(sizeof(int) * count);
+    uint32_t *members = malloc(sizeof(uint32_t) * count);
+    uint8_t *boundary = malloc(RULE_PORT_GROUPS + 1);
+    int failed = !ranges || !range_counts || !members || !boundary ? -1 : 0;
+    if (failed)
+        printf("[x] can't allocate the port groups\n");
+    for (uint32_t i = 0; !failed && i < count; i++)
+        range_counts[i] = rule_ranges(&builder->rules[i], &ranges[i * 4]);
+    // group 0 is the empty one
+    if (!failed && group_add(set, members, 0) < 0)
+        failed = -1;
+    static const uint8_t port_protos[2] = {IPPROTO_TCP, IPPROTO_UDP};
+    for (int p = 0; !failed && p < 2; p++){
+        memset(boundary, 0, RULE_PORT_GROUPS + 1);
+        boundary[0] = 1;
+        for (uint32_t i = 0; i < count; i++){
+            if (!proto_applies(&builder->rules[i], port_protos[p]))
+                continue;
+            for (int r = 0; r < range_counts[i]; r++){
+                boundary[ranges[i * 4 + r].lo] = 1;
+                boundary[ranges[i * 4 + r].hi + 1] = 1;
+            }
+        }
+        for (uint32_t port = 0; !failed && port < RULE_PORT_GROUPS;){
+            uint32_t end = port + 1;
+            while (end < RULE_PORT_GROUPS && !boundary[end])
+                end++;
+            uint32_t found = 0;
+            for (uint32_t i = 0; i < count; i++)
+                if (proto_applies(&builder->rules[i], port_protos[p]) && covers(&ranges[i * 4], range_counts[i], port))
+                    members[found++] = i;
+            int64_t group = group_add(set, members, found);
+            if (group < 0){
+                failed = -1;
+                break;
+            }
+            for (; port < end; port++)
+                port_groups[p * RULE_PORT_GROUPS + port] = (uint16_t)group;
+        }
+    }
+    for (int p = 0; !failed && p < 2; p++){
+        uint32_t found = 0;
+        for (uint32_t i = 0; i < count; i++){
+            bool applies = p == 0 ? proto_applies(&builder->rules[i], IPPROTO_ICMP) : !builder->rules[i].proto;
+            if (applies && covers(&ranges[i * 4], range_counts[i], 0))
+                members[found++] = i;
+        }
+        int64_t group = group_add(set, members, found);
+        if (group < 0)
+            failed = -1;
+        else
+            *(p == 0 ? icmp_group : other_group) = (uint16_t)group;
+    }
+    free(ranges);
+    free(range_counts);
+    free(members);
+    free(boundary);
+    return failed;
+}
+
+/** the matcher of the fast patterns of a group, the rules without content go first */
+static int build_group_matcher(const rule_builder *builder, group_build *group, matcher_pattern *patterns){
+    uint32_t *ordered = malloc(sizeof(uint32_t) * (group->count ? group->count : 1));
+    if (!ordered)
+        return -1;
+    uint32_t pattern_count = 0;
+    for (uint32_t i = 0; i < group->count; i++){
+        const rule *member = &builder->rules[group->rules[i]];
+        if (member->fast_pattern < 0){
+            ordered[group->always_count++] = group->rules[i];
+            continue;
+        }
+        const rule_check *check = &builder->checks[member->first_check + member->fast_pattern];
+        patterns[pattern_count++] = (matcher_pattern){
+            .bytes = builder->pool + check->bytes,
+            .len = check->len,
+            .id = group->rules[i],
+            .flags = check->flags & CHECK_NOCASE ? MATCHER_NOCASE : 0
+        };
+    }
+    memcpy(group->rules, ordered, sizeof(uint32_t) * group->always_count);
+    free(ordered);
+    if (!pattern_count)
+        return 0;
+    group->fast = INIT_MATCHER(patterns, pattern_count);
+    return group->fast ? 0 : -1;
+}
+
+/**
+ * lay the rules out in one image: header, rules, checks, groups, the
+ * indexes of the rules without content of every group, the port table,
+ * contents and messages, the regexes, then the matcher of every group 64
+ * byte aligned
+ */
+static rule_db *lay_out(rule_builder *builder){
+    group_set set = {0};
+    set.slots = calloc(GROUP_SLOTS, sizeof(uint32_t));
+    uint16_t *port_groups = malloc(sizeof(uint16_t) * 2 * RULE_PORT_GROUPS);
+    matcher_pattern *patterns = malloc(sizeof(matcher_pattern) * builder->rule_count);
+    uint16_t icmp_group = 0, other_group = 0;
+    rule_db *db = NULL;
+    bool failed = !set.slots || !port_groups || !patterns
+        || build_groups(builder, &set, port_groups, &icmp_group, &other_group) < 0;
+    for (uint32_t g = 0; !failed && g < set.count; g++)
+        failed = build_group_matcher(builder, &set.groups[g], patterns) < 0;
+
+    size_t rules_offset = (sizeof(rule_db) + 7) & ~(size_t)7;
+    size_t checks_offset = rules_offset + sizeof(rule) * builder->rule_count;
+    size_t groups_offset = checks_offset + sizeof(rule_check) * builder->check_count;
+    size_t always_offset = groups_offset + sizeof(rule_group) * set.count;
+    size_t size = always_offset;
+    for (uint32_t g = 0; g < set.count; g++)
+        size += sizeof(uint32_t) * set.groups[g].always_count;
+    size_t port_groups_offset = (size + 7) & ~(size_t)7;
+    size_t pool_offset = port_groups_offset + sizeof(uint16_t) * 2 * RULE_PORT_GROUPS;
+    size = pool_offset + builder->pool_len;
+    size_t regexes_offset = (size + 7) & ~(size_t)7;
+    size = regexes_offset;
+    for (uint32_t i = 0; i < builder->regex_count; i++)
+        size += (builder->regexes[i]->size + 7) & ~(size_t)7;
+    for (uint32_t g = 0; g < set.count; g++)
+        if (set.groups[g].fast)
+            size = ((size + 63) & ~(size_t)63) + set.groups[g].fast->size;
+    if (!failed && size > UINT32_MAX){
+        printf("[x] the rule db would be past 4GB\n");
+        failed = true;
+    }
+    if (!failed)
+        db = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (!failed && !db)
+        printf("[x] can't allocate the rule db\n");
+    if (db){
+        memset(db, 0, size);
+        *db = (rule_db){
+            .magic = RULE_DB_MAGIC,
+            .version = RULE_DB_VERSION,
+            .size = size,
+            .rule_count = builder->rule_count,
+            .rules_offset = (uint32_t)rules_offset,
+            .check_count = builder->check_count,
+            .checks_offset = (uint32_t)checks_offset,
+            .group_count = set.count,
+            .groups_offset = (uint32_t)groups_offset,
+            .port_groups_offset = (uint32_t)port_groups_offset,
+            .icmp_group = icmp_group,
+            .other_group = other_group,
+            .regex_count = builder->regex_count
+        };
+        u_char *base = (u_char *)db;
+        rule *rules = (rule *)(base + rules_offset);
+        for (uint32_t i = 0; i < builder->rule_count; i++){
+            rules[i] = builder->rules[i];
+            rules[i].msg += (uint32_t)pool_offset;
+        }
+        // the regexes are in the order of their checks
+        size_t regex_at = regexes_offset;
+        rule_check *checks = (rule_check *)(base + checks_offset);
+        for (uint32_t i = 0; i < builder->check_count; i++){
+            checks[i] = builder->checks[i];
+            if (checks[i].type == CHECK_CONTENT)
+                checks[i].bytes += (uint32_t)pool_offset;
+            if (checks[i].type != CHECK_REGEX)
+                continue;
+            checks[i].bytes = (uint32_t)regex_at;
+            memcpy(base + regex_at, builder->regexes[checks[i].value], checks[i].len);
+            regex_at += (checks[i].len + 7) & ~(size_t)7;
+        }
+        memcpy(base + port_groups_offset, port_groups, sizeof(uint16_t) * 2 * RULE_PORT_GROUPS);
+        memcpy(base + pool_offset, builder->pool, builder->pool_len);
+        rule_group *groups = (rule_group *)(base + groups_offset);
+        size_t always_at = always_offset;
+        size_t matcher_at = regex_at;
+        for (uint32_t g = 0; g < set.count; g++){
+            const group_build *group = &set.groups[g];
+            groups[g].always_count = group->always_count;
+            groups[g].always_offset = (uint32_t)always_at;
+            memcpy(base + always_at, group->rules, sizeof(uint32_t) * group->always_count);
+            always_at += sizeof(uint32_t) * group->always_count;
+            if (!group->fast)
+                continue;
+            matcher_at = (matcher_at + 63) & ~(size_t)63;
+            groups[g].pattern_count = group->fast->pattern_count;
+            groups[g].matcher_offset = (uint32_t)matcher_at;
+            memcpy(base + matcher_at, group->fast, group->fast->size);
+            matcher_at += group->fast->size;
+            db->pattern_count += group->fast->pattern_count;
+        }
+    }
+    for (uint32_t g = 0; g < set.count; g++){
+        free(set.groups[g].rules);
+        FREE_MATCHER(set.groups[g].fast);
+    }
+    free(set.groups);
+    free(set.slots);
+    free(port_groups);
+    free(patterns);
+    return db;
+}
+
+/**
+ * rule_compile: read a rule file into a rule db image, the fast pattern
+ * of a rule is its longest content that isn't negated
+ * ### return:
+ *  `rule_db *`: the image, free() it once written
+ *  `NULL`: can't read the file, a rule is malformed or there's none
+ */
+rule_db *rule_compile(const char *path){
+    FILE *file = fopen(path, "r");
+    if (!file){
+        printf("[x] can't open the rule file <%s>\n", path);
+        return NULL;
+    }
+    rule_builder builder = {0};
+    rule_parser parser = {.path = path};
+    char *line = NULL;
+    size_t line_size = 0;
+    bool failed = false;
+    // offset 0 of the pool is the message of the rules without one
+    if (pool_add(&builder, "", 1) < 0)
+        failed = true;
+    while (!failed && getline(&line, &line_size, file) >= 0){
+        parser.line++;
+        const char *c = skip_space(line);
+        if (!*c || *c == '#')
+            continue;
+        rule *grown = grow(builder.rules, builder.rule_count, &builder.rule_size, sizeof(rule));
+        if (!grown){
+            parse_error(&parser, "out of memory");
+            failed = true;
+            break;
+        }
+        builder.rules = grown;
+        rule *parsed = &builder.rules[builder.rule_count];
+        memset(parsed, 0, sizeof(rule));
+        parsed->first_check = builder.check_count;
+        parsed->fast_pattern = -1;
+        parser.rule = parsed;
+        parser.last_content = -1;
+        parser.absolute = false;
+        parser.has_sid = false;
+        if (parse_rule(&parser, &builder, c) < 0){
+            failed = true;
+            break;
+        }
+        uint32_t longest = 0;
+        bool has_regex = false;
+        for (int i = 0; i < parsed->check_count; i++){
+            const rule_check *check = &builder.checks[parsed->first_check + i];
+            has_regex |= check->type == CHECK_REGEX;
+            if (check->type == CHECK_CONTENT && !(check->flags & CHECK_NEGATED) && check->len > longest){
+                longest = check->len;
+                parsed->fast_pattern = i;
+            }
+        }
+        // a regex is only worth running on what the prefilter let through
+        if (has_regex && parsed->fast_pattern < 0){
+            parse_error(&parser, "a rule with a pcre needs a content too");
+            failed = true;
+            break;
+        }
+        builder.rule_count++;
+    }
+    free(line);
+    fclose(file);
+    rule_db *db = NULL;
+    if (!failed && !builder.rule_count)
+        printf("[x] no rules in <%s>\n", path);
+    else if (!failed)
+        db = lay_out(&builder);
+    for (uint32_t i = 0; i < builder.regex_count; i++)
+        FREE_REGEX(builder.regexes[i]);
+    free(builder.regexes);
+    free(builder.rules);
+    free(builder.checks);
+    free(builder.pool);
+    return db;
+}
+
+/**
+ * rule_db_write: write the image next to `path` and rename it over, a
+ * process that still maps the old file keeps its pages
+ * ### return:
+ *  `0`: written
+ *  `-1`: on error
+ */
+int rule_db_write(const rule_db *db, const char *path){
+    char temporary[4096];
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", path) >= (int)sizeof(temporary)){
+        printf("[x] the rule db path is too long\n");
+        return -1;
+    }
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        printf("[x] can't create <%s>\n", temporary);
+        return -1;
+    }
+    const u_char *bytes = (const u_char *)db;
+    size_t written = 0;
+    while (written < db->size){
+        ssize_t n = write(fd, bytes + written, db->size - written);
+        if (n <= 0)
+            break;
+        written += (size_t)n;
+    }
+    bool failed = written < db->size || fsync(fd) < 0;
+    // closed on every path, a failed fsync included
+    if (close(fd) < 0)
+        failed = true;
+    if (failed){
+        printf("[x] can't write the rule db <%s>\n", temporary);
+        unlink(temporary);
+        return -1;
+    }
+    if (rename(temporary, path) < 0){
+        printf("[x] can't rename <%s> to <%s>\n", temporary, path);
+        unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * INIT_RULE_DB: map a compiled rule db read only, before the fork so
+ * every worker reads the same pages
+ * ### return:
+ *  `rule_db *`: if successful
+ *  `NULL`: can't map it, or it's not a rule db of this version
+ */
+const rule_db *INIT_RULE_DB(const char *path){
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        printf("[x] can't open the rule db <%s>\n", path);
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(rule_db)){
+        printf("[x] <%s> is not a rule db\n", path);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        printf("[x] can't map the rule db <%s>\n", path);
+        return NULL;
+    }
+    const rule_db *db = map;
+    uint64_t size = (uint64_t)info.st_size;
+    bool valid = db->magic == RULE_DB_MAGIC && db->version == RULE_DB_VERSION && db->size == size
+        && db->rules_offset + (uint64_t)db->rule_count * sizeof(rule) <= size
+        && db->checks_offset + (uint64_t)db->check_count * sizeof(rule_check) <= size
+        && db->groups_offset + (uint64_t)db->group_count * sizeof(rule_group) <= size
+        && db->port_groups_offset + (uint64_t)sizeof(uint16_t) * 2 * RULE_PORT_GROUPS <= size
+        && db->icmp_group < db->group_count && db->other_group < db->group_count;
+    const uint16_t *port_groups = (const uint16_t *)((const u_char *)db + db->port_groups_offset);
+    for (uint32_t i = 0; valid && i < 2 * RULE_PORT_GROUPS; i++)
+        valid = port_groups[i] < db->group_count;
+    for (uint32_t g = 0; valid && g < db->group_count; g++){
+        const rule_group *group = rule_db_group(db, (uint16_t)g);
+        valid = group->always_offset + (uint64_t)group->always_count * sizeof(uint32_t) <= size
+            && group->matcher_offset % 64 == 0
+            && (!group->matcher_offset || (group->matcher_offset + (uint64_t)sizeof(matcher) <= size
+                && group->matcher_offset + (uint64_t)rule_group_matcher(db, group)->size <= size));
+    }
+    // a worker follows the nodes of a regex without looking, they have to be in it
+    const rule_check *checks = (const rule_check *)((const u_char *)db + db->checks_offset);
+    for (uint32_t i = 0; valid && i < db->check_count; i++){
+        if (checks[i].type != CHECK_REGEX)
+            continue;
+        const regex *re = (const regex *)((const u_char *)db + checks[i].bytes);
+        valid = checks[i].value < db->regex_count && checks[i].bytes % 8 == 0
+            && checks[i].bytes + (uint64_t)sizeof(regex) <= size && checks[i].bytes + (uint64_t)re->size <= size
+            && re->node_count <= REGEX_MAX_NODES && re->class_count <= 256
+            && re->nodes_offset + (uint64_t)re->node_count * sizeof(regex_node) <= re->size
+            && re->sets_offset + (uint64_t)re->set_count * 32 <= re->size
+            && (re->start == REGEX_NONE || re->start < re->node_count)
+            && (re->start_anchored == REGEX_NONE || re->start_anchored < re->node_count);
+        const regex_node *nodes = valid ? (const regex_node *)((const u_char *)re + re->nodes_offset) : NULL;
+        for (uint32_t n = 0; valid && n < re->node_count; n++)
+            valid = (nodes[n].type != REGEX_SET || (nodes[n].set < re->set_count && nodes[n].out < re->node_count))
+                && (nodes[n].type != REGEX_SPLIT || (nodes[n].out < re->node_count && nodes[n].out2 < re->node_count));
+        for (uint32_t b = 0; valid && b < 256; b++)
+            valid = re->classes[b] < re->class_count;
+    }
+    if (!valid){
+        printf("[x] <%s> is not a rule db of version %d\n", path, RULE_DB_VERSION);
+        munmap(map, (size_t)size);
+        return NULL;
+    }
+    return db;
+}
+
+void FREE_RULE_DB(const rule_db *db){
+    if (db)
+        munmap((void *)db, (size_t)db->size);
+}
+
+static bool addr_match(const rule_addr *rule, uint8_t version, const uint8_t *addr){
+    if (!rule->version)
+        return true;
+    bool in = rule->version == version;
+    int i = 0;
+    uint8_t bits = rule->prefix;
+    for (; in && bits >= 8; i++, bits -= 8)
+        in = rule->addr[i] == addr[i];
+    if (in && bits)
+        in = ((rule->addr[i] ^ addr[i]) & (uint8_t)(0xff << (8 - bits))) == 0;
+    return in != rule->negated;
+}
+
+static inline bool ports_match(const rule_ports *ports, uint16_t port){
+    bool in = port >= ports->lo && port <= ports->hi;
+    return in != ports->negated;
+}
+
+static bool endpoints_match(const rule *rule, uint8_t version, const uint8_t *src, const uint8_t *dst,
+    uint16_t src_port, uint16_t dst_port){
+    return ports_match(&rule->src_ports, src_port) && ports_match(&rule->dst_ports, dst_port)
+        && addr_match(&rule->src, version, src) && addr_match(&rule->dst, version, dst);
+}
+
+/** first position of `bytes` in [from, to) of the payload */
+static int64_t find(const u_char *data, int64_t from, int64_t to, const u_char *bytes, uint32_t len, bool nocase){
+    if (to - from < len)
+        return -1;
+    if (!nocase){
+        const u_char *at = memmem(data + from, (size_t)(to - from), bytes, len);
+        return at ? at - data : -1;
+    }
+    uint8_t first = lower(bytes[0]);
+    for (int64_t i = from; i + len <= to; i++){
+        if (lower(data[i]) != first)
+            continue;
+        uint32_t n = 1;
+        while (n < len && lower(data[i + n]) == lower(bytes[n]))
+            n++;
+        if (n == len)
+            return i;
+    }
+    return -1;
+}
+
+static bool byte_test(const rule_check *check, const rule_packet *packet, int64_t cursor){
+    int64_t at = (check->flags & CHECK_RELATIVE ? cursor : packet->start) + check->offset;
+    if (at < 0 || at + check->size > packet->len)
+        return false;
+    uint64_t value = 0;
+    for (int i = 0; i < check->size; i++){
+        int from = check->flags & CHECK_LITTLE ? check->size - 1 - i : i;
+        value = value << 8 | packet->data[at + from];
+    }
+    switch (check->op){
+        case '<': return value < check->value;
+        case '>': return value > check->value;
+        case '=': return value == check->value;
+        case '!': return value != check->value;
+        default: return (value & check->value) != 0;
+    }
+}
+
+/**
+ * the first match of a pcre, from the cursor when it's relative. a search
+ * is linear in the payload but still the dearest check, it costs budget
+ */
+static bool regex_check(const rule_db *db, const rule_check *check, const rule_packet *packet,
+    int64_t *cursor, regex_scratch *scratch, int *budget){
+    // ^ anchors where the search starts, the chunk of a stream and not the
+    // tail of the previous one before it
+    int64_t from = check->flags & CHECK_RELATIVE ? *cursor : packet->start;
+    if (--*budget < 0 || from > packet->len)
+        return false;
+    const regex *re = (const regex *)((const u_char *)db + check->bytes);
+    regex_match match;
+    bool found = regex_search(scratch, (uint32_t)check->value, re, packet->data, (uint32_t)from, packet->len, &match);
+    if (check->flags & CHECK_NEGATED)
+        return !found;
+    if (!found)
+        return false;
+    *cursor = match.end;
+    scratch->match = match;
+    scratch->matched = true;
+    return true;
+}
+
+/** no content or regex match after check `i`, where it ends is where the rule does */
+static bool last_match(const rule_check *checks, int count, int i){
+    for (int next = i + 1; next < count; next++)
+        if (checks[next].type != CHECK_BYTE_TEST && !(checks[next].flags & CHECK_NEGATED))
+            return false;
+    return true;
+}
+
+/**
+ * match the checks from `i` on, the cursor is where the last content
+ * or regex match ended. a content that is followed by a relative check is
+ * tried at its next positions too when the rest doesn't match, `budget`
+ * keeps a hostile payload from making that quadratic
+ */
+static bool match_checks(const rule_db *db, const rule_check *checks, int count, int i,
+    const rule_packet *packet, int64_t cursor, regex_scratch *scratch, int *budget){
+    // a match that ends in the tail of the previous chunk was the previous
+    // chunk's, it alerted there already
+    if (i == count)
+        return !packet->start || cursor > packet->start;
+    const rule_check *check = &checks[i];
+    if (check->type == CHECK_BYTE_TEST)
+        return byte_test(check, packet, cursor)
+            && match_checks(db, checks, count, i + 1, packet, cursor, scratch, budget);
+    if (check->type == CHECK_REGEX)
+        return regex_check(db, check, packet, &cursor, scratch, budget)
+            && match_checks(db, checks, count, i + 1, packet, cursor, scratch, budget);
+    // an absolute content without offset and depth is looked for in the
+    // tail of the previous chunk too, one cut across the chunks is found
+    int64_t start = check->flags & CHECK_RELATIVE ? cursor + check->offset
+        : check->offset || check->depth ? packet->start + check->offset : 0;
+    // the last match of the rule has to end in the chunk, that one is only
+    // looked for from where it would
+    if (!(check->flags & CHECK_RELATIVE) && packet->start && last_match(checks, count, i)
+        && start < (int64_t)packet->start - check->len + 1)
+        start = (int64_t)packet->start - check->len + 1;
+    int64_t end = check->depth ? start + check->depth : packet->len;
+    if (end > packet->len)
+        end = packet->len;
+    if (start < 0)
+        start = 0;
+    const u_char *bytes = (const u_char *)db + check->bytes;
+    bool nocase = check->flags & CHECK_NOCASE;
+    if (check->flags & CHECK_NEGATED)
+        return find(packet->data, start, end, bytes, check->len, nocase) < 0
+            && match_checks(db, checks, count, i + 1, packet, cursor, scratch, budget);
+    bool retry = i + 1 < count && checks[i + 1].flags & CHECK_RELATIVE;
+    int64_t at;
+    while (--*budget >= 0 && (at = find(packet->data, start, end, bytes, check->len, nocase)) >= 0){
+        if (match_checks(db, checks, count, i + 1, packet, at + check->len, scratch, budget))
+            return true;
+        if (!retry)
+            break;
+        start = at + 1;
+    }
+    return false;
+}
+
+/**
+ * rule_match: does a packet (or a chunk of a stream) match a rule, its
+ * header, its flow and then its contents, byte tests and pcres in order.
+ * `scratch` runs the pcres (NULL when the db has none), it says where the
+ * last one matched
+ */
+bool rule_match(const rule_db *db, const rule *rule, const rule_packet *packet, regex_scratch *scratch){
+    if (scratch)
+        scratch->matched = false;
+    if (rule->proto && rule->proto != packet->proto
+        && !(rule->proto == IPPROTO_ICMP && packet->proto == IPPROTO_ICMPV6))
+        return false;
+    if (rule->flow){
+        bool established = packet->flow_state >= FLOW_ESTABLISHED && packet->flow_state <= FLOW_CLOSING;
+        if (rule->flow & RULE_ESTABLISHED && !established)
+            return false;
+        if (rule->flow & RULE_NOT_ESTABLISHED && established)
+            return false;
+        if (rule->flow & (RULE_TO_SERVER | RULE_TO_CLIENT)){
+            int wanted = rule->flow & RULE_TO_SERVER ? FLOW_TO_SERVER : FLOW_TO_CLIENT;
+            if (!packet->flow_state || packet->direction != wanted)
+                return false;
+        }
+    }
+    if (!endpoints_match(rule, packet->version, packet->src, packet->dst, packet->src_port, packet->dst_port)
+        && !(rule->bidirectional
+            && endpoints_match(rule, packet->version, packet->dst, packet->src, packet->dst_port, packet->src_port)))
+        return false;
+    const rule_check *checks = (const rule_check *)((const u_char *)db + db->checks_offset) + rule->first_check;
+    int budget = RULE_MATCH_BUDGET;
+    return match_checks(db, checks, rule->check_count, 0, packet, 0, scratch, &budget);
+}
@@ -0,0 +1,223 @@
+#include "../detect.h"
+#include <ctype.h>
+
+/**
+ * TEST :
+ * random pattern sets, some nocase, over a small mixed case alphabet
+ * scanned on random payloads: every hit must be one a naive search
+ * finds and none missing, for the payload whole and cut in random
+ * chunks with the state carried over, and through the batch scan. a
+ * folded matcher can't check a case sensitive pattern that started in an
+ * earlier chunk, it reports it on the folded bytes alone: that extra hit
+ * is expected, nothing else. a large set needs 32 bit transitions
+ */
+#define RANDOM_SETS 2000
+#define PAYLOADS 10
+#define MAX_PATTERNS 16
+#define MAX_PAYLOAD 256
+#define MAX_HITS (MAX_PATTERNS * MAX_PAYLOAD + 64)
+#define WIDE_PATTERNS 400
+#define WIDE_LEN 100
+
+static int errors = 0;
+
+typedef struct{
+    u_char bytes[MATCHER_MAX_PATTERN];
+    uint32_t len;
+    uint8_t flags;
+}pattern_text;
+
+static pattern_text texts[WIDE_PATTERNS];
+static matcher_pattern patterns[WIDE_PATTERNS];
+
+static bool same_bytes(const u_char *a, const u_char *b, uint32_t len, bool nocase){
+    for (uint32_t k = 0; k < len; k++)
+        if (nocase ? tolower(a[k]) != tolower(b[k]) : a[k] != b[k])
+            return false;
+    return true;
+}
+
+/**
+ * the hits a naive search gives, the payload cut at `cuts` (chunk starts).
+ * with `folded`, a case sensitive pattern that starts before the chunk
+ * it ends in is compared without case, as the matcher documents
+ */
+static uint32_t naive(uint32_t count, const u_char *data, uint32_t len, const uint32_t *cuts, uint32_t cut_count,
+    bool folded, matcher_hit *hits){
+    uint32_t found = 0, chunk = 0;
+    for (uint32_t end = 1; end <= len; end++){
+        while (chunk + 1 < cut_count && cuts[chunk + 1] < end)
+            chunk++;
+        for (uint32_t p = 0; p < count; p++){
+            uint32_t plen = texts[p].len;
+            if (plen > end)
+                continue;
+            bool nocase = (texts[p].flags & MATCHER_NOCASE) || (folded && end - plen < cuts[chunk]);
+            if (same_bytes(data + end - plen, texts[p].bytes, plen, nocase))
+                hits[found++] = (matcher_hit){p, 0, end};
+        }
+    }
+    return found;
+}
+
+static int by_end(const void *a, const void *b){
+    const matcher_hit *x = a, *y = b;
+    if (x->end != y->end)
+        return x->end < y->end ? -1 : 1;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static void compare(matcher_hit *got, uint32_t got_count, matcher_hit *expected, uint32_t expected_count,
+    const char *what, int set){
+    qsort(got, got_count, sizeof(matcher_hit), by_end);
+    qsort(expected, expected_count, sizeof(matcher_hit), by_end);
+    bool equal = got_count == expected_count;
+    for (uint32_t k = 0; equal && k < got_count; k++)
+        equal = got[k].id == expected[k].id && got[k].end == expected[k].end;
+    if (!equal){
+        printf("[x] set %d %s: %u hits, expected %u\n", set, what, got_count, expected_count);
+        errors++;
+    }
+}
+
+/** scan `data` cut at `cuts` with the state carried over, ends made absolute */
+static uint32_t scan_chunks(const matcher *matcher, const u_char *data, uint32_t len, const uint32_t *cuts,
+    uint32_t cut_count, matcher_hit *hits){
+    uint32_t state = 0, found = 0;
+    for (uint32_t c = 0; c < cut_count; c++){
+        uint32_t from = cuts[c], to = c + 1 < cut_count ? cuts[c + 1] : len;
+        uint32_t chunk_found = matcher_scan(matcher, data + from, to - from, &state, hits + found, MAX_HITS - found, 0);
+        for (uint32_t k = found; k < found + chunk_found; k++)
+            hits[k].end += from;
+        found += chunk_found;
+    }
+    return found;
+}
+
+static void check_payload(const matcher *matcher, uint32_t count, const u_char *data, uint32_t len, int set){
+    static matcher_hit got[MAX_HITS], expected[MAX_HITS];
+    uint32_t whole = 0;
+    uint32_t got_count = matcher_scan(matcher, data, len, NULL, got, MAX_HITS, 0);
+    compare(got, got_count, expected, naive(count, data, len, &whole, 1, false, expected), "whole", set);
+
+    // random cuts, chunks of 0 bytes included
+    uint32_t cuts[8] = {0};
+    uint32_t cut_count = 1 + (uint32_t)rand() % 7;
+    for (uint32_t c = 1; c < cut_count; c++)
+        cuts[c] = cuts[c - 1] + (uint32_t)rand() % (len - cuts[c - 1] + 1);
+    got_count = scan_chunks(matcher, data, len, cuts, cut_count, got);
+    compare(got, got_count, expected, naive(count, data, len, cuts, cut_count, matcher->folded, expected), "in chunks", set);
+
+    // the same chunks through the batch scan, one state for the stream
+    matcher_input inputs[8];
+    uint32_t state = 0;
+    for (uint32_t c = 0; c < cut_count; c++){
+        uint32_t to = c + 1 < cut_count ? cuts[c + 1] : len;
+        inputs[c] = (matcher_input){data + cuts[c], to - cuts[c], &state};
+    }
+    got_count = matcher_scan_batch(matcher, inputs, cut_count, got, MAX_HITS);
+    for (uint32_t k = 0; k < got_count; k++)
+        got[k].end += cuts[got[k].input];
+    compare(got, got_count, expected, naive(count, data, len, cuts, cut_count, matcher->folded, expected), "batch", set);
+}
+
+static matcher *build(uint32_t count){
+    for (uint32_t p = 0; p < count; p++)
+        patterns[p] = (matcher_pattern){texts[p].bytes, texts[p].len, p, texts[p].flags};
+    return INIT_MATCHER(patterns, count);
+}
+
+int main(void){
+    srand(21);
+    static u_char data[MAX_PAYLOAD];
+    for (int set = 0; set < RANDOM_SETS && errors < 10; set++){
+        // a narrow alphabet for many overlaps, sometimes one starting byte
+        // (memchr), sometimes every byte starts one (no prefilter at all)
+        const char *alphabet = (const char *[]){"abAB", "abcdABCD", "aAbBxyz"}[set % 3];
+        uint32_t letters = (uint32_t)strlen(alphabet);
+        uint32_t count = 1 + (uint32_t)rand() % MAX_PATTERNS;
+        bool any_nocase = rand() % 2;
+        for (uint32_t p = 0; p < count; p++){
+            texts[p].len = 1 + (uint32_t)rand() % 6;
+            for (uint32_t k = 0; k < texts[p].len; k++)
+                texts[p].bytes[k] = (u_char)alphabet[rand() % letters];
+            if (set % 5 == 0)
+                texts[p].bytes[0] = 'a';
+            texts[p].flags = any_nocase && rand() % 2 ? MATCHER_NOCASE : 0;
+        }
+        matcher *matcher = build(count);
+        if (!matcher){
+            printf("[x] can't build set %d\n", set);
+            errors++;
+            continue;
+        }
+        for (int i = 0; i < PAYLOADS; i++){
+            uint32_t len = (uint32_t)rand() % MAX_PAYLOAD;
+            for (uint32_t k = 0; k < len; k++)
+                data[k] = (u_char)alphabet[rand() % letters];
+            check_payload(matcher, count, data, len, set);
+        }
+        FREE_MATCHER(matcher);
+    }
+
+    // the extra hit itself: "XYZ" is case sensitive next to a nocase
+    // pattern, "xy|z" can't be told from "XY|Z" once the chunk is gone
+    texts[0] = (pattern_text){"abc", 3, MATCHER_NOCASE};
+    texts[1] = (pattern_text){"XYZ", 3, 0};
+    matcher *matcher = build(2);
+    if (!matcher){
+        printf("[x] can't build the folded matcher\n");
+        return 1;
+    }
+    matcher_hit hits[4];
+    uint32_t state = 0;
+    uint32_t found = matcher_scan(matcher, (const u_char *)"xyz", 3, NULL, hits, 4, 0);
+    if (found){
+        printf("[x] xyz matched XYZ in one chunk\n");
+        errors++;
+    }
+    matcher_scan(matcher, (const u_char *)"xy", 2, &state, hits, 4, 0);
+    found = matcher_scan(matcher, (const u_char *)"z", 1, &state, hits, 4, 0);
+    if (found != 1 || hits[0].id != 1 || hits[0].end != 1){
+        printf("[x] xy|z: %u hits, expected the extra XYZ\n", found);
+        errors++;
+    }
+    state = 0;
+    matcher_scan(matcher, (const u_char *)"xY", 2, &state, hits, 4, 0);
+    found = matcher_scan(matcher, (const u_char *)"Zab", 3, &state, hits, 4, 0);
+    if (found != 1 || hits[0].id != 1){
+        printf("[x] xY|Zab: %u hits, expected the extra XYZ alone\n", found);
+        errors++;
+    }
+    FREE_MATCHER(matcher);
+
+    // enough long random patterns for more than 2^15 states
+    for (uint32_t p = 0; p < WIDE_PATTERNS; p++){
+        texts[p].len = WIDE_LEN;
+        for (uint32_t k = 0; k < WIDE_LEN; k++)
+            texts[p].bytes[k] = (u_char)('a' + rand() % 26);
+        texts[p].flags = 0;
+    }
+    matcher = build(WIDE_PATTERNS);
+    if (!matcher || !matcher->wide){
+        printf("[x] the large set isn't on 32 bit transitions\n");
+        return 1;
+    }
+    for (int i = 0; i < PAYLOADS; i++){
+        // some patterns planted whole, some cut by the chunks
+        uint32_t len = MAX_PAYLOAD;
+        for (uint32_t k = 0; k < len; k++)
+            data[k] = (u_char)('a' + rand() % 26);
+        uint32_t p = (uint32_t)rand() % WIDE_PATTERNS;
+        memcpy(data + rand() % (len - WIDE_LEN), texts[p].bytes, WIDE_LEN);
+        check_payload(matcher, WIDE_PATTERNS, data, len, -1);
+    }
+    FREE_MATCHER(matcher);
+
+    if (errors){
+        printf("[x] %d errors\n", errors);
+        return 1;
+    }
+    printf("[+] matcher ok\n");
+    return 0;
+}
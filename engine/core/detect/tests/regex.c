@@ -0,0 +1,218 @@
+#include "../detect.h"
+#include <regex.h>
+#include <time.h>
+
+/**
+ * TEST :
+ * random regexes over a two letter alphabet searched on random payloads
+ * from random positions: the match and its offsets must be the leftmost
+ * longest one posix regexec gives. fixed cases for anchors, flags, classes
+ * and escapes, malformed regexes must not compile. a regex whose dfa
+ * outgrows the cache on every payload must still give the offsets the
+ * nfa alone gives (and the known ones), the cache starting over, and the
+ * classic catastrophic ones must stay linear on a long payload
+ */
+#define RANDOM_REGEXES 3000
+#define SEARCHES 20
+#define CACHE_PAYLOAD (1 << 16)
+#define CACHE_ROUNDS 50
+#define LONG_PAYLOAD (1 << 20)
+
+static char pattern[256];
+static int pattern_len;
+
+static void random_regex(int depth){
+    switch (rand() % (depth > 3 ? 3 : 9)){
+        case 0: pattern[pattern_len++] = "ab"[rand() % 2]; break;
+        case 1: pattern_len += sprintf(pattern + pattern_len, "[ab]"); break;
+        case 2: pattern[pattern_len++] = '.'; break;
+        case 3:
+            pattern[pattern_len++] = '(';
+            random_regex(depth + 1);
+            pattern[pattern_len++] = '|';
+            random_regex(depth + 1);
+            pattern[pattern_len++] = ')';
+            break;
+        case 4: random_regex(depth + 1); random_regex(depth + 1); break;
+        default:
+            pattern[pattern_len++] = '(';
+            random_regex(depth + 1);
+            pattern_len += sprintf(pattern + pattern_len, ")%s", (const char *[]){"*", "+", "?", "{0,2}"}[rand() % 4]);
+            break;
+    }
+}
+
+typedef struct{
+    const char *pattern;
+    uint8_t flags;
+    const char *data;
+    int start;                          // -1 for no match
+    int end;
+}test_case;
+
+static const test_case cases[] = {
+    {"^abc", 0, "abcabc", 0, 3},
+    {"^abc", 0, "xabc", -1, -1},
+    {"abc$", 0, "abcabc", 3, 6},
+    {"ab|abcd|c", 0, "xabcd", 1, 5},
+    {"x\\s*", 0, "x   y", 0, 4},
+    {"a.*b", 0, "aXbXb", 0, 5},
+    {"abc$", 0, "abc\nx", -1, -1},
+    {"abc$", REGEX_MULTILINE, "abc\nx", 0, 3},
+    {"^x", REGEX_MULTILINE, "abc\nx", 4, 5},
+    {"ABC", REGEX_NOCASE, "xxabc", 2, 5},
+    {"a.c", 0, "a\nc", -1, -1},
+    {"a.c", REGEX_DOTALL, "a\nc", 0, 3},
+    {"\\d{3}-\\d{4}", 0, "call 555-1234 now", 5, 13},
+    {"[^a-z]+", 0, "abc123", 3, 6},
+    {"\\x41\\x42", 0, "zAB", 1, 3},
+    {"(?:ab)+c", 0, "ababc", 0, 5},
+    {"a|^b", 0, "cb", -1, -1},
+    {"a|^b", 0, "bc", 0, 1},
+    {"user=\\w+", 0, "GET /?user=root&x", 6, 15},
+};
+
+static const char *malformed[] = {"a)", "(a", "[a", "a{2,1}", "\\b", "a$b", "*", "a{1001}", "(a$)*"};
+
+static bool same(bool found, const regex_match *match, int start, int end){
+    return found == (start >= 0) && (!found || ((int)match->start == start && (int)match->end == end));
+}
+
+int main(void){
+    srand(11);
+    int errors = 0;
+    regex_scratch *scratch = INIT_REGEX_SCRATCH(1);
+    if (!scratch){
+        printf("[x] can't allocate the scratch\n");
+        return 1;
+    }
+    for (int i = 0; i < RANDOM_REGEXES && errors < 10; i++){
+        pattern_len = 0;
+        random_regex(0);
+        pattern[pattern_len] = 0;
+        regex *re = INIT_REGEX(pattern, (uint32_t)pattern_len, 0);
+        regex_t reference;
+        if (!re || regcomp(&reference, pattern, REG_EXTENDED)){
+            printf("[x] can't compile /%s/\n", pattern);
+            FREE_REGEX(re);
+            errors++;
+            continue;
+        }
+        // every regex has its own dfa, the cache starts empty
+        FREE_REGEX_SCRATCH(scratch);
+        scratch = INIT_REGEX_SCRATCH(1);
+        for (int s = 0; s < SEARCHES; s++){
+            char data[32];
+            int len = rand() % 16;
+            for (int k = 0; k < len; k++)
+                data[k] = "abc"[rand() % 3];
+            data[len] = 0;
+            uint32_t from = (uint32_t)(rand() % (len + 1));
+            int start = -1, end = -1;
+            regmatch_t expected;
+            if (!regexec(&reference, data + from, 1, &expected, 0)){
+                start = (int)from + expected.rm_so;
+                end = (int)from + expected.rm_eo;
+            }
+            regex_match match;
+            bool found = regex_search(scratch, 0, re, (const u_char *)data, from, (uint32_t)len, &match);
+            if (!same(found, &match, start, end)){
+                printf("[x] /%s/ on \"%s\" from %u: [%d,%d), expected [%d,%d)\n", pattern, data, from,
+                    found ? (int)match.start : -1, found ? (int)match.end : -1, start, end);
+                errors++;
+            }
+        }
+        regfree(&reference);
+        FREE_REGEX(re);
+    }
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+        const test_case *test = &cases[i];
+        regex *re = INIT_REGEX(test->pattern, (uint32_t)strlen(test->pattern), test->flags);
+        FREE_REGEX_SCRATCH(scratch);
+        scratch = INIT_REGEX_SCRATCH(1);
+        regex_match match;
+        bool found = re && regex_search(scratch, 0, re, (const u_char *)test->data, 0, (uint32_t)strlen(test->data), &match);
+        if (!re || !same(found, &match, test->start, test->end)){
+            printf("[x] /%s/ on case %zu: [%d,%d), expected [%d,%d)\n", test->pattern, i,
+                found ? (int)match.start : -1, found ? (int)match.end : -1, test->start, test->end);
+            errors++;
+        }
+        FREE_REGEX(re);
+    }
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++){
+        regex *re = INIT_REGEX(malformed[i], (uint32_t)strlen(malformed[i]), 0);
+        if (re){
+            printf("[x] compiled /%s/\n", malformed[i]);
+            FREE_REGEX(re);
+            errors++;
+        }
+    }
+
+    // 2^13 states and more, far past the cache: a search fills it and
+    // finishes on the nfa, the next one starts it over. the only c has an a
+    // 13 bytes before it, the match runs from the start of the payload to it
+    const char *wide = "[ab]*a[ab]{12}c";
+    regex *re = INIT_REGEX(wide, (uint32_t)strlen(wide), 0);
+    FREE_REGEX_SCRATCH(scratch);
+    scratch = INIT_REGEX_SCRATCH(1);
+    u_char *data = malloc(LONG_PAYLOAD);
+    if (!re || !scratch || !data){
+        printf("[x] can't set the cache test up\n");
+        return 1;
+    }
+    for (int round = 0; round < CACHE_ROUNDS; round++){
+        for (uint32_t k = 0; k < CACHE_PAYLOAD; k++)
+            data[k] = "ab"[rand() % 2];
+        uint32_t at = 13 + (uint32_t)rand() % (CACHE_PAYLOAD - 13);
+        data[at - 13] = 'a';
+        data[at] = 'c';
+        regex_match cached, nfa;
+        bool found = regex_search(scratch, 0, re, data, 0, CACHE_PAYLOAD, &cached);
+        // past the count of the scratch, no dfa at all
+        bool found_nfa = regex_search(scratch, 1, re, data, 0, CACHE_PAYLOAD, &nfa);
+        if (!same(found, &cached, 0, (int)at + 1) || !same(found_nfa, &nfa, 0, (int)at + 1)){
+            printf("[x] %s round %d: [%d,%d) and [%d,%d) on the nfa, expected [0,%u)\n", wide, round,
+                found ? (int)cached.start : -1, found ? (int)cached.end : -1,
+                found_nfa ? (int)nfa.start : -1, found_nfa ? (int)nfa.end : -1, at + 1);
+            errors++;
+        }
+    }
+    if (!scratch->stats.flushes || !scratch->stats.nfa_searches){
+        printf("[x] the cache never filled: %lu flushes, %lu nfa searches\n",
+            (unsigned long)scratch->stats.flushes, (unsigned long)scratch->stats.nfa_searches);
+        errors++;
+    }
+    FREE_REGEX(re);
+
+    // a long run of a with one b at the end, what backtracking chokes on
+    const char *catastrophic[] = {"(a*)*b", "(a|a)*b", "(a|aa)*b", "(a+a+)+b"};
+    memset(data, 'a', LONG_PAYLOAD);
+    data[LONG_PAYLOAD - 1] = 'b';
+    for (size_t i = 0; i < sizeof(catastrophic) / sizeof(catastrophic[0]); i++){
+        re = INIT_REGEX(catastrophic[i], (uint32_t)strlen(catastrophic[i]), 0);
+        FREE_REGEX_SCRATCH(scratch);
+        scratch = INIT_REGEX_SCRATCH(1);
+        struct timespec before, after;
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        regex_match match;
+        bool found = re && regex_search(scratch, 0, re, data, 0, LONG_PAYLOAD, &match);
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        double seconds = (double)(after.tv_sec - before.tv_sec) + (double)(after.tv_nsec - before.tv_nsec) / 1e9;
+        if (!same(found, &match, 0, LONG_PAYLOAD) || seconds > 2.0){
+            printf("[x] /%s/ on 1MB of a: [%d,%d) in %.2fs\n", catastrophic[i],
+                found ? (int)match.start : -1, found ? (int)match.end : -1, seconds);
+            errors++;
+        }
+        FREE_REGEX(re);
+    }
+    free(data);
+    FREE_REGEX_SCRATCH(scratch);
+
+    if (errors){
+        printf("[x] %d errors\n", errors);
+        return 1;
+    }
+    printf("[+] regex ok\n");
+    return 0;
+}
@@ -0,0 +1,212 @@
+#include "../detect.h"
+#include <arpa/inet.h>
+
+/**
+ * TEST :
+ * a rule file compiled, written and mapped back, each rule matched
+ * against crafted payloads: header and flow, offset and depth, relative
+ * contents and their retries, negated ones, byte tests of every size,
+ * order and operator, absolute and relative. a relative chain past the
+ * budget of tries must give up, the same chain within it must match.
+ * rules mixing offset/depth with distance/within (either way round) and
+ * other malformed rules must not compile
+ */
+#define RULES_PATH "/tmp/rules_test.rules"
+#define DB_PATH "/tmp/rules_test.db"
+
+static const char *rules_text =
+    "# test rules\n"
+    "alert tcp any any -> any 80 (msg:\"get admin\"; content:\"GET \"; depth:4; content:\"/admin\"; distance:0; within:32; sid:1; rev:2;)\n"
+    "alert tcp any any -> 10.0.0.0/8 any (msg:\"nocase ua\"; content:\"user-agent: evil\"; nocase; flow:established,to_server; sid:2;)\n"
+    "alert udp any 5000 <> any 53 (msg:\"dns big id\"; byte_test:2,>,0x8000,0; sid:3;)\n"
+    "alert ip any any -> any any (msg:\"negated\"; content:\"abc\"; content:!\"xyz\"; sid:4;)\n"
+    "alert tcp any any -> !10.0.0.0/8 any (msg:\"chain\"; content:\"a\"; content:\"b\"; distance:0; within:1; content:\"c\"; distance:0; within:1; sid:5;)\n"
+    "alert tcp any 1024: -> any :100 (msg:\"little\"; content:\"LEN\"; byte_test:2,=,258,0,relative,little; sid:6;)\n"
+    "alert tcp any any -> any 80 (msg:\"offset\"; content:\"key=\"; offset:2; depth:8; content:\"x\"; distance:2; sid:7;)\n"
+    "alert tcp any any -> any 80 (msg:\"flags\"; content:\"HDR\"; byte_test:1,&,0x80,3; byte_test:4,!,0,1,relative; byte_test:8,<,0x100,5,relative; sid:8; classtype:foo; reference:url,\"x;y\";)\n";
+
+typedef struct{
+    uint32_t sid;
+    const char *payload;
+    uint32_t len;
+    const char *dst;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t flow_state;
+    uint8_t direction;
+    bool expected;
+}test_case;
+
+#define CASE(sid, payload, ...) {sid, payload, sizeof(payload) - 1, __VA_ARGS__}
+
+static const test_case cases[] = {
+    CASE(1, "GET /x/admin HTTP", "2.2.2.2", 5000, 80, 0, 0, true),
+    CASE(1, "GET /x/admin HTTP", "2.2.2.2", 5000, 81, 0, 0, false),
+    CASE(1, " GET /admin", "2.2.2.2", 5000, 80, 0, 0, false),
+    CASE(1, "GET /0123456789012345678901234567890123/admin", "2.2.2.2", 5000, 80, 0, 0, false),
+    CASE(2, "xx USER-AGENT: EVIL", "10.2.2.2", 5000, 80, FLOW_ESTABLISHED, FLOW_TO_SERVER, true),
+    CASE(2, "xx USER-AGENT: EVIL", "11.2.2.2", 5000, 80, FLOW_ESTABLISHED, FLOW_TO_SERVER, false),
+    CASE(2, "xx USER-AGENT: EVIL", "10.2.2.2", 5000, 80, FLOW_SYN_SENT, FLOW_TO_SERVER, false),
+    CASE(2, "xx USER-AGENT: EVIL", "10.2.2.2", 5000, 80, FLOW_ESTABLISHED, FLOW_TO_CLIENT, false),
+    CASE(2, "xx USER-AGENT: EVIL", "10.2.2.2", 5000, 80, 0, 0, false),
+    // <> takes both ways round
+    CASE(3, "\x90\x01", "2.2.2.2", 53, 5000, 0, 0, true),
+    CASE(3, "\x90\x01", "2.2.2.2", 5000, 53, 0, 0, true),
+    CASE(3, "\x10\x01", "2.2.2.2", 53, 5000, 0, 0, false),
+    CASE(3, "\x90\x01", "2.2.2.2", 54, 5000, 0, 0, false),
+    CASE(3, "\x90", "2.2.2.2", 53, 5000, 0, 0, false),
+    CASE(4, "abc", "2.2.2.2", 1, 2, 0, 0, true),
+    CASE(4, "abcxyz", "2.2.2.2", 1, 2, 0, 0, false),
+    // the first a and ab aren't the ones the chain matches on
+    CASE(5, "aab_abx_abc", "2.2.2.2", 1, 2, 0, 0, true),
+    CASE(5, "aab_abx_ab c", "2.2.2.2", 1, 2, 0, 0, false),
+    CASE(5, "abc", "10.2.2.2", 1, 2, 0, 0, false),
+    CASE(6, "xLEN\x02\x01", "2.2.2.2", 2000, 80, 0, 0, true),
+    CASE(6, "xLEN\x02\x01", "2.2.2.2", 1000, 80, 0, 0, false),
+    CASE(6, "xLEN\x01\x02", "2.2.2.2", 2000, 80, 0, 0, false),
+    CASE(6, "xLEN\x02", "2.2.2.2", 2000, 80, 0, 0, false),
+    CASE(7, "..key=..x", "2.2.2.2", 1, 80, 0, 0, true),
+    CASE(7, "key=..x", "2.2.2.2", 1, 80, 0, 0, false),
+    CASE(7, "........key=..x", "2.2.2.2", 1, 80, 0, 0, false),
+    CASE(7, "..key=.x", "2.2.2.2", 1, 80, 0, 0, false),
+    CASE(7, "..key=.x.x", "2.2.2.2", 1, 80, 0, 0, true),
+    CASE(8, "HDR\x80\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00\xff", "2.2.2.2", 1, 80, 0, 0, true),
+    CASE(8, "HDR\x7f\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00\xff", "2.2.2.2", 1, 80, 0, 0, false),
+    CASE(8, "HDR\x80\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xff", "2.2.2.2", 1, 80, 0, 0, false),
+    CASE(8, "HDR\x80\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x01\x00", "2.2.2.2", 1, 80, 0, 0, false),
+    CASE(8, "HDR\x80\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00", "2.2.2.2", 1, 80, 0, 0, false),
+};
+
+static const char *malformed[] = {
+    "alert tcp any any -> any 80 (content:\"a\"; offset:1; distance:1; sid:1;)",
+    "alert tcp any any -> any 80 (content:\"a\"; distance:0; depth:3; sid:1;)",
+    "alert tcp any any -> any 80 (content:\"a\"; within:3; offset:0; sid:1;)",
+    "alert tcp any any -> any 80 (content:\"abcd\"; depth:3; sid:1;)",
+    "alert tcp any any -> any 80 (offset:1; content:\"a\"; sid:1;)",
+    "alert tcp any any -> any 80 (nocase; content:\"a\"; sid:1;)",
+    "alert tcp any any -> any 80 (content:\"a\";)",
+    "alert tcp any any -> any 80 (content:\"\"; sid:1;)",
+    "alert tcp any any -> any 80 (pcre:\"/a/\"; sid:1;)",
+    "alert tcp any any -> any 80 (byte_test:2,~,1,0; sid:1;)",
+    "alert tcp any any -> any 80 (byte_test:3,=,1,0; sid:1;)",
+    "alert tcp any any -> any 80 (byte_test:2,=,1,-1; sid:1;)",
+    "alert tcp any any -> any 80 (flow:to_server,to_client; sid:1;)",
+    "alert tcp any any -> any 80 (sid:1; msg:\"a\")",
+    "alert tcp any any -> any 65536 (sid:1;)",
+    "alert tcp any any -> 10.0.0.0/33 any (sid:1;)",
+    "alert sctp any any -> any any (sid:1;)",
+    "drop tcp any any -> any any (sid:1;)",
+};
+
+// modifiers that go together
+static const char *accepted[] = {
+    "alert tcp any any -> any 80 (content:\"a\"; offset:1; depth:3; sid:1;)",
+    "alert tcp any any -> any 80 (content:\"a\"; distance:1; within:3; sid:1;)",
+    "alert tcp any any -> any 80 (content:\"a\"; depth:3; content:\"b\"; distance:0; within:1; sid:1;)",
+};
+
+static const rule *by_sid(const rule_db *db, uint32_t sid){
+    for (uint32_t i = 0; i < db->rule_count; i++)
+        if (rule_db_rules(db)[i].sid == sid)
+            return &rule_db_rules(db)[i];
+    return NULL;
+}
+
+static bool matches(const rule_db *db, uint32_t sid, const u_char *payload, uint32_t len, const char *dst,
+    uint16_t src_port, uint16_t dst_port, uint8_t flow_state, uint8_t direction){
+    uint8_t src_addr[16] = {1, 1, 1, 1}, dst_addr[16] = {0};
+    inet_pton(AF_INET, dst, dst_addr);
+    rule_packet packet = {
+        .data = payload,
+        .len = len,
+        .version = 4,
+        .proto = sid == 3 ? IPPROTO_UDP : IPPROTO_TCP,
+        .flow_state = flow_state,
+        .direction = direction,
+        .src = src_addr,
+        .dst = dst_addr,
+        .src_port = src_port,
+        .dst_port = dst_port
+    };
+    return rule_match(db, by_sid(db, sid), &packet, NULL);
+}
+
+static rule_db *compile_text(const char *text){
+    FILE *file = fopen(RULES_PATH, "w");
+    if (!file)
+        return NULL;
+    fprintf(file, "%s\n", text);
+    fclose(file);
+    return rule_compile(RULES_PATH);
+}
+
+int main(void){
+    int errors = 0;
+    rule_db *compiled = compile_text(rules_text);
+    if (!compiled || rule_db_write(compiled, DB_PATH) < 0){
+        printf("[x] can't compile the rules\n");
+        return 1;
+    }
+    free(compiled);
+    const rule_db *db = INIT_RULE_DB(DB_PATH);
+    if (!db || db->rule_count != 8){
+        printf("[x] can't map the compiled rules\n");
+        return 1;
+    }
+    const rule *first = by_sid(db, 1);
+    if (strcmp(rule_msg(db, first), "get admin") || first->rev != 2){
+        printf("[x] sid 1 lost its msg or rev\n");
+        errors++;
+    }
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+        const test_case *test = &cases[i];
+        bool found = matches(db, test->sid, (const u_char *)test->payload, test->len, test->dst,
+            test->src_port, test->dst_port, test->flow_state, test->direction);
+        if (found != test->expected){
+            printf("[x] sid %u on case %zu: %s, expected %s\n", test->sid, i,
+                found ? "match" : "no match", test->expected ? "match" : "no match");
+            errors++;
+        }
+    }
+
+    // "ab" over and over before the "abc": each one is a try of the chain
+    static u_char chain[4096];
+    for (int pairs = 50; pairs <= 1000; pairs += 950){
+        uint32_t len = 0;
+        for (int i = 0; i < pairs; i++, len += 2)
+            memcpy(chain + len, "ab", 2);
+        memcpy(chain + len, "abc", 3);
+        bool found = matches(db, 5, chain, len + 3, "2.2.2.2", 1, 2, 0, 0);
+        if (found != (pairs < RULE_MATCH_BUDGET)){
+            printf("[x] chain after %d tries: %s\n", pairs, found ? "matched past the budget" : "not matched");
+            errors++;
+        }
+    }
+    FREE_RULE_DB(db);
+
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++){
+        compiled = compile_text(malformed[i]);
+        if (compiled){
+            printf("[x] compiled %s\n", malformed[i]);
+            free(compiled);
+            errors++;
+        }
+    }
+    for (size_t i = 0; i < sizeof(accepted) / sizeof(accepted[0]); i++){
+        compiled = compile_text(accepted[i]);
+        if (!compiled){
+            printf("[x] didn't compile %s\n", accepted[i]);
+            errors++;
+        }
+        free(compiled);
+    }
+    unlink(RULES_PATH);
+    unlink(DB_PATH);
+
+    if (errors){
+        printf("[x] %d errors\n", errors);
+        return 1;
+    }
+    printf("[+] rules ok\n");
+    return 0;
+}
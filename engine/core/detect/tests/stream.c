@@ -0,0 +1,175 @@
+#include "../detect.h"
+#include "../../../helpers/helpers.h"
+#include <arpa/inet.h>
+
+/**
+ * TEST :
+ * a tcp flow through the flow table, the stream reassembly and the
+ * detector, the client request cut across segments: a rule whose fast
+ * pattern is cut in two, and one whose first content is, must each alert
+ * once. a rule anchored with depth still counts from the start of a later
+ * chunk, the tail of the previous one before it doesn't move it (nor the
+ * ^ of a pcre), a request with the pieces in the wrong order must not
+ * alert and neither must a match left whole in the tail, again. a content
+ * repeated in the next chunk alerts again
+ */
+#define RULES_PATH "/tmp/detect_stream_test.rules"
+#define DB_PATH "/tmp/detect_stream_test.db"
+
+static const char *rules_text =
+    "alert tcp any any -> any 80 (msg:\"admin\"; flow:established,to_server; content:\"GET \"; content:\"/admin\"; distance:0; sid:1;)\n"
+    "alert tcp any any -> any 80 (msg:\"login\"; content:\"POST\"; depth:4; content:\"/login\"; distance:1; within:6; sid:2;)\n"
+    "alert tcp any any -> any 80 (msg:\"user\"; content:\"USER\"; pcre:\"/^USER \\w+/\"; sid:3;)\n"
+    "alert tcp any any -> any 80 (msg:\"one content\"; content:\"/etc/passwd\"; sid:4;)\n";
+
+static uint32_t client_seq = 1000, server_seq = 5000;
+static int errors = 0;
+
+static uint16_t checksum(const uint8_t *bytes, int len){
+    uint32_t sum = 0;
+    for (int i = 0; i < len; i += 2)
+        sum += (uint32_t)(bytes[i] << 8 | bytes[i + 1]);
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+/** one ipv4 tcp segment 10.0.0.1:40000 <-> 10.0.0.2:80, the sequence of its side moves on */
+static uint32_t segment(uint8_t *frame, bool from_client, uint8_t flags, const char *data){
+    uint32_t len = (uint32_t)strlen(data);
+    memset(frame, 0, 54);
+    frame[12] = 0x08;
+    uint8_t *ip = frame + 14, *tcp = frame + 34;
+    ip[0] = 0x45;
+    uint16_t total = htons((uint16_t)(40 + len));
+    memcpy(ip + 2, &total, 2);
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    uint8_t client[4] = {10, 0, 0, 1}, server[4] = {10, 0, 0, 2};
+    memcpy(ip + 12, from_client ? client : server, 4);
+    memcpy(ip + 16, from_client ? server : client, 4);
+    uint16_t sum = htons(checksum(ip, 20));
+    memcpy(ip + 10, &sum, 2);
+    uint16_t ports[2] = {htons(40000), htons(80)};
+    memcpy(tcp, &ports[from_client ? 0 : 1], 2);
+    memcpy(tcp + 2, &ports[from_client ? 1 : 0], 2);
+    uint32_t *seq = from_client ? &client_seq : &server_seq;
+    uint32_t seq_be = htonl(*seq), ack_be = htonl(from_client ? server_seq : client_seq);
+    memcpy(tcp + 4, &seq_be, 4);
+    memcpy(tcp + 8, &ack_be, 4);
+    tcp[12] = 5 << 4;
+    tcp[13] = flags;
+    tcp[14] = 0xff;
+    memcpy(frame + 54, data, len);
+    *seq += len + (flags & 0x03 ? 1 : 0);
+    return 54 + len;
+}
+
+static void push(flow_table *flows, stream_table *streams, detector *detector, bool from_client, uint8_t flags, const char *data){
+    static uint8_t frame[1600];
+    static uint64_t now_ns = 1000000000ULL;
+    uint32_t len = segment(frame, from_client, flags, data);
+    packet_meta meta;
+    decode_packet(frame, len, now_ns, &meta);
+    int direction;
+    flow_entry *flow = flow_track(flows, &meta, now_ns, &direction);
+    now_ns += 1000000;
+    if (!flow){
+        printf("[x] segment not tracked\n");
+        errors++;
+        return;
+    }
+    if (meta.payload_len)
+        stream_push(streams, flow, direction, frame, &meta, false);
+    detect_packet(detector, &meta, frame, flow, direction, false, false);
+    stream_batch_end(streams);
+    detect_batch_end(detector);
+}
+
+static void expect(const detector *detector, uint64_t alerts, const char *what){
+    if (detector->stats.alerts != alerts){
+        printf("[x] %s: %lu alerts, expected %lu\n", what, (unsigned long)detector->stats.alerts, (unsigned long)alerts);
+        errors++;
+    }
+}
+
+int main(void){
+    FILE *file = fopen(RULES_PATH, "w");
+    if (!file){
+        printf("[x] can't write %s\n", RULES_PATH);
+        return 1;
+    }
+    fputs(rules_text, file);
+    fclose(file);
+    rule_db *compiled = rule_compile(RULES_PATH);
+    if (!compiled || rule_db_write(compiled, DB_PATH) < 0){
+        printf("[x] can't compile the rules\n");
+        return 1;
+    }
+    free(compiled);
+    const rule_db *rules = INIT_RULE_DB(DB_PATH);
+    timer_wheel *timers = INIT_TIMER_WHEEL(1000000ULL);
+    flow_config flow_settings = {.enabled = true, .max_flows = 64, .timeout_new_ms = 30000,
+        .timeout_established_ms = 300000, .timeout_closed_ms = 10000};
+    stream_config stream_settings = {.enabled = true, .flow_buffer_kb = 64, .memory_kb = 1024};
+    flow_table *flows = timers ? INIT_FLOW_TABLE(&flow_settings, timers) : NULL;
+    stream_table *streams = flows ? INIT_STREAMS(&stream_settings, flows) : NULL;
+    detector *detector = rules && streams ? INIT_DETECTOR(rules, streams) : NULL;
+    if (!detector){
+        printf("[x] can't set the detector up\n");
+        return 1;
+    }
+
+    push(flows, streams, detector, true, 0x02, "");
+    push(flows, streams, detector, false, 0x12, "");
+    push(flows, streams, detector, true, 0x10, "");
+    // the fast pattern cut in two
+    push(flows, streams, detector, true, 0x18, "GET /ad");
+    expect(detector, 0, "half a request");
+    push(flows, streams, detector, true, 0x18, "min HTTP/1.0\r\n\r\n");
+    expect(detector, 1, "GET /ad|min");
+    push(flows, streams, detector, false, 0x18, "HTTP/1.0 403 Forbidden\r\n\r\n");
+    // the first content cut in two, the fast pattern whole in the next chunk
+    push(flows, streams, detector, true, 0x18, "GE");
+    push(flows, streams, detector, true, 0x18, "T /admin HTTP/1.0\r\n\r\n");
+    expect(detector, 2, "GE|T /admin");
+    // depth counts from the start of the chunk, not of the tail before it
+    push(flows, streams, detector, true, 0x18, "POST /login HTTP/1.0\r\n\r\n");
+    expect(detector, 3, "POST /login in a later chunk");
+    push(flows, streams, detector, true, 0x18, "xPOST /login HTTP/1.0\r\n\r\n");
+    expect(detector, 3, "POST past its depth");
+    // the pieces the other way round
+    push(flows, streams, detector, true, 0x18, "/adm");
+    push(flows, streams, detector, true, 0x18, "in GET ");
+    expect(detector, 3, "/adm|in GET ");
+    // a match kept whole in the tail alerted with its own chunk already
+    push(flows, streams, detector, true, 0x18, "GET /admin");
+    expect(detector, 4, "GET /admin");
+    push(flows, streams, detector, true, 0x18, "/admin");
+    expect(detector, 4, "GET /admin|/admin");
+    // ^ is the start of the chunk, not of the tail before it
+    push(flows, streams, detector, true, 0x18, "USER root\r\n");
+    expect(detector, 5, "^USER in a later chunk");
+    push(flows, streams, detector, true, 0x18, "x USER root\r\n");
+    expect(detector, 5, "USER past the ^");
+    // a content seen again in the chunk is a match of its own
+    push(flows, streams, detector, true, 0x18, "cat /etc/passwd");
+    expect(detector, 6, "/etc/passwd");
+    push(flows, streams, detector, true, 0x18, "/etc/passwd");
+    expect(detector, 7, "/etc/passwd|/etc/passwd");
+
+    FREE_DETECTOR(detector);
+    FREE_STREAMS(streams);
+    FREE_FLOW_TABLE(flows);
+    FREE_TIMER_WHEEL(timers);
+    FREE_RULE_DB(rules);
+    unlink(RULES_PATH);
+    unlink(DB_PATH);
+
+    if (errors){
+        printf("[x] %d errors\n", errors);
+        return 1;
+    }
+    printf("[+] detect stream ok\n");
+    return 0;
+}
@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "xxhash.h"
+#include "./flow.h"
+#include "../capture/protocols/read.h"
+
+/**
+ * ipv4/ipv6 fragment reassembly, one table per worker.
+ * everything is allocated once in INIT_DEFRAG: the datagram slots, the
+ * hash buckets and the fragment storage (memory_kb cut in chunks), so a
+ * fragment flood can't make us allocate, when something runs out the
+ * least recently touched datagram is evicted to make room, datagrams
+ * left waiting too long are dropped by their timer on the worker's wheel.
+ * fragments are kept as pieces in arrival order, overlaps are only
+ * resolved when the datagram is complete: the pieces are written in
+ * arrival order (last wins) or in reverse (first wins)
+ */
+
+#define DEFRAG_HASH_SEED 0xF7
+
+typedef struct {
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint32_t id;
+    uint8_t proto;
+    uint8_t version;
+    uint8_t pad[2];
+} defrag_key;
+
+static uint32_t key_bucket(defrag_table *table, const defrag_key *key){
+    return (uint32_t)XXH64(key, sizeof(defrag_key), DEFRAG_HASH_SEED) & table->bucket_mask;
+}
+
+static void datagram_key(const defrag_datagram *datagram, defrag_key *key){
+    memset(key, 0, sizeof(defrag_key));
+    memcpy(key->src, datagram->src, 16);
+    memcpy(key->dst, datagram->dst, 16);
+    key->id = datagram->id;
+    key->proto = datagram->proto;
+    key->version = datagram->version;
+}
+
+static inline uint8_t *chunk_at(defrag_table *table, uint32_t chunk){
+    return table->chunks + (size_t)chunk * DEFRAG_CHUNK_SIZE;
+}
+
+static void lru_unlink(defrag_table *table, uint32_t index){
+    defrag_datagram *datagram = &table->datagrams[index];
+    if (datagram->lru_prev != DEFRAG_NONE)
+        table->datagrams[datagram->lru_prev].lru_next = datagram->lru_next;
+    else
+        table->lru_head = datagram->lru_next;
+    if (datagram->lru_next != DEFRAG_NONE)
+        table->datagrams[datagram->lru_next].lru_prev = datagram->lru_prev;
+    else
+        table->lru_tail = datagram->lru_prev;
+}
+
+static void lru_push_head(defrag_table *table, uint32_t index){
+    defrag_datagram *datagram = &table->datagrams[index];
+    datagram->lru_prev = DEFRAG_NONE;
+    datagram->lru_next = table->lru_head;
+    if (table->lru_head != DEFRAG_NONE)
+        table->datagrams[table->lru_head].lru_prev = index;
+    else
+        table->lru_tail = index;
+    table->lru_head = index;
+}
+
+/**
+ * give the chunks of a datagram back and put its slot on the free list
+ */
+static void release_datagram(defrag_table *table, uint32_t index){
+    defrag_datagram *datagram = &table->datagrams[index];
+    for (int i = 0; i < datagram->piece_count; i++)
+        table->free_chunks[table->free_chunk_count++] = datagram->pieces[i].chunk;
+    if (datagram->header_chunk != DEFRAG_NONE)
+        table->free_chunks[table->free_chunk_count++] = datagram->header_chunk;
+
+    defrag_key key;
+    datagram_key(datagram, &key);
+    uint32_t *link = &table->buckets[key_bucket(table, &key)];
+    while (*link != index)
+        link = &table->datagrams[*link].hash_next;
+    *link = datagram->hash_next;
+
+    lru_unlink(table, index);
+    timer_cancel(table->timers, &datagram->timer);
+    datagram->in_use = false;
+    datagram->hash_next = table->free_datagram;
+    table->free_datagram = index;
+}
+
+/**
+ * evict the least recently touched datagram that isn't `keep`
+ * ### return:
+ *  `false`: there was nothing else to evict
+ */
+static bool evict_one(defrag_table *table, uint32_t keep){
+    uint32_t victim = table->lru_tail;
+    if (victim == keep && victim != DEFRAG_NONE)
+        victim = table->datagrams[victim].lru_prev;
+    if (victim == DEFRAG_NONE)
+        return false;
+    release_datagram(table, victim);
+    table->stats.evictions++;
+    return true;
+}
+
+/**
+ * a free chunk for datagram `keep`, evicting others if we're out
+ * ### return:
+ *  `uint32_t`: the chunk
+ *  `DEFRAG_NONE`: `keep` alone holds the whole storage
+ */
+static uint32_t alloc_chunk(defrag_table *table, uint32_t keep){
+    while (table->free_chunk_count == 0){
+        if (!evict_one(table, keep))
+            return DEFRAG_NONE;
+    }
+    return table->free_chunks[--table->free_chunk_count];
+}
+
+static uint32_t find_datagram(defrag_table *table, const defrag_key *key, uint32_t bucket){
+    uint32_t index = table->buckets[bucket];
+    while (index != DEFRAG_NONE){
+        defrag_datagram *datagram = &table->datagrams[index];
+        if (datagram->id == key->id && datagram->proto == key->proto &&
+            datagram->version == key->version &&
+            memcmp(datagram->src, key->src, 16) == 0 && memcmp(datagram->dst, key->dst, 16) == 0)
+            return index;
+        index = datagram->hash_next;
+    }
+    return DEFRAG_NONE;
+}
+
+/** the timer of a datagram went off, dropped if nothing came for too long */
+static void datagram_timeout(timer_entry *timer, void *ctx, uint64_t now_ns){
+    defrag_table *table = ctx;
+    defrag_datagram *datagram = (defrag_datagram *)((char *)timer - offsetof(defrag_datagram, timer));
+    uint64_t deadline_ns = datagram->last_ns + table->timeout_ns;
+    if (deadline_ns <= now_ns){
+        release_datagram(table, (uint32_t)(datagram - table->datagrams));
+        table->stats.timeouts++;
+        return;
+    }
+    timer_add(table->timers, timer, deadline_ns, datagram_timeout, table);
+}
+
+static uint32_t new_datagram(defrag_table *table, const defrag_key *key, uint32_t bucket, uint64_t now_ns){
+    if (table->free_datagram == DEFRAG_NONE)
+        evict_one(table, DEFRAG_NONE);
+    uint32_t index = table->free_datagram;
+    defrag_datagram *datagram = &table->datagrams[index];
+    table->free_datagram = datagram->hash_next;
+
+    memcpy(datagram->src, key->src, 16);
+    memcpy(datagram->dst, key->dst, 16);
+    datagram->id = key->id;
+    datagram->proto = key->proto;
+    datagram->version = key->version;
+    datagram->piece_count = 0;
+    datagram->last_seen = false;
+    datagram->in_use = true;
+    datagram->total = 0;
+    datagram->first_ns = now_ns;
+    datagram->header_chunk = DEFRAG_NONE;
+    datagram->header_len = 0;
+    datagram->l3_offset = 0;
+    // the eviction above may have emptied this very bucket
+    datagram->hash_next = table->buckets[bucket];
+    table->buckets[bucket] = index;
+    lru_push_head(table, index);
+    timer_start(table->timers, now_ns);
+    timer_add(table->timers, &datagram->timer, now_ns + table->timeout_ns, datagram_timeout, table);
+    return index;
+}
+
+/**
+ * are all the bytes in [0, total) there, pieces can overlap
+ */
+static bool datagram_complete(const defrag_datagram *datagram){
+    if (!datagram->last_seen || datagram->header_chunk == DEFRAG_NONE)
+        return false;
+    // insertion sort by offset, there are at most DEFRAG_MAX_PIECES
+    defrag_piece sorted[DEFRAG_MAX_PIECES];
+    int count = datagram->piece_count;
+    for (int i = 0; i < count; i++){
+        defrag_piece piece = datagram->pieces[i];
+        int j = i;
+        while (j > 0 && sorted[j - 1].offset > piece.offset){
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = piece;
+    }
+    uint32_t covered = 0;
+    for (int i = 0; i < count; i++){
+        if (sorted[i].offset > covered)
+            return false;
+        uint32_t end = (uint32_t)sorted[i].offset + sorted[i].len;
+        if (end > covered)
+            covered = end;
+    }
+    return covered >= datagram->total;
+}
+
+static uint16_t ipv4_checksum(const uint8_t *header, int len){
+    uint32_t sum = 0;
+    for (int i = 0; i < len; i += 2)
+        sum += (uint32_t)(header[i] << 8 | header[i + 1]);
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+/**
+ * what the length field of the ip header would say with `header` bytes
+ * from the start of it and `payload` bytes of fragment data after them,
+ * it has to fit 16 bits
+ */
+static inline uint32_t ip_length(uint8_t version, uint32_t header, uint32_t payload){
+    return version == 4 ? header + payload : header - 40 + payload;
+}
+
+/**
+ * write the whole packet in table->out: headers of the first fragment,
+ * then the pieces in the order the policy wants, then fix the ip header
+ * so it no longer looks like a fragment
+ * ### return:
+ *  `int`: length of the frame
+ */
+static int assemble(defrag_table *table, defrag_datagram *datagram){
+    uint8_t *out = table->out;
+    uint8_t *payload = out + datagram->header_len;
+    memcpy(out, chunk_at(table, datagram->header_chunk), datagram->header_len);
+    int count = datagram->piece_count;
+    for (int n = 0; n < count; n++){
+        int i = table->config.policy == DEFRAG_LAST ? n : count - 1 - n;
+        const defrag_piece *piece = &datagram->pieces[i];
+        memcpy(payload + piece->offset, chunk_at(table, piece->chunk), piece->len);
+    }
+
+    uint8_t *ip = out + datagram->l3_offset;
+    uint32_t ip_len = datagram->header_len - datagram->l3_offset + datagram->total;
+    if (datagram->version == 4){
+        ip[2] = (uint8_t)(ip_len >> 8);
+        ip[3] = (uint8_t)ip_len;
+        // keep DF, drop MF and the offset
+        ip[6] &= 0x40;
+        ip[7] = 0;
+        ip[10] = 0;
+        ip[11] = 0;
+        int header = (ip[0] & 0x0F) * 4;
+        uint16_t checksum = ipv4_checksum(ip, header);
+        ip[10] = (uint8_t)(checksum >> 8);
+        ip[11] = (uint8_t)checksum;
+    }else{
+        uint32_t payload_len = ip_len - 40;
+        ip[4] = (uint8_t)(payload_len >> 8);
+        ip[5] = (uint8_t)payload_len;
+        // the fragment header stays as an atomic fragment (offset 0, no M)
+        uint8_t *fragment_header = out + datagram->header_len - 8;
+        fragment_header[2] = 0;
+        fragment_header[3] = 0;
+    }
+    return datagram->header_len + datagram->total;
+}
+
+/**
+ * INIT_DEFRAG: allocate a whole reassembly table up front, the fragment
+ * storage is populated right away so the first flood doesn't page fault
+ * ### return:
+ *  `defrag_table *`: if successful
+ *  `NULL`: on error
+ */
+defrag_table *INIT_DEFRAG(const defrag_config *config, timer_wheel *timers){
+    if (!timers)
+        return NULL;
+    uint32_t chunk_count = (uint32_t)((uint64_t)config->memory_kb * 1024 / DEFRAG_CHUNK_SIZE);
+    if (config->max_datagrams < 1 || chunk_count < 2){
+        printf("[x] defrag needs at least one datagram and %d KB\n", 2 * DEFRAG_CHUNK_SIZE / 1024);
+        return NULL;
+    }
+    defrag_table *table = calloc(1, sizeof(defrag_table));
+    if (!table)
+        return NULL;
+    table->config = *config;
+    table->timers = timers;
+    table->timeout_ns = (uint64_t)config->timeout_ms * 1000000ULL;
+
+    uint32_t buckets = 1;
+    while (buckets < config->max_datagrams)
+        buckets <<= 1;
+    table->bucket_mask = buckets - 1;
+    table->buckets = malloc(sizeof(uint32_t) * buckets);
+    table->datagrams = calloc(config->max_datagrams, sizeof(defrag_datagram));
+    table->free_chunks = malloc(sizeof(uint32_t) * chunk_count);
+    table->out = malloc(DEFRAG_CHUNK_SIZE + DEFRAG_MAX_DATAGRAM);
+    table->chunks = mmap(NULL, (size_t)chunk_count * DEFRAG_CHUNK_SIZE,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (table->chunks == MAP_FAILED)
+        table->chunks = NULL;
+    if (!table->buckets || !table->datagrams || !table->free_chunks || !table->out || !table->chunks){
+        perror("[x] can't allocate the defrag table");
+        FREE_DEFRAG(table);
+        return NULL;
+    }
+    table->chunk_count = chunk_count;
+
+    memset(table->buckets, 0xFF, sizeof(uint32_t) * buckets);
+    for (uint32_t i = 0; i < config->max_datagrams; i++)
+        table->datagrams[i].hash_next = i + 1 < config->max_datagrams ? i + 1 : DEFRAG_NONE;
+    table->free_datagram = 0;
+    table->lru_head = DEFRAG_NONE;
+    table->lru_tail = DEFRAG_NONE;
+    for (uint32_t i = 0; i < chunk_count; i++)
+        table->free_chunks[i] = chunk_count - 1 - i;
+    table->free_chunk_count = chunk_count;
+    return table;
+}
+
+void FREE_DEFRAG(defrag_table *table){
+    if (!table)
+        return;
+    // the wheel may outlive the table
+    if (table->datagrams)
+        for (uint32_t i = 0; i < table->config.max_datagrams; i++)
+            timer_cancel(table->timers, &table->datagrams[i].timer);
+    if (table->chunks)
+        munmap(table->chunks, (size_t)table->chunk_count * DEFRAG_CHUNK_SIZE);
+    free(table->buckets);
+    free(table->datagrams);
+    free(table->free_chunks);
+    free(table->out);
+    free(table);
+}
+
+/**
+ * defrag_push: add the fragment `frame` (decoded in `meta`) to its
+ * datagram, `whole` points to the reassembled frame when this one
+ * completes it, valid until the next call
+ * ### return:
+ *  `int`: length of the reassembled frame
+ *  `0`: kept, the datagram is still missing pieces
+ *  `-1`: dropped (the fragment or its whole datagram)
+ */
+int defrag_push(defrag_table *table, const u_char *frame, const packet_meta *meta, uint64_t now_ns, const u_char **whole){
+    table->stats.fragments++;
+    uint32_t l3 = meta->l3_offset;
+    uint32_t data = meta->frag_data;
+    if (!(meta->flags & META_FRAGMENT) || !data || meta->tunnel_count)
+        goto drop;
+
+    // what the ip header says, a fragment cut by the snaplen can't be put back
+    uint32_t declared = meta->ip_version == 4
+        ? l3 + read_be16(frame + l3 + 2)
+        : l3 + 40 + read_be16(frame + l3 + 4);
+    if (declared < data || declared > meta->caplen)
+        goto drop;
+    uint32_t len = declared - data;
+    uint32_t offset = meta->frag_offset;
+    bool more = meta->flags & META_MORE_FRAGMENTS;
+    if ((more && (len == 0 || len % 8)) || offset + len > DEFRAG_MAX_DATAGRAM)
+        goto drop;
+    // the headers of this fragment are the ones of the first one, near enough
+    if (ip_length(meta->ip_version, data - l3, offset + len) > UINT16_MAX)
+        goto oversized;
+
+    defrag_key key;
+    memset(&key, 0, sizeof(defrag_key));
+    memcpy(key.src, meta->src_addr, 16);
+    memcpy(key.dst, meta->dst_addr, 16);
+    key.id = meta->ip_id;
+    key.proto = meta->ip_version == 4 ? meta->ip_proto : 0;
+    key.version = meta->ip_version;
+    uint32_t bucket = key_bucket(table, &key);
+    uint32_t index = find_datagram(table, &key, bucket);
+    if (index == DEFRAG_NONE){
+        index = new_datagram(table, &key, bucket, now_ns);
+    }else{
+        lru_unlink(table, index);
+        lru_push_head(table, index);
+    }
+    defrag_datagram *datagram = &table->datagrams[index];
+    datagram->last_ns = now_ns;
+
+    if (!more){
+        // two different ends, or data already past this one: someone's lying
+        if (datagram->last_seen && datagram->total != offset + len)
+            goto drop_datagram;
+        for (int i = 0; i < datagram->piece_count; i++){
+            if ((uint32_t)datagram->pieces[i].offset + datagram->pieces[i].len > offset + len)
+                goto drop_datagram;
+        }
+        datagram->last_seen = true;
+        datagram->total = offset + len;
+    }else if (datagram->last_seen && offset + len > datagram->total){
+        goto drop_datagram;
+    }
+
+    for (int i = 0; i < datagram->piece_count; i++){
+        uint32_t start = datagram->pieces[i].offset;
+        if (start < offset + len && offset < start + datagram->pieces[i].len){
+            table->stats.overlaps++;
+            break;
+        }
+    }
+
+    if (offset == 0 && datagram->header_chunk == DEFRAG_NONE){
+        if (data > DEFRAG_CHUNK_SIZE)
+            goto drop_datagram;
+        uint32_t chunk = alloc_chunk(table, index);
+        if (chunk == DEFRAG_NONE)
+            goto drop_datagram;
+        memcpy(chunk_at(table, chunk), frame, data);
+        datagram->header_chunk = chunk;
+        datagram->header_len = (uint16_t)data;
+        datagram->l3_offset = (uint16_t)l3;
+    }
+
+    for (uint32_t done = 0; done < len;){
+        if (datagram->piece_count == DEFRAG_MAX_PIECES)
+            goto drop_datagram;
+        uint32_t chunk = alloc_chunk(table, index);
+        if (chunk == DEFRAG_NONE)
+            goto drop_datagram;
+        uint32_t piece_len = len - done < DEFRAG_CHUNK_SIZE ? len - done : DEFRAG_CHUNK_SIZE;
+        memcpy(chunk_at(table, chunk), frame + data + done, piece_len);
+        datagram->pieces[datagram->piece_count++] = (defrag_piece){
+            .chunk = chunk,
+            .offset = (uint16_t)(offset + done),
+            .len = (uint16_t)piece_len
+        };
+        done += piece_len;
+    }
+
+    if (!datagram_complete(datagram))
+        return 0;
+    // now with the real headers, the length written back has to fit
+    if (ip_length(datagram->version, datagram->header_len - datagram->l3_offset, datagram->total) > UINT16_MAX){
+        release_datagram(table, index);
+        goto oversized;
+    }
+    int frame_len = assemble(table, datagram);
+    release_datagram(table, index);
+    table->stats.reassembled++;
+    *whole = table->out;
+    return frame_len;
+
+drop_datagram:
+    release_datagram(table, index);
+    goto drop;
+oversized:
+    table->stats.oversized++;
+drop:
+    table->stats.dropped++;
+    return -1;
+}
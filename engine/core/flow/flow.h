@@ -0,0 +1,301 @@
+#ifndef FLOW_HEADERS
+#define FLOW_HEADERS
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "../capture/protocols/protoheaders.h"
+#include "../../helpers/helpers.h"
+
+/**
+ * per worker state built on top of the decoded packets, everything in
+ * here is created by the worker after the fork and only ever touched by
+ * it, no locks, no sharing. the timeouts all run on the worker's timer
+ * wheel, moved by packet time
+ */
+
+/** fragment reassembly */
+
+// preallocated fragment storage is cut in chunks of this size,
+// a fragment bigger than that takes several
+#define DEFRAG_CHUNK_SIZE 2048
+// pieces (fragment parts of at most a chunk) a datagram can be made of,
+// a datagram cut finer than that is dropped, tiny fragment floods included
+#define DEFRAG_MAX_PIECES 64
+// ip payload can't be bigger than that, plus the headers of the first fragment.
+// the whole datagram has to fit the 16 bit length of its ip header too,
+// one that wouldn't is dropped (ping of death)
+#define DEFRAG_MAX_DATAGRAM 65535
+// end of a chain or list, or "not there yet"
+#define DEFRAG_NONE UINT32_MAX
+
+/** which copy wins when fragments overlap */
+typedef enum {
+    DEFRAG_FIRST = 61,      // what arrived first stays
+    DEFRAG_LAST = 62        // what arrived last overwrites
+} defrag_policy;
+
+typedef struct {
+    bool enabled;
+    uint32_t max_datagrams;     // in flight at once
+    uint32_t memory_kb;         // hard cap of the fragment storage
+    uint32_t timeout_ms;
+    defrag_policy policy;
+} defrag_config;
+
+typedef struct {
+    uint32_t chunk;             // where the bytes are
+    uint16_t offset;            // in the ip payload
+    uint16_t len;
+} defrag_piece;
+
+typedef struct {
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint32_t id;
+    uint8_t proto;              // ipv4 only, ipv6 keys on (src, dst, id)
+    uint8_t version;
+    uint8_t piece_count;
+    bool last_seen;             // got the fragment without more fragments
+    bool in_use;
+    uint32_t total;             // ip payload length, known once last_seen
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint32_t hash_next;         // bucket chain, DEFRAG_NONE ends it
+    uint32_t lru_prev;          // lru list, head is the most recently touched
+    uint32_t lru_next;
+    uint32_t header_chunk;      // headers of the first fragment, DEFRAG_NONE until it shows up
+    uint16_t header_len;        // frame start -> fragmentable part
+    uint16_t l3_offset;
+    timer_entry timer;          // looks at last_ns when it fires
+    defrag_piece pieces[DEFRAG_MAX_PIECES];     // arrival order
+} defrag_datagram;
+
+typedef struct {
+    uint64_t fragments;
+    uint64_t reassembled;
+    uint64_t overlaps;
+    uint64_t timeouts;
+    uint64_t evictions;         // made room under memory pressure
+    uint64_t dropped;           // malformed, truncated, too many pieces, inconsistent
+    uint64_t oversized;         // of the dropped, longer than the ip length can say
+} defrag_stats;
+
+typedef struct {
+    defrag_config config;
+    uint64_t timeout_ns;
+    uint32_t bucket_mask;
+    uint32_t *buckets;
+    defrag_datagram *datagrams;
+    uint32_t free_datagram;     // free list through hash_next
+    uint32_t lru_head;
+    uint32_t lru_tail;
+    uint8_t *chunks;
+    uint32_t chunk_count;
+    uint32_t *free_chunks;      // stack
+    uint32_t free_chunk_count;
+    uint8_t *out;               // the last reassembled frame
+    timer_wheel *timers;
+    defrag_stats stats;
+} defrag_table;
+
+defrag_table *INIT_DEFRAG(const defrag_config *config, timer_wheel *timers);
+void FREE_DEFRAG(defrag_table *table);
+int defrag_push(defrag_table *table, const u_char *frame, const packet_meta *meta, uint64_t now_ns, const u_char **whole);
+
+/** flow table */
+
+// one bucket is one cache line: 8 tags and 8 entry indices
+#define FLOW_BUCKET_SLOTS 8
+#define FLOW_NONE 0                 // entries are numbered from 1
+
+/** where a flow is at, tcp ones follow the handshake and the teardown */
+typedef enum {
+    FLOW_NEW = 71,                  // one direction seen (udp, icmp, ...)
+    FLOW_SYN_SENT = 72,
+    FLOW_SYN_RECEIVED = 73,
+    FLOW_ESTABLISHED = 74,          // both directions seen for non tcp
+    FLOW_FIN_WAIT = 75,             // one side sent FIN
+    FLOW_CLOSING = 76,              // both did
+    FLOW_CLOSED = 77                // RST, or the last ACK after both FINs
+} flow_state;
+
+// packet direction, from the side that opened the flow or towards it
+#define FLOW_TO_SERVER 0
+#define FLOW_TO_CLIENT 1
+
+// flow_entry.flags
+#define FLOW_MIDSTREAM  0x01        // tcp picked up without its handshake
+#define FLOW_FIN_CLIENT 0x02
+#define FLOW_FIN_SERVER 0x04
+
+typedef struct {
+    bool enabled;
+    uint32_t max_flows;
+    uint32_t timeout_new_ms;        // handshakes and one sided flows
+    uint32_t timeout_established_ms;
+    uint32_t timeout_closed_ms;     // after FIN/RST
+} flow_config;
+
+/** both directions of a flow share the key, the lower endpoint first */
+typedef struct {
+    uint8_t addr_lo[16];
+    uint8_t addr_hi[16];
+    uint16_t port_lo;
+    uint16_t port_hi;
+    uint8_t proto;
+    uint8_t version;
+    uint8_t pad[2];
+} flow_key;
+
+typedef struct {
+    flow_key key;
+    uint8_t state;                  // flow_state
+    uint8_t flags;                  // FLOW_*
+    bool client_is_lo;              // the client is key.addr_lo/port_lo
+    uint8_t dissector;              // payload dissector seen on the flow, classify once
+    uint32_t hash;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint64_t packets[2];            // by direction, FLOW_TO_*
+    uint64_t bytes[2];
+    timer_entry timer;              // looks at last_ns when it fires
+    uint32_t free_next;             // free list when unused
+} flow_entry;
+
+typedef struct {
+    uint16_t tags[FLOW_BUCKET_SLOTS];       // top bits of the hash, saves touching entries
+    uint32_t entries[FLOW_BUCKET_SLOTS];    // FLOW_NONE when empty
+    uint32_t overflow;                      // entries that live further because this was full
+    uint32_t pad[3];
+} __attribute__((aligned(64))) flow_bucket;
+
+_Static_assert(sizeof(flow_bucket) == 64, "a flow bucket is one cache line");
+
+// told about a flow right before its entry goes away or starts over as
+// a new connection, so state kept on the side can be let go of
+typedef void (*flow_release_fn)(void *ctx, flow_entry *flow);
+
+typedef struct {
+    uint64_t created;
+    uint64_t expired;
+    uint64_t untracked;             // table full
+    uint64_t midstream;
+} flow_stats;
+
+typedef struct {
+    flow_config config;
+    uint64_t timeout_ns[3];         // new, established, closed
+    uint32_t bucket_mask;
+    flow_bucket *buckets;
+    flow_entry *entries;            // [0] unused
+    uint32_t free_entry;
+    uint32_t active;
+    timer_wheel *timers;
+    flow_release_fn release;        // optional
+    void *release_ctx;
+    flow_stats stats;
+} flow_table;
+
+/** index of an entry, from 1 to max_flows, to keep per flow state in arrays */
+static inline uint32_t flow_index(const flow_table *table, const flow_entry *flow){
+    return (uint32_t)(flow - table->entries);
+}
+
+flow_table *INIT_FLOW_TABLE(const flow_config *config, timer_wheel *timers);
+void FREE_FLOW_TABLE(flow_table *table);
+flow_entry *flow_track(flow_table *table, const packet_meta *meta, uint64_t now_ns, int *direction);
+const char *flow_state_name(uint8_t state);
+
+/** tcp stream reassembly */
+
+// buffered data is cut in pieces of at most this, a copied piece takes one chunk
+#define STREAM_CHUNK_SIZE 2048
+#define STREAM_NONE UINT32_MAX
+#define STREAM_MAX_CALLBACKS 8
+
+// stream_chunk.flags
+#define STREAM_GAP 0x01             // bytes are missing right before this chunk
+#define STREAM_END 0x02             // last call for this direction, no data
+
+typedef struct {
+    bool enabled;
+    uint32_t depth_kb;              // delivered per direction, 0 for the whole stream
+    uint32_t flow_buffer_kb;        // out of order span held per direction
+    uint32_t memory_kb;             // copies held past their batch, all flows of a worker
+} stream_config;
+
+/** what the inspection stages get, in order, once per contiguous run */
+typedef struct {
+    const u_char *data;             // valid for the call only
+    uint32_t len;
+    uint8_t flags;                  // STREAM_*
+    uint64_t offset;                // of data in the stream, gaps counted
+} stream_chunk;
+
+typedef void (*stream_fn)(void *ctx, const flow_entry *flow, int direction, const stream_chunk *chunk);
+
+typedef struct {
+    const u_char *data;             // into the batch, or into a chunk once copied
+    uint32_t seq;
+    uint32_t len;
+    uint32_t next;                  // sequence order, free list when unused
+    uint32_t chunk;                 // STREAM_NONE while it points into the batch
+    uint32_t half;                  // stream it belongs to, flow index * 2 + direction
+    uint32_t pad;
+} stream_segment;
+
+// stream_half.flags
+#define STREAM_STARTED 0x01         // next_seq is known
+#define STREAM_DEPTH 0x02           // depth reached, nothing more is looked at
+#define STREAM_SKIPPED 0x04         // the next chunk comes after a gap
+
+/** one direction of a flow */
+typedef struct {
+    uint32_t next_seq;
+    uint32_t head;                  // buffered segments, STREAM_NONE when there's none
+    uint32_t buffered;              // bytes in them
+    uint8_t flags;
+    uint64_t offset;                // stream bytes before next_seq
+} stream_half;
+
+typedef struct {
+    uint64_t segments;              // with data
+    uint64_t in_order_bytes;        // delivered straight from the packet
+    uint64_t out_of_order;          // segments buffered
+    uint64_t copied_bytes;          // held past their batch
+    uint64_t overlap_bytes;         // already had them, dropped
+    uint64_t gaps;                  // holes given up on
+    uint64_t flow_limit;            // ... because the flow buffer was full
+    uint64_t memory_limit;          // ... because the worker ran out of chunks or segments
+    uint64_t depth_reached;
+    uint32_t peak_chunks;
+    uint32_t peak_segments;
+} stream_stats;
+
+typedef struct {
+    stream_config config;
+    flow_table *flows;
+    uint64_t depth;                 // bytes, 0 for no limit
+    uint32_t flow_buffer;           // bytes
+    stream_half *halves;            // 2 per flow entry
+    stream_segment *segments;
+    uint32_t segment_count;
+    uint32_t free_segment;
+    uint32_t used_segments;
+    uint8_t *chunks;
+    uint32_t chunk_count;
+    uint32_t *free_chunks;          // stack
+    uint32_t free_chunk_count;
+    uint32_t *pending;              // segments pointing into the current batch
+    uint32_t pending_count;
+    stream_stats stats;
+} stream_table;
+
+int register_stream_callback(stream_fn fn, void *ctx);
+stream_table *INIT_STREAMS(const stream_config *config, flow_table *flows);
+void FREE_STREAMS(stream_table *streams);
+void stream_push(stream_table *streams, flow_entry *flow, int direction, const u_char *frame, const packet_meta *meta, bool transient);
+void stream_batch_end(stream_table *streams);
+uint64_t stream_memory(const stream_table *streams);
+
+#endif
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include "xxhash.h"
+#include "./flow.h"
+
+/**
+ * per worker flow table, keyed by the 5-tuple of both directions.
+ * open addressing over cache line buckets: a lookup reads the home
+ * bucket, compares 16 bit tags and only touches an entry when a tag
+ * matches. a full bucket sends new entries to the next one and counts
+ * them in its `overflow`, so a lookup only walks on while that's not 0
+ * and a delete can't cut a probe chain.
+ * entries are preallocated and expire through the worker's timer wheel,
+ * lazily: a packet only updates `last_ns`, when its timer fires a flow
+ * is either expired or its timer is set again to the real deadline, so
+ * the hot path doesn't touch the wheel (FIN/RST bring the timer closer)
+ */
+
+#define FLOW_HASH_SEED 0xB3
+
+static const char *state_names[] = {
+    [FLOW_NEW - FLOW_NEW] = "new",
+    [FLOW_SYN_SENT - FLOW_NEW] = "syn_sent",
+    [FLOW_SYN_RECEIVED - FLOW_NEW] = "syn_received",
+    [FLOW_ESTABLISHED - FLOW_NEW] = "established",
+    [FLOW_FIN_WAIT - FLOW_NEW] = "fin_wait",
+    [FLOW_CLOSING - FLOW_NEW] = "closing",
+    [FLOW_CLOSED - FLOW_NEW] = "closed",
+};
+
+const char *flow_state_name(uint8_t state){
+    if (state < FLOW_NEW || state > FLOW_CLOSED)
+        return "unknown";
+    return state_names[state - FLOW_NEW];
+}
+
+/**
+ * key of the packet, and whether its source is the lower endpoint
+ */
+static bool packet_key(const packet_meta *meta, flow_key *key){
+    memset(key, 0, sizeof(flow_key));
+    size_t addr_len = meta->ip_version == 6 ? 16 : 4;
+    uint16_t sport = meta->src_port;
+    uint16_t dport = meta->dst_port;
+    // echo requests and replies of one ping share their id
+    if (meta->ip_proto == IPPROTO_ICMP || meta->ip_proto == IPPROTO_ICMPV6)
+        sport = dport = meta->icmp_id;
+    key->proto = meta->ip_proto;
+    key->version = meta->ip_version;
+    int order = memcmp(meta->src_addr, meta->dst_addr, addr_len);
+    if (order < 0 || (order == 0 && sport <= dport)){
+        memcpy(key->addr_lo, meta->src_addr, addr_len);
+        memcpy(key->addr_hi, meta->dst_addr, addr_len);
+        key->port_lo = sport;
+        key->port_hi = dport;
+        return true;
+    }
+    memcpy(key->addr_lo, meta->dst_addr, addr_len);
+    memcpy(key->addr_hi, meta->src_addr, addr_len);
+    key->port_lo = dport;
+    key->port_hi = sport;
+    return false;
+}
+
+static inline uint64_t state_timeout(flow_table *table, uint8_t state){
+    switch (state){
+        case FLOW_ESTABLISHED:
+            return table->timeout_ns[1];
+        case FLOW_FIN_WAIT:
+        case FLOW_CLOSING:
+        case FLOW_CLOSED:
+            return table->timeout_ns[2];
+        default:
+            return table->timeout_ns[0];
+    }
+}
+
+/**
+ * find the entry of `key` starting at its home bucket
+ * ### return:
+ *  `uint32_t`: the entry
+ *  `FLOW_NONE`: not there
+ */
+static uint32_t find_flow(flow_table *table, const flow_key *key, uint32_t hash){
+    uint16_t tag = (uint16_t)(hash >> 16);
+    uint32_t bucket_index = hash & table->bucket_mask;
+    for (uint32_t probe = 0; probe <= table->bucket_mask; probe++){
+        const flow_bucket *bucket = &table->buckets[bucket_index];
+        for (int i = 0; i < FLOW_BUCKET_SLOTS; i++){
+            uint32_t index = bucket->entries[i];
+            if (index != FLOW_NONE && bucket->tags[i] == tag &&
+                memcmp(&table->entries[index].key, key, sizeof(flow_key)) == 0)
+                return index;
+        }
+        if (!bucket->overflow)
+            return FLOW_NONE;
+        bucket_index = (bucket_index + 1) & table->bucket_mask;
+    }
+    return FLOW_NONE;
+}
+
+static void insert_flow(flow_table *table, uint32_t index, uint32_t hash){
+    uint16_t tag = (uint16_t)(hash >> 16);
+    uint32_t bucket_index = hash & table->bucket_mask;
+    // there are more slots than entries, a free one always exists
+    for (;;){
+        flow_bucket *bucket = &table->buckets[bucket_index];
+        for (int i = 0; i < FLOW_BUCKET_SLOTS; i++){
+            if (bucket->entries[i] == FLOW_NONE){
+                bucket->entries[i] = index;
+                bucket->tags[i] = tag;
+                return;
+            }
+        }
+        bucket->overflow++;
+        bucket_index = (bucket_index + 1) & table->bucket_mask;
+    }
+}
+
+static void delete_flow(flow_table *table, uint32_t index){
+    flow_entry *flow = &table->entries[index];
+    if (table->release)
+        table->release(table->release_ctx, flow);
+    uint32_t bucket_index = flow->hash & table->bucket_mask;
+    for (;;){
+        flow_bucket *bucket = &table->buckets[bucket_index];
+        for (int i = 0; i < FLOW_BUCKET_SLOTS; i++){
+            if (bucket->entries[i] == index){
+                bucket->entries[i] = FLOW_NONE;
+                goto unlinked;
+            }
+        }
+        // it went past this one when it got in
+        bucket->overflow--;
+        bucket_index = (bucket_index + 1) & table->bucket_mask;
+    }
+unlinked:
+    timer_cancel(table->timers, &flow->timer);
+    flow->free_next = table->free_entry;
+    table->free_entry = index;
+    table->active--;
+}
+
+/**
+ * tcp state machine, only the flags are looked at, not the sequence
+ * numbers, that's the stream reassembly's business
+ */
+static void tcp_track(flow_entry *flow, uint8_t tcp_flags, int direction){
+    if (flow->state == FLOW_CLOSED)
+        return;
+    if (tcp_flags & TCP_RST){
+        flow->state = FLOW_CLOSED;
+        return;
+    }
+    if (tcp_flags & TCP_FIN)
+        flow->flags |= direction == FLOW_TO_SERVER ? FLOW_FIN_CLIENT : FLOW_FIN_SERVER;
+    switch (flow->state){
+        case FLOW_SYN_SENT:
+            if (direction == FLOW_TO_CLIENT && (tcp_flags & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK))
+                flow->state = FLOW_SYN_RECEIVED;
+            break;
+        case FLOW_SYN_RECEIVED:
+            if (direction == FLOW_TO_SERVER && (tcp_flags & TCP_ACK) && !(tcp_flags & TCP_SYN))
+                flow->state = FLOW_ESTABLISHED;
+            break;
+        case FLOW_CLOSING:
+            // the ACK of the last FIN
+            if ((tcp_flags & TCP_ACK) && !(tcp_flags & TCP_FIN))
+                flow->state = FLOW_CLOSED;
+            return;
+        default:
+            break;
+    }
+    if ((flow->flags & (FLOW_FIN_CLIENT | FLOW_FIN_SERVER)) == (FLOW_FIN_CLIENT | FLOW_FIN_SERVER))
+        flow->state = FLOW_CLOSING;
+    else if (flow->flags & (FLOW_FIN_CLIENT | FLOW_FIN_SERVER) && flow->state != FLOW_CLOSED)
+        flow->state = FLOW_FIN_WAIT;
+}
+
+/**
+ * a fresh entry for the first packet of a flow, the client is who sent
+ * the SYN, or whoever got the SYN/ACK, or the higher port when the
+ * handshake was missed
+ */
+static void open_flow(flow_table *table, flow_entry *flow, const packet_meta *meta, bool src_is_lo, uint64_t now_ns){
+    flow->flags = 0;
+    flow->dissector = 0;
+    flow->first_ns = now_ns;
+    flow->packets[0] = flow->packets[1] = 0;
+    flow->bytes[0] = flow->bytes[1] = 0;
+    bool src_is_client = true;
+    flow->state = FLOW_NEW;
+    if (meta->ip_proto == IPPROTO_TCP && meta->flags & META_HAS_L4){
+        uint8_t syn_ack = meta->tcp_flags & (TCP_SYN | TCP_ACK);
+        if (syn_ack == TCP_SYN){
+            flow->state = FLOW_SYN_SENT;
+        }else if (syn_ack == (TCP_SYN | TCP_ACK)){
+            flow->state = FLOW_SYN_RECEIVED;
+            src_is_client = false;
+        }else{
+            flow->state = FLOW_ESTABLISHED;
+            flow->flags |= FLOW_MIDSTREAM;
+            src_is_client = meta->src_port > meta->dst_port;
+            table->stats.midstream++;
+        }
+    }
+    flow->client_is_lo = src_is_client == src_is_lo;
+}
+
+/** the timer of a flow went off, it's gone if it was idle long enough */
+static void flow_timeout(timer_entry *timer, void *ctx, uint64_t now_ns){
+    flow_table *table = ctx;
+    flow_entry *flow = (flow_entry *)((char *)timer - offsetof(flow_entry, timer));
+    uint64_t deadline_ns = flow->last_ns + state_timeout(table, flow->state);
+    if (deadline_ns <= now_ns){
+        delete_flow(table, flow_index(table, flow));
+        table->stats.expired++;
+        return;
+    }
+    timer_add(table->timers, timer, deadline_ns, flow_timeout, table);
+}
+
+/**
+ * flow_track: find (or start) the flow of a decoded packet and account
+ * the packet to it, `direction` gets FLOW_TO_SERVER or FLOW_TO_CLIENT
+ * ### return:
+ *  `flow_entry *`: the flow, valid until the timers run next
+ *  `NULL`: not an ip packet, or the table is full
+ */
+flow_entry *flow_track(flow_table *table, const packet_meta *meta, uint64_t now_ns, int *direction){
+    if (!(meta->flags & META_HAS_L3))
+        return NULL;
+    flow_key key;
+    bool src_is_lo = packet_key(meta, &key);
+    uint32_t hash = (uint32_t)XXH64(&key, sizeof(flow_key), FLOW_HASH_SEED);
+    uint32_t index = find_flow(table, &key, hash);
+    flow_entry *flow;
+    if (index == FLOW_NONE){
+        index = table->free_entry;
+        if (index == FLOW_NONE){
+            table->stats.untracked++;
+            return NULL;
+        }
+        flow = &table->entries[index];
+        table->free_entry = flow->free_next;
+        table->active++;
+        table->stats.created++;
+        flow->key = key;
+        flow->hash = hash;
+        insert_flow(table, index, hash);
+        open_flow(table, flow, meta, src_is_lo, now_ns);
+        flow->last_ns = now_ns;
+        timer_start(table->timers, now_ns);
+        timer_add(table->timers, &flow->timer, now_ns + state_timeout(table, flow->state), flow_timeout, table);
+    }else{
+        flow = &table->entries[index];
+        // the tuple is reused for a new connection
+        if (flow->state == FLOW_CLOSED && meta->ip_proto == IPPROTO_TCP &&
+            (meta->tcp_flags & (TCP_SYN | TCP_ACK)) == TCP_SYN){
+            if (table->release)
+                table->release(table->release_ctx, flow);
+            open_flow(table, flow, meta, src_is_lo, now_ns);
+        }
+    }
+
+    int dir = src_is_lo == flow->client_is_lo ? FLOW_TO_SERVER : FLOW_TO_CLIENT;
+    if (meta->ip_proto == IPPROTO_TCP && meta->flags & META_HAS_L4)
+        tcp_track(flow, meta->tcp_flags, dir);
+    else if (flow->state == FLOW_NEW && dir == FLOW_TO_CLIENT)
+        flow->state = FLOW_ESTABLISHED;
+    flow->packets[dir]++;
+    flow->bytes[dir] += meta->caplen;
+    if (now_ns > flow->last_ns)
+        flow->last_ns = now_ns;
+    // FIN/RST shorten the timeout, the timer is set later than that
+    uint64_t due_ns = flow->last_ns + state_timeout(table, flow->state);
+    if (due_ns / table->timers->tick_ns < flow->timer.expires)
+        timer_add(table->timers, &flow->timer, due_ns, flow_timeout, table);
+    if (meta->dissector)
+        flow->dissector = meta->dissector;
+    *direction = dir;
+    return flow;
+}
+
+/**
+ * INIT_FLOW_TABLE: allocate the whole table up front, twice as many
+ * bucket slots as entries so probe chains stay short, flows time out
+ * on `timers`
+ * ### return:
+ *  `flow_table *`: if successful
+ *  `NULL`: on error
+ */
+flow_table *INIT_FLOW_TABLE(const flow_config *config, timer_wheel *timers){
+    if (!timers)
+        return NULL;
+    if (config->max_flows < 1 || config->max_flows >= UINT32_MAX / 4){
+        printf("[x] the flow table needs between 1 and %u flows\n", UINT32_MAX / 4);
+        return NULL;
+    }
+    flow_table *table = calloc(1, sizeof(flow_table));
+    if (!table)
+        return NULL;
+    table->config = *config;
+    table->timers = timers;
+    table->timeout_ns[0] = (uint64_t)config->timeout_new_ms * 1000000ULL;
+    table->timeout_ns[1] = (uint64_t)config->timeout_established_ms * 1000000ULL;
+    table->timeout_ns[2] = (uint64_t)config->timeout_closed_ms * 1000000ULL;
+
+    uint32_t buckets = 1;
+    while ((uint64_t)buckets * FLOW_BUCKET_SLOTS < (uint64_t)config->max_flows * 2)
+        buckets <<= 1;
+    table->bucket_mask = buckets - 1;
+    table->buckets = aligned_alloc(64, sizeof(flow_bucket) * buckets);
+    table->entries = calloc((size_t)config->max_flows + 1, sizeof(flow_entry));
+    if (!table->buckets || !table->entries){
+        perror("[x] can't allocate the flow table");
+        FREE_FLOW_TABLE(table);
+        return NULL;
+    }
+    memset(table->buckets, 0, sizeof(flow_bucket) * buckets);
+    for (uint32_t i = 1; i <= config->max_flows; i++)
+        table->entries[i].free_next = i < config->max_flows ? i + 1 : FLOW_NONE;
+    table->free_entry = 1;
+    return table;
+}
+
+void FREE_FLOW_TABLE(flow_table *table){
+    if (!table)
+        return;
+    // the wheel may outlive the table
+    if (table->entries)
+        for (uint32_t i = 1; i <= table->config.max_flows; i++)
+            timer_cancel(table->timers, &table->entries[i].timer);
+    free(table->buckets);
+    free(table->entries);
+    free(table);
+}
@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include "./flow.h"
+
+/**
+ * tcp stream reassembly, one table per worker on top of its flow table.
+ * data that comes in order goes to the callbacks straight from the
+ * packet, only out of order data is held: as segments pointing into the
+ * batch while the batch is alive, copied in chunks of the preallocated
+ * storage by stream_batch_end when they must outlive it.
+ * held data can't grow past `flow_buffer` bytes of sequence space per
+ * direction, or past the chunks and segments of the worker: when it would
+ * the holes are given up on, what's held is delivered with gaps flagged
+ * and the stream goes on from there. overlapping data: the bytes that
+ * came first win
+ */
+
+// sequence numbers wrap, compare them as a distance
+#define SEQ_LT(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+
+typedef struct {
+    stream_fn fn;
+    void *ctx;
+} stream_callback;
+
+// registered before the fork, every worker gets a copy
+static stream_callback callbacks[STREAM_MAX_CALLBACKS];
+static int callback_count = 0;
+
+/**
+ * register_stream_callback: `fn` gets every contiguous chunk of every
+ * reassembled stream, then a STREAM_END when the flow goes away
+ * ### return:
+ *  `0`: registered
+ *  `-1`: there are STREAM_MAX_CALLBACKS already
+ */
+int register_stream_callback(stream_fn fn, void *ctx){
+    if (callback_count == STREAM_MAX_CALLBACKS){
+        printf("[x] can't register more than %d stream callbacks\n", STREAM_MAX_CALLBACKS);
+        return -1;
+    }
+    callbacks[callback_count++] = (stream_callback){fn, ctx};
+    return 0;
+}
+
+static void call_back(stream_table *streams, uint32_t h, const stream_chunk *chunk){
+    const flow_entry *flow = &streams->flows->entries[h / 2];
+    for (int i = 0; i < callback_count; i++)
+        callbacks[i].fn(callbacks[i].ctx, flow, (int)(h & 1), chunk);
+}
+
+/** hand `len` bytes at next_seq to the callbacks, up to the depth */
+static void deliver(stream_table *streams, uint32_t h, const u_char *data, uint32_t len){
+    stream_half *half = &streams->halves[h];
+    stream_chunk chunk = {data, len, half->flags & STREAM_SKIPPED ? STREAM_GAP : 0, half->offset};
+    if (streams->depth && half->offset + len >= streams->depth){
+        // a gap can jump past it
+        chunk.len = half->offset < streams->depth ? (uint32_t)(streams->depth - half->offset) : 0;
+        half->flags |= STREAM_DEPTH;
+        streams->stats.depth_reached++;
+    }
+    half->next_seq += len;
+    half->offset += len;
+    if (chunk.len){
+        half->flags &= ~STREAM_SKIPPED;
+        call_back(streams, h, &chunk);
+    }
+}
+
+/** give up on the bytes up to `seq`, the next chunk is flagged as a gap */
+static void skip(stream_table *streams, uint32_t h, uint32_t seq){
+    stream_half *half = &streams->halves[h];
+    half->offset += seq - half->next_seq;
+    half->next_seq = seq;
+    half->flags |= STREAM_SKIPPED;
+    streams->stats.gaps++;
+}
+
+static void free_segment(stream_table *streams, uint32_t index){
+    stream_segment *segment = &streams->segments[index];
+    if (segment->chunk != STREAM_NONE)
+        streams->free_chunks[streams->free_chunk_count++] = segment->chunk;
+    segment->data = NULL;
+    segment->chunk = STREAM_NONE;
+    segment->next = streams->free_segment;
+    streams->free_segment = index;
+    streams->used_segments--;
+}
+
+static void drop_segments(stream_table *streams, uint32_t h){
+    stream_half *half = &streams->halves[h];
+    while (half->head != STREAM_NONE){
+        uint32_t next = streams->segments[half->head].next;
+        free_segment(streams, half->head);
+        half->head = next;
+    }
+    half->buffered = 0;
+}
+
+/** deliver the held segments that became contiguous */
+static void drain(stream_table *streams, uint32_t h){
+    stream_half *half = &streams->halves[h];
+    while (half->head != STREAM_NONE && !(half->flags & STREAM_DEPTH)){
+        stream_segment *segment = &streams->segments[half->head];
+        if (SEQ_LT(half->next_seq, segment->seq))
+            return;
+        uint32_t seen = half->next_seq - segment->seq;
+        if (seen < segment->len)
+            deliver(streams, h, segment->data + seen, segment->len - seen);
+        uint32_t next = segment->next;
+        half->buffered -= segment->len;
+        free_segment(streams, half->head);
+        half->head = next;
+    }
+    if (half->flags & STREAM_DEPTH)
+        drop_segments(streams, h);
+}
+
+/** deliver everything that's held, skipping over the holes */
+static void give_up(stream_table *streams, uint32_t h){
+    stream_half *half = &streams->halves[h];
+    while (half->head != STREAM_NONE && !(half->flags & STREAM_DEPTH)){
+        uint32_t seq = streams->segments[half->head].seq;
+        if (SEQ_LT(half->next_seq, seq))
+            skip(streams, h, seq);
+        drain(streams, h);
+    }
+    drop_segments(streams, h);
+}
+
+/** copy a segment out of the batch into a chunk, false when there's none left */
+static bool copy_segment(stream_table *streams, uint32_t index){
+    if (!streams->free_chunk_count)
+        return false;
+    stream_segment *segment = &streams->segments[index];
+    uint32_t chunk = streams->free_chunks[--streams->free_chunk_count];
+    u_char *storage = streams->chunks + (size_t)chunk * STREAM_CHUNK_SIZE;
+    memcpy(storage, segment->data, segment->len);
+    segment->data = storage;
+    segment->chunk = chunk;
+    streams->stats.copied_bytes += segment->len;
+    uint32_t used = streams->chunk_count - streams->free_chunk_count;
+    if (used > streams->stats.peak_chunks)
+        streams->stats.peak_chunks = used;
+    return true;
+}
+
+/**
+ * hold the out of order bytes [seq, end) in sequence order, only the
+ * parts no held segment has yet, cut in pieces of at most a chunk
+ * ### return:
+ *  `true`: held
+ *  `false`: ran out of segments or chunks, some of it may be held
+ */
+static bool hold(stream_table *streams, uint32_t h, uint32_t seq, uint32_t end, const u_char *data, bool transient){
+    stream_half *half = &streams->halves[h];
+    uint32_t prev = STREAM_NONE;
+    uint32_t current = half->head;
+    while (SEQ_LT(seq, end)){
+        while (current != STREAM_NONE &&
+            SEQ_LEQ(streams->segments[current].seq + streams->segments[current].len, seq)){
+            prev = current;
+            current = streams->segments[current].next;
+        }
+        uint32_t stop = end;
+        if (current != STREAM_NONE){
+            const stream_segment *held = &streams->segments[current];
+            if (SEQ_LEQ(held->seq, seq)){
+                // got these already
+                uint32_t held_end = held->seq + held->len;
+                uint32_t covered = SEQ_LT(end, held_end) ? end : held_end;
+                streams->stats.overlap_bytes += covered - seq;
+                data += covered - seq;
+                seq = covered;
+                continue;
+            }
+            if (SEQ_LT(held->seq, stop))
+                stop = held->seq;
+        }
+        if (stop - seq > STREAM_CHUNK_SIZE)
+            stop = seq + STREAM_CHUNK_SIZE;
+
+        uint32_t index = streams->free_segment;
+        if (index == STREAM_NONE)
+            return false;
+        stream_segment *segment = &streams->segments[index];
+        streams->free_segment = segment->next;
+        segment->data = data;
+        segment->seq = seq;
+        segment->len = stop - seq;
+        segment->chunk = STREAM_NONE;
+        segment->half = h;
+        if (transient || streams->pending_count == streams->segment_count){
+            if (!copy_segment(streams, index)){
+                segment->data = NULL;
+                segment->next = streams->free_segment;
+                streams->free_segment = index;
+                return false;
+            }
+        }else{
+            streams->pending[streams->pending_count++] = index;
+        }
+        streams->used_segments++;
+        if (streams->used_segments > streams->stats.peak_segments)
+            streams->stats.peak_segments = streams->used_segments;
+        segment->next = current;
+        if (prev == STREAM_NONE)
+            half->head = index;
+        else
+            streams->segments[prev].next = index;
+        prev = index;
+        half->buffered += segment->len;
+        data += segment->len;
+        seq = stop;
+    }
+    return true;
+}
+
+/** the payload of a segment, in whatever order it comes */
+static void push_data(stream_table *streams, uint32_t h, uint32_t seq, const u_char *data, uint32_t len, bool transient){
+    stream_half *half = &streams->halves[h];
+    uint32_t end = seq + len;
+    for (;;){
+        if (half->flags & STREAM_DEPTH)
+            return;
+        if (SEQ_LEQ(end, half->next_seq)){
+            streams->stats.overlap_bytes += end - seq;
+            return;
+        }
+        if (SEQ_LT(seq, half->next_seq)){
+            streams->stats.overlap_bytes += half->next_seq - seq;
+            data += half->next_seq - seq;
+            seq = half->next_seq;
+        }
+        if (seq == half->next_seq){
+            // in order, up to the first held segment
+            uint32_t stop = end;
+            if (half->head != STREAM_NONE && SEQ_LT(streams->segments[half->head].seq, stop))
+                stop = streams->segments[half->head].seq;
+            streams->stats.in_order_bytes += stop - seq;
+            deliver(streams, h, data, stop - seq);
+            data += stop - seq;
+            seq = stop;
+            drain(streams, h);
+            continue;
+        }
+        if (SEQ_LT(half->next_seq + streams->flow_buffer, end)){
+            streams->stats.flow_limit++;
+        }else{
+            streams->stats.out_of_order++;
+            if (hold(streams, h, seq, end, data, transient))
+                return;
+            streams->stats.memory_limit++;
+        }
+        // no room for the hole, go on past it
+        give_up(streams, h);
+        if (SEQ_LT(half->next_seq, seq))
+            skip(streams, h, seq);
+    }
+}
+
+/**
+ * stream_push: reassemble the tcp payload of a packet of `flow`, going
+ * `direction`. `frame` must stay valid until stream_batch_end unless
+ * `transient`, then whatever is held is copied right away
+ */
+void stream_push(stream_table *streams, flow_entry *flow, int direction, const u_char *frame, const packet_meta *meta, bool transient){
+    if (meta->ip_proto != IPPROTO_TCP || !(meta->flags & META_HAS_L4))
+        return;
+    uint32_t h = flow_index(streams->flows, flow) * 2 + (uint32_t)direction;
+    stream_half *half = &streams->halves[h];
+    uint32_t seq = meta->tcp_seq;
+    if (meta->tcp_flags & TCP_SYN){
+        if (!(half->flags & STREAM_STARTED)){
+            half->next_seq = seq + 1;
+            half->flags |= STREAM_STARTED;
+        }
+        seq++;
+    }
+    if (!meta->payload_len)
+        return;
+    if (!(half->flags & STREAM_STARTED)){
+        // picked up after the SYN, the stream starts here
+        half->next_seq = seq;
+        half->flags |= STREAM_STARTED;
+        if (flow->flags & FLOW_MIDSTREAM)
+            half->flags |= STREAM_SKIPPED;
+    }
+    streams->stats.segments++;
+    push_data(streams, h, seq, frame + meta->payload_offset, meta->payload_len, transient);
+}
+
+/**
+ * stream_batch_end: the batch is about to go, copy what's held from it.
+ * a stream whose data can't be copied gets it delivered now, with gaps
+ */
+void stream_batch_end(stream_table *streams){
+    for (uint32_t i = 0; i < streams->pending_count; i++){
+        uint32_t index = streams->pending[i];
+        stream_segment *segment = &streams->segments[index];
+        // delivered in the meantime, or already copied
+        if (!segment->data || segment->chunk != STREAM_NONE)
+            continue;
+        if (!copy_segment(streams, index)){
+            streams->stats.memory_limit++;
+            give_up(streams, segment->half);
+        }
+    }
+    streams->pending_count = 0;
+}
+
+/**
+ * the flow of both directions is going away, deliver what's held
+ * and tell the callbacks it's over
+ */
+static void release_streams(void *ctx, flow_entry *flow){
+    stream_table *streams = ctx;
+    for (uint32_t h = flow_index(streams->flows, flow) * 2, last = h + 1; h <= last; h++){
+        stream_half *half = &streams->halves[h];
+        if (half->flags & STREAM_STARTED){
+            give_up(streams, h);
+            stream_chunk end = {NULL, 0, STREAM_END, half->offset};
+            call_back(streams, h, &end);
+        }
+        *half = (stream_half){.head = STREAM_NONE};
+    }
+}
+
+/**
+ * stream_memory: bytes of held data right now, copies and the segments
+ * describing them
+ */
+uint64_t stream_memory(const stream_table *streams){
+    return (uint64_t)(streams->chunk_count - streams->free_chunk_count) * STREAM_CHUNK_SIZE +
+        (uint64_t)streams->used_segments * sizeof(stream_segment);
+}
+
+/**
+ * INIT_STREAMS: allocate everything up front, `memory_kb` of chunks and
+ * twice as many segments (the ones pointing into the batch need no chunk),
+ * and hook into `flows` to hear about flows going away
+ * ### return:
+ *  `stream_table *`: if successful
+ *  `NULL`: on error
+ */
+stream_table *INIT_STREAMS(const stream_config *config, flow_table *flows){
+    uint32_t chunk_count = (uint32_t)((uint64_t)config->memory_kb * 1024 / STREAM_CHUNK_SIZE);
+    if (chunk_count < 1 || config->flow_buffer_kb < 1){
+        printf("[x] streams need at least %d KB and a flow buffer\n", STREAM_CHUNK_SIZE / 1024);
+        return NULL;
+    }
+    stream_table *streams = calloc(1, sizeof(stream_table));
+    if (!streams)
+        return NULL;
+    streams->config = *config;
+    streams->flows = flows;
+    streams->depth = (uint64_t)config->depth_kb * 1024;
+    streams->flow_buffer = config->flow_buffer_kb * 1024;
+
+    size_t half_count = ((size_t)flows->config.max_flows + 1) * 2;
+    streams->segment_count = chunk_count * 2;
+    streams->halves = malloc(sizeof(stream_half) * half_count);
+    streams->segments = malloc(sizeof(stream_segment) * streams->segment_count);
+    streams->pending = malloc(sizeof(uint32_t) * streams->segment_count);
+    streams->free_chunks = malloc(sizeof(uint32_t) * chunk_count);
+    streams->chunks = mmap(NULL, (size_t)chunk_count * STREAM_CHUNK_SIZE,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (streams->chunks == MAP_FAILED)
+        streams->chunks = NULL;
+    if (!streams->halves || !streams->segments || !streams->pending || !streams->free_chunks || !streams->chunks){
+        perror("[x] can't allocate the stream table");
+        FREE_STREAMS(streams);
+        return NULL;
+    }
+    streams->chunk_count = chunk_count;
+
+    for (size_t i = 0; i < half_count; i++)
+        streams->halves[i] = (stream_half){.head = STREAM_NONE};
+    for (uint32_t i = 0; i < streams->segment_count; i++){
+        streams->segments[i] = (stream_segment){.chunk = STREAM_NONE};
+        streams->segments[i].next = i + 1 < streams->segment_count ? i + 1 : STREAM_NONE;
+    }
+    streams->free_segment = 0;
+    for (uint32_t i = 0; i < chunk_count; i++)
+        streams->free_chunks[i] = chunk_count - 1 - i;
+    streams->free_chunk_count = chunk_count;
+
+    flows->release = release_streams;
+    flows->release_ctx = streams;
+    printf("[@] streams: %zu KB of chunks, %zu KB of segments, %zu KB of stream state\n",
+        (size_t)chunk_count * STREAM_CHUNK_SIZE / 1024,
+        sizeof(stream_segment) * streams->segment_count / 1024,
+        sizeof(stream_half) * half_count / 1024);
+    return streams;
+}
+
+void FREE_STREAMS(stream_table *streams){
+    if (!streams)
+        return;
+    if (streams->flows && streams->flows->release_ctx == streams){
+        streams->flows->release = NULL;
+        streams->flows->release_ctx = NULL;
+    }
+    if (streams->chunks)
+        munmap(streams->chunks, (size_t)streams->chunk_count * STREAM_CHUNK_SIZE);
+    free(streams->halves);
+    free(streams->segments);
+    free(streams->pending);
+    free(streams->free_chunks);
+    free(streams);
+}
@@ -2,15 +2,52 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include "../../helpers/helpers.h"
 
+// the health jobs run on a timer wheel driven by the clock
+#define HEALTH_TICK_NS 100000000ULL         // 100ms
+#define HEALTH_PERIOD_NS 10000000000ULL     // 10s
+
+static inline uint64_t health_clock_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void health_check(timer_entry *timer, void *ctx, uint64_t now_ns){
+    printf("<health check rootine>\n");
+    timer_add(ctx, timer, now_ns + HEALTH_PERIOD_NS, health_check, ctx);
+}
 
 void *health_thread(void *arg){
 
     printf("[+] health thread stuff ...\n");
+    timer_wheel *timers = INIT_TIMER_WHEEL(HEALTH_TICK_NS);
+    if (!timers){
+        printf("[x] health thread can't allocate its timers\n");
+        return NULL;
+    }
+    timer_entry check = {0};
+    uint64_t now_ns = health_clock_ns();
+    timer_start(timers, now_ns);
+    timer_add(timers, &check, now_ns, health_check, timers);
     while (true){
-        printf("<health check rootine>\n");
-        sleep(10);
+        // sleep till the next timer is due, the wheel fires what's over
+        uint64_t next_ns = timer_next_ns(timers);
+        now_ns = health_clock_ns();
+        if (next_ns > now_ns){
+            uint64_t wait_ns = next_ns - now_ns;
+            if (wait_ns > HEALTH_PERIOD_NS)
+                wait_ns = HEALTH_PERIOD_NS;
+            struct timespec wait = {
+                .tv_sec = wait_ns / 1000000000ULL,
+                .tv_nsec = wait_ns % 1000000000ULL
+            };
+            nanosleep(&wait, NULL);
+        }
+        timer_advance(timers, health_clock_ns());
     }
 
+    FREE_TIMER_WHEEL(timers);
     return NULL;
-}
\ No newline at end of file
+}
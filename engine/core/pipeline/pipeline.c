@@ -0,0 +1,700 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>          // inet_ntop()
+#include "./pipeline.h"
+
+#include "../capture/protocols/protoheaders.h"
+
+batch_ring_t *batch_ring;
+
+// worker side, the records of the packets of the batch being processed
+static packet_meta worker_metas[MAX_BATCH];
+// flow of each record (NULL when untracked) and which way the packet went,
+// valid until the end of the batch
+static flow_entry *worker_flows[MAX_BATCH];
+static uint8_t worker_directions[MAX_BATCH];
+// timeouts are counted in ms or more, 10ms is close enough for all of them
+#define WORKER_TIMER_TICK_NS 10000000ULL
+// packet time of the last packet the worker got, the time of its wheel
+static uint64_t worker_clock_ns = 0;
+// endpoints the worker looked up in the reputation list and found there
+static uint64_t reputation_lookups = 0;
+static uint64_t reputation_hits = 0;
+
+static inline uint64_t monotonic_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * the time of a packet for the timeouts: its timestamp, or the one of the
+ * packet before it when it has none. every backend stamps in wall clock
+ * time (a replay in the time of its file), so the wall clock stands in
+ * until the first stamped packet, never the monotonic one
+ */
+static inline uint64_t packet_time(uint64_t ts_ns){
+    if (ts_ns)
+        worker_clock_ns = ts_ns;
+    else if (!worker_clock_ns){
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        worker_clock_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
+    return worker_clock_ns;
+}
+
+/**
+ * look both endpoints of a packet up in the reputation list, once per
+ * flow (on its first packet) when it's tracked, every packet when not
+ */
+static void reputation_check(const lpm_db *db, const packet_meta *meta, const flow_entry *flow){
+    if (meta->ip_version != 4 && meta->ip_version != 6)
+        return;
+    if (flow && flow->packets[FLOW_TO_SERVER] + flow->packets[FLOW_TO_CLIENT] != 1)
+        return;
+    uint32_t src = lpm_lookup(db, meta->ip_version, meta->src_addr);
+    uint32_t dst = lpm_lookup(db, meta->ip_version, meta->dst_addr);
+    reputation_lookups += 2;
+    if (!src && !dst)
+        return;
+    reputation_hits += (src != 0) + (dst != 0);
+    char from[INET6_ADDRSTRLEN] = "?", to[INET6_ADDRSTRLEN] = "?";
+    int family = meta->ip_version == 6 ? AF_INET6 : AF_INET;
+    inet_ntop(family, meta->src_addr, from, sizeof(from));
+    inet_ntop(family, meta->dst_addr, to, sizeof(to));
+    const char *format = meta->ip_version == 6 ? "[REPUTATION] src %s dst %s [%s][%s]:%u -> [%s]:%u\n"
+        : "[REPUTATION] src %s dst %s [%s]%s:%u -> %s:%u\n";
+    printf(format, src ? lpm_tag(db, src) : "-", dst ? lpm_tag(db, dst) : "-", protocol_name(meta->ip_proto),
+        from, meta->src_port, to, meta->dst_port);
+}
+
+/**
+ * queue the packet that was just added to the batch on the worker
+ * that owns its flow, both directions of a flow hash the same
+ */
+static inline void batch_shard(batch_ring_t *ring, shared_batch_t *batch, const u_char *packet, size_t caplen){
+    int owner = (int)(flow_hash(packet, caplen) % (uint64_t)ring->workers);
+    batch->shards[owner][batch->shard_count[owner]++] = (uint16_t)(batch->count - 1);
+}
+
+/**
+ * copy one frame in the next free slot of the batch with its capture
+ * record, frames bigger than a slot get truncated to PACKET_SIZE
+ */
+static inline void batch_push(batch_ring_t *ring, shared_batch_t *batch, const u_char *packet, uint32_t caplen, uint32_t wire_len, uint64_t ts_ns){
+    if (caplen > PACKET_SIZE)
+        caplen = PACKET_SIZE;
+    memcpy(batch->packets[batch->count], packet, caplen);
+    packet_desc *desc = &batch->descs[batch->count];
+    desc->offset = 0;
+    desc->caplen = caplen;
+    desc->wire_len = wire_len;
+    desc->ts_ns = ts_ns;
+    desc->ingress = ring->ingress;
+    batch->count++;
+}
+
+/**
+ * get the frame at `index` of the batch, wherever it lives
+ */
+static inline const u_char *batch_packet(batch_ring_t *ring, shared_batch_t *batch, int index, size_t *len){
+    *len = batch->descs[index].caplen;
+    if (ring->zero_copy)
+        return ring->ring + batch->descs[index].offset;
+    return batch->packets[index];
+}
+
+/**
+ * drop one reference on a ring block, the last one out
+ * hands the block back to the kernel
+ */
+static void batch_block_unref(batch_ring_t *ring, uint32_t block){
+    if (atomic_fetch_sub(&ring->block_refs[block], 1) == 1) {
+        tpacket_release_block((struct tpacket_block_desc *)
+            (ring->ring + (size_t)block * ring->ring_block_size));
+    }
+}
+
+/**
+ * take the next slot of the ring for filling, this only blocks
+ * when a worker is a whole ring behind
+ */
+shared_batch_t *acquire_batch(batch_ring_t *ring){
+    shared_batch_t *batch = &ring->slots[ring->next_seq & (ring->depth - 1)];
+    for (int i = 0; i < ring->workers; i++) {
+        spsc_wait_not_full(ring->queues[i]);
+    }
+    if (ring->xsk && batch->count > 0) {
+        for (int i = 0; i < batch->count; i++) {
+            xdp_fill_frame(ring->xsk, batch->descs[i].offset);
+        }
+        xdp_fill_flush(ring->xsk);
+    }
+    batch->seq = ring->next_seq;
+    if (ring->stats)
+        batch->open_ns = monotonic_ns();
+    batch->count = 0;
+    batch->blocks_count = 0;
+    memset(batch->shard_count, 0, sizeof(int) * ring->workers);
+    ring->filling = batch;
+    return batch;
+}
+
+/**
+ * hand the batch being filled to the workers and move on to
+ * the next slot without waiting for them
+ */
+void publish_batch(batch_ring_t *ring){
+    shared_batch_t *batch = ring->filling;
+    printf("[SNIFFER] Captured %d packets (batch %lu)\n", batch->count, (unsigned long)batch->seq);
+    if (ring->stats) {
+        batch->publish_ns = monotonic_ns();
+        ring->stats->batches++;
+        ring->stats->batch_packets += batch->count;
+        latency_record(&ring->stats->fill, batch->publish_ns - batch->open_ns);
+    }
+    // every worker holds the blocks of this batch until it's done with it,
+    // they take over the reference the batch held while it was filled
+    for (int i = 0; i < batch->blocks_count; i++) {
+        atomic_fetch_add(&ring->block_refs[batch->blocks[i]], ring->workers);
+        batch_block_unref(ring, batch->blocks[i]);
+    }
+    // mark batch ready, acquire_batch already made room in every queue
+    for (int i = 0; i < ring->workers; i++) {
+        spsc_try_push(ring->queues[i], batch->seq);
+    }
+    ring->next_seq++;
+    acquire_batch(ring);
+}
+
+/**
+ * the sniffer is done, hand over what's left and tell every worker
+ * to exit once it drained the ring
+ */
+void close_batch_ring(batch_ring_t *ring){
+    if (ring->filling->count > 0)
+        publish_batch(ring);
+    for (int i = 0; i < ring->workers; i++) {
+        spsc_push(ring->queues[i], BATCH_STOP);
+    }
+}
+
+void packet_handler(u_char *user, const struct pcap_pkthdr *hdr, const u_char *packet) {
+    batch_ring_t *ring = (batch_ring_t*)user;
+
+    if (ring->filling->count >= MAX_BATCH) return; // simple overflow protection
+
+    uint64_t frac_ns = ring->pcap_nano ? (uint64_t)hdr->ts.tv_usec : (uint64_t)hdr->ts.tv_usec * 1000ULL;
+    batch_push(ring, ring->filling, packet, hdr->caplen, hdr->len,
+        (uint64_t)hdr->ts.tv_sec * 1000000000ULL + frac_ns);
+    batch_shard(ring, ring->filling, packet, hdr->caplen);
+}
+
+/**
+ * same as packet_handler but for frames walked out of a TPACKET_V3 block,
+ * a block can hold more frames than a batch so a full batch is
+ * published right away instead of dropping the rest of the block
+ */
+void tpacket_frame_handler(u_char *user, const struct tpacket3_hdr *hdr, const u_char *frame){
+    batch_ring_t *ring = (batch_ring_t*)user;
+
+    if (ring->filling->count >= MAX_BATCH)
+        publish_batch(ring);
+
+    batch_push(ring, ring->filling, frame, hdr->tp_snaplen, hdr->tp_len,
+        (uint64_t)hdr->tp_sec * 1000000000ULL + hdr->tp_nsec);
+    batch_shard(ring, ring->filling, frame, hdr->tp_snaplen);
+}
+
+/**
+ * zero copy flavour of tpacket_frame_handler, only a descriptor
+ * pointing into the ring goes in the batch, nothing is truncated
+ */
+void tpacket_desc_handler(u_char *user, const struct tpacket3_hdr *hdr, const u_char *frame){
+    batch_ring_t *ring = (batch_ring_t*)user;
+
+    if (ring->filling->count >= MAX_BATCH)
+        publish_batch(ring);
+
+    shared_batch_t *batch = ring->filling;
+    uint64_t offset = (uint64_t)(frame - ring->ring);
+    uint32_t block = (uint32_t)(offset / ring->ring_block_size);
+    // frames of a block are contiguous, so only compare with the last one.
+    // the batch holds the block until it's published
+    if (batch->blocks_count == 0 || batch->blocks[batch->blocks_count - 1] != block){
+        batch->blocks[batch->blocks_count++] = block;
+        atomic_fetch_add(&ring->block_refs[block], 1);
+    }
+
+    packet_desc *desc = &batch->descs[batch->count];
+    desc->offset = offset;
+    desc->caplen = hdr->tp_snaplen;
+    desc->wire_len = hdr->tp_len;
+    desc->ts_ns = (uint64_t)hdr->tp_sec * 1000000000ULL + hdr->tp_nsec;
+    desc->ingress = ring->ingress;
+    batch->count++;
+    batch_shard(ring, batch, frame, hdr->tp_snaplen);
+}
+
+/**
+ * run the user space filter of the ring on a frame
+ * ### return:
+ *  `uint32_t`: how many bytes of the frame to keep (snaplen applied)
+ *  `0`: the filter rejected it
+ */
+static inline uint32_t sniffer_filter(batch_ring_t *ring, const u_char *frame, uint32_t len){
+    uint32_t caplen = len < ring->snaplen ? len : ring->snaplen;
+    if (!ring->filter)
+        return caplen;
+    struct pcap_pkthdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.caplen = len;
+    hdr.len = len;
+    // the program returns how many bytes to keep, 0 is a reject
+    int keep = pcap_offline_filter(ring->filter, &hdr, frame);
+    if (keep <= 0)
+        return 0;
+    return (uint32_t)keep < caplen ? (uint32_t)keep : caplen;
+}
+
+/**
+ * xdp flavour of tpacket_desc_handler, the descriptor points into
+ * the UMEM and the frame is recycled when its slot is reused
+ */
+void xdp_desc_handler(u_char *user, const struct xdp_desc *xdesc, const u_char *frame){
+    batch_ring_t *ring = (batch_ring_t*)user;
+    uint32_t caplen = sniffer_filter(ring, frame, xdesc->len);
+    if (caplen == 0){
+        xdp_fill_frame(ring->xsk, xdesc->addr);
+        return;
+    }
+
+    if (ring->filling->count >= MAX_BATCH)
+        publish_batch(ring);
+
+    shared_batch_t *batch = ring->filling;
+    packet_desc *desc = &batch->descs[batch->count];
+    desc->offset = xdesc->addr;
+    desc->caplen = caplen;
+    desc->wire_len = xdesc->len;
+    desc->ts_ns = ring->rx_ts_ns;
+    desc->ingress = ring->ingress;
+    batch->count++;
+    batch_shard(ring, batch, frame, caplen);
+}
+
+/**
+ * replay flavour of tpacket_desc_handler, the descriptor points into
+ * the mmap'd file so there is nothing to give back
+ */
+void replay_desc_handler(u_char *user, const packet_desc *rdesc, const u_char *frame){
+    batch_ring_t *ring = (batch_ring_t*)user;
+    uint32_t caplen = sniffer_filter(ring, frame, rdesc->caplen);
+    if (caplen == 0)
+        return;
+
+    if (ring->filling->count >= MAX_BATCH)
+        publish_batch(ring);
+
+    shared_batch_t *batch = ring->filling;
+    packet_desc *desc = &batch->descs[batch->count];
+    *desc = *rdesc;
+    desc->caplen = caplen;
+    batch->count++;
+    batch_shard(ring, batch, frame, caplen);
+}
+
+void sniffer(pcap_t *initiated_pcap){
+    batch_ring->pcap_nano = pcap_get_tstamp_precision(initiated_pcap) == PCAP_TSTAMP_PRECISION_NANO;
+    acquire_batch(batch_ring);
+    while (1) {
+        int res = pcap_dispatch(initiated_pcap, MAX_BATCH, packet_handler, (u_char*)batch_ring);
+        
+        if (res < 0) {
+            fprintf(stderr, "[x] pcap error: %s\n", pcap_geterr(initiated_pcap));
+            break;
+        }
+        
+        if (res == 0) {
+            // No packets captured, continue waiting
+            continue;
+        }
+
+        publish_batch(batch_ring);
+    }
+    close_batch_ring(batch_ring);
+}
+
+/**
+ * sniffer loop for the TPACKET_V3 backend, drains every block the kernel
+ * already retired and only publishes when the batch is full or the ring
+ * ran dry, so one poll() covers many packets
+ */
+void sniffer_tpacket(tpacket_ring *ring){
+    acquire_batch(batch_ring);
+    while (running) {
+        // a lap ahead of the workers: the next block still has frames of
+        // a batch in flight and isn't the kernel's yet, it stays
+        // TP_STATUS_USER with the frames we already took. hand over what
+        // we hold (it can be in there) and wait for them
+        if (batch_ring->zero_copy && atomic_load(&batch_ring->block_refs[ring->current]) != 0) {
+            if (batch_ring->filling->count > 0)
+                publish_batch(batch_ring);
+            else
+                sched_yield();
+            continue;
+        }
+        // don't sleep in poll while we are holding packets
+        int timeout = batch_ring->filling->count > 0 ? 0 : 1000;
+        struct tpacket_block_desc *block = tpacket_next_block(ring, timeout);
+        if (!block) {
+            if (batch_ring->filling->count > 0)
+                publish_batch(batch_ring);
+            continue;
+        }
+        if (!batch_ring->zero_copy) {
+            tpacket_walk_block(block, tpacket_frame_handler, (u_char*)batch_ring);
+            tpacket_release_block(block);
+            continue;
+        }
+        // the sniffer holds its own reference while it walks the block,
+        // a block can be spread over many batches
+        uint32_t index = (uint32_t)(((u_char*)block - ring->map) / ring->block_size);
+        atomic_fetch_add(&batch_ring->block_refs[index], 1);
+        tpacket_walk_block(block, tpacket_desc_handler, (u_char*)batch_ring);
+        batch_block_unref(batch_ring, index);
+    }
+    close_batch_ring(batch_ring);
+}
+
+/**
+ * sniffer loop for the AF_XDP backend, same shape as sniffer_tpacket
+ */
+void sniffer_xdp(xdp_socket *xsk){
+    acquire_batch(batch_ring);
+    while (running) {
+        // don't sleep in poll while we are holding packets
+        int timeout = batch_ring->filling->count > 0 ? 0 : 1000;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        batch_ring->rx_ts_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+        int res = xdp_walk_rx(xsk, MAX_BATCH, timeout, xdp_desc_handler, (u_char*)batch_ring);
+        if (res < 0) {
+            perror("[x] xdp error");
+            break;
+        }
+        // give the frames the filter rejected back right away
+        if (batch_ring->filter)
+            xdp_fill_flush(xsk);
+        if (res == 0 && batch_ring->filling->count > 0)
+            publish_batch(batch_ring);
+    }
+    close_batch_ring(batch_ring);
+}
+
+/**
+ * sniffer loop for a replayed file, publishes whenever the pacing
+ * leaves it waiting and stops once every loop was played
+ */
+void sniffer_replay(replay_file *file){
+    acquire_batch(batch_ring);
+    while (running && !file->finished) {
+        int res = replay_walk(file, MAX_BATCH, 1000, replay_desc_handler, (u_char*)batch_ring);
+        if (res < 0)
+            break;
+        // a full batch is already published by the handler
+        if (res < MAX_BATCH && batch_ring->filling->count > 0)
+            publish_batch(batch_ring);
+    }
+    printf("[SNIFFER] replay done, %d loop(s)\n", file->loops_done);
+    close_batch_ring(batch_ring);
+}
+
+void worker(int id){
+
+    char filename[64];
+    snprintf(filename, sizeof(filename), "worker_%d.log", id);
+    freopen(filename, "w", stdout);
+    // index of this worker inside its capture group
+    int local = id - batch_ring->first_worker;
+    spsc_ring *queue = batch_ring->queues[local];
+    // every timeout of this worker, moved by packet time (the clock when
+    // there's none) once per batch
+    timer_wheel *timers = INIT_TIMER_WHEEL(WORKER_TIMER_TICK_NS);
+    defrag_table *defrag = NULL;
+    if (batch_ring->defrag.enabled){
+        defrag = INIT_DEFRAG(&batch_ring->defrag, timers);
+        if (!defrag)
+            printf("[!] worker %d runs without fragment reassembly\n", id);
+    }
+    flow_table *flows = NULL;
+    if (batch_ring->flows.enabled){
+        flows = INIT_FLOW_TABLE(&batch_ring->flows, timers);
+        if (!flows)
+            printf("[!] worker %d runs without a flow table\n", id);
+    }
+    stream_table *streams = NULL;
+    if (flows && batch_ring->streams.enabled){
+        streams = INIT_STREAMS(&batch_ring->streams, flows);
+        if (!streams)
+            printf("[!] worker %d runs without stream reassembly\n", id);
+    }
+    detector *detect = NULL;
+    if (batch_ring->rules){
+        detect = INIT_DETECTOR(batch_ring->rules, streams);
+        if (!detect)
+            printf("[!] worker %d runs without payload inspection\n", id);
+    }
+    while (1) {
+        // batches come in the order they were published
+        uint64_t seq = 0;
+        spsc_wait_peek(queue, &seq);
+        if (seq == BATCH_STOP) {
+            spsc_pop(queue);
+            break;
+        }
+        shared_batch_t *batch = &batch_ring->slots[seq & (batch_ring->depth - 1)];
+        pipeline_stats *stats = batch_ring->stats;
+        uint64_t picked_ns = stats ? monotonic_ns() : 0;
+        uint64_t bytes = 0;
+        // packet time drives the timeouts, a batch without packets of this
+        // worker doesn't move them
+        uint64_t latest_ns = 0;
+        // only the packets of the flows this worker owns, decoded
+        // into records first, the stages after that never parse again
+        int count = batch->shard_count[local];
+        for (int n = 0; n < count; n++) {
+            int index = batch->shards[local][n];
+            size_t len = 0;
+            const u_char *pkt = batch_packet(batch_ring, batch, index, &len);
+            const packet_desc *desc = &batch->descs[index];
+            bytes += len;
+            packet_meta *meta = &worker_metas[n];
+            decode_packet(pkt, (uint32_t)len, desc->ts_ns, meta);
+            meta->wire_len = desc->wire_len;
+            meta->ingress = desc->ingress;
+            worker_flows[n] = NULL;
+            uint64_t ts_ns = packet_time(meta->ts_ns);
+            if (ts_ns > latest_ns)
+                latest_ns = ts_ns;
+            // the fragment that completes a datagram gets the record of
+            // the whole datagram, the others keep their fragment record
+            const u_char *frame = pkt;
+            if (defrag && meta->flags & META_FRAGMENT && !meta->tunnel_count){
+                const u_char *whole = NULL;
+                int whole_len = defrag_push(defrag, pkt, meta, ts_ns, &whole);
+                if (whole_len > 0){
+                    decode_packet(whole, (uint32_t)whole_len, meta->ts_ns, meta);
+                    meta->wire_len = (uint32_t)whole_len;
+                    meta->ingress = desc->ingress;
+                    frame = whole;
+                }
+            }
+            // a piece of a datagram isn't a packet of its flow yet
+            bool streamed = false;
+            if (flows && !(meta->flags & META_FRAGMENT)){
+                int direction = FLOW_TO_SERVER;
+                worker_flows[n] = flow_track(flows, meta, ts_ns, &direction);
+                worker_directions[n] = (uint8_t)direction;
+                // a reassembled datagram is overwritten by the next one
+                if (streams && worker_flows[n]){
+                    stream_push(streams, worker_flows[n], direction, frame, meta, frame != pkt);
+                    streamed = meta->ip_proto == IPPROTO_TCP && meta->flags & META_HAS_L4;
+                }
+            }
+            // a datagram being reassembled is looked up once it's whole
+            bool pending = defrag && meta->flags & META_FRAGMENT && !meta->tunnel_count;
+            if (batch_ring->reputation && !pending)
+                reputation_check(batch_ring->reputation, meta, worker_flows[n]);
+            // the payload of tcp streams is looked at once reassembled
+            if (detect)
+                detect_packet(detect, meta, frame, worker_flows[n], worker_directions[n], !streamed, frame != pkt);
+        }
+
+        // reading the packets is just a sink, off unless asked for
+        if (batch_ring->text_output) {
+            printf("[Worker %d] Processing %d/%d packets (batch %lu)\n",
+                id, count, batch->count, (unsigned long)batch->seq);
+            for (int n = 0; n < count; n++) {
+                meta_print(&worker_metas[n], stdout);
+            }
+            fflush(stdout);
+        }
+
+        // payloads are scanned while the frames are still there
+        if (detect)
+            detect_batch_end(detect);
+
+        // held stream data is copied out before the batch goes
+        if (streams)
+            stream_batch_end(streams);
+
+        // let go of the ring blocks this batch pointed into
+        for (int i = 0; i < batch->blocks_count; i++) {
+            batch_block_unref(batch_ring, batch->blocks[i]);
+        }
+
+        if (stats) {
+            uint64_t done_ns = monotonic_ns();
+            stats->packets[local] += batch->shard_count[local];
+            stats->bytes[local] += bytes;
+            stats->end_ns[local] = done_ns;
+            latency_record(&stats->queue[local], picked_ns - batch->publish_ns);
+            latency_record(&stats->work[local], done_ns - picked_ns);
+            latency_record(&stats->total[local], done_ns - batch->open_ns);
+        }
+
+        // timeouts go last, the flows of this batch stay valid till here
+        if (timers && (defrag || flows) && latest_ns)
+            timer_advance(timers, latest_ns);
+
+        // signal done, this hands the slot back to the sniffer
+        spsc_pop(queue);
+    }
+    if (defrag){
+        printf("[@] defrag: %lu fragments, %lu reassembled, %lu overlaps, %lu timeouts, %lu evictions, %lu dropped (%lu oversized)\n",
+            (unsigned long)defrag->stats.fragments, (unsigned long)defrag->stats.reassembled,
+            (unsigned long)defrag->stats.overlaps, (unsigned long)defrag->stats.timeouts,
+            (unsigned long)defrag->stats.evictions, (unsigned long)defrag->stats.dropped,
+            (unsigned long)defrag->stats.oversized);
+        FREE_DEFRAG(defrag);
+    }
+    if (flows){
+        printf("[@] flows: %lu created, %lu expired, %lu midstream, %lu untracked, %u active\n",
+            (unsigned long)flows->stats.created, (unsigned long)flows->stats.expired,
+            (unsigned long)flows->stats.midstream, (unsigned long)flows->stats.untracked, flows->active);
+        if (streams){
+            printf("[@] streams: %lu segments, %lu in order bytes, %lu out of order, %lu copied bytes, %lu overlap bytes\n",
+                (unsigned long)streams->stats.segments, (unsigned long)streams->stats.in_order_bytes,
+                (unsigned long)streams->stats.out_of_order, (unsigned long)streams->stats.copied_bytes,
+                (unsigned long)streams->stats.overlap_bytes);
+            printf("[@] streams: %lu gaps (%lu flow buffer, %lu memory), %lu at depth, peak %u chunks %u segments, %lu bytes held\n",
+                (unsigned long)streams->stats.gaps, (unsigned long)streams->stats.flow_limit,
+                (unsigned long)streams->stats.memory_limit, (unsigned long)streams->stats.depth_reached,
+                streams->stats.peak_chunks, streams->stats.peak_segments, (unsigned long)stream_memory(streams));
+            FREE_STREAMS(streams);
+        }
+        FREE_FLOW_TABLE(flows);
+    }
+    if (batch_ring->reputation)
+        printf("[@] reputation: %lu lookups, %lu listed\n",
+            (unsigned long)reputation_lookups, (unsigned long)reputation_hits);
+    if (detect){
+        printf("[@] detect: %lu packets, %lu stream chunks, %lu bytes scanned, %lu fast pattern hits (%lu dropped), "
+            "%lu rules evaluated, %lu alerts\n",
+            (unsigned long)detect->stats.packets, (unsigned long)detect->stats.chunks,
+            (unsigned long)detect->stats.bytes, (unsigned long)detect->stats.hits,
+            (unsigned long)detect->stats.dropped_hits, (unsigned long)detect->stats.evaluated,
+            (unsigned long)detect->stats.alerts);
+        if (detect->regex)
+            printf("[@] pcre: %lu searches, %lu dfa states built, %lu cache flushes, %lu finished on the nfa\n",
+                (unsigned long)detect->regex->stats.searches, (unsigned long)detect->regex->stats.dfa_states,
+                (unsigned long)detect->regex->stats.flushes, (unsigned long)detect->regex->stats.nfa_searches);
+        FREE_DETECTOR(detect);
+    }
+    FREE_TIMER_WHEEL(timers);
+    fflush(stdout);
+}
+
+/**
+ * create a ring of `depth` batches (a power of two) in shared memory for a capture group
+ * of `workers` workers, `first_worker` is the global id of the first one
+ * ### return:
+ *  `batch_ring_t *`: if successful
+ *  `NULL`: on error
+ */
+batch_ring_t *INIT_BATCH_RING(int depth, int workers, int first_worker){
+    // just create an annonymous shared mempry holding the ring of batches
+    batch_ring_t *ring = mmap(NULL, sizeof(batch_ring_t) + sizeof(shared_batch_t) * depth, 
+                        PROT_READ | PROT_WRITE, 
+                        MAP_SHARED | MAP_ANONYMOUS,  // ← no file descriptor needed
+                        -1, 0);
+    if (ring == MAP_FAILED){
+        printf("[x] can't allocate the batch ring\n");
+        return NULL;
+    }
+    ring->depth = depth;
+    ring->workers = workers;
+    ring->first_worker = first_worker;
+    ring->next_seq = 0;
+    // one queue of batch seqs per worker
+    for (int i = 0; i < workers; i++) {
+        ring->queues[i] = spsc_create_shared(depth);
+        if (!ring->queues[i]){
+            printf("[x] can't allocate the queue of worker %d\n", first_worker + i);
+            return NULL;
+        }
+    }
+    return ring;
+}
+
+/**
+ * let the workers of `ring` read frames straight from the tpacket ring,
+ * must be called before the fork
+ * ### return:
+ *  `0`: if successful
+ *  `-1`: on error
+ */
+int share_tpacket_ring(batch_ring_t *ring, tpacket_ring *tp){
+    ring->block_refs = mmap(NULL, sizeof(atomic_int) * tp->block_count,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    if (ring->block_refs == MAP_FAILED){
+        printf("[x] can't allocate the ring block refcounts\n");
+        return -1;
+    }
+    for (unsigned int i = 0; i < tp->block_count; i++) {
+        atomic_init(&ring->block_refs[i], 0);
+    }
+    ring->ring = tp->map;
+    ring->ring_block_size = tp->block_size;
+    ring->zero_copy = true;
+    return 0;
+}
+
+/**
+ * create the stats of a ring in shared memory, before the fork
+ * ### return:
+ *  `pipeline_stats *`: if successful
+ *  `NULL`: on error
+ */
+pipeline_stats *INIT_PIPELINE_STATS(){
+    pipeline_stats *stats = mmap(NULL, sizeof(pipeline_stats),
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    if (stats == MAP_FAILED){
+        printf("[x] can't allocate the pipeline stats\n");
+        return NULL;
+    }
+    latency_reset(&stats->fill);
+    for (int i = 0; i < MAX_WORKERS; i++) {
+        latency_reset(&stats->queue[i]);
+        latency_reset(&stats->work[i]);
+        latency_reset(&stats->total[i]);
+    }
+    return stats;
+}
+
+/**
+ * pin the calling process on `cpu` (wrapped on the online cpus)
+ */
+void pin_to_cpu(int cpu){
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online < 1)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % online, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        perror("[!] can't pin process");
+}
@@ -0,0 +1,129 @@
+#ifndef PIPELINE_HEADERS
+#define PIPELINE_HEADERS
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "../capture/capture.h"
+#include "../../helpers/helpers.h"
+#include "../flow/flow.h"
+#include "../detect/detect.h"
+
+/**
+ * sniffer -> batch ring -> workers, shared by main and the benchmark
+ */
+
+#define MAX_BATCH 1024
+#define PACKET_SIZE 2048
+#define MAX_WORKERS 64
+// pushed to every worker queue once the sniffer is done for good
+#define BATCH_STOP UINT64_MAX
+
+typedef struct {
+    uint64_t seq;          // sequence number of the batch held in this slot
+    int count;
+    // capture record of every frame: time, caplen, wire length, ingress
+    packet_desc descs[MAX_BATCH];
+    u_char packets[MAX_BATCH][PACKET_SIZE];
+
+    // zero copy mode, the batch only carries descriptors into the ring
+    int blocks_count;           // ring blocks referenced by this batch
+    uint32_t blocks[MAX_BATCH];
+
+    // per worker queues, indexes of the packets of each worker's flows
+    int shard_count[MAX_WORKERS];
+    uint16_t shards[MAX_WORKERS][MAX_BATCH];
+
+    // CLOCK_MONOTONIC, only stamped when the ring keeps stats
+    uint64_t open_ns;           // the sniffer started filling it
+    uint64_t publish_ns;        // handed to the workers
+} shared_batch_t;
+
+/**
+ * what the pipeline measured, in shared memory, every field has a
+ * single writer (the sniffer or one worker) so there are no atomics,
+ * read it once the processes are gone
+ */
+typedef struct {
+    // sniffer side
+    uint64_t batches;
+    uint64_t batch_packets;
+    latency_hist fill;                  // batch opened -> published
+    // worker side, by index in the capture group
+    uint64_t packets[MAX_WORKERS];
+    uint64_t bytes[MAX_WORKERS];
+    uint64_t end_ns[MAX_WORKERS];       // last batch done
+    latency_hist queue[MAX_WORKERS];    // published -> picked up by the worker
+    latency_hist work[MAX_WORKERS];     // picked up -> worker done with its flows
+    latency_hist total[MAX_WORKERS];    // batch opened -> worker done with it
+} pipeline_stats;
+
+/**
+ * ring of `depth` batches, the sniffer fills batch k+1 while the
+ * workers are still on batch k and only waits when every slot is
+ * still being drained.
+ * each worker has its own spsc queue of batch seqs, a worker only pops
+ * a seq once it's done with the batch, so a queue with room in it means
+ * that worker is done with the slot the sniffer is about to reuse
+ */
+typedef struct {
+    int depth;
+    int workers;                        // how many workers consume each batch
+    int first_worker;                   // global id of the first of them
+    spsc_ring *queues[MAX_WORKERS];     // one per worker, `depth` seqs each
+    uint64_t next_seq;                  // sniffer side, seq of the slot being filled
+    shared_batch_t *filling;            // sniffer side, slot being filled
+
+    // zero copy mode, frames stay in the capture ring and a ring block
+    // goes back to the kernel when its refcount
+    // (sniffer + one per worker per batch) hits 0
+    bool zero_copy;
+    u_char *ring;               // capture ring (or UMEM), same address in every process
+    size_t ring_block_size;
+    atomic_int *block_refs;     // one counter per ring block, NULL for xdp
+
+    // xdp mode, sniffer side, the frames of a slot go back to the fill
+    // ring when the slot gets reused since every worker is done with it
+    xdp_socket *xsk;
+    uint64_t rx_ts_ns;          // xdp has no per frame timestamp, one per rx walk
+    // the xdp program and a replayed file can't run a pcap filter in the
+    // kernel, so the sniffer does it before the frame costs us a batch
+    // slot, NULL when there's no filter
+    struct bpf_program *filter;
+    uint32_t snaplen;
+    uint32_t ingress;           // ifindex of the capture interface, replays bring their own
+    bool pcap_nano;             // sniffer side, pcap puts ns in ts.tv_usec
+
+    pipeline_stats *stats;      // NULL unless something measures the pipeline
+    bool text_output;           // workers print every packet in their log
+    defrag_config defrag;       // every worker builds its own table from it
+    flow_config flows;          // same
+    stream_config streams;      // needs the flows
+    const rule_db *rules;       // mapped before the fork, NULL when there's nothing to look for
+    const lpm_db *reputation;   // same, the listed prefixes the endpoints are looked up in
+
+    shared_batch_t slots[];
+} batch_ring_t;
+
+// the ring of the capture group this process belongs to
+extern batch_ring_t *batch_ring;
+
+batch_ring_t *INIT_BATCH_RING(int depth, int workers, int first_worker);
+int share_tpacket_ring(batch_ring_t *ring, tpacket_ring *tp);
+pipeline_stats *INIT_PIPELINE_STATS();
+void pin_to_cpu(int cpu);
+
+shared_batch_t *acquire_batch(batch_ring_t *ring);
+void publish_batch(batch_ring_t *ring);
+void close_batch_ring(batch_ring_t *ring);
+
+void tpacket_frame_handler(u_char *user, const struct tpacket3_hdr *hdr, const u_char *frame);
+void tpacket_desc_handler(u_char *user, const struct tpacket3_hdr *hdr, const u_char *frame);
+void xdp_desc_handler(u_char *user, const struct xdp_desc *xdesc, const u_char *frame);
+void replay_desc_handler(u_char *user, const packet_desc *rdesc, const u_char *frame);
+
+void sniffer(pcap_t *initiated_pcap);
+void sniffer_tpacket(tpacket_ring *ring);
+void sniffer_xdp(xdp_socket *xsk);
+void sniffer_replay(replay_file *file);
+void worker(int id);
+#endif
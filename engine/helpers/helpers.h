@@ -137,6 +137,110 @@ typedef struct
     _Atomic (Hashmap *) curr_table;
 }hashmap_resize_info;
 
+#define CACHE_LINE_SIZE 64
+
+/** single producer / single consumer ring in shared memory */
+typedef struct{
+    // producer's line
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t head;
+    _Atomic uint32_t consumer_sleeping;     // futex word, set when the ring was found empty
+    // consumer's line
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t tail;
+    _Atomic uint32_t producer_sleeping;     // futex word, set when the ring was found full
+    // read only after creation
+    _Alignas(CACHE_LINE_SIZE) uint32_t capacity;
+    size_t mapped_size;
+    uint64_t entries[];
+}spsc_ring;
+
+// 16 linear sub buckets per power of two, ~6% error on any value
+#define LATENCY_SUB_BITS 4
+#define LATENCY_BUCKETS (64 << LATENCY_SUB_BITS)
+
+/** log-linear histogram of latencies in ns, one writer, no locks */
+typedef struct{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+}latency_hist;
+
+// hierarchical timing wheel: TIMER_LEVELS levels of 2^TIMER_SLOT_BITS slots,
+// level n slots are 2^(n*TIMER_SLOT_BITS) ticks wide
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4
+
+typedef struct timer_entry timer_entry;
+typedef void (*timer_fn)(timer_entry *timer, void *ctx, uint64_t now_ns);
+
+/** embedded in whatever expires, pending while pprev isn't NULL */
+struct timer_entry{
+    timer_entry *next;
+    timer_entry **pprev;
+    uint64_t expires;       // tick
+    timer_fn fn;
+    void *ctx;
+};
+
+/** one owner, no locks: time only moves when the owner calls timer_advance */
+typedef struct{
+    uint64_t tick_ns;
+    uint64_t now;           // next tick to run
+    bool started;
+    uint64_t count;
+    uint64_t occupied[TIMER_LEVELS];        // slots that may hold timers
+    timer_entry *slots[TIMER_LEVELS][TIMER_SLOTS];
+}timer_wheel;
+
+// longest prefix match (poptrie): a direct table on the first
+// LPM_DIRECT_BITS bits, then nodes of 2^LPM_STRIDE slots
+#define LPM_MAGIC 0x4d504c41            // "ALPM"
+#define LPM_VERSION 1
+#define LPM_DIRECT_BITS 16
+#define LPM_STRIDE 6
+#define LPM_LEAF 0x80000000u            // a direct entry that is a value, not a node
+#define LPM_MAX_TAGS 65535
+#define LPM_TAG_MAX 64
+
+/**
+ * 64 slots, each goes on to a child or ends on a value. the children of
+ * a node are next to each other and so are its values, a run of slots
+ * with the same value keeps one: a slot is found by counting the bits
+ * before it
+ */
+typedef struct{
+    uint64_t vector;                    // slots that have a child
+    uint64_t leafvec;                   // the other slots, where a new run of values starts
+    uint32_t base0;                     // first value of the node, in the leaves
+    uint32_t base1;                     // first child, in the nodes
+}lpm_node;
+
+typedef struct{
+    uint64_t direct_offset;             // uint32_t per 2^LPM_DIRECT_BITS, a node or LPM_LEAF | value
+    uint64_t nodes_offset;
+    uint64_t leaves_offset;             // uint32_t values
+    uint32_t node_count;
+    uint32_t leaf_count;
+    uint32_t prefix_count;
+    uint32_t pad;
+}lpm_tree;
+
+/**
+ * prefixes of a list file, one immutable image mapped read only before
+ * the fork. a value is the tag of the longest prefix that covers the
+ * address, 0 when none does
+ */
+typedef struct{
+    uint32_t magic;                     // LPM_MAGIC
+    uint32_t version;                   // LPM_VERSION
+    uint64_t size;                      // of the whole image
+    lpm_tree trees[2];                  // ipv4, ipv6
+    uint32_t tag_count;
+    uint32_t tags_offset;               // offset of each nul terminated tag, tag n is value n + 1
+}lpm_db;
+
 /*Json api*/
 void *get_nested_values(cJSON *json,type type,  unsigned int argcount, ...);
 
@@ -227,6 +331,43 @@ int cache_Data(redisContext *c, Data *data, char *key);
 int cache_Array(redisContext *c, Array *data,char *key);
 redisContext *create_redis_conn();
 
+/** SPSC ring API */
+spsc_ring *spsc_create_shared(uint32_t capacity);
+void spsc_free_shared(spsc_ring *ring);
+uint32_t spsc_size(spsc_ring *ring);
+bool spsc_try_push(spsc_ring *ring, uint64_t value);
+void spsc_push(spsc_ring *ring, uint64_t value);
+void spsc_wait_not_full(spsc_ring *ring);
+bool spsc_try_peek(spsc_ring *ring, uint64_t *value);
+void spsc_wait_peek(spsc_ring *ring, uint64_t *value);
+void spsc_pop(spsc_ring *ring);
+
+/** latency histogram API */
+void latency_reset(latency_hist *hist);
+void latency_record(latency_hist *hist, uint64_t value);
+void latency_merge(latency_hist *into, const latency_hist *from);
+uint64_t latency_percentile(const latency_hist *hist, double quantile);
+
+/** timer wheel API */
+timer_wheel *INIT_TIMER_WHEEL(uint64_t tick_ns);
+void FREE_TIMER_WHEEL(timer_wheel *wheel);
+void timer_start(timer_wheel *wheel, uint64_t now_ns);
+void timer_add(timer_wheel *wheel, timer_entry *timer, uint64_t expires_ns, timer_fn fn, void *ctx);
+void timer_cancel(timer_wheel *wheel, timer_entry *timer);
+void timer_advance(timer_wheel *wheel, uint64_t now_ns);
+uint64_t timer_next_ns(const timer_wheel *wheel);
+static inline bool timer_pending(const timer_entry *timer){
+    return timer->pprev != NULL;
+}
+
+/** LPM API */
+lpm_db *lpm_compile(const char *path);
+int lpm_write(const lpm_db *db, const char *path);
+const lpm_db *INIT_LPM(const char *path);
+void FREE_LPM(const lpm_db *db);
+uint32_t lpm_lookup(const lpm_db *db, uint8_t version, const uint8_t *addr);
+const char *lpm_tag(const lpm_db *db, uint32_t value);
+
 Array *deep_copy_Array(Array *array);
 Data *deep_copy_Data(Data *data);
 #endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "./helpers.h"
+
+/**
+ * values under 2^LATENCY_SUB_BITS get a bucket each, above that every
+ * power of two is split in 2^LATENCY_SUB_BITS linear buckets, so the
+ * bucket of a value is found with one clz and the whole thing is a
+ * fixed 8KB array that can live in shared memory
+ */
+
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+
+static inline int latency_bucket(uint64_t value){
+    if (value < LATENCY_SUB_COUNT)
+        return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - LATENCY_SUB_BITS;
+    int sub = (int)((value >> shift) & (LATENCY_SUB_COUNT - 1));
+    return (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT + sub;
+}
+
+/**
+ * smallest value that falls in `bucket`
+ */
+static inline uint64_t latency_bucket_low(int bucket){
+    if (bucket < LATENCY_SUB_COUNT)
+        return (uint64_t)bucket;
+    int msb = bucket / LATENCY_SUB_COUNT + LATENCY_SUB_BITS - 1;
+    int sub = bucket % LATENCY_SUB_COUNT;
+    int shift = msb - LATENCY_SUB_BITS;
+    return ((uint64_t)(LATENCY_SUB_COUNT | sub)) << shift;
+}
+
+void latency_reset(latency_hist *hist){
+    memset(hist, 0, sizeof(latency_hist));
+    hist->min = UINT64_MAX;
+}
+
+void latency_record(latency_hist *hist, uint64_t value){
+    hist->buckets[latency_bucket(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+/**
+ * add every sample of `from` to `into`
+ */
+void latency_merge(latency_hist *into, const latency_hist *from){
+    if (from->count == 0)
+        return;
+    for (int i = 0; i < LATENCY_BUCKETS; i++){
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->min < into->min)
+        into->min = from->min;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+/**
+ * value under which `quantile` (0..1) of the samples fall, it's the
+ * middle of the bucket holding that rank, clamped to the seen min/max
+ * ### return:
+ *  `uint64_t`: the value
+ *  `0`: when the histogram is empty
+ */
+uint64_t latency_percentile(const latency_hist *hist, double quantile){
+    if (hist->count == 0)
+        return 0;
+    if (quantile <= 0)
+        return hist->min;
+    if (quantile >= 1)
+        return hist->max;
+    uint64_t rank = (uint64_t)(quantile * (double)hist->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++){
+        seen += hist->buckets[i];
+        if (seen < rank)
+            continue;
+        uint64_t low = latency_bucket_low(i);
+        uint64_t high = i + 1 < LATENCY_BUCKETS ? latency_bucket_low(i + 1) : hist->max;
+        uint64_t value = low + (high - low) / 2;
+        if (value < hist->min)
+            return hist->min;
+        return value > hist->max ? hist->max : value;
+    }
+    return hist->max;
+}
@@ -0,0 +1,602 @@
+#define _GNU_SOURCE
+#include "./helpers.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <endian.h>             // be64toh()
+#include <arpa/inet.h>          // inet_pton()
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * longest prefix match over ipv4 and ipv6, a poptrie: the first 16 bits
+ * of an address pick an entry of a direct table, either the value or the
+ * node to go on from. a node takes the next 6 bits, a slot goes on to a
+ * child or ends on a value. nodes don't keep 64 of each, the children of
+ * a node are next to each other, and so are its values with a run of the
+ * same one kept once: the bits of `vector` and `leafvec` before a slot
+ * say which one it is (popcount). values are pushed down when it's
+ * built, a slot has the value of the longest prefix that covers it, so a
+ * lookup never backtracks: 1 + 3 reads at most for ipv4, 1 + 19 for ipv6.
+ * list file, one prefix per line, `#` or `;` start a comment:
+ *   203.0.113.7 botnet
+ *   198.51.100.0/24 scanner
+ *   2001:db8::/32
+ * the tag is `listed` when there's none, the later of two equal prefixes
+ * wins
+ */
+
+#define LPM_DEFAULT_TAG "listed"
+
+// addresses as two 64 bit halves, ipv4 in the top 32 bits of `hi`
+typedef struct{
+    uint64_t hi;
+    uint64_t lo;
+    uint32_t value;
+    uint32_t line;
+    uint8_t len;
+}lpm_prefix;
+
+typedef struct{
+    lpm_prefix *prefixes;
+    uint32_t count;
+    uint32_t size;
+}lpm_list;
+
+typedef struct{
+    const lpm_prefix *prefixes;
+    uint32_t *direct;
+    lpm_node *nodes;
+    uint32_t node_count;
+    uint32_t node_size;
+    uint32_t *leaves;
+    uint32_t leaf_count;
+    uint32_t leaf_size;
+}lpm_builder;
+
+static inline uint32_t key_bits(uint64_t hi, uint64_t lo, unsigned offset, unsigned count){
+    // strides never straddle the two halves: 16 + 8 * 6 is 64
+    uint64_t word = offset < 64 ? hi << offset : lo << (offset - 64);
+    return (uint32_t)(word >> (64 - count));
+}
+
+static inline uint64_t below(unsigned slot){
+    return slot == 63 ? UINT64_MAX : (2ULL << slot) - 1;
+}
+
+static void *grow_array(void *array, uint32_t needed, uint32_t *size, size_t item){
+    if (needed <= *size)
+        return array;
+    uint32_t wanted = *size ? *size : 1024;
+    while (wanted < needed)
+        wanted *= 2;
+    void *grown = realloc(array, item * wanted);
+    if (grown)
+        *size = wanted;
+    return grown;
+}
+
+static int compare_prefix(const void *a, const void *b){
+    const lpm_prefix *left = a, *right = b;
+    if (left->hi != right->hi)
+        return left->hi < right->hi ? -1 : 1;
+    if (left->lo != right->lo)
+        return left->lo < right->lo ? -1 : 1;
+    if (left->len != right->len)
+        return (int)left->len - (int)right->len;
+    // qsort isn't stable, equal prefixes keep the order of the file
+    return left->line < right->line ? -1 : left->line > right->line;
+}
+
+/**
+ * a node for the prefixes [first, end) (they all have the same first
+ * `offset` bits) in nodes[index], `inherited` is the value of the longest
+ * shorter prefix that covers it
+ * ### return:
+ *  `0`: built
+ *  `-1`: out of memory
+ */
+static int build_node(lpm_builder *builder, uint32_t first, uint32_t end, unsigned offset,
+    uint32_t inherited, uint32_t index){
+    const lpm_prefix *prefixes = builder->prefixes;
+    uint32_t values[64];
+    uint8_t lens[64] = {0};
+    for (int s = 0; s < 64; s++)
+        values[s] = inherited;
+    // the prefixes that end in this node cover a range of its slots
+    for (uint32_t i = first; i < end; i++){
+        const lpm_prefix *prefix = &prefixes[i];
+        if (prefix->len <= offset || prefix->len > offset + LPM_STRIDE)
+            continue;
+        uint32_t slot = key_bits(prefix->hi, prefix->lo, offset, LPM_STRIDE);
+        uint32_t span = 1u << (offset + LPM_STRIDE - prefix->len);
+        for (uint32_t s = slot; s < slot + span; s++){
+            if (prefix->len >= lens[s]){
+                values[s] = prefix->value;
+                lens[s] = prefix->len;
+            }
+        }
+    }
+    // the longer ones go on in a child, the prefixes of a slot are next to each other
+    uint32_t child_first[64], child_end[64];
+    uint64_t vector = 0;
+    for (uint32_t i = first; i < end;){
+        uint32_t slot = key_bits(prefixes[i].hi, prefixes[i].lo, offset, LPM_STRIDE);
+        uint32_t next = i;
+        bool deeper = false;
+        while (next < end && key_bits(prefixes[next].hi, prefixes[next].lo, offset, LPM_STRIDE) == slot)
+            deeper |= prefixes[next++].len > offset + LPM_STRIDE;
+        if (deeper){
+            vector |= 1ULL << slot;
+            child_first[slot] = i;
+            child_end[slot] = next;
+        }
+        i = next;
+    }
+    uint32_t children = (uint32_t)__builtin_popcountll(vector);
+    uint32_t base1 = builder->node_count;
+    lpm_node *nodes = grow_array(builder->nodes, base1 + children, &builder->node_size, sizeof(lpm_node));
+    uint32_t *leaves = grow_array(builder->leaves, builder->leaf_count + 64, &builder->leaf_size, sizeof(uint32_t));
+    if (nodes)
+        builder->nodes = nodes;
+    if (leaves)
+        builder->leaves = leaves;
+    if (!nodes || !leaves)
+        return -1;
+    builder->node_count += children;
+    uint32_t base0 = builder->leaf_count;
+    uint64_t leafvec = 0;
+    bool any = false;
+    uint32_t last = 0;
+    for (int s = 0; s < 64; s++){
+        if (vector & (1ULL << s))
+            continue;
+        if (!any || values[s] != last){
+            leafvec |= 1ULL << s;
+            builder->leaves[builder->leaf_count++] = values[s];
+            last = values[s];
+            any = true;
+        }
+    }
+    builder->nodes[index] = (lpm_node){vector, leafvec, base0, base1};
+    uint32_t child = base1;
+    for (int s = 0; s < 64; s++){
+        if (!(vector & (1ULL << s)))
+            continue;
+        if (build_node(builder, child_first[s], child_end[s], offset + LPM_STRIDE, values[s], child++) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * the direct table of one family from its sorted prefixes, then a node
+ * for every entry that has longer prefixes under it
+ * ### return:
+ *  `0`: built
+ *  `-1`: out of memory
+ */
+static int build_tree(lpm_builder *builder, const lpm_prefix *prefixes, uint32_t count){
+    uint32_t entries = 1u << LPM_DIRECT_BITS;
+    uint8_t *lens = calloc(entries, 1);
+    builder->prefixes = prefixes;
+    builder->direct = calloc(entries, sizeof(uint32_t));
+    if (!lens || !builder->direct){
+        free(lens);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++){
+        const lpm_prefix *prefix = &prefixes[i];
+        if (prefix->len > LPM_DIRECT_BITS)
+            continue;
+        uint32_t entry = key_bits(prefix->hi, prefix->lo, 0, LPM_DIRECT_BITS);
+        uint32_t span = 1u << (LPM_DIRECT_BITS - prefix->len);
+        for (uint32_t e = entry; e < entry + span; e++){
+            if (prefix->len >= lens[e]){
+                builder->direct[e] = prefix->value;
+                lens[e] = prefix->len;
+            }
+        }
+    }
+    free(lens);
+    for (uint32_t e = 0; e < entries; e++)
+        builder->direct[e] |= LPM_LEAF;
+    for (uint32_t i = 0; i < count;){
+        uint32_t entry = key_bits(prefixes[i].hi, prefixes[i].lo, 0, LPM_DIRECT_BITS);
+        uint32_t next = i;
+        bool deeper = false;
+        while (next < count && key_bits(prefixes[next].hi, prefixes[next].lo, 0, LPM_DIRECT_BITS) == entry)
+            deeper |= prefixes[next++].len > LPM_DIRECT_BITS;
+        if (deeper){
+            uint32_t index = builder->node_count;
+            lpm_node *nodes = grow_array(builder->nodes, index + 1, &builder->node_size, sizeof(lpm_node));
+            if (!nodes)
+                return -1;
+            builder->nodes = nodes;
+            builder->node_count++;
+            uint32_t value = builder->direct[entry] & ~LPM_LEAF;
+            builder->direct[entry] = index;
+            if (build_node(builder, i, next, LPM_DIRECT_BITS, value, index) < 0)
+                return -1;
+        }
+        i = next;
+    }
+    return 0;
+}
+
+static int list_error(const char *path, int line, const char *what){
+    printf("[x] %s:%d: %s\n", path, line, what);
+    return -1;
+}
+
+/** the tag of a line, added the first time it's seen */
+static int64_t tag_value(char ***tags, uint32_t *count, uint32_t *size, const char *tag){
+    // lists come sorted by source more often than not
+    if (*count && strcmp((*tags)[*count - 1], tag) == 0)
+        return *count;
+    for (uint32_t i = 0; i < *count; i++)
+        if (strcmp((*tags)[i], tag) == 0)
+            return i + 1;
+    if (*count == LPM_MAX_TAGS)
+        return -1;
+    char **grown = grow_array(*tags, *count + 1, size, sizeof(char *));
+    if (!grown)
+        return -1;
+    *tags = grown;
+    if (!((*tags)[*count] = strdup(tag)))
+        return -1;
+    return ++*count;
+}
+
+/**
+ * one `<addr>[/<prefix>] [<tag>]` line into `list`, the bits past the
+ * prefix are dropped
+ * ### return:
+ *  `1`: a prefix was added, `0`: nothing on the line
+ *  `-1`: malformed
+ */
+static int parse_line(const char *path, int number, char *line, lpm_list *lists, char ***tags,
+    uint32_t *tag_count, uint32_t *tag_size){
+    char *c = line;
+    while (isspace((unsigned char)*c))
+        c++;
+    if (!*c || *c == '#' || *c == ';')
+        return 0;
+    char *addr = c;
+    while (*c && !isspace((unsigned char)*c) && *c != '#' && *c != ';')
+        c++;
+    char *addr_end = c;
+    while (isspace((unsigned char)*c))
+        c++;
+    const char *tag = LPM_DEFAULT_TAG;
+    if (*c && *c != '#' && *c != ';'){
+        char *tag_start = c;
+        while (*c && !isspace((unsigned char)*c) && *c != '#' && *c != ';')
+            c++;
+        if (c - tag_start >= LPM_TAG_MAX)
+            return list_error(path, number, "tag longer than 63 bytes");
+        char *tag_end = c;
+        while (isspace((unsigned char)*c))
+            c++;
+        if (*c && *c != '#' && *c != ';')
+            return list_error(path, number, "expected <addr>[/<prefix>] [<tag>]");
+        *tag_end = '\0';
+        tag = tag_start;
+    }
+    *addr_end = '\0';
+    char *slash = strchr(addr, '/');
+    if (slash)
+        *slash = '\0';
+    uint8_t bytes[16];
+    int family = strchr(addr, ':') ? 6 : 4;
+    if (inet_pton(family == 6 ? AF_INET6 : AF_INET, addr, bytes) != 1)
+        return list_error(path, number, "not an ipv4 or ipv6 address");
+    unsigned bits = family == 6 ? 128 : 32, len = bits;
+    if (slash){
+        char *end = NULL;
+        unsigned long prefix = strtoul(slash + 1, &end, 10);
+        if (!isdigit((unsigned char)slash[1]) || *end || prefix > bits)
+            return list_error(path, number, family == 6 ? "the prefix is 0 to 128" : "the prefix is 0 to 32");
+        len = (unsigned)prefix;
+    }
+    lpm_prefix prefix = {.len = (uint8_t)len, .line = (uint32_t)number};
+    for (unsigned i = 0; i < bits / 8; i++){
+        if (i < 8)
+            prefix.hi |= (uint64_t)bytes[i] << (56 - 8 * i);
+        else
+            prefix.lo |= (uint64_t)bytes[i] << (56 - 8 * (i - 8));
+    }
+    if (len < 64){
+        prefix.hi &= len ? UINT64_MAX << (64 - len) : 0;
+        prefix.lo = 0;
+    }else if (len < 128){
+        prefix.lo &= len > 64 ? UINT64_MAX << (128 - len) : 0;
+    }
+    int64_t value = tag_value(tags, tag_count, tag_size, tag);
+    if (value < 0)
+        return list_error(path, number, "out of memory or more than 65535 tags");
+    prefix.value = (uint32_t)value;
+    lpm_list *list = &lists[family == 6];
+    lpm_prefix *grown = grow_array(list->prefixes, list->count + 1, &list->size, sizeof(lpm_prefix));
+    if (!grown)
+        return list_error(path, number, "out of memory");
+    list->prefixes = grown;
+    list->prefixes[list->count++] = prefix;
+    return 1;
+}
+
+/**
+ * lay the image out: header, tag offsets, tags, then for each family its
+ * direct table, nodes and values (64 byte aligned)
+ */
+static lpm_db *lay_out(lpm_builder builders[2], const lpm_list lists[2], char **tags, uint32_t tag_count){
+    size_t tags_offset = (sizeof(lpm_db) + 7) & ~(size_t)7;
+    size_t size = tags_offset + sizeof(uint32_t) * tag_count;
+    for (uint32_t i = 0; i < tag_count; i++)
+        size += strlen(tags[i]) + 1;
+    size_t offsets[2][3];
+    for (int f = 0; f < 2; f++){
+        offsets[f][0] = (size + 63) & ~(size_t)63;
+        offsets[f][1] = offsets[f][0] + sizeof(uint32_t) * (1u << LPM_DIRECT_BITS);
+        offsets[f][2] = offsets[f][1] + sizeof(lpm_node) * builders[f].node_count;
+        size = offsets[f][2] + sizeof(uint32_t) * builders[f].leaf_count;
+    }
+    lpm_db *db = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (!db){
+        printf("[x] can't allocate the prefix list image\n");
+        return NULL;
+    }
+    memset(db, 0, size);
+    *db = (lpm_db){
+        .magic = LPM_MAGIC,
+        .version = LPM_VERSION,
+        .size = size,
+        .tag_count = tag_count,
+        .tags_offset = (uint32_t)tags_offset
+    };
+    u_char *base = (u_char *)db;
+    uint32_t *tag_offsets = (uint32_t *)(base + tags_offset);
+    size_t at = tags_offset + sizeof(uint32_t) * tag_count;
+    for (uint32_t i = 0; i < tag_count; i++){
+        size_t len = strlen(tags[i]) + 1;
+        tag_offsets[i] = (uint32_t)at;
+        memcpy(base + at, tags[i], len);
+        at += len;
+    }
+    for (int f = 0; f < 2; f++){
+        db->trees[f] = (lpm_tree){
+            .direct_offset = offsets[f][0],
+            .nodes_offset = offsets[f][1],
+            .leaves_offset = offsets[f][2],
+            .node_count = builders[f].node_count,
+            .leaf_count = builders[f].leaf_count,
+            .prefix_count = lists[f].count
+        };
+        memcpy(base + offsets[f][0], builders[f].direct, sizeof(uint32_t) * (1u << LPM_DIRECT_BITS));
+        if (builders[f].node_count)
+            memcpy(base + offsets[f][1], builders[f].nodes, sizeof(lpm_node) * builders[f].node_count);
+        if (builders[f].leaf_count)
+            memcpy(base + offsets[f][2], builders[f].leaves, sizeof(uint32_t) * builders[f].leaf_count);
+    }
+    return db;
+}
+
+/**
+ * lpm_compile: read a prefix list into an image, ipv4 and ipv6 apart
+ * ### return:
+ *  `lpm_db *`: the image, free() it once written
+ *  `NULL`: can't read the file or a line is malformed
+ */
+lpm_db *lpm_compile(const char *path){
+    FILE *file = fopen(path, "r");
+    if (!file){
+        printf("[x] can't open the prefix list <%s>\n", path);
+        return NULL;
+    }
+    lpm_list lists[2] = {0};
+    char **tags = NULL;
+    uint32_t tag_count = 0, tag_size = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    int number = 0;
+    bool failed = false;
+    while (!failed && getline(&line, &line_size, file) >= 0)
+        failed = parse_line(path, ++number, line, lists, &tags, &tag_count, &tag_size) < 0;
+    free(line);
+    fclose(file);
+    lpm_builder builders[2] = {0};
+    lpm_db *db = NULL;
+    for (int f = 0; !failed && f < 2; f++){
+        // shorter first among equal keys, the last of equal prefixes wins
+        if (lists[f].count)
+            qsort(lists[f].prefixes, lists[f].count, sizeof(lpm_prefix), compare_prefix);
+        if (build_tree(&builders[f], lists[f].prefixes, lists[f].count) < 0){
+            printf("[x] out of memory building the prefix list\n");
+            failed = true;
+        }
+    }
+    if (!failed)
+        db = lay_out(builders, lists, tags, tag_count);
+    for (int f = 0; f < 2; f++){
+        free(builders[f].direct);
+        free(builders[f].nodes);
+        free(builders[f].leaves);
+        free(lists[f].prefixes);
+    }
+    for (uint32_t i = 0; i < tag_count; i++)
+        free(tags[i]);
+    free(tags);
+    return db;
+}
+
+/**
+ * lpm_write: write the image next to `path` and rename it over, a
+ * process that still maps the old file keeps its pages
+ * ### return:
+ *  `0`: written
+ *  `-1`: on error
+ */
+int lpm_write(const lpm_db *db, const char *path){
+    char temporary[4096];
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", path) >= (int)sizeof(temporary)){
+        printf("[x] the prefix db path is too long\n");
+        return -1;
+    }
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        printf("[x] can't create <%s>\n", temporary);
+        return -1;
+    }
+    const u_char *bytes = (const u_char *)db;
+    size_t written = 0;
+    while (written < db->size){
+        ssize_t n = write(fd, bytes + written, db->size - written);
+        if (n <= 0)
+            break;
+        written += (size_t)n;
+    }
+    bool failed = written < db->size || fsync(fd) < 0;
+    // closed on every path, a failed fsync included
+    if (close(fd) < 0)
+        failed = true;
+    if (failed){
+        printf("[x] can't write the prefix db <%s>\n", temporary);
+        unlink(temporary);
+        return -1;
+    }
+    if (rename(temporary, path) < 0){
+        printf("[x] can't rename <%s> to <%s>\n", temporary, path);
+        unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+static bool tree_valid(const lpm_db *db, const lpm_tree *tree){
+    uint64_t size = db->size;
+    if (tree->direct_offset % 64 || tree->nodes_offset % 8 || tree->leaves_offset % 4
+        || tree->direct_offset + (uint64_t)sizeof(uint32_t) * (1u << LPM_DIRECT_BITS) > size
+        || tree->nodes_offset + (uint64_t)sizeof(lpm_node) * tree->node_count > size
+        || tree->leaves_offset + (uint64_t)sizeof(uint32_t) * tree->leaf_count > size)
+        return false;
+    // a lookup follows whatever it reads without looking, all of it has to be in the image
+    const u_char *base = (const u_char *)db;
+    const uint32_t *direct = (const uint32_t *)(base + tree->direct_offset);
+    for (uint32_t e = 0; e < 1u << LPM_DIRECT_BITS; e++)
+        if (direct[e] & LPM_LEAF ? (direct[e] & ~LPM_LEAF) > db->tag_count : direct[e] >= tree->node_count)
+            return false;
+    const lpm_node *nodes = (const lpm_node *)(base + tree->nodes_offset);
+    for (uint32_t n = 0; n < tree->node_count; n++){
+        const lpm_node *node = &nodes[n];
+        if ((node->vector & node->leafvec)
+            || (uint64_t)node->base1 + (uint64_t)__builtin_popcountll(node->vector) > tree->node_count
+            || (uint64_t)node->base0 + (uint64_t)__builtin_popcountll(node->leafvec) > tree->leaf_count)
+            return false;
+        // every slot that's not a child needs a value at or before it
+        uint64_t leaves = ~node->vector;
+        if (leaves && !(node->leafvec & (leaves & -leaves)))
+            return false;
+    }
+    const uint32_t *values = (const uint32_t *)(base + tree->leaves_offset);
+    for (uint32_t l = 0; l < tree->leaf_count; l++)
+        if (values[l] > db->tag_count)
+            return false;
+    return true;
+}
+
+/**
+ * INIT_LPM: map a compiled prefix db read only, before the fork so every
+ * worker reads the same pages
+ * ### return:
+ *  `lpm_db *`: if successful
+ *  `NULL`: can't map it, or it's not a prefix db of this version
+ */
+const lpm_db *INIT_LPM(const char *path){
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        printf("[x] can't open the prefix db <%s>\n", path);
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(lpm_db)){
+        printf("[x] <%s> is not a prefix db\n", path);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        printf("[x] can't map the prefix db <%s>\n", path);
+        return NULL;
+    }
+    const lpm_db *db = map;
+    uint64_t size = (uint64_t)info.st_size;
+    bool valid = db->magic == LPM_MAGIC && db->version == LPM_VERSION && db->size == size
+        && db->tag_count <= LPM_MAX_TAGS && db->tags_offset % 4 == 0
+        && db->tags_offset + (uint64_t)sizeof(uint32_t) * db->tag_count <= size;
+    const uint32_t *tags = (const uint32_t *)((const u_char *)db + db->tags_offset);
+    for (uint32_t i = 0; valid && i < db->tag_count; i++)
+        valid = tags[i] < size && memchr((const u_char *)db + tags[i], '\0', size - tags[i]);
+    for (int f = 0; valid && f < 2; f++)
+        valid = tree_valid(db, &db->trees[f]);
+    if (!valid){
+        printf("[x] <%s> is not a prefix db of version %d\n", path, LPM_VERSION);
+        munmap(map, (size_t)size);
+        return NULL;
+    }
+    return db;
+}
+
+void FREE_LPM(const lpm_db *db){
+    if (db)
+        munmap((void *)db, (size_t)db->size);
+}
+
+/**
+ * lpm_lookup: the longest prefix of the list that covers `addr` (4 or
+ * 16 bytes, network order as the decoder has it)
+ * ### return:
+ *  `0`: not listed
+ *  `n`: the value of the prefix, lpm_tag() names it
+ */
+uint32_t lpm_lookup(const lpm_db *db, uint8_t version, const uint8_t *addr){
+    uint64_t hi, lo = 0;
+    const lpm_tree *tree = &db->trees[version == 6];
+    if (version == 6){
+        memcpy(&hi, addr, 8);
+        memcpy(&lo, addr + 8, 8);
+        hi = be64toh(hi);
+        lo = be64toh(lo);
+    }else{
+        uint32_t word;
+        memcpy(&word, addr, 4);
+        hi = (uint64_t)ntohl(word) << 32;
+    }
+    const u_char *base = (const u_char *)db;
+    uint32_t entry = ((const uint32_t *)(base + tree->direct_offset))[hi >> (64 - LPM_DIRECT_BITS)];
+    if (entry & LPM_LEAF)
+        return entry & ~LPM_LEAF;
+    const lpm_node *nodes = (const lpm_node *)(base + tree->nodes_offset);
+    const uint32_t *leaves = (const uint32_t *)(base + tree->leaves_offset);
+    const lpm_node *node = &nodes[entry];
+    for (unsigned offset = LPM_DIRECT_BITS; offset < 128; offset += LPM_STRIDE){
+        unsigned slot = key_bits(hi, lo, offset, LPM_STRIDE);
+        uint64_t mask = below(slot);
+        if (!(node->vector & (1ULL << slot)))
+            return leaves[node->base0 + __builtin_popcountll(node->leafvec & mask) - 1];
+        node = &nodes[node->base1 + __builtin_popcountll(node->vector & mask) - 1];
+    }
+    return 0;
+}
+
+/**
+ * lpm_tag: the tag of a value lpm_lookup() returned
+ * ### return:
+ *  `char *`: the tag, in the image
+ *  `NULL`: not a value of this db
+ */
+const char *lpm_tag(const lpm_db *db, uint32_t value){
+    if (!value || value > db->tag_count)
+        return NULL;
+    const uint32_t *tags = (const uint32_t *)((const u_char *)db + db->tags_offset);
+    return (const char *)db + tags[value - 1];
+}
@@ -0,0 +1,176 @@
+#include "./helpers.h"
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/**
+ * single producer / single consumer ring of 64bit values living in
+ * anonymous shared memory, so it keeps working across fork().
+ * head and tail sit on their own cache lines, the fast path is two
+ * atomics and no syscall, a futex is only touched when the consumer
+ * finds the ring empty or the producer finds it full
+ */
+
+#define SPSC_SPIN_COUNT 128
+
+static inline void spsc_futex_wait(_Atomic uint32_t *word, uint32_t expected){
+    // shared futex (no FUTEX_PRIVATE_FLAG), the waker is another process
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+static inline void spsc_futex_wake(_Atomic uint32_t *word){
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static inline void spsc_cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * create a ring that holds `capacity` values in a MAP_SHARED mapping,
+ * create it before forking the producer and the consumer. `capacity`
+ * must be a power of two, the indexes wrap around 2^32 and are masked
+ * into the entries
+ * ### return:
+ *  `spsc_ring *`: if successful
+ *  `NULL`: on error
+ */
+spsc_ring *spsc_create_shared(uint32_t capacity){
+    if (capacity == 0 || (capacity & (capacity - 1))){
+        printf("[x] spsc ring capacity must be a power of two\n");
+        return NULL;
+    }
+    size_t size = sizeof(spsc_ring) + sizeof(uint64_t) * capacity;
+    spsc_ring *ring = mmap(NULL, size,
+                           PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS,
+                           -1, 0);
+    if (ring == MAP_FAILED){
+        printf("[x] can't map the spsc ring\n");
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->consumer_sleeping, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->producer_sleeping, 0);
+    ring->capacity = capacity;
+    ring->mapped_size = size;
+    return ring;
+}
+
+void spsc_free_shared(spsc_ring *ring){
+    if (!ring)
+        return;
+    munmap(ring, ring->mapped_size);
+}
+
+/**
+ * how many values are waiting in the ring
+ */
+uint32_t spsc_size(spsc_ring *ring){
+    return atomic_load_explicit(&ring->head, memory_order_acquire)
+         - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/**
+ * push without ever blocking
+ * ### return:
+ *  `true`: value pushed
+ *  `false`: ring is full
+ */
+bool spsc_try_push(spsc_ring *ring, uint64_t value){
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= ring->capacity)
+        return false;
+    ring->entries[head & (ring->capacity - 1)] = value;
+    // seq_cst so the store is ordered before reading consumer_sleeping
+    atomic_store(&ring->head, head + 1);
+    if (atomic_load(&ring->consumer_sleeping)){
+        atomic_store(&ring->consumer_sleeping, 0);
+        spsc_futex_wake(&ring->consumer_sleeping);
+    }
+    return true;
+}
+
+/**
+ * block (producer side) until there is room for one more value
+ */
+void spsc_wait_not_full(spsc_ring *ring){
+    for (int spin = 0; spin < SPSC_SPIN_COUNT; spin++){
+        if (spsc_size(ring) < ring->capacity)
+            return;
+        spsc_cpu_relax();
+    }
+    while (spsc_size(ring) >= ring->capacity){
+        atomic_store(&ring->producer_sleeping, 1);
+        // the consumer may have made room before it saw the flag
+        if (spsc_size(ring) < ring->capacity){
+            atomic_store(&ring->producer_sleeping, 0);
+            return;
+        }
+        spsc_futex_wait(&ring->producer_sleeping, 1);
+    }
+}
+
+/**
+ * push, sleeping while the ring is full
+ */
+void spsc_push(spsc_ring *ring, uint64_t value){
+    while (!spsc_try_push(ring, value)){
+        spsc_wait_not_full(ring);
+    }
+}
+
+/**
+ * look at the oldest value without consuming it
+ * ### return:
+ *  `true`: `value` was filled
+ *  `false`: ring is empty
+ */
+bool spsc_try_peek(spsc_ring *ring, uint64_t *value){
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail)
+        return false;
+    *value = ring->entries[tail & (ring->capacity - 1)];
+    return true;
+}
+
+/**
+ * peek, sleeping while the ring is empty
+ */
+void spsc_wait_peek(spsc_ring *ring, uint64_t *value){
+    for (int spin = 0; spin < SPSC_SPIN_COUNT; spin++){
+        if (spsc_try_peek(ring, value))
+            return;
+        spsc_cpu_relax();
+    }
+    while (!spsc_try_peek(ring, value)){
+        atomic_store(&ring->consumer_sleeping, 1);
+        // the producer may have pushed before it saw the flag
+        if (spsc_try_peek(ring, value)){
+            atomic_store(&ring->consumer_sleeping, 0);
+            return;
+        }
+        spsc_futex_wait(&ring->consumer_sleeping, 1);
+    }
+}
+
+/**
+ * consume the oldest value (the one spsc_try_peek returned),
+ * the slot is only given back to the producer here so the consumer
+ * can keep using what it points to until it's done
+ */
+void spsc_pop(spsc_ring *ring){
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    // seq_cst so the store is ordered before reading producer_sleeping
+    atomic_store(&ring->tail, tail + 1);
+    if (atomic_load(&ring->producer_sleeping)){
+        atomic_store(&ring->producer_sleeping, 0);
+        spsc_futex_wake(&ring->producer_sleeping);
+    }
+}
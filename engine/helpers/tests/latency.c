@@ -0,0 +1,64 @@
+#include "../helpers.h"
+
+/**
+ * TEST :
+ * percentiles of a known distribution must land within the
+ * bucket error, and merging two halves must give the same answer
+ * as recording everything in one histogram
+ */
+#define SAMPLES 100000
+
+static int check(const char *name, uint64_t got, uint64_t expected){
+    // a bucket is 1/16 of its power of two wide, half of that each side
+    uint64_t diff = got > expected ? got - expected : expected - got;
+    if (diff * 16 > expected){
+        printf("[x] %s = %lu, expected ~%lu\n", name, (unsigned long)got, (unsigned long)expected);
+        return -1;
+    }
+    return 0;
+}
+
+int main(){
+    latency_hist *all = malloc(sizeof(latency_hist));
+    latency_hist *low = malloc(sizeof(latency_hist));
+    latency_hist *high = malloc(sizeof(latency_hist));
+    latency_reset(all);
+    latency_reset(low);
+    latency_reset(high);
+    // 1..SAMPLES us, uniform
+    for (uint64_t i = 1; i <= SAMPLES; i++){
+        uint64_t value = i * 1000;
+        latency_record(all, value);
+        latency_record(i % 2 ? low : high, value);
+    }
+    latency_merge(low, high);
+    int res = 0;
+    res |= check("p50", latency_percentile(all, 0.50), SAMPLES * 500);
+    res |= check("p99", latency_percentile(all, 0.99), SAMPLES * 990);
+    res |= check("p999", latency_percentile(all, 0.999), SAMPLES * 999);
+    res |= check("small", latency_percentile(all, 0.00001), 1000);
+    if (latency_percentile(all, 1) != SAMPLES * 1000 || all->min != 1000){
+        printf("[x] min/max are off\n");
+        res = -1;
+    }
+    for (double q = 0.1; q < 1; q += 0.1){
+        if (latency_percentile(all, q) != latency_percentile(low, q)){
+            printf("[x] merged histogram differs at %.1f\n", q);
+            res = -1;
+        }
+    }
+    // tiny values are exact
+    latency_reset(all);
+    for (uint64_t i = 0; i < 10; i++)
+        latency_record(all, 7);
+    if (latency_percentile(all, 0.5) != 7){
+        printf("[x] small values must be exact\n");
+        res = -1;
+    }
+    free(all);
+    free(low);
+    free(high);
+    if (res == 0)
+        printf("[v] percentiles are within the bucket error\n");
+    return res;
+}
@@ -0,0 +1,165 @@
+#include "../helpers.h"
+#include <arpa/inet.h>
+
+/**
+ * TEST :
+ * random ipv4 and ipv6 prefixes (around a few bases so the trie gets
+ * deep, some of them repeated with another tag) written to a list,
+ * compiled, written and mapped back: the lookup of random addresses
+ * around the same bases must give the tag a linear scan of the list
+ * gives, the longest prefix and the later of two equal ones. a malformed
+ * list must not compile
+ */
+#define PREFIXES 20000
+#define LOOKUPS 60000
+#define BASES 16
+#define LIST_PATH "/tmp/lpm_test.list"
+#define DB_PATH "/tmp/lpm_test.db"
+
+typedef struct{
+    uint8_t version;
+    uint8_t addr[16];
+    uint8_t len;
+    char tag[16];
+}test_prefix;
+
+static test_prefix prefixes[PREFIXES];
+static uint8_t bases[2][BASES][16];
+
+static bool covers(const test_prefix *prefix, uint8_t version, const uint8_t *addr){
+    if (prefix->version != version)
+        return false;
+    int i = 0;
+    uint8_t bits = prefix->len;
+    for (; bits >= 8; i++, bits -= 8)
+        if (prefix->addr[i] != addr[i])
+            return false;
+    return !bits || ((prefix->addr[i] ^ addr[i]) & (uint8_t)(0xff << (8 - bits))) == 0;
+}
+
+static const char *linear(uint8_t version, const uint8_t *addr){
+    const char *tag = NULL;
+    int best = -1;
+    for (int i = 0; i < PREFIXES; i++){
+        if (covers(&prefixes[i], version, addr) && prefixes[i].len >= best){
+            best = prefixes[i].len;
+            tag = prefixes[i].tag;
+        }
+    }
+    return tag;
+}
+
+// a base with its last bytes (from a random bit on) changed
+static void near(uint8_t version, uint8_t *addr){
+    int bytes = version == 6 ? 16 : 4;
+    memcpy(addr, bases[version == 6][rand() % BASES], 16);
+    int from = rand() % (bytes * 8 + 1);
+    for (int b = from; b < bytes * 8; b++)
+        if (rand() % 2)
+            addr[b / 8] ^= (uint8_t)(0x80 >> (b % 8));
+}
+
+int main(void){
+    srand(7);
+    int errors = 0;
+    for (int f = 0; f < 2; f++)
+        for (int b = 0; b < BASES; b++)
+            for (int i = 0; i < 16; i++)
+                bases[f][b][i] = (uint8_t)rand();
+    FILE *list = fopen(LIST_PATH, "w");
+    if (!list){
+        printf("[x] can't write %s\n", LIST_PATH);
+        return 1;
+    }
+    fprintf(list, "# test list\n\n");
+    for (int i = 0; i < PREFIXES; i++){
+        test_prefix *prefix = &prefixes[i];
+        if (i && rand() % 20 == 0){
+            // the same prefix again, this one wins
+            *prefix = prefixes[rand() % i];
+        }else{
+            prefix->version = rand() % 2 ? 6 : 4;
+            near(prefix->version, prefix->addr);
+            int bits = prefix->version == 6 ? 128 : 32;
+            prefix->len = (uint8_t)(rand() % 4 == 0 ? rand() % (bits + 1) : bits / 2 + rand() % (bits / 2 + 1));
+        }
+        snprintf(prefix->tag, sizeof(prefix->tag), "t%d", rand() % 50);
+        char text[INET6_ADDRSTRLEN];
+        inet_ntop(prefix->version == 6 ? AF_INET6 : AF_INET, prefix->addr, text, sizeof(text));
+        // the default tag and a comment now and then
+        if (rand() % 10 == 0){
+            strcpy(prefix->tag, "listed");
+            fprintf(list, "%s/%u ; no tag\n", text, prefix->len);
+        }else if (prefix->len == (prefix->version == 6 ? 128 : 32) && rand() % 2){
+            fprintf(list, "  %s\t%s\n", text, prefix->tag);
+        }else{
+            fprintf(list, "%s/%u %s\n", text, prefix->len, prefix->tag);
+        }
+    }
+    fclose(list);
+
+    lpm_db *compiled = lpm_compile(LIST_PATH);
+    if (!compiled || lpm_write(compiled, DB_PATH) < 0){
+        printf("[x] can't compile the list\n");
+        return 1;
+    }
+    free(compiled);
+    const lpm_db *db = INIT_LPM(DB_PATH);
+    if (!db){
+        printf("[x] can't map the compiled list\n");
+        return 1;
+    }
+    for (int i = 0; i < LOOKUPS; i++){
+        uint8_t version = rand() % 2 ? 6 : 4, addr[16];
+        if (i < PREFIXES){
+            // the address of a prefix itself, the deepest leaves
+            version = prefixes[i].version;
+            memcpy(addr, prefixes[i].addr, 16);
+        }else{
+            near(version, addr);
+        }
+        const char *expected = linear(version, addr);
+        const char *found = lpm_tag(db, lpm_lookup(db, version, addr));
+        if ((expected == NULL) != (found == NULL) || (expected && strcmp(expected, found))){
+            if (errors++ < 10){
+                char text[INET6_ADDRSTRLEN];
+                inet_ntop(version == 6 ? AF_INET6 : AF_INET, addr, text, sizeof(text));
+                printf("[x] %s: %s, expected %s\n", text, found ? found : "-", expected ? expected : "-");
+            }
+        }
+    }
+    FREE_LPM(db);
+
+    // nothing listed at all, and a malformed line
+    list = fopen(LIST_PATH, "w");
+    fprintf(list, "; empty\n");
+    fclose(list);
+    compiled = lpm_compile(LIST_PATH);
+    uint8_t any[16] = {10, 1, 2, 3};
+    if (!compiled || lpm_lookup(compiled, 4, any) || lpm_lookup(compiled, 6, any)){
+        printf("[x] an empty list lists something\n");
+        errors++;
+    }
+    free(compiled);
+    const char *malformed[] = {"10.0.0.0/33\n", "10.0.0/8\n", "::1/129 tag\n", "10.0.0.1 a b\n", "10.0.0.0/ x\n"};
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++){
+        list = fopen(LIST_PATH, "w");
+        fprintf(list, "%s", malformed[i]);
+        fclose(list);
+        compiled = lpm_compile(LIST_PATH);
+        if (compiled){
+            printf("[x] compiled %s", malformed[i]);
+            free(compiled);
+            errors++;
+        }
+    }
+    unlink(LIST_PATH);
+    unlink(DB_PATH);
+
+    if (errors){
+        printf("[x] %d errors\n", errors);
+        return 1;
+    }
+    printf("[+] lpm ok\n");
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include "../helpers.h"
+#include <sys/wait.h>
+
+/**
+ * TEST :
+ * a forked consumer must see every value the producer pushed,
+ * in order, with a ring small enough to hit both the full and
+ * the empty futex paths many times
+ */
+#define VALUES 1000000
+
+int main(){
+    spsc_ring *ring = spsc_create_shared(4);
+    if (!ring){
+        printf("[x] can't create the ring\n");
+        return -1;
+    }
+    pid_t consumer = fork();
+    if (consumer == 0){
+        uint64_t expected = 0;
+        while (expected < VALUES){
+            uint64_t value = 0;
+            spsc_wait_peek(ring, &value);
+            if (value != expected){
+                printf("[x] got %lu, expected %lu\n", (unsigned long)value, (unsigned long)expected);
+                _exit(1);
+            }
+            spsc_pop(ring);
+            // let the producer fill the ring from time to time
+            if (expected % 100000 == 0)
+                usleep(1000);
+            expected++;
+        }
+        _exit(0);
+    }
+    for (uint64_t value = 0; value < VALUES; value++){
+        spsc_push(ring, value);
+        // and let the consumer drain it from time to time
+        if (value % 250000 == 0)
+            usleep(10000);
+    }
+    int status = 0;
+    waitpid(consumer, &status, 0);
+    spsc_free_shared(ring);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        printf("[x] consumer failed\n");
+        return -1;
+    }
+    printf("[v] %d values went through in order\n", VALUES);
+    return 0;
+}
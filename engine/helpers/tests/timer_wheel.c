@@ -0,0 +1,149 @@
+#include "../helpers.h"
+
+/**
+ * TEST :
+ * timers spread over every level, some cancelled, some moved, time
+ * advanced in random steps (and a few big jumps): every live timer must
+ * fire exactly once, never before its tick is over and at most one tick
+ * after, cancelled ones never. a timer re-adding itself from its callback
+ * must keep firing on time. a wheel moved by years at once (a timer far
+ * past the span of the wheel pending) must get there right away and still
+ * fire it on time
+ */
+#define TIMERS 20000
+#define TICK_NS 1000ULL
+
+typedef struct{
+    timer_entry timer;
+    uint64_t expires_ns;
+    int fired;
+    bool cancelled;
+}test_timer;
+
+static int errors = 0;
+// time of the previous advance, a timer due before it is late
+static uint64_t previous_ns = 0;
+
+static void on_fire(timer_entry *timer, void *ctx, uint64_t now_ns){
+    (void)ctx;
+    test_timer *t = (test_timer *)timer;
+    t->fired++;
+    // fired in the first advance past the end of its tick
+    uint64_t due_ns = (t->expires_ns / TICK_NS + 1) * TICK_NS;
+    if (t->cancelled || t->fired > 1 || now_ns < due_ns || (previous_ns >= due_ns && previous_ns)){
+        if (errors++ < 10)
+            printf("[x] timer expiring at %lu fired at %lu (%d times, cancelled %d)\n",
+                (unsigned long)t->expires_ns, (unsigned long)now_ns, t->fired, t->cancelled);
+    }
+}
+
+static uint64_t periodic_fires = 0;
+static uint64_t periodic_late = 0;
+
+static void periodic(timer_entry *timer, void *ctx, uint64_t now_ns){
+    timer_wheel *wheel = ctx;
+    periodic_fires++;
+    // due at the end of tick 10 * n, the test moves at most 2 ticks at once
+    uint64_t due_ns = (periodic_fires * 10 + 1) * TICK_NS;
+    if (now_ns < due_ns || now_ns >= due_ns + 2 * TICK_NS)
+        periodic_late++;
+    timer_add(wheel, timer, (periodic_fires + 1) * 10 * TICK_NS, periodic, wheel);
+}
+
+int main(){
+    srand(7);
+    timer_wheel *wheel = INIT_TIMER_WHEEL(TICK_NS);
+    test_timer *timers = calloc(TIMERS, sizeof(test_timer));
+    timer_start(wheel, 0);
+    for (int i = 0; i < TIMERS; i++){
+        // a bit of every level, and past the span of the wheel
+        int bits = rand() % 30;
+        timers[i].expires_ns = ((uint64_t)rand() % (1ULL << bits)) * TICK_NS + (uint64_t)(rand() % 1000);
+        timer_add(wheel, &timers[i].timer, timers[i].expires_ns, on_fire, NULL);
+    }
+    for (int i = 0; i < TIMERS; i += 7){
+        timer_cancel(wheel, &timers[i].timer);
+        timers[i].cancelled = true;
+    }
+    // moved further away
+    for (int i = 3; i < TIMERS; i += 11){
+        if (timers[i].cancelled)
+            continue;
+        timers[i].expires_ns += 5000 * TICK_NS;
+        timer_add(wheel, &timers[i].timer, timers[i].expires_ns, on_fire, NULL);
+    }
+    uint64_t now_ns = 0;
+    uint64_t last_ns = (1ULL << 30) * TICK_NS;
+    while (now_ns < last_ns){
+        if (rand() % 1000 == 0)
+            now_ns += (uint64_t)(rand() % 100000) * TICK_NS;
+        else
+            now_ns += (uint64_t)(rand() % 5000) * 37;
+        if (now_ns > last_ns)
+            now_ns = last_ns;
+        timer_advance(wheel, now_ns);
+        previous_ns = now_ns;
+        // nothing that's due may be left
+        if (timer_next_ns(wheel) <= now_ns && rand() % 100 == 0){
+            printf("[x] next timer at %lu, before now %lu\n",
+                (unsigned long)timer_next_ns(wheel), (unsigned long)now_ns);
+            errors++;
+        }
+    }
+    timer_advance(wheel, last_ns + 2 * TICK_NS);
+    previous_ns = 0;
+    for (int i = 0; i < TIMERS; i++){
+        if (!timers[i].cancelled && timers[i].fired != 1){
+            if (errors++ < 20)
+                printf("[x] timer %d expiring at %lu fired %d times\n",
+                    i, (unsigned long)timers[i].expires_ns, timers[i].fired);
+        }
+    }
+    if (wheel->count != 0){
+        printf("[x] %lu timers left in the wheel\n", (unsigned long)wheel->count);
+        errors++;
+    }
+    FREE_TIMER_WHEEL(wheel);
+
+    // a periodic timer driven one tick at a time and in jumps
+    wheel = INIT_TIMER_WHEEL(TICK_NS);
+    timer_entry tick_timer = {0};
+    timer_start(wheel, 0);
+    timer_add(wheel, &tick_timer, 10 * TICK_NS, periodic, wheel);
+    for (now_ns = 0; now_ns <= 100000 * TICK_NS; now_ns += (rand() % 3) * TICK_NS)
+        timer_advance(wheel, now_ns);
+    if (periodic_fires < 9990 || periodic_late){
+        printf("[x] periodic timer fired %lu times, %lu late\n",
+            (unsigned long)periodic_fires, (unsigned long)periodic_late);
+        errors++;
+    }
+    timer_cancel(wheel, &tick_timer);
+    FREE_TIMER_WHEEL(wheel);
+    free(timers);
+
+    // started at 1s, then 50 years of ticks with one timer at the end
+    wheel = INIT_TIMER_WHEEL(TICK_NS);
+    timer_start(wheel, 1000000000ULL);
+    test_timer far = {.expires_ns = 50ULL * 365 * 86400 * 1000000000ULL};
+    timer_add(wheel, &far.timer, far.expires_ns, on_fire, NULL);
+    struct timespec before, after;
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    previous_ns = 0;
+    timer_advance(wheel, far.expires_ns - TICK_NS);
+    previous_ns = far.expires_ns - TICK_NS;
+    timer_advance(wheel, far.expires_ns + 2 * TICK_NS);
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    double seconds = (double)(after.tv_sec - before.tv_sec) + (after.tv_nsec - before.tv_nsec) / 1e9;
+    if (far.fired != 1 || seconds > 0.5){
+        printf("[x] a timer 50 years away fired %d times, advancing took %.2fs\n", far.fired, seconds);
+        errors++;
+    }
+    FREE_TIMER_WHEEL(wheel);
+
+    if (errors){
+        printf("[x] %d errors\n", errors);
+        return 1;
+    }
+    printf("[+] timer wheel ok\n");
+    return 0;
+}
@@ -0,0 +1,271 @@
+#include "./helpers.h"
+
+/**
+ * hierarchical timing wheel. a timer `delta` ticks away goes in the level
+ * whose slots are just fine enough for it: level 0 holds the next 64
+ * ticks one per slot, level 1 the next 4096 in slots of 64 ticks, ...
+ * when level 0 wraps, the next slot of level 1 is spread over level 0
+ * (and so on up), so a timer is moved at most TIMER_LEVELS - 1 times.
+ * adding and cancelling are a list insert/unlink, running the wheel skips
+ * the empty slots with the `occupied` bitmaps.
+ * time is whatever the owner says it is: packet timestamps when replaying,
+ * the clock when live, a timer fires once the time is past its tick (at
+ * most one tick late, never early)
+ */
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+// timers further than that wait in the last level, its cascade places them again
+#define TIMER_SPAN (1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS))
+
+/**
+ * INIT_TIMER_WHEEL: an empty wheel counting time in ticks of `tick_ns`
+ * ### return:
+ *  `timer_wheel *`: if successful
+ *  `NULL`: on error
+ */
+timer_wheel *INIT_TIMER_WHEEL(uint64_t tick_ns){
+    if (!tick_ns){
+        printf("[x] a timer wheel needs a tick\n");
+        return NULL;
+    }
+    timer_wheel *wheel = calloc(1, sizeof(timer_wheel));
+    if (!wheel)
+        return NULL;
+    wheel->tick_ns = tick_ns;
+    return wheel;
+}
+
+/** the timers belong to their owners, pending ones are just forgotten */
+void FREE_TIMER_WHEEL(timer_wheel *wheel){
+    free(wheel);
+}
+
+/**
+ * timer_start: where time starts, the first packet or the clock,
+ * only the first call counts. a timer added before is placed as if
+ * time started at its expiry
+ */
+void timer_start(timer_wheel *wheel, uint64_t now_ns){
+    if (wheel->started)
+        return;
+    wheel->now = now_ns / wheel->tick_ns;
+    wheel->started = true;
+}
+
+static void place(timer_wheel *wheel, timer_entry *timer){
+    uint64_t expires = timer->expires < wheel->now ? wheel->now : timer->expires;
+    uint64_t delta = expires - wheel->now;
+    if (delta >= TIMER_SPAN){
+        delta = TIMER_SPAN - 1;
+        expires = wheel->now + delta;
+    }
+    int level = delta ? (63 - __builtin_clzll(delta)) / TIMER_SLOT_BITS : 0;
+    uint32_t slot = (uint32_t)(expires >> (level * TIMER_SLOT_BITS)) & TIMER_MASK;
+    timer_entry **head = &wheel->slots[level][slot];
+    timer->next = *head;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+/**
+ * timer_add: call `fn` once the time is past `expires_ns`, a timer that's
+ * already pending is moved
+ */
+void timer_add(timer_wheel *wheel, timer_entry *timer, uint64_t expires_ns, timer_fn fn, void *ctx){
+    if (timer->pprev)
+        timer_cancel(wheel, timer);
+    if (!wheel->started)
+        timer_start(wheel, expires_ns);
+    timer->expires = expires_ns / wheel->tick_ns;
+    timer->fn = fn;
+    timer->ctx = ctx;
+    place(wheel, timer);
+    wheel->count++;
+}
+
+/** timer_cancel: nothing happens if it isn't pending */
+void timer_cancel(timer_wheel *wheel, timer_entry *timer){
+    if (!timer->pprev)
+        return;
+    // the occupied bit stays, the slot is found empty when it's reached
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    wheel->count--;
+}
+
+/** spread a slot of an upper level over the levels below it */
+static void cascade(timer_wheel *wheel, int level, uint32_t slot){
+    timer_entry *timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ULL << slot);
+    while (timer){
+        timer_entry *next = timer->next;
+        place(wheel, timer);
+        timer = next;
+    }
+}
+
+/**
+ * fire the timers of `tick`, the wheel is already past it. level 0 only
+ * holds timers less than a turn away, all of them are due
+ */
+static void run_slot(timer_wheel *wheel, uint64_t tick, uint64_t now_ns){
+    uint32_t slot = (uint32_t)tick & TIMER_MASK;
+    // taken off the wheel first: what the callbacks add for this slot is
+    // for its next turn, and they can still cancel the ones not run yet
+    timer_entry *list = wheel->slots[0][slot];
+    wheel->slots[0][slot] = NULL;
+    wheel->occupied[0] &= ~(1ULL << slot);
+    if (list)
+        list->pprev = &list;
+    while (list){
+        timer_entry *timer = list;
+        list = timer->next;
+        if (list)
+            list->pprev = &list;
+        timer->next = NULL;
+        timer->pprev = NULL;
+        wheel->count--;
+        timer->fn(timer, timer->ctx, now_ns);
+    }
+}
+
+/**
+ * the first tick from `from` (a multiple of TIMER_SLOTS) where something
+ * is due: level 0 wraps into its next turn, or an upper level has a slot
+ * to cascade (a slot of level n cascades at the start of its 64^n ticks)
+ */
+static uint64_t next_event(const timer_wheel *wheel, uint64_t from){
+    if (wheel->occupied[0])
+        return from;
+    uint64_t next = UINT64_MAX;
+    for (int level = 1; level < TIMER_LEVELS; level++){
+        uint64_t occupied = wheel->occupied[level];
+        if (!occupied)
+            continue;
+        unsigned shift = level * TIMER_SLOT_BITS;
+        // first slot boundary of this level at or after `from`, then the
+        // first occupied slot from there, around the level
+        uint64_t first = (from + (1ULL << shift) - 1) >> shift;
+        unsigned index = (unsigned)first & TIMER_MASK;
+        uint64_t turned = index ? occupied >> index | occupied << (TIMER_SLOTS - index) : occupied;
+        uint64_t tick = (first + (uint64_t)__builtin_ctzll(turned)) << shift;
+        if (tick < next)
+            next = tick;
+    }
+    return next;
+}
+
+/**
+ * only the last level has timers and nothing is due before `target`:
+ * they're either past the span of the wheel (placed in the last slot it
+ * has, again every time it cascades) or far enough that time can go
+ * straight to the first of them, all of them placed again from there
+ */
+static void rebase(timer_wheel *wheel, uint64_t target){
+    int level = TIMER_LEVELS - 1;
+    timer_entry *list = NULL;
+    uint64_t first = UINT64_MAX;
+    for (uint32_t slot = 0; slot < TIMER_SLOTS; slot++){
+        timer_entry *timer = wheel->slots[level][slot];
+        wheel->slots[level][slot] = NULL;
+        while (timer){
+            timer_entry *next = timer->next;
+            if (timer->expires < first)
+                first = timer->expires;
+            timer->next = list;
+            list = timer;
+            timer = next;
+        }
+    }
+    wheel->occupied[level] = 0;
+    uint64_t now = first < target ? first : target;
+    if (now > wheel->now)
+        wheel->now = now;
+    while (list){
+        timer_entry *next = list->next;
+        place(wheel, list);
+        list = next;
+    }
+}
+
+/**
+ * timer_advance: move time to `now_ns` and fire every timer whose tick is
+ * over. the callbacks get `now_ns` and can add and cancel timers. empty
+ * stretches are skipped in one step, a jump of years costs no more than
+ * one of a tick
+ */
+void timer_advance(timer_wheel *wheel, uint64_t now_ns){
+    if (!wheel->started){
+        timer_start(wheel, now_ns);
+        return;
+    }
+    uint64_t target = now_ns / wheel->tick_ns;
+    while (wheel->now < target){
+        if (!wheel->count){
+            wheel->now = target;
+            break;
+        }
+        uint64_t tick = wheel->now;
+        uint32_t index = (uint32_t)tick & TIMER_MASK;
+        if (index == 0){
+            for (int level = 1; level < TIMER_LEVELS; level++){
+                uint32_t slot = (uint32_t)(tick >> (level * TIMER_SLOT_BITS)) & TIMER_MASK;
+                if (wheel->occupied[level] & (1ULL << slot))
+                    cascade(wheel, level, slot);
+                if (slot)
+                    break;
+            }
+        }
+        uint64_t ahead = wheel->occupied[0] >> index;
+        if (!ahead){
+            // nothing left in this turn of level 0, on to the next turn
+            // where something wraps in or cascades
+            uint64_t next = next_event(wheel, (tick | TIMER_MASK) + 1);
+            uint64_t lower = 0;
+            for (int level = 0; level < TIMER_LEVELS - 1; level++)
+                lower |= wheel->occupied[level];
+            if (next < target && !lower)
+                rebase(wheel, target);
+            else
+                wheel->now = next < target ? next : target;
+            continue;
+        }
+        uint64_t skip = (uint64_t)__builtin_ctzll(ahead);
+        if (skip){
+            wheel->now = tick + skip < target ? tick + skip : target;
+            continue;
+        }
+        wheel->now = tick + 1;
+        run_slot(wheel, tick, now_ns);
+    }
+}
+
+/**
+ * timer_next_ns: no timer fires before that, good enough to sleep on
+ * ### return:
+ *  `uint64_t`: the time, in the wheel's time
+ *  `UINT64_MAX`: no timer
+ */
+uint64_t timer_next_ns(const timer_wheel *wheel){
+    if (!wheel->count)
+        return UINT64_MAX;
+    uint32_t index = (uint32_t)wheel->now & TIMER_MASK;
+    uint64_t ahead = index ? wheel->occupied[0] >> index : 0;
+    uint64_t tick;
+    if (ahead)
+        tick = wheel->now + (uint64_t)__builtin_ctzll(ahead);
+    else if (index)
+        tick = (wheel->now | TIMER_MASK) + 1;
+    else
+        // the upper levels may cascade right here
+        tick = wheel->now;
+    // a tick is over once the time is past its end
+    return (tick + 1) * wheel->tick_ns;
+}
@@ -4,6 +4,8 @@
 #include "./engine/helpers/helpers.h"
 #include "./engine/core/config/config.h"
 #include "./engine/core/clientserver/clientserver.h"
+#include "./engine/core/pipeline/pipeline.h"
+#include "./engine/core/capture/protocols/protoheaders.h"
 #include <stdio.h>    
 #include <stdlib.h>    
 #include <unistd.h>    
@@ -11,19 +13,7 @@
 #include <stdatomic.h>
 #include <fcntl.h>
 #include <sys/mman.h>
-#include <semaphore.h>
-#include <stdatomic.h>
-
-// for parsing 
-#include <netinet/if_ether.h>   // struct ether_header
-#include <netinet/ip.h>         // struct ip, struct iphdr
-#include <netinet/tcp.h>        // struct tcphdr
-#include <netinet/udp.h>        // struct udphdr
-#include <netinet/ip_icmp.h>    // struct icmphdr
-#include <netinet/ip6.h>        // struct ip6_hdr (IPv6)
-#include <arpa/inet.h>          // ntohs(), ntohl(), inet_ntoa()
-#include <net/ethernet.h>       // ETHERTYPE_* constants
-#include "./engine/core/capture/protocols/protoheaders.h"
+#include <net/if.h>
 void sigchld_handler(int signum) {
     int status;
     pid_t pid;
@@ -38,192 +28,302 @@ void sigchld_handler(int signum) {
     }
 }
 
-#define MAX_BATCH 1024
-#define PACKET_SIZE 2048
-
-typedef struct {
-    sem_t batch_ready;     // signals workers
-    sem_t batch_done;      // signals sniffer
-    atomic_int workers_done;
-    int count;
-    size_t lengths[MAX_BATCH];
-    u_char packets[MAX_BATCH][PACKET_SIZE];
-} shared_batch_t;
-
-shared_batch_t *shared_batch;
-
-
-
-
-void packet_handler(u_char *user, const struct pcap_pkthdr *hdr, const u_char *packet) {
-    shared_batch_t *batch = (shared_batch_t*)user;
-
-    if (batch->count >= MAX_BATCH) return; // simple overflow protection
-
-    memcpy(batch->packets[batch->count], packet, hdr->caplen);
-    batch->lengths[batch->count] = hdr->caplen;
-    batch->count++;
-}
-
-void sniffer(pcap_t *initiated_pcap, int workers_count){
-    while (1) {
-        shared_batch->count = 0;
-        int res = pcap_dispatch(initiated_pcap, MAX_BATCH, packet_handler, (u_char*)shared_batch);
-        
-        if (res < 0) {
-            fprintf(stderr, "[x] pcap error: %s\n", pcap_geterr(initiated_pcap));
-            break;
-        }
-        
-        if (res == 0) {
-            // No packets captured, continue waiting
-            continue;
-        }
-
-        printf("[SNIFFER] Captured %d packets\n", shared_batch->count);
-        atomic_store(&shared_batch->workers_done, workers_count);
-        // mark batch ready
-        for (int i = 0; i < workers_count; i++) {
-            sem_post(&shared_batch->batch_ready);
-        }
-
-        // wait until workers consume
-        sem_wait(&shared_batch->batch_done);
-    }
-}
-
-void worker(int id){
-
-    char filename[64];
-    snprintf(filename, sizeof(filename), "worker_%d.log", id);
-    freopen(filename, "w", stdout);
-    while (1) {
-        sem_wait(&shared_batch->batch_ready);
-        printf("[Worker %d] Processing %d packets\n", id, shared_batch->count);
-        fflush(stdout);
-        for (int i = 0; i < shared_batch->count; i++) {
-            const u_char *pkt = shared_batch->packets[i];
-            size_t len = shared_batch->lengths[i];
-            
-            // point to start of eth
-            struct ether_header *eth = (struct ether_header *)pkt;
-            struct ip *iph = NULL;
-            switch (ntohs(eth->ether_type))
-            {
-                case ETHERTYPE_IP:
-                    iph = (struct ip *)(pkt + ETH_HEADER_SIZE_PLAIN);
-                    // ip dest and source
-                    protocol_mapper(iph);
-                    fflush(stdout);
-                    break;
-                case ETHERTYPE_VLAN:
-                    // advance pointer to point at type
-                    pkt += sizeof(struct ether_header);
-                    uint16_t next_header = ntohs(eth->ether_type);
-                    
-                    while(next_header == ETHERTYPE_VLAN){
-                        // get the tci , the struct is is just simplifying things
-                        vlan_tci *vlantci = (vlan_tci *) pkt;
-                        // get tci
-                        uint16_t tci = ntohs(vlantci->tci);
-                        // get vid
-                        uint16_t vid = tci & 0X0FFF; 
-                        
-                        printf("vlan[%u] ", vid);
-                        
-                        // skip 2bytes of tci
-                        pkt += sizeof(uint16_t);
-                        // get the next header 2bytes
-                        next_header = ntohs(*(uint16_t*)pkt);
-                        // now point at the next 2 headers 
-                        // it's either the next tci ot the start of 
-                        // the payload if next header is not a vlan
-                        pkt += sizeof(uint16_t);
-                    }
-                    // get ip packet
-                    iph = (struct ip *)(pkt);
-                    // pass it to the mapper
-                    protocol_mapper(iph);
-                    // flush
-                    fflush(stdout);
-                    break;
-
-                case ETHERTYPE_LOOPBACK:
-                    break;
-                    
-                default:
-                    break;
-            }
-            // check if this is an ipv4 eth packer
-            if (ntohs(eth->ether_type) == ETHERTYPE_IP) {
-
-            }
-            // check if this is an ipv6 tagged packet
-            // well not now 
-        }
-
-        // signal done
-        
-        if (atomic_fetch_sub(&shared_batch->workers_done, 1) == 1) {
-            sem_post(&shared_batch->batch_done);
-        }
-    }
-}
-
 int main (int argc, char **argv){
     signal(SIGCHLD, sigchld_handler);
     cJSON *core_config =  INIT_CORE_CONFIG();
     int thread_count = GET_THREAD_COUNT(core_config);
     int core_count = GET_CORE_COUNT(core_config);
+    int ring_depth = GET_BATCH_RING_DEPTH(core_config);
+    capture_backend backend = GET_CAPTURE_BACKEND(core_config);
+    char *interface_name = GET_CAPTURE_INTERFACE(core_config);
+    char *filter = GET_CAPTURE_FILTER(core_config);
+    int snaplen = GET_CAPTURE_SNAPLEN(core_config);
+    // one capture group (socket + sniffer + its workers) per fanout socket
+    int groups = GET_CAPTURE_FANOUT_SOCKETS(core_config);
+    bool pin = groups > 1 && GET_CAPTURE_FANOUT_PIN(core_config);
+    bool text_output = GET_DECODER_TEXT_OUTPUT(core_config);
+    int tunnel_depth = GET_DECODER_MAX_TUNNEL_DEPTH(core_config);
+    defrag_config defrag;
+    GET_DEFRAG_CONFIG(core_config, &defrag);
+    flow_config flows;
+    GET_FLOW_CONFIG(core_config, &flows);
+    stream_config streams;
+    GET_STREAM_CONFIG(core_config, &streams);
+    char *rule_file = GET_DETECT_RULES(core_config);
+    char *rule_db_path = GET_DETECT_RULE_DB(core_config);
+    char *reputation_list = GET_REPUTATION_LIST(core_config);
+    char *reputation_db = GET_REPUTATION_DB(core_config);
+    if (core_count > MAX_WORKERS){
+        printf("[x] core count must be <= %d\n", MAX_WORKERS);
+        return -1;
+    }
+    if (groups > core_count){
+        printf("[x] capture.fanout.sockets must be <= the core count\n");
+        return -1;
+    }
+    if (groups > 1 && backend != CAPTURE_TPACKET){
+        printf("[x] capture.fanout needs the tpacket backend\n");
+        return -1;
+    }
 
-    // just create an annonymous shared mempry (THIS is temp , 
-    // i think i will switch with zero copy from the ring directly , 
-    // or double batching but for now this will do)
-    shared_batch = mmap(NULL, sizeof(shared_batch_t), 
-                        PROT_READ | PROT_WRITE, 
-                        MAP_SHARED | MAP_ANONYMOUS,  // ← no file descriptor needed
-                        -1, 0);
+    // compiled once to a file and mapped read only, the workers share
+    // its pages through the page cache
+    const rule_db *rules = NULL;
+    if (rule_file){
+        if (!rule_db_path){
+            printf("[x] detect.rules needs a detect.rule_db to compile to\n");
+            return -1;
+        }
+        rule_db *compiled = rule_compile(rule_file);
+        if (!compiled)
+            return -1;
+        int written = rule_db_write(compiled, rule_db_path);
+        free(compiled);
+        if (written < 0)
+            return -1;
+    }
+    if (rule_db_path){
+        rules = INIT_RULE_DB(rule_db_path);
+        if (!rules)
+            return -1;
+    }
+    // same for the prefix list
+    const lpm_db *reputation = NULL;
+    if (reputation_list){
+        if (!reputation_db){
+            printf("[x] reputation.list needs a reputation.db to compile to\n");
+            return -1;
+        }
+        lpm_db *compiled = lpm_compile(reputation_list);
+        if (!compiled)
+            return -1;
+        int written = lpm_write(compiled, reputation_db);
+        free(compiled);
+        if (written < 0)
+            return -1;
+    }
+    if (reputation_db){
+        reputation = INIT_LPM(reputation_db);
+        if (!reputation)
+            return -1;
+    }
 
-    // init semaphore for batch ready
-    sem_init(&shared_batch->batch_ready, 1, 0);
-    // init semaphore for batch done
-    sem_init(&shared_batch->batch_done, 1, 0);
-    // init atomic counter for workers to track if they are done
-    atomic_init(&shared_batch->workers_done, 0);
+    // the workers are split as evenly as possible between the groups
+    batch_ring_t **rings = calloc(groups, sizeof(batch_ring_t *));
+    int first_worker = 0;
+    for (int g = 0; g < groups; g++) {
+        int workers = core_count / groups + (g < core_count % groups ? 1 : 0);
+        rings[g] = INIT_BATCH_RING(ring_depth, workers, first_worker);
+        if (!rings[g])
+            return -1;
+        rings[g]->text_output = text_output;
+        rings[g]->defrag = defrag;
+        rings[g]->flows = flows;
+        rings[g]->streams = streams;
+        rings[g]->rules = rules;
+        rings[g]->reputation = reputation;
+        // a replayed file says which of its interfaces a frame came from
+        if (backend != CAPTURE_REPLAY)
+            rings[g]->ingress = if_nametoindex(interface_name);
+        first_worker += workers;
+    }
 
 
     // print some config info
     printf("---------LOADED CONFIG-----------\n");
     printf("[@] thread count = %d\n", thread_count);
     printf("[@] core count = %d\n", core_count);
+    printf("[@] batch ring depth = %d\n", ring_depth);
+    printf("[@] capture groups = %d\n", groups);
+    printf("[@] capture filter = %s\n", filter ? filter : "none");
+    printf("[@] snaplen = %d\n", snaplen);
+    printf("[@] max tunnel depth = %d\n", tunnel_depth);
+    if (defrag.enabled)
+        printf("[@] defrag = %u datagrams, %u KB, %u ms, %s wins\n", defrag.max_datagrams,
+            defrag.memory_kb, defrag.timeout_ms, defrag.policy == DEFRAG_FIRST ? "first" : "last");
+    else
+        printf("[@] defrag = off\n");
+    if (flows.enabled)
+        printf("[@] flows = %u per worker\n", flows.max_flows);
+    else
+        printf("[@] flows = off\n");
+    if (flows.enabled && streams.enabled)
+        printf("[@] streams = depth %u KB, %u KB out of order per direction, %u KB per worker\n",
+            streams.depth_kb, streams.flow_buffer_kb, streams.memory_kb);
+    else
+        printf("[@] streams = off\n");
+    if (rules)
+        printf("[@] rules = %u from %s in %u port groups, %lu KB\n", rules->rule_count, rule_db_path,
+            rules->group_count, (unsigned long)(rules->size / 1024));
+    else
+        printf("[@] rules = off\n");
+    if (reputation)
+        printf("[@] reputation = %u ipv4 and %u ipv6 prefixes from %s, %lu KB\n",
+            reputation->trees[0].prefix_count, reputation->trees[1].prefix_count, reputation_db,
+            (unsigned long)(reputation->size / 1024));
+    else
+        printf("[@] reputation = off\n");
     printf("---------------------------------\n");
 
 
-    // initiat the pcap capturing , for now  ill keep this wlan0 hardcoded here
-    pcap_t *initiated_pcap = INIT_PCAP("wlan0");
-    if (!initiated_pcap){
-        printf("[x] can't initiat pcap\n");
-        return -1;
+    // the workers inherit it
+    decoder_set_tunnel_depth(tunnel_depth);
+
+    // initiat the capturing on the configured backend
+    pcap_t *initiated_pcap = NULL;
+    tpacket_ring **tp_rings = calloc(groups, sizeof(tpacket_ring *));
+    xdp_socket *xsk = NULL;
+    replay_file *replay = NULL;
+    if (backend == CAPTURE_REPLAY){
+        replay = INIT_REPLAY(
+            GET_CAPTURE_REPLAY_FILE(core_config),
+            GET_CAPTURE_REPLAY_PACING(core_config),
+            GET_CAPTURE_REPLAY_PPS(core_config),
+            GET_CAPTURE_REPLAY_LOOPS(core_config)
+        );
+        if (!replay){
+            printf("[x] can't open the replay file\n");
+            return -1;
+        }
+        // the file is mapped before the fork so workers can read it directly
+        rings[0]->ring = replay->map;
+        rings[0]->zero_copy = true;
+        rings[0]->snaplen = (uint32_t)snaplen;
+        if (filter){
+            rings[0]->filter = calloc(1, sizeof(struct bpf_program));
+            if (capture_compile_filter(filter, snaplen, rings[0]->filter) < 0)
+                return -1;
+        }
+    }else if (backend == CAPTURE_XDP){
+        xsk = INIT_XDP(
+            interface_name,
+            GET_CAPTURE_XDP_QUEUE(core_config),
+            GET_CAPTURE_XDP_FRAME_COUNT(core_config),
+            GET_CAPTURE_FRAME_SIZE(core_config),
+            GET_CAPTURE_XDP_RING_SIZE(core_config)
+        );
+        if (!xsk){
+            printf("[x] can't initiat the xdp socket\n");
+            return -1;
+        }
+        // every slot of the batch ring plus the one being filled can hold
+        // frames, the kernel needs some left over to keep receiving
+        if (xsk->frame_count <= (uint32_t)(ring_depth + 1) * MAX_BATCH){
+            printf("[x] capture.xdp_frame_count must be > %d with a batch ring of %d\n",
+                (ring_depth + 1) * MAX_BATCH, ring_depth);
+            return -1;
+        }
+        // the UMEM is mapped before the fork so workers can read it directly
+        rings[0]->ring = xsk->umem;
+        rings[0]->xsk = xsk;
+        rings[0]->zero_copy = true;
+        rings[0]->snaplen = (uint32_t)snaplen;
+        printf("[@] zero copy from the xdp UMEM\n");
+        if (filter){
+            rings[0]->filter = calloc(1, sizeof(struct bpf_program));
+            if (capture_compile_filter(filter, snaplen, rings[0]->filter) < 0)
+                return -1;
+            printf("[!] xdp can't filter in the kernel, the sniffer runs the filter\n");
+        }
+    }else if (backend == CAPTURE_TPACKET){
+        bool zero_copy = GET_CAPTURE_ZERO_COPY(core_config);
+        int fanout_group = GET_CAPTURE_FANOUT_GROUP(core_config);
+        int fanout_mode = GET_CAPTURE_FANOUT_MODE(core_config);
+        // the cpu a packet came in on says nothing of its flow, the two
+        // directions (and the fragments) would end up in different workers
+        if (groups > 1 && fanout_mode == PACKET_FANOUT_CPU && (defrag.enabled || flows.enabled || streams.enabled)){
+            printf("[x] capture.fanout.mode cpu can't be used with defrag, flows or streams\n");
+            return -1;
+        }
+        int block_size = GET_CAPTURE_BLOCK_SIZE(core_config);
+        int block_count = GET_CAPTURE_BLOCK_COUNT(core_config);
+        int frame_size = GET_CAPTURE_FRAME_SIZE(core_config);
+        // a zero copy block stays out of the kernel until every batch with
+        // frames in it is done: every slot of the batch ring plus the one
+        // being filled, each spread over that many blocks at least
+        int batch_blocks = (int)((int64_t)MAX_BATCH * frame_size / block_size) + 1;
+        if (zero_copy && block_count <= (ring_depth + 1) * batch_blocks){
+            printf("[x] capture.block_count must be > %d with a batch ring of %d and zero copy\n",
+                (ring_depth + 1) * batch_blocks, ring_depth);
+            return -1;
+        }
+        for (int g = 0; g < groups; g++) {
+            tp_rings[g] = INIT_TPACKET(
+                interface_name,
+                block_size,
+                block_count,
+                frame_size,
+                GET_CAPTURE_BLOCK_TIMEOUT(core_config)
+            );
+            if (!tp_rings[g]){
+                printf("[x] can't initiat the tpacket ring\n");
+                return -1;
+            }
+            // the socket filter also cuts frames to snaplen in the kernel
+            if (capture_attach_filter(tp_rings[g]->fd, filter, snaplen) < 0){
+                printf("[x] can't set the capture filter\n");
+                return -1;
+            }
+            if (groups > 1 && tpacket_join_fanout(tp_rings[g], fanout_group, fanout_mode) < 0){
+                printf("[x] can't join fanout group %d\n", fanout_group);
+                return -1;
+            }
+            // the ring is mapped before the fork so workers can read it directly
+            if (zero_copy && share_tpacket_ring(rings[g], tp_rings[g]) < 0)
+                return -1;
+        }
+        if (zero_copy)
+            printf("[@] zero copy from the capture ring\n");
+    }else{
+        initiated_pcap = INIT_PCAP(interface_name, snaplen, filter, GET_CAPTURE_NANO_TIMESTAMPS(core_config));
+        if (!initiated_pcap){
+            printf("[x] can't initiat pcap\n");
+            return -1;
+        }
     }
     // keep track of the workers pids
     pid_t *pids = calloc(1 ,sizeof(pid_t) * core_count);
     // track how many fork
     int forked_count = 0;
-    
-    // fork sniffer
-    pid_t sniffer_pid = fork();
-    if (sniffer_pid == 0) {
-        sniffer(initiated_pcap, core_count);
-        exit(0);
-    } else if (sniffer_pid > 0) {
+    // sniffers and workers get consecutive cpus when pinned
+    int cpu = 0;
+
+    for (int g = 0; g < groups; g++) {
+        // the children of this group inherit it
+        batch_ring = rings[g];
+
+        // fork sniffer
+        pid_t sniffer_pid = fork();
+        if (sniffer_pid == 0) {
+            if (pin)
+                pin_to_cpu(cpu);
+            if (backend == CAPTURE_REPLAY)
+                sniffer_replay(replay);
+            else if (backend == CAPTURE_XDP)
+                sniffer_xdp(xsk);
+            else if (backend == CAPTURE_TPACKET)
+                sniffer_tpacket(tp_rings[g]);
+            else
+                sniffer(initiated_pcap);
+            exit(0);
+        } else if (sniffer_pid < 0) {
+            printf("[x] can't start the sniffer of group %d\n", g);
+            continue;
+        }
+        cpu++;
         // if parent , fork workers
-        for (int i = 0; i < core_count; i++) {
+        for (int i = 0; i < batch_ring->workers; i++) {
+            int id = batch_ring->first_worker + i;
             pid_t p = fork();
             if (p == 0) {
-                worker(i);
+                if (pin)
+                    pin_to_cpu(cpu);
+                worker(id);
                 exit(0);
             }
-            pids[i] = p;
+            cpu++;
+            if (p < 0) continue;
+            pids[id] = p;
             forked_count++;
         }
     }
@@ -234,7 +334,7 @@ int main (int argc, char **argv){
     }
 
     // wait for children
-    int remaining = core_count;
+    int remaining = forked_count;
     while (remaining > 0) {
         sleep(1); // can also do other work
         for (int i = 0; i < core_count; i++) {
@@ -246,4 +346,4 @@ int main (int argc, char **argv){
         }
     }
     return 1;
-}
\ No newline at end of file
+}